@@ -622,7 +622,11 @@ function Transport() {
             self.close(data);
 
         } else if (data.command == "ping") {
-            /* 'ping' messages are ignored */
+            /* 'ping' messages on a channel are answered for flow control */
+            if (channel) {
+                data.command = "pong";
+                self.send_control(data);
+            }
 
         } else if (data.command == "hint") {
             if (process_hints)
@@ -4350,6 +4354,62 @@ function factory() {
             throw "invalid date or offset";
     }
 
+    /*
+     * Decode a binary metrics1 'data' message. See doc/protocol.md.
+     * Values for instanced metrics are in a Float64Array. Values that
+     * are absent are the same as at the previous point in time.
+     */
+    function decode_metrics_binary(payload, meta, last) {
+        var view = new window.DataView(payload.buffer, payload.byteOffset, payload.byteLength);
+        var length = payload.byteLength;
+        var metrics = meta.metrics;
+        var metrics_len = metrics.length;
+        var message = [ ];
+        var pos = 1;
+        var count, bitmap, index, data, values, value, n, i, j;
+
+        while (pos < length) {
+            /* The timestamp at pos is implied by the meta interval */
+            count = view.getUint32(pos + 8, true);
+            bitmap = pos + 12;
+            pos = bitmap + ((count + 7) >> 3);
+
+            data = [ ];
+            index = 0;
+            for (i = 0; i < metrics_len; i++) {
+                values = null;
+                n = 1;
+                if (metrics[i].instances) {
+                    n = metrics[i].instances.length;
+                    values = new window.Float64Array(n);
+                }
+                for (j = 0; j < n; j++, index++) {
+                    if (payload[bitmap + (index >> 3)] & (1 << (index & 7))) {
+                        value = view.getFloat64(pos, true);
+                        pos += 8;
+                    } else if (!last) {
+                        value = NaN;
+                    } else if (values) {
+                        value = last[i] ? last[i][j] : NaN;
+                    } else {
+                        value = last[i];
+                    }
+                    if (values)
+                        values[j] = value;
+                    else
+                        data[i] = value;
+                }
+                if (values)
+                    data[i] = values;
+            }
+
+            message.push(data);
+            last = data;
+        }
+
+        return message;
+    }
+
     function MetricsChannel(interval, options_list, cache) {
         var self = this;
         event_mixin(self, { });
@@ -4381,10 +4441,12 @@ function factory() {
                 following = true;
             }
 
+            /* Ask for packed data messages, older bridges will send JSON anyway */
             var options = extend({
                 payload: "metrics1",
                 interval: interval,
-                source: "internal"
+                source: "internal",
+                binary: true
             }, options_list[0]);
 
             delete options.archive_source;
@@ -4395,6 +4457,7 @@ function factory() {
             var meta = null;
             var last = null;
             var beg;
+            var decoder = null;
 
             channel.addEventListener("close", function(ev, close_options) {
                 if (!is_archive)
@@ -4420,12 +4483,29 @@ function factory() {
             });
 
             channel.addEventListener("message", function(ev, payload) {
-                var message = JSON.parse(payload);
+                var message, packed = false;
 
                 var data, data_len, last_len, dataj, dataj_len, lastj, lastj_len;
                 var i, j, k;
                 var timestamp;
 
+                if (typeof payload === "string") {
+                    message = JSON.parse(payload);
+                } else if (payload[0] === 0) {
+                    if (!meta) {
+                        console.warn("metrics channel received data before meta");
+                        return;
+                    }
+                    message = decode_metrics_binary(payload, meta, last);
+                    if (message.length)
+                        last = message[message.length - 1];
+                    packed = true;
+                } else {
+                    if (!decoder)
+                        decoder = cockpit.utf8_decoder();
+                    message = JSON.parse(decoder.decode(payload));
+                }
+
                 /* A meta message? */
                 var message_len = message.length;
                 if (message_len === undefined) {
@@ -4443,8 +4523,8 @@ function factory() {
                 /* A data message */
                 } else if (meta) {
 
-                    /* Data decompression */
-                    for (i = 0; i < message_len; i++) {
+                    /* Data decompression, already done for packed data */
+                    for (i = 0; !packed && i < message_len; i++) {
                         data = message[i];
                         if (last) {
                             data_len = data.length;
@@ -696,6 +696,107 @@ function common_dbus_tests(channel_options, bus_name)
     });
 
 
+    QUnit.asyncTest("watch from two channels", function() {
+        assert.expect(3);
+
+        var cache = { };
+
+        var first = cockpit.dbus(bus_name, channel_options);
+        var second = cockpit.dbus(bus_name, channel_options);
+        $(second).on("notify", function(event, data) {
+            $.extend(true, cache, data);
+        });
+
+        /* The second channel gets what the first one already has, and only what it watches */
+        first.watch({ "path_namespace": "/otree" }).
+            then(function() {
+                return second.watch("/otree/frobber");
+            }).
+            always(function() {
+                assert.equal(this.state(), "resolved", "finished successfuly");
+                assert.deepEqual(Object.keys(cache), [ "/otree/frobber" ], "only watched path");
+                assert.equal(cache["/otree/frobber"]["com.redhat.Cockpit.DBusTests.Frobber"]["y"], 42,
+                             "correct data");
+                $(second).off();
+                first.close();
+                second.close();
+                QUnit.start();
+            });
+    });
+
+    QUnit.asyncTest("unwatch from one of two channels", function() {
+        assert.expect(3);
+
+        var notified = 0;
+        var kept = 0;
+
+        var first = cockpit.dbus(bus_name, channel_options);
+        var second = cockpit.dbus(bus_name, channel_options);
+
+        /* Once the second channel stops watching, only the first hears about changes */
+        first.watch("/otree/frobber").
+            then(function() {
+                return second.watch("/otree/frobber");
+            }).
+            then(function() {
+                second.unwatch("/otree/frobber");
+                $(second).on("notify", function(event, data) {
+                    notified++;
+                });
+                return first.call("/otree/frobber", "com.redhat.Cockpit.DBusTests.Frobber",
+                                  "RequestPropertyMods", []);
+            }).
+            then(function() {
+                /* And the first one keeps its watch when the second one goes away */
+                second.close();
+                $(first).on("notify", function(event, data) {
+                    if (data["/otree/frobber"])
+                        kept++;
+                });
+                return first.call("/otree/frobber", "com.redhat.Cockpit.DBusTests.Frobber",
+                                  "RequestPropertyMods", []);
+            }).
+            always(function() {
+                assert.equal(this.state(), "resolved", "finished successfuly");
+                assert.equal(notified, 0, "no notify after unwatch");
+                assert.ok(kept > 0, "first channel still notified");
+                $(first).off();
+                $(second).off();
+                first.close();
+                QUnit.start();
+            });
+    });
+
+    QUnit.asyncTest("meta stays with its channel", function() {
+        assert.expect(2);
+
+        var properties = null;
+
+        var first = cockpit.dbus(bus_name, channel_options);
+        var second = cockpit.dbus(bus_name, channel_options);
+
+        /* What one page says about an interface doesn't reach another */
+        first.meta({ "com.redhat.Cockpit.DBusTests.Frobber": { "methods": { } } });
+        $(second).on("meta", function(event, data) {
+            var iface = data["com.redhat.Cockpit.DBusTests.Frobber"];
+            if (iface)
+                properties = iface.properties;
+        });
+
+        first.watch("/otree/frobber").
+            then(function() {
+                return second.watch("/otree/frobber");
+            }).
+            always(function() {
+                assert.equal(this.state(), "resolved", "finished successfuly");
+                assert.ok(properties && properties["FinallyNormalName"], "introspected meta");
+                $(second).off();
+                first.close();
+                second.close();
+                QUnit.start();
+            });
+    });
+
     QUnit.asyncTest("watch change", function() {
         assert.expect(2);
 
@@ -35,6 +35,16 @@ function MockPeer() {
             console.log("dropping message after close");
     };
 
+    /* send a binary message */
+    this.send_binary = function(payload) {
+        if (!channel)
+            console.log("dropping message before open");
+        else if (channel.valid)
+            channel.dispatchEvent("message", payload);
+        else
+            console.log("dropping message after close");
+    };
+
     /* send a object as JSON */
     this.send_json = function(payload) {
         this.send(JSON.stringify(payload));
@@ -127,4 +137,68 @@ QUnit.test("non-instanced decompression", function() {
     assert.deepEqual(sink.samples, [ [ 10 ], [ 10 ] ], "got correct samples");
 });
 
+/* Pack points in time, where null is an absent value */
+function pack_metrics(points) {
+    var size = 1, pos = 1, count;
+    points.forEach(function(values) {
+        size += 12 + ((values.length + 7) >> 3);
+        values.forEach(function(value) {
+            if (value !== null)
+                size += 8;
+        });
+    });
+
+    var buffer = new window.ArrayBuffer(size);
+    var bytes = new window.Uint8Array(buffer);
+    var view = new window.DataView(buffer);
+
+    points.forEach(function(values, i) {
+        count = values.length;
+        view.setFloat64(pos, i * 1000, true);
+        view.setUint32(pos + 8, count, true);
+        var bitmap = pos + 12;
+        pos = bitmap + ((count + 7) >> 3);
+        values.forEach(function(value, j) {
+            if (value !== null) {
+                bytes[bitmap + (j >> 3)] |= 1 << (j & 7);
+                view.setFloat64(pos, value, true);
+                pos += 8;
+            }
+        });
+    });
+
+    return bytes;
+}
+
+QUnit.test("binary decompression", function() {
+    assert.expect(4);
+
+    var peer = new MockPeer();
+    var sink = new MockSink();
+
+    $(peer).on("opened", function(event, channel, options) {
+        assert.strictEqual(options.binary, true, "asked for binary");
+    });
+
+    var metrics = cockpit.metrics(1000, { source: "source",
+                                          metrics: [ { name: "m1" }, { name: "m2" } ],
+                                        });
+    metrics.series = sink.series;
+
+    metrics.follow();
+    peer.send_json({ timestamp: 0, now: 0, interval: 1000,
+                     metrics: [ { name: "m1", instances: [ "a", "b" ] }, { name: "m2" } ]
+                   });
+    peer.send_binary(pack_metrics([ [ 1, 2, 3 ], [ null, 5, null ] ]));
+    peer.send_binary(pack_metrics([ [ null, null, 4 ] ]));
+
+    function plain(sample) {
+        return [ Array.prototype.slice.call(sample[0]), sample[1] ];
+    }
+
+    assert.deepEqual(plain(sink.samples[0]), [ [ 1, 2 ], 3 ], "got first sample");
+    assert.deepEqual(plain(sink.samples[1]), [ [ 1, 5 ], 3 ], "got second sample");
+    assert.deepEqual(plain(sink.samples[2]), [ [ 1, 5 ], 4 ], "got third sample");
+});
+
 QUnit.start();
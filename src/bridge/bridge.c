@@ -19,6 +19,7 @@
 #include "config.h"
 
 #include "cockpitchannel.h"
+#include "cockpitdbuscache.h"
 #include "cockpitdbusinternal.h"
 #include "cockpitdbusjson.h"
 #include "cockpitechochannel.h"
@@ -32,6 +33,7 @@
 #include "cockpitpackages.h"
 #include "cockpitpipechannel.h"
 #include "cockpitinternalmetrics.h"
+#include "cockpitmetricshistory.h"
 #include "cockpitpolkitagent.h"
 #include "cockpitrouter.h"
 #include "cockpitwebsocketstream.h"
@@ -119,6 +121,7 @@ send_init_command (CockpitTransport *transport,
                    gboolean interactive)
 {
   const gchar *checksum;
+  JsonArray *capabilities;
   JsonObject *object;
   JsonObject *block;
   GHashTable *os_release;
@@ -140,6 +143,11 @@ send_init_command (CockpitTransport *transport,
     }
   else
     {
+      /* We understand compressed messages, the caller decides whether to send them */
+      capabilities = json_array_new ();
+      json_array_add_string_element (capabilities, "compression");
+      json_object_set_array_member (object, "capabilities", capabilities);
+
       checksum = cockpit_packages_get_checksum (packages);
       if (checksum)
         json_object_set_string_member (object, "checksum", checksum);
@@ -457,7 +465,8 @@ call_update_router (gconstpointer user_data)
 
 static int
 run_bridge (const gchar *interactive,
-            gboolean privileged_slave)
+            gboolean privileged_slave,
+            gint coalesce)
 {
   CockpitTransport *transport;
   CockpitRouter *router;
@@ -466,6 +475,7 @@ run_bridge (const gchar *interactive,
   gboolean closed = FALSE;
   gpointer polkit_agent = NULL;
   const gchar *directory;
+  gchar *cache_directory = NULL;
   struct passwd *pwd;
   GPid daemon_pid = 0;
   GPid agent_pid = 0;
@@ -549,6 +559,8 @@ run_bridge (const gchar *interactive,
   else
     {
       transport = cockpit_pipe_transport_new_fds ("stdio", 0, outfd);
+      if (coalesce > 0)
+        cockpit_pipe_set_coalesce (cockpit_pipe_transport_get_pipe (COCKPIT_PIPE_TRANSPORT (transport)), coalesce);
     }
 
   if (uid != 0)
@@ -571,6 +583,17 @@ run_bridge (const gchar *interactive,
 
   router = setup_router (transport, privileged_slave);
 
+  /* Fifteen minutes of the basic metrics, for instant graphs, from the first graph on */
+  if (!privileged_slave)
+    cockpit_metrics_history_enable (1000, 15 * 60);
+
+  /* Introspection data of services, kept for the next bridge */
+  if (!privileged_slave)
+    {
+      cache_directory = g_build_filename (g_get_user_cache_dir (), "cockpit", "dbus", NULL);
+      cockpit_dbus_cache_directory = cache_directory;
+    }
+
   cockpit_dbus_user_startup (pwd);
   cockpit_dbus_setup_startup ();
   cockpit_dbus_process_startup ();
@@ -596,11 +619,15 @@ run_bridge (const gchar *interactive,
   g_object_unref (router);
   g_object_unref (transport);
 
+  cockpit_metrics_history_stop ();
   cockpit_packages_on_change (packages, NULL, NULL);
 
   cockpit_dbus_machines_cleanup ();
   cockpit_dbus_internal_cleanup ();
 
+  cockpit_dbus_cache_directory = NULL;
+  g_free (cache_directory);
+
   if (daemon_pid)
     kill (daemon_pid, SIGTERM);
   if (agent_pid)
@@ -676,6 +703,7 @@ main (int argc,
   static gboolean opt_privileged = FALSE;
   static gboolean opt_version = FALSE;
   static gchar *opt_interactive = NULL;
+  static gint opt_coalesce = 0;
 
   static GOptionEntry entries[] = {
     { "interact", 0, 0, G_OPTION_ARG_STRING, &opt_interactive, "Interact with the raw protocol", "boundary" },
@@ -683,6 +711,7 @@ main (int argc,
     { "packages", 0, 0, G_OPTION_ARG_NONE, &opt_packages, "Show Cockpit package information", NULL },
     { "rules", 0, 0, G_OPTION_ARG_NONE, &opt_rules, "Show Cockpit bridge rules", NULL },
     { "version", 0, 0, G_OPTION_ARG_NONE, &opt_version, "Show Cockpit version information", NULL },
+    { "coalesce", 0, 0, G_OPTION_ARG_INT, &opt_coalesce, "Gather output into fewer writes", "usec" },
     { NULL }
   };
 
@@ -743,7 +772,7 @@ main (int argc,
       return 2;
     }
 
-  ret = run_bridge (opt_interactive, opt_privileged);
+  ret = run_bridge (opt_interactive, opt_privileged, opt_coalesce);
 
   if (packages)
     cockpit_packages_free (packages);
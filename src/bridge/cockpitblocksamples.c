@@ -21,42 +21,28 @@
 
 #include "cockpitblocksamples.h"
 
-#include <stdio.h>
-#include <string.h>
+#include "cockpitprocfile.h"
 
 void
 cockpit_block_samples (CockpitSamples *samples)
 {
-  gchar *contents = NULL;
-  gsize len;
-  GError *error = NULL;
-  gchar **lines = NULL;
-  guint n;
-  static gboolean not_supported = FALSE;
+  static CockpitProcFile proc_diskstats = COCKPIT_PROC_FILE_INIT ("diskstats");
+  CockpitProcScanner scanner;
+  CockpitProcScanner line;
+  CockpitProcScanner whole;
+  gchar dev_name[128];
+  guint64 num_sectors_read;
+  guint64 num_sectors_written;
 
-  if (not_supported)
-      goto out;
+  if (!cockpit_proc_file_read (&proc_diskstats))
+    return;
 
-  if (!g_file_get_contents ("/proc/diskstats", &contents, &len, &error))
+  cockpit_proc_scanner_init (&scanner, &proc_diskstats);
+  while (cockpit_proc_scanner_line (&scanner, &line))
     {
-      g_message ("error loading contents /proc/diskstats: %s", error->message);
-      not_supported = TRUE;
-      goto out;
-    }
-
-  lines = g_strsplit (contents, "\n", -1);
-  for (n = 0; lines != NULL && lines[n] != NULL; n++)
-    {
-      const gchar *line = lines[n];
-      guint num_parsed;
-      gint dev_major, dev_minor;
-      gchar dev_name[128];
-      guint64 num_reads,  num_reads_merged,  num_sectors_read,    num_msec_reading;
-      guint64 num_writes, num_writes_merged, num_sectors_written, num_msec_writing;
-      guint64 num_io_in_progress, num_msec_doing_io, weighted_num_msec_doing_io;
-
-      if (strlen (line) == 0)
+      if (line.pos == line.end)
         continue;
+      whole = line;
 
       /* From http://www.kernel.org/doc/Documentation/iostats.txt
        *
@@ -92,27 +78,27 @@ cockpit_block_samples (CockpitSamples *samples)
        *     I/O completion time and the backlog that may be accumulating.
        */
 
-      num_parsed = sscanf (line,
-                           "%d %d %127s"
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
-                           &dev_major, &dev_minor, dev_name,
-                           &num_reads,  &num_reads_merged, &num_sectors_read, &num_msec_reading,
-                           &num_writes, &num_writes_merged, &num_sectors_written, &num_msec_writing,
-                           &num_io_in_progress, &num_msec_doing_io, &weighted_num_msec_doing_io);
-      if (num_parsed != 14)
+      if (!cockpit_proc_scanner_uint64 (&line, NULL) ||                 /* major */
+          !cockpit_proc_scanner_uint64 (&line, NULL) ||                 /* minor */
+          !cockpit_proc_scanner_word (&line, 0, dev_name, sizeof (dev_name)) ||
+          !cockpit_proc_scanner_uint64 (&line, NULL) ||                 /* reads */
+          !cockpit_proc_scanner_uint64 (&line, NULL) ||                 /* reads merged */
+          !cockpit_proc_scanner_uint64 (&line, &num_sectors_read) ||
+          !cockpit_proc_scanner_uint64 (&line, NULL) ||                 /* msec reading */
+          !cockpit_proc_scanner_uint64 (&line, NULL) ||                 /* writes */
+          !cockpit_proc_scanner_uint64 (&line, NULL) ||                 /* writes merged */
+          !cockpit_proc_scanner_uint64 (&line, &num_sectors_written) ||
+          !cockpit_proc_scanner_uint64 (&line, NULL) ||                 /* msec writing */
+          !cockpit_proc_scanner_uint64 (&line, NULL) ||                 /* in progress */
+          !cockpit_proc_scanner_uint64 (&line, NULL) ||                 /* msec doing io */
+          !cockpit_proc_scanner_uint64 (&line, NULL))                   /* weighted msec */
         {
-          g_message ("error parsing line %d of file /proc/diskstats (num_parsed = %d): %s", n, num_parsed, line);
+          g_message ("error parsing line of file /proc/diskstats: %.*s",
+                     (int)(whole.end - whole.pos), whole.pos);
           continue;
         }
 
       cockpit_samples_sample (samples, "block.device.read", dev_name, num_sectors_read * 512);
       cockpit_samples_sample (samples, "block.device.written", dev_name, num_sectors_written * 512);
     }
-
-out:
-  g_clear_error (&error);
-  g_strfreev (lines);
-  g_free (contents);
 }
@@ -0,0 +1,107 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2018 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitbridgesamples.h"
+
+#include "cockpitchannel.h"
+
+#include "common/cockpittransport.h"
+
+/*
+ * Samples of the bridge itself: traffic per channel and per payload
+ * type, and the state of each transport.
+ */
+
+static void
+sample_channel (const gchar *name,
+                const CockpitChannelStats *stats,
+                gpointer user_data)
+{
+  CockpitSamples *samples = user_data;
+
+  cockpit_samples_sample (samples, "cockpit.channel.rx", name, stats->rx_bytes);
+  cockpit_samples_sample (samples, "cockpit.channel.tx", name, stats->tx_bytes);
+  cockpit_samples_sample (samples, "cockpit.channel.rx-messages", name, stats->rx_messages);
+  cockpit_samples_sample (samples, "cockpit.channel.tx-messages", name, stats->tx_messages);
+}
+
+static void
+sample_payload (const gchar *name,
+                const CockpitChannelStats *stats,
+                gpointer user_data)
+{
+  CockpitSamples *samples = user_data;
+
+  cockpit_samples_sample (samples, "cockpit.payload.rx", name, stats->rx_bytes);
+  cockpit_samples_sample (samples, "cockpit.payload.tx", name, stats->tx_bytes);
+  cockpit_samples_sample (samples, "cockpit.payload.rx-messages", name, stats->rx_messages);
+  cockpit_samples_sample (samples, "cockpit.payload.tx-messages", name, stats->tx_messages);
+}
+
+typedef struct {
+  CockpitSamples *samples;
+  GHashTable *seen;
+} TransportSampling;
+
+static void
+sample_transport (CockpitTransport *transport,
+                  const CockpitTransportStats *stats,
+                  gpointer user_data)
+{
+  TransportSampling *ts = user_data;
+  gchar *instance;
+  gchar *name = NULL;
+  guint count;
+
+  /* Several transports can have the same name, number the later ones */
+  g_object_get (transport, "name", &name, NULL);
+  if (!name)
+    name = g_strdup ("transport");
+  count = GPOINTER_TO_UINT (g_hash_table_lookup (ts->seen, name)) + 1;
+  if (count > 1)
+    instance = g_strdup_printf ("%s:%u", name, count);
+  else
+    instance = g_strdup (name);
+  g_hash_table_replace (ts->seen, name, GUINT_TO_POINTER (count));
+
+  cockpit_samples_sample (ts->samples, "cockpit.transport.rx", instance, stats->rx_bytes);
+  cockpit_samples_sample (ts->samples, "cockpit.transport.tx", instance, stats->tx_bytes);
+  cockpit_samples_sample (ts->samples, "cockpit.transport.rx-wire", instance, stats->rx_wire_bytes);
+  cockpit_samples_sample (ts->samples, "cockpit.transport.tx-wire", instance, stats->tx_wire_bytes);
+  cockpit_samples_sample (ts->samples, "cockpit.transport.queued", instance, stats->queued_bytes);
+  cockpit_samples_sample (ts->samples, "cockpit.transport.queued-blocks", instance, stats->queued_blocks);
+  cockpit_samples_sample (ts->samples, "cockpit.transport.frozen", instance, stats->frozen);
+
+  g_free (instance);
+}
+
+void
+cockpit_bridge_samples (CockpitSamples *samples)
+{
+  TransportSampling ts = { samples, NULL };
+
+  cockpit_channel_foreach_stats (sample_channel, samples);
+  cockpit_channel_foreach_payload_stats (sample_payload, samples);
+
+  ts.seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  cockpit_transport_foreach_stats (sample_transport, &ts);
+  g_hash_table_unref (ts.seen);
+}
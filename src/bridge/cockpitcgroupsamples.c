@@ -20,14 +20,21 @@
 #include "config.h"
 
 #include "cockpitcgroupsamples.h"
+#include "cockpitprocfile.h"
 
+#include <sys/inotify.h>
+#include <sys/resource.h>
+
+#include <errno.h>
 #include <fts.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
 const gchar *cockpit_cgroup_memory_root = "/sys/fs/cgroup/memory";
 const gchar *cockpit_cgroup_cpuacct_root = "/sys/fs/cgroup/cpuacct";
+const gchar *cockpit_cgroup_unified_root = "/sys/fs/cgroup";
 
 static double
 read_double (const gchar *prefix,
@@ -141,9 +148,477 @@ notice_cgroups_in_hierarchy (CockpitSamples *samples,
 }
 
 
+/*
+ * The unified cgroup v2 hierarchy.
+ *
+ * Rather than walking the tree on every tick, the cgroups are found
+ * once and then kept up to date with inotify. The queued inotify
+ * events are read at the start of each tick, so there's no need for
+ * a main loop watch. Each cgroup keeps its files open and reads them
+ * again with pread(), as long as there are file descriptors to spare.
+ */
+
+enum {
+  MEMORY_CURRENT,
+  MEMORY_MAX,
+  CPU_STAT,
+  IO_STAT,
+  PIDS_CURRENT,
+  N_CGROUP_FILES
+};
+
+static const gchar *cgroup_file_names[N_CGROUP_FILES] = {
+  "memory.current",
+  "memory.max",
+  "cpu.stat",
+  "io.stat",
+  "pids.current",
+};
+
+/* Try again to open files that are missing, ie: for controllers that weren't enabled */
+#define CGROUP_RETRY_TICKS 60
+
+#define CGROUP_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+typedef struct _Cgroup Cgroup;
+
+struct _Cgroup {
+  gchar *path;
+  const gchar *instance;
+  gint wd;
+  CockpitProcFile files[N_CGROUP_FILES];
+
+  /* So that a removed subtree is found without looking at every cgroup */
+  Cgroup *parent;
+  GHashTable *children;
+};
+
+static struct {
+  gboolean checked;
+  gboolean unified;
+  gint inotify_fd;
+  GHashTable *by_path;
+  GHashTable *by_wd;
+  gboolean rescan;
+  guint ticks;
+  guint open_fds;
+  guint max_open_fds;
+} hierarchy = { FALSE, FALSE, -1, };
+
+static void
+cgroup_free (gpointer data)
+{
+  Cgroup *cgroup = data;
+  gint i;
+
+  if (cgroup->wd >= 0)
+    {
+      g_hash_table_remove (hierarchy.by_wd, GINT_TO_POINTER (cgroup->wd));
+      inotify_rm_watch (hierarchy.inotify_fd, cgroup->wd);
+    }
+
+  for (i = 0; i < N_CGROUP_FILES; i++)
+    {
+      if (cgroup->files[i].fd >= 0)
+        hierarchy.open_fds--;
+      cockpit_proc_file_clear (&cgroup->files[i]);
+    }
+
+  if (cgroup->children)
+    g_hash_table_destroy (cgroup->children);
+  g_free (cgroup->path);
+  g_slice_free (Cgroup, cgroup);
+}
+
+static void
+add_cgroup (const gchar *path)
+{
+  static gboolean logged_watch = FALSE;
+  Cgroup *cgroup;
+  Cgroup *other;
+  const gchar *instance;
+  const gchar *slash;
+  gchar *parent;
+  gint i;
+
+  if (g_hash_table_lookup (hierarchy.by_path, path))
+    return;
+
+  cgroup = g_slice_new0 (Cgroup);
+  cgroup->path = g_strdup (path);
+
+  /* The instance is relative to the root, and the root itself is "" */
+  instance = cgroup->path + strlen (cockpit_cgroup_unified_root);
+  if (*instance == '/')
+    instance++;
+  cgroup->instance = instance;
+
+  for (i = 0; i < N_CGROUP_FILES; i++)
+    {
+      cgroup->files[i].name = cgroup_file_names[i];
+      cgroup->files[i].fd = -1;
+    }
+
+  cgroup->wd = inotify_add_watch (hierarchy.inotify_fd, path, CGROUP_WATCH_EVENTS);
+  if (cgroup->wd < 0)
+    {
+      /* Still sample it, but new child cgroups won't be noticed until a rescan */
+      if (!logged_watch)
+        g_message ("couldn't watch cgroup %s: %s", path, g_strerror (errno));
+      logged_watch = TRUE;
+    }
+  else
+    {
+      /* The same directory may already be watched under an old name */
+      other = g_hash_table_lookup (hierarchy.by_wd, GINT_TO_POINTER (cgroup->wd));
+      if (other)
+        other->wd = -1;
+      g_hash_table_insert (hierarchy.by_wd, GINT_TO_POINTER (cgroup->wd), cgroup);
+    }
+
+  /* Parents are always added before their children */
+  slash = strrchr (path, '/');
+  if (slash && slash != path)
+    {
+      parent = g_strndup (path, slash - path);
+      cgroup->parent = g_hash_table_lookup (hierarchy.by_path, parent);
+      g_free (parent);
+    }
+  if (cgroup->parent)
+    {
+      if (!cgroup->parent->children)
+        cgroup->parent->children = g_hash_table_new (g_direct_hash, g_direct_equal);
+      g_hash_table_add (cgroup->parent->children, cgroup);
+    }
+
+  g_hash_table_insert (hierarchy.by_path, cgroup->path, cgroup);
+}
+
+static void
+add_cgroup_tree (const gchar *path)
+{
+  const gchar *paths[] = { path, NULL };
+  FTSENT *ent;
+  FTS *fs;
+
+  /*
+   * Each directory is watched when it's first seen, before its children
+   * are listed, so that nothing created in between is missed.
+   */
+  fs = fts_open ((gchar **)paths, FTS_NOCHDIR | FTS_PHYSICAL, NULL);
+  if (fs)
+    {
+      while ((ent = fts_read (fs)) != NULL)
+        {
+          if (ent->fts_info == FTS_D)
+            add_cgroup (ent->fts_path);
+        }
+      fts_close (fs);
+    }
+}
+
+static void
+remove_cgroup (Cgroup *cgroup)
+{
+  GHashTableIter iter;
+  Cgroup *child;
+
+  /* Each child takes itself out of our children as it goes */
+  while (cgroup->children && g_hash_table_size (cgroup->children) > 0)
+    {
+      g_hash_table_iter_init (&iter, cgroup->children);
+      g_hash_table_iter_next (&iter, (gpointer *)&child, NULL);
+      remove_cgroup (child);
+    }
+
+  if (cgroup->parent)
+    g_hash_table_remove (cgroup->parent->children, cgroup);
+
+  g_hash_table_remove (hierarchy.by_path, cgroup->path);
+}
+
+static void
+remove_cgroup_tree (const gchar *path)
+{
+  Cgroup *cgroup;
+
+  cgroup = g_hash_table_lookup (hierarchy.by_path, path);
+  if (cgroup)
+    remove_cgroup (cgroup);
+}
+
+static gboolean
+open_hierarchy (void)
+{
+  struct rlimit rl;
+
+  hierarchy.inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (hierarchy.inotify_fd < 0)
+    {
+      g_message ("couldn't watch cgroups: %s", g_strerror (errno));
+      return FALSE;
+    }
+
+  hierarchy.by_path = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, cgroup_free);
+  hierarchy.by_wd = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  /* Leave at least half of our file descriptors for everything else */
+  if (getrlimit (RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY)
+    hierarchy.max_open_fds = 512;
+  else
+    hierarchy.max_open_fds = rl.rlim_cur / 2;
+
+  hierarchy.rescan = TRUE;
+  return TRUE;
+}
+
+static void
+read_events (void)
+{
+  /* Aligned for struct inotify_event */
+  guint64 buffer[(sizeof (struct inotify_event) + NAME_MAX + 1) * 16 / sizeof (guint64)];
+  const struct inotify_event *event;
+  Cgroup *parent;
+  gchar *path;
+  gssize len;
+  gssize i;
+
+  for (;;)
+    {
+      len = read (hierarchy.inotify_fd, buffer, sizeof (buffer));
+      if (len < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno != EAGAIN)
+            {
+              g_message ("couldn't read cgroup events: %s", g_strerror (errno));
+              hierarchy.rescan = TRUE;
+            }
+          break;
+        }
+      else if (len == 0)
+        {
+          break;
+        }
+
+      for (i = 0; i < len; i += sizeof (struct inotify_event) + event->len)
+        {
+          event = (const struct inotify_event *)((const gchar *)buffer + i);
+
+          if (event->mask & IN_Q_OVERFLOW)
+            {
+              hierarchy.rescan = TRUE;
+              continue;
+            }
+
+          parent = g_hash_table_lookup (hierarchy.by_wd, GINT_TO_POINTER (event->wd));
+          if (!parent)
+            continue;
+
+          /* The directory itself is gone, and the watch with it */
+          if (event->mask & IN_IGNORED)
+            {
+              g_hash_table_remove (hierarchy.by_wd, GINT_TO_POINTER (parent->wd));
+              parent->wd = -1;
+              remove_cgroup_tree (parent->path);
+              continue;
+            }
+
+          if (!(event->mask & IN_ISDIR) || event->len == 0)
+            continue;
+
+          path = g_build_filename (parent->path, event->name, NULL);
+          if (event->mask & (IN_CREATE | IN_MOVED_TO))
+            add_cgroup_tree (path);
+          else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+            remove_cgroup_tree (path);
+          g_free (path);
+        }
+    }
+}
+
+static gboolean
+read_cgroup_file (Cgroup *cgroup,
+                  gint which)
+{
+  CockpitProcFile *file = &cgroup->files[which];
+  gboolean opened;
+  gboolean ret;
+
+  opened = file->fd >= 0;
+  ret = cockpit_proc_file_read_in (file, cgroup->path, opened || hierarchy.open_fds < hierarchy.max_open_fds);
+  if (!opened && file->fd >= 0)
+    hierarchy.open_fds++;
+
+  /* A missing file means the controller isn't enabled for this cgroup */
+  if (!ret && errno != ENOENT)
+    g_debug ("couldn't read %s/%s: %s", cgroup->path, file->name, g_strerror (errno));
+
+  return ret;
+}
+
+static gboolean
+parse_cgroup_value (Cgroup *cgroup,
+                    gint which,
+                    guint64 *value)
+{
+  CockpitProcScanner scanner;
+
+  if (!read_cgroup_file (cgroup, which))
+    return FALSE;
+
+  cockpit_proc_scanner_init (&scanner, &cgroup->files[which]);
+
+  /* Unlimited => zero, like for v1 */
+  if (cockpit_proc_scanner_prefix (&scanner, "max"))
+    *value = 0;
+  else if (!cockpit_proc_scanner_uint64 (&scanner, value))
+    return FALSE;
+
+  return TRUE;
+}
+
+static void
+collect_unified (CockpitSamples *samples,
+                 Cgroup *cgroup)
+{
+  CockpitProcScanner scanner;
+  CockpitProcScanner line;
+  guint64 value;
+  guint64 read_bytes;
+  guint64 written_bytes;
+  gchar word[64];
+
+  if (parse_cgroup_value (cgroup, MEMORY_CURRENT, &value))
+    cockpit_samples_sample (samples, "cgroup.memory.usage", cgroup->instance, value);
+  if (parse_cgroup_value (cgroup, MEMORY_MAX, &value))
+    cockpit_samples_sample (samples, "cgroup.memory.limit", cgroup->instance, value);
+  if (parse_cgroup_value (cgroup, PIDS_CURRENT, &value))
+    cockpit_samples_sample (samples, "cgroup.pids.current", cgroup->instance, value);
+
+  if (read_cgroup_file (cgroup, CPU_STAT))
+    {
+      cockpit_proc_scanner_init (&scanner, &cgroup->files[CPU_STAT]);
+      while (cockpit_proc_scanner_line (&scanner, &line))
+        {
+          if (cockpit_proc_scanner_prefix (&line, "usage_usec ") &&
+              cockpit_proc_scanner_uint64 (&line, &value))
+            {
+              cockpit_samples_sample (samples, "cgroup.cpu.usage", cgroup->instance, value / 1000);
+              break;
+            }
+        }
+    }
+
+  /* Lines like: 8:0 rbytes=1459200 wbytes=314773504 rios=192 wios=353 dbytes=0 dios=0 */
+  if (read_cgroup_file (cgroup, IO_STAT))
+    {
+      read_bytes = written_bytes = 0;
+      cockpit_proc_scanner_init (&scanner, &cgroup->files[IO_STAT]);
+      while (cockpit_proc_scanner_line (&scanner, &line))
+        {
+          if (!cockpit_proc_scanner_word (&line, 0, word, sizeof (word)))
+            continue;
+          while (cockpit_proc_scanner_word (&line, '=', word, sizeof (word)) &&
+                 cockpit_proc_scanner_uint64 (&line, &value))
+            {
+              if (strcmp (word, "rbytes") == 0)
+                read_bytes += value;
+              else if (strcmp (word, "wbytes") == 0)
+                written_bytes += value;
+            }
+        }
+
+      cockpit_samples_sample (samples, "cgroup.io.read", cgroup->instance, read_bytes);
+      cockpit_samples_sample (samples, "cgroup.io.written", cgroup->instance, written_bytes);
+    }
+}
+
+static void
+notice_unified_cgroups (CockpitSamples *samples)
+{
+  GHashTableIter iter;
+  Cgroup *cgroup;
+  gint i;
+
+  if (hierarchy.inotify_fd < 0 && !open_hierarchy ())
+    return;
+
+  read_events ();
+
+  if (hierarchy.rescan)
+    {
+      g_hash_table_remove_all (hierarchy.by_path);
+      add_cgroup_tree (cockpit_cgroup_unified_root);
+      hierarchy.rescan = FALSE;
+
+      /* Events queued up during the scan are for cgroups we already know about */
+      read_events ();
+    }
+
+  hierarchy.ticks++;
+
+  g_hash_table_iter_init (&iter, hierarchy.by_path);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&cgroup))
+    {
+      if (hierarchy.ticks % CGROUP_RETRY_TICKS == 0)
+        {
+          for (i = 0; i < N_CGROUP_FILES; i++)
+            cgroup->files[i].failed = FALSE;
+        }
+
+      collect_unified (samples, cgroup);
+    }
+}
+
+/**
+ * cockpit_cgroup_samples_reset:
+ *
+ * Forget which cgroup hierarchy is in use, and all the cgroups that
+ * have been found. They are looked for again from the configured
+ * roots on the next sample.
+ */
+void
+cockpit_cgroup_samples_reset (void)
+{
+  if (hierarchy.by_path)
+    g_hash_table_destroy (hierarchy.by_path);
+  if (hierarchy.by_wd)
+    g_hash_table_destroy (hierarchy.by_wd);
+  if (hierarchy.inotify_fd >= 0)
+    close (hierarchy.inotify_fd);
+
+  memset (&hierarchy, 0, sizeof (hierarchy));
+  hierarchy.inotify_fd = -1;
+}
+
 void
 cockpit_cgroup_samples (CockpitSamples *samples)
 {
+  gchar *path;
+
+  /* A unified hierarchy has cgroup.controllers at its root */
+  if (!hierarchy.checked)
+    {
+      path = g_build_filename (cockpit_cgroup_unified_root, "cgroup.controllers", NULL);
+      hierarchy.unified = (access (path, F_OK) == 0);
+      hierarchy.checked = TRUE;
+      g_free (path);
+    }
+
+  if (hierarchy.unified)
+    {
+      /* We are looking for files like
+
+         /sys/fs/cgroup/.../memory.current
+         /sys/fs/cgroup/.../cpu.stat
+      */
+
+      notice_unified_cgroups (samples);
+      return;
+    }
+
   /* We are looking for files like
 
      /sys/fs/cgroup/memory/.../memory.usage_in_bytes
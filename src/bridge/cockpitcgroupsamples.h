@@ -24,8 +24,14 @@
 
 G_BEGIN_DECLS
 
+extern const gchar *cockpit_cgroup_memory_root;
+extern const gchar *cockpit_cgroup_cpuacct_root;
+extern const gchar *cockpit_cgroup_unified_root;
+
 void            cockpit_cgroup_samples         (CockpitSamples *samples);
 
+void            cockpit_cgroup_samples_reset   (void);
+
 
 G_END_DECLS
 
@@ -21,6 +21,7 @@
 
 #include "cockpitchannel.h"
 
+#include "common/cockpitflow.h"
 #include "common/cockpitjson.h"
 #include "common/cockpitloopback.h"
 #include "common/cockpitunicode.h"
@@ -52,17 +53,22 @@ const gchar * cockpit_bridge_local_address = NULL;
  * closes then the channel closes, but the channel can also close
  * individually either for failure reasons, or with an orderly shutdown.
  *
+ * When opened with the "flow-control" option the channel sends "ping"
+ * messages with a "sequence" of the bytes sent so far, and expects the
+ * other end to answer them with "pong". The channel is a #CockpitFlow
+ * and emits CockpitFlow::pressure when too many bytes have not been
+ * acknowledged, so that the data source can stop reading.
+ *
  * See doc/protocol.md for information about channels.
  */
 
 struct _CockpitChannelPrivate {
-    gulong recv_sig;
+    gboolean dispatching;
     gulong close_sig;
-    gulong control_sig;
 
     /* Construct arguments */
     CockpitTransport *transport;
-    gchar *id;
+    const gchar *id; /* interned */
     JsonObject *open_options;
     gchar **capabilities;
 
@@ -92,8 +98,27 @@ struct _CockpitChannelPrivate {
     /* Buffer for incomplete unicode bytes */
     GBytes *out_buffer;
     gint buffer_timeout;
+
+    /* Flow control */
+    gboolean flow_control;
+    gint64 out_sequence;
+    gint64 out_acked;
+    gboolean pressure;
+    CockpitFlow *throttle;
+    gulong throttle_sig;
+    gboolean throttled;
+
+    /* Statistics, also added up per payload type */
+    CockpitChannelStats stats;
+    CockpitChannelStats *payload_stats;
 };
 
+/* A ping is sent each time this many bytes have been sent */
+#define CHANNEL_FLOW_PING   (16L * 1024L)
+
+/* Unacknowledged bytes allowed before applying back pressure */
+#define CHANNEL_FLOW_WINDOW (2L * 1024L * 1024L)
+
 enum {
     PROP_0,
     PROP_TRANSPORT,
@@ -104,7 +129,15 @@ enum {
 
 static guint cockpit_channel_sig_closed;
 
-G_DEFINE_TYPE (CockpitChannel, cockpit_channel, G_TYPE_OBJECT);
+/* A set of all live channels, and payload type -> CockpitChannelStats */
+static GHashTable *all_channels;
+static GHashTable *payload_stats;
+
+static void  cockpit_channel_flow_iface_init (CockpitFlowIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (CockpitChannel, cockpit_channel, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_FLOW, cockpit_channel_flow_iface_init)
+);
 
 static gboolean
 on_idle_prepare (gpointer data)
@@ -149,14 +182,68 @@ on_transport_recv (CockpitTransport *transport,
                    gpointer user_data)
 {
   CockpitChannel *self = user_data;
+  gsize length = g_bytes_get_size (data);
 
-  if (g_strcmp0 (channel_id, self->priv->id) != 0)
-    return FALSE;
+  self->priv->stats.rx_messages++;
+  self->priv->stats.rx_bytes += length;
+  if (self->priv->payload_stats)
+    {
+      self->priv->payload_stats->rx_messages++;
+      self->priv->payload_stats->rx_bytes += length;
+    }
 
   process_recv (self, data);
   return TRUE;
 }
 
+static void
+update_pressure (CockpitChannel *self)
+{
+  gboolean pressure;
+
+  pressure = self->priv->throttled ||
+             self->priv->out_sequence - self->priv->out_acked > CHANNEL_FLOW_WINDOW;
+
+  if (pressure != self->priv->pressure)
+    {
+      g_debug ("%s: %s back pressure on channel", self->priv->id,
+               pressure ? "applying" : "relieving");
+      self->priv->pressure = pressure;
+      cockpit_flow_emit_pressure (COCKPIT_FLOW (self), pressure);
+    }
+}
+
+static void
+process_pong (CockpitChannel *self,
+              JsonObject *options)
+{
+  gint64 sequence;
+
+  if (!cockpit_json_get_int (options, "sequence", -1, &sequence) ||
+      sequence < 0 || sequence > self->priv->out_sequence)
+    {
+      g_message ("%s: received invalid \"pong\" \"sequence\" field", self->priv->id);
+      return;
+    }
+
+  if (sequence > self->priv->out_acked)
+    {
+      self->priv->out_acked = sequence;
+      update_pressure (self);
+    }
+}
+
+static void
+process_ping (CockpitChannel *self,
+              JsonObject *options)
+{
+  JsonObject *pong;
+
+  pong = cockpit_transport_build_pong (options);
+  cockpit_channel_control (self, "pong", pong);
+  json_object_unref (pong);
+}
+
 static void
 process_control (CockpitChannel *self,
                  const gchar *command,
@@ -165,6 +252,18 @@ process_control (CockpitChannel *self,
   CockpitChannelClass *klass;
   const gchar *problem;
 
+  if (g_str_equal (command, "ping"))
+    {
+      process_ping (self, options);
+      return;
+    }
+
+  if (g_str_equal (command, "pong"))
+    {
+      process_pong (self, options);
+      return;
+    }
+
   if (g_str_equal (command, "close"))
     {
       g_debug ("close channel %s", self->priv->id);
@@ -189,7 +288,7 @@ process_control (CockpitChannel *self,
 
 static gboolean
 on_transport_control (CockpitTransport *transport,
-                      const char *command,
+                      const gchar *command,
                       const gchar *channel_id,
                       JsonObject *options,
                       GBytes *payload,
@@ -197,7 +296,8 @@ on_transport_control (CockpitTransport *transport,
 {
   CockpitChannel *self = user_data;
 
-  if (g_strcmp0 (channel_id, self->priv->id) != 0)
+  /* Reusing the id of an open channel is for the router to refuse */
+  if (g_str_equal (command, "open"))
     return FALSE;
 
   process_control (self, command, options);
@@ -224,6 +324,9 @@ cockpit_channel_actual_send (CockpitChannel *self,
                              gboolean trust_is_utf8)
 {
   GBytes *validated = NULL;
+  JsonObject *ping;
+  gint64 out_sequence;
+  gsize length;
 
   g_return_if_fail (self->priv->out_buffer == NULL);
   g_return_if_fail (self->priv->buffer_timeout == 0);
@@ -236,6 +339,31 @@ cockpit_channel_actual_send (CockpitChannel *self,
 
   cockpit_transport_send (self->priv->transport, self->priv->id, payload);
 
+  length = g_bytes_get_size (payload);
+  self->priv->stats.tx_messages++;
+  self->priv->stats.tx_bytes += length;
+  if (self->priv->payload_stats)
+    {
+      self->priv->payload_stats->tx_messages++;
+      self->priv->payload_stats->tx_bytes += length;
+    }
+
+  out_sequence = self->priv->out_sequence + length;
+
+  /* Ask the other end to acknowledge each block of data as it arrives */
+  if (self->priv->flow_control &&
+      out_sequence / CHANNEL_FLOW_PING != self->priv->out_sequence / CHANNEL_FLOW_PING)
+    {
+      ping = json_object_new ();
+      json_object_set_int_member (ping, "sequence", out_sequence);
+      cockpit_channel_control (self, "ping", ping);
+      json_object_unref (ping);
+    }
+
+  self->priv->out_sequence = out_sequence;
+  if (self->priv->flow_control)
+    update_pressure (self);
+
   if (validated)
     g_bytes_unref (validated);
 }
@@ -264,16 +392,32 @@ static void
 cockpit_channel_constructed (GObject *object)
 {
   CockpitChannel *self = COCKPIT_CHANNEL (object);
+  const gchar *payload = NULL;
 
   G_OBJECT_CLASS (cockpit_channel_parent_class)->constructed (object);
 
   g_return_if_fail (self->priv->id != NULL);
 
+  if (!all_channels)
+    all_channels = g_hash_table_new (g_direct_hash, g_direct_equal);
+  g_hash_table_add (all_channels, self);
+  if (self->priv->open_options &&
+      cockpit_json_get_string (self->priv->open_options, "payload", NULL, &payload) && payload)
+    {
+      if (!payload_stats)
+        payload_stats = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+      self->priv->payload_stats = g_hash_table_lookup (payload_stats, payload);
+      if (!self->priv->payload_stats)
+        {
+          self->priv->payload_stats = g_new0 (CockpitChannelStats, 1);
+          g_hash_table_insert (payload_stats, g_strdup (payload), self->priv->payload_stats);
+        }
+    }
+
   self->priv->capabilities = NULL;
-  self->priv->recv_sig = g_signal_connect (self->priv->transport, "recv",
-                                           G_CALLBACK (on_transport_recv), self);
-  self->priv->control_sig = g_signal_connect (self->priv->transport, "control",
-                                              G_CALLBACK (on_transport_control), self);
+  cockpit_transport_add_channel (self->priv->transport, self->priv->id,
+                                 on_transport_recv, on_transport_control, self);
+  self->priv->dispatching = TRUE;
   self->priv->close_sig = g_signal_connect (self->priv->transport, "closed",
                                             G_CALLBACK (on_transport_closed), self);
 
@@ -373,7 +517,11 @@ cockpit_channel_real_prepare (CockpitChannel *channel)
       return;
     }
 
-  if (!cockpit_json_get_string (options, "binary", NULL, &binary))
+  if (!cockpit_json_get_bool (options, "flow-control", FALSE, &self->priv->flow_control))
+    {
+      cockpit_channel_fail (self, "protocol-error", "channel has invalid \"flow-control\" option");
+    }
+  else if (!cockpit_json_get_string (options, "binary", NULL, &binary))
     {
       cockpit_channel_fail (self, "protocol-error", "channel has invalid \"binary\" option");
     }
@@ -424,7 +572,8 @@ cockpit_channel_set_property (GObject *object,
       self->priv->transport = g_value_dup_object (value);
       break;
     case PROP_ID:
-      self->priv->id = g_value_dup_string (value);
+      if (g_value_get_string (value))
+        self->priv->id = cockpit_transport_intern_channel (g_value_get_string (value), -1);
       break;
     case PROP_OPTIONS:
       self->priv->open_options = g_value_dup_boxed (value);
@@ -454,13 +603,9 @@ cockpit_channel_dispose (GObject *object)
       self->priv->prepare_tag = 0;
     }
 
-  if (self->priv->recv_sig)
-    g_signal_handler_disconnect (self->priv->transport, self->priv->recv_sig);
-  self->priv->recv_sig = 0;
-
-  if (self->priv->control_sig)
-    g_signal_handler_disconnect (self->priv->transport, self->priv->control_sig);
-  self->priv->control_sig = 0;
+  if (self->priv->dispatching)
+    cockpit_transport_remove_channel (self->priv->transport, self->priv->id);
+  self->priv->dispatching = FALSE;
 
   if (self->priv->close_sig)
     g_signal_handler_disconnect (self->priv->transport, self->priv->close_sig);
@@ -477,6 +622,8 @@ cockpit_channel_dispose (GObject *object)
     g_bytes_unref (self->priv->out_buffer);
   self->priv->out_buffer = NULL;
 
+  cockpit_flow_throttle (COCKPIT_FLOW (self), NULL);
+
   G_OBJECT_CLASS (cockpit_channel_parent_class)->dispose (object);
 }
 
@@ -492,7 +639,9 @@ cockpit_channel_finalize (GObject *object)
     json_object_unref (self->priv->close_options);
 
   g_strfreev (self->priv->capabilities);
-  g_free (self->priv->id);
+  if (all_channels)
+    g_hash_table_remove (all_channels, self);
+  cockpit_transport_release_channel (self->priv->id);
 
   G_OBJECT_CLASS (cockpit_channel_parent_class)->finalize (object);
 }
@@ -538,6 +687,63 @@ cockpit_channel_real_close (CockpitChannel *self,
   g_signal_emit (self, cockpit_channel_sig_closed, 0, problem);
 }
 
+static void
+on_throttle_pressure (GObject *object,
+                      gboolean throttle,
+                      gpointer user_data)
+{
+  CockpitChannel *self = COCKPIT_CHANNEL (user_data);
+  self->priv->throttled = throttle;
+  update_pressure (self);
+}
+
+static void
+on_throttle_weak (gpointer data,
+                  GObject *where_the_object_was)
+{
+  CockpitChannel *self = COCKPIT_CHANNEL (data);
+  self->priv->throttle = NULL;
+  self->priv->throttle_sig = 0;
+  on_throttle_pressure (NULL, FALSE, self);
+}
+
+static void
+cockpit_channel_throttle (CockpitFlow *flow,
+                          CockpitFlow *controlling)
+{
+  CockpitChannel *self = COCKPIT_CHANNEL (flow);
+
+  if (self->priv->throttle)
+    {
+      g_signal_handler_disconnect (self->priv->throttle, self->priv->throttle_sig);
+      g_object_weak_unref (G_OBJECT (self->priv->throttle), on_throttle_weak, self);
+      self->priv->throttle = NULL;
+      self->priv->throttle_sig = 0;
+    }
+
+  /*
+   * A channel that is throttled passes on pressure from the controlling
+   * flow to whatever is feeding the channel.
+   */
+  if (controlling)
+    {
+      self->priv->throttle = controlling;
+      self->priv->throttle_sig = g_signal_connect (controlling, "pressure",
+                                                   G_CALLBACK (on_throttle_pressure), self);
+      g_object_weak_ref (G_OBJECT (controlling), on_throttle_weak, self);
+    }
+  else if (self->priv->throttled)
+    {
+      on_throttle_pressure (NULL, FALSE, self);
+    }
+}
+
+static void
+cockpit_channel_flow_iface_init (CockpitFlowIface *iface)
+{
+  iface->throttle = cockpit_channel_throttle;
+}
+
 static void
 cockpit_channel_class_init (CockpitChannelClass *klass)
 {
@@ -654,13 +860,9 @@ cockpit_channel_close (CockpitChannel *self,
   g_return_if_fail (COCKPIT_IS_CHANNEL (self));
 
   /* No further messages should be received */
-  if (self->priv->recv_sig)
-    g_signal_handler_disconnect (self->priv->transport, self->priv->recv_sig);
-  self->priv->recv_sig = 0;
-
-  if (self->priv->control_sig)
-    g_signal_handler_disconnect (self->priv->transport, self->priv->control_sig);
-  self->priv->control_sig = 0;
+  if (self->priv->dispatching)
+    cockpit_transport_remove_channel (self->priv->transport, self->priv->id);
+  self->priv->dispatching = FALSE;
 
   if (self->priv->close_sig)
     g_signal_handler_disconnect (self->priv->transport, self->priv->close_sig);
@@ -837,6 +1039,52 @@ cockpit_channel_get_id (CockpitChannel *self)
   return self->priv->id;
 }
 
+/**
+ * cockpit_channel_foreach_stats:
+ * @func: called for each channel
+ * @user_data: passed to @func
+ *
+ * Call @func with the id and the number of messages and bytes
+ * received and sent for each channel that currently exists.
+ */
+void
+cockpit_channel_foreach_stats (CockpitChannelStatsFunc func,
+                               gpointer user_data)
+{
+  CockpitChannel *channel;
+  GHashTableIter iter;
+
+  if (!all_channels)
+    return;
+
+  g_hash_table_iter_init (&iter, all_channels);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&channel, NULL))
+    (func) (channel->priv->id, &channel->priv->stats, user_data);
+}
+
+/**
+ * cockpit_channel_foreach_payload_stats:
+ * @func: called for each payload type
+ * @user_data: passed to @func
+ *
+ * Call @func with the totals for each payload type, including
+ * the channels that have already gone away.
+ */
+void
+cockpit_channel_foreach_payload_stats (CockpitChannelStatsFunc func,
+                                       gpointer user_data)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if (!payload_stats)
+    return;
+
+  g_hash_table_iter_init (&iter, payload_stats);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    (func) (key, value, user_data);
+}
+
 /**
  * cockpit_channel_prepare:
  * @self: the channel
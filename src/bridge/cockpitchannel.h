@@ -69,6 +69,17 @@ struct _CockpitChannelClass
                                const gchar *problem);
 };
 
+typedef struct {
+  guint64 rx_messages;
+  guint64 rx_bytes;
+  guint64 tx_messages;
+  guint64 tx_bytes;
+} CockpitChannelStats;
+
+typedef void        (* CockpitChannelStatsFunc)       (const gchar *name,
+                                                       const CockpitChannelStats *stats,
+                                                       gpointer user_data);
+
 GType               cockpit_channel_get_type          (void) G_GNUC_CONST;
 
 void                cockpit_channel_prepare           (CockpitChannel *self);
@@ -83,6 +94,12 @@ void                cockpit_channel_fail              (CockpitChannel *self,
 
 const gchar *       cockpit_channel_get_id            (CockpitChannel *self);
 
+void                cockpit_channel_foreach_stats     (CockpitChannelStatsFunc func,
+                                                       gpointer user_data);
+
+void                cockpit_channel_foreach_payload_stats (CockpitChannelStatsFunc func,
+                                                           gpointer user_data);
+
 /* Used by implementations */
 
 void                cockpit_channel_control           (CockpitChannel *self,
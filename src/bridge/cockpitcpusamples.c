@@ -21,7 +21,8 @@
 
 #include "cockpitcpusamples.h"
 
-#include <stdio.h>
+#include "cockpitprocfile.h"
+
 #include <unistd.h>
 
 gint cockpit_cpu_user_hz = -1;
@@ -41,49 +42,37 @@ ensure_user_hz (void)
   return cockpit_cpu_user_hz;
 }
 
-/* TODO: this should be optimized so we don't allocate memory and call open()/close() all the time */
-
 void
 cockpit_cpu_samples (CockpitSamples *samples)
 {
-  gchar *contents = NULL;
-  GError *error = NULL;
-  gchar **lines = NULL;
+  static CockpitProcFile proc_stat = COCKPIT_PROC_FILE_INIT ("stat");
+  CockpitProcScanner scanner;
+  CockpitProcScanner line;
   guint64 user_hz;
-  gsize len;
-  guint n;
+  guint64 user;
+  guint64 nice;
+  guint64 system;
+  guint64 idle;
+  guint64 iowait;
 
-  if (!g_file_get_contents ("/proc/stat", &contents, &len, &error))
-    {
-      g_message ("error loading contents /proc/stat: %s", error->message);
-      g_error_free (error);
-      goto out;
-    }
+  if (!cockpit_proc_file_read (&proc_stat))
+    return;
 
   /* see 'man proc' for the format of /proc/stat */
 
-  lines = g_strsplit (contents, "\n", -1);
-  for (n = 0; lines != NULL && lines[n] != NULL; n++)
+  cockpit_proc_scanner_init (&scanner, &proc_stat);
+  while (cockpit_proc_scanner_line (&scanner, &line))
     {
-      const gchar *line = lines[n];
-      guint64 user;
-      guint64 nice;
-      guint64 system;
-      guint64 idle;
-      guint64 iowait;
-
-      if (!(g_str_has_prefix (line, "cpu ")))
+      if (!cockpit_proc_scanner_prefix (&line, "cpu "))
         continue;
 
-      #define FMT64 "%" G_GUINT64_FORMAT " "
-      if (sscanf (line + sizeof ("cpu ") - 1, FMT64 FMT64 FMT64 FMT64 FMT64,
-                  &user,
-                  &nice,
-                  &system,
-                  &idle,
-                  &iowait) != 5)
+      if (!cockpit_proc_scanner_uint64 (&line, &user) ||
+          !cockpit_proc_scanner_uint64 (&line, &nice) ||
+          !cockpit_proc_scanner_uint64 (&line, &system) ||
+          !cockpit_proc_scanner_uint64 (&line, &idle) ||
+          !cockpit_proc_scanner_uint64 (&line, &iowait))
         {
-          g_warning ("Error parsing line %d of /proc/stat with content `%s'", n, line);
+          g_warning ("Error parsing cpu line of /proc/stat");
           continue;
         }
 
@@ -94,8 +83,4 @@ cockpit_cpu_samples (CockpitSamples *samples)
       cockpit_samples_sample (samples, "cpu.basic.iowait", NULL, iowait*1000/user_hz);
       break;
     }
-
-out:
-  g_strfreev (lines);
-  g_free (contents);
 }
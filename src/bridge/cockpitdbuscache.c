@@ -21,13 +21,25 @@
 
 #include "cockpitdbuscache.h"
 
+#include "cockpitdbusmeta.h"
 #include "cockpitdbusrules.h"
 #include "cockpitpaths.h"
 
+#include "common/cockpitjson.h"
+
+#include <sys/stat.h>
+#include <errno.h>
 #include <string.h>
+#include <unistd.h>
 
 #define DEBUG_BATCHES 0
 
+/* How many Introspect() calls we keep in flight at once */
+#define MAX_INTROSPECTS 16
+
+/* How many distinct leaf introspection documents we keep parsed */
+#define MAX_INTROSPECT_XML 64
+
 /*
  * This is a cache of properties which tracks updates. The best way to do
  * this is via ObjectManager. But it also does introspection and uses that
@@ -42,6 +54,16 @@
  * Also information about an interface will be available before we notify
  * about properties on an interface. This is a further ordering guarantee.
  *
+ * Several Introspect() calls are in flight at once, but their replies are
+ * processed strictly in the order they were queued. A reply that arrives
+ * early waits until those queued before it have been processed.
+ *
+ * Interface info can be kept on disk between bridges, in a file per
+ * message bus and bus name in cockpit_dbus_cache_directory. It is only
+ * used while the same build of the service is running. The first time
+ * an interface loaded from there is used, one real Introspect() goes
+ * out in the background to check it.
+ *
  * Since there are lots of strings, to help with allocation churn, we have our
  * own string intern table, where path, interface and property names are
  * stored while the cache is active. Each time we get a path etc. from an
@@ -65,9 +87,22 @@ struct _CockpitDBusCache {
   /* Introspection stuff */
   GHashTable *introspected;
   GQueue *introspects;
+  GList *introspect_unsent;
+  guint introspecting;
+  GHashTable *introspect_xml;
   GHashTable *introsent;
   GList *trash;
 
+  /* Introspection kept on disk, for caches on a known message bus */
+  gchar *bus;
+  gchar *identity;
+  gboolean preloading;
+  gboolean persist_dirty;
+  GHashTable *persisted;
+  GHashTable *unverified;
+  GHashTable *verifying;
+  GList *retired;
+
   /* The main data cache: paths > interfaces -> properties -> values */
   GHashTable *cache;
 
@@ -96,6 +131,7 @@ struct _CockpitDBusCache {
 
 enum {
   PROP_CONNECTION = 1,
+  PROP_BUS,
   PROP_NAME,
   PROP_LOGNAME,
   PROP_INTERFACE_INFO
@@ -104,6 +140,9 @@ enum {
 static guint signal_meta;
 static guint signal_update;
 
+/* Where introspection data is kept between bridges, or NULL */
+const gchar *cockpit_dbus_cache_directory = NULL;
+
 G_DEFINE_TYPE (CockpitDBusCache, cockpit_dbus_cache, G_TYPE_OBJECT);
 
 static void
@@ -362,7 +401,12 @@ cockpit_dbus_cache_init (CockpitDBusCache *self)
   self->rules = cockpit_dbus_rules_new ();
 
   self->introspects = g_queue_new ();
+  self->introspect_xml = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                (GDestroyNotify)g_dbus_node_info_unref);
   self->introsent = g_hash_table_new (g_str_hash, g_str_equal);
+  self->persisted = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->unverified = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->verifying = g_hash_table_new (g_str_hash, g_str_equal);
 
   self->batches = g_queue_new ();
   self->barriers = g_queue_new ();
@@ -378,7 +422,14 @@ typedef struct {
   CockpitDBusIntrospectFunc callback;
   gpointer user_data;
   BatchData *batch;
+
+  /* Holds a reference while the call is in flight */
+  CockpitDBusCache *cache;
   gboolean introspecting;
+  gboolean replied;
+  gboolean flushed;
+  GVariant *retval;
+  GError *error;
 } IntrospectData;
 
 static void
@@ -389,6 +440,17 @@ scrape_variant (CockpitDBusCache *self,
                 BatchData *batch,
                 GVariant *data);
 
+static void
+introspect_free (IntrospectData *id)
+{
+  g_assert (id->callback == NULL);
+  g_assert (id->cache == NULL);
+  if (id->retval)
+    g_variant_unref (id->retval);
+  g_clear_error (&id->error);
+  g_slice_free (IntrospectData, id);
+}
+
 static void
 introspect_complete (CockpitDBusCache *self,
                      IntrospectData *id)
@@ -425,8 +487,11 @@ introspect_complete (CockpitDBusCache *self,
   id->callback = NULL;
 
   batch_unref (self, id->batch);
-  g_assert (id->callback == NULL);
-  g_slice_free (IntrospectData, id);
+  id->batch = NULL;
+
+  /* A call still in flight frees this when it returns */
+  if (id->cache == NULL)
+    introspect_free (id);
 }
 
 static void
@@ -475,56 +540,109 @@ dbus_error_matches_unknown (GError *error)
   return ret;
 }
 
-static void
-on_introspect_reply (GObject *source,
-                     GAsyncResult *result,
-                     gpointer user_data)
+static GDBusNodeInfo *
+introspect_parse (CockpitDBusCache *self,
+                  const gchar *xml,
+                  GError **error)
 {
-  CockpitDBusCache *self = user_data;
-  IntrospectData *id;
   GDBusNodeInfo *node;
-  GError *error = NULL;
-  GVariant *retval;
-  const gchar *xml;
 
-  /* All done with this introspect */
-  id = g_queue_pop_head (self->introspects);
+  /*
+   * Objects of the same kind usually have identical introspection data,
+   * and parsing it is most of the work. Only documents without child
+   * nodes are kept, others are specific to the path they came from.
+   */
+  node = g_hash_table_lookup (self->introspect_xml, xml);
+  if (node)
+    return g_dbus_node_info_ref (node);
 
-  /* Introspects have been flushed */
-  if (!id)
+  node = g_dbus_node_info_new_for_xml (xml, error);
+  if (node && !(node->nodes && node->nodes[0]))
     {
-      g_object_unref (self);
-      return;
+      if (g_hash_table_size (self->introspect_xml) >= MAX_INTROSPECT_XML)
+        g_hash_table_remove_all (self->introspect_xml);
+      g_hash_table_insert (self->introspect_xml, g_strdup (xml), g_dbus_node_info_ref (node));
     }
 
-  g_assert (id->introspecting);
+  return node;
+}
 
-  retval = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &error);
+static IntrospectData *
+introspect_pop (CockpitDBusCache *self)
+{
+  if (self->introspect_unsent == self->introspects->head)
+    self->introspect_unsent = g_list_next (self->introspect_unsent);
+  return g_queue_pop_head (self->introspects);
+}
 
-  if (retval)
+static void
+introspect_process (CockpitDBusCache *self)
+{
+  IntrospectData *id;
+  GDBusNodeInfo *node;
+  const gchar *xml;
+
+  for (;;)
     {
-      g_debug ("%s: reply from Introspect() at %s", self->logname, id->path);
+      /* Only ever process the oldest introspect, to keep things in order */
+      id = g_queue_peek_head (self->introspects);
+      if (!id || !id->replied)
+        return;
 
-      g_variant_get (retval, "(&s)", &xml);
+      introspect_pop (self);
 
-      node = g_dbus_node_info_new_for_xml (xml, &error);
-      if (node)
+      if (id->retval)
+        {
+          g_debug ("%s: reply from Introspect() at %s", self->logname, id->path);
+
+          g_variant_get (id->retval, "(&s)", &xml);
+
+          node = introspect_parse (self, xml, &id->error);
+          if (node)
+            {
+              process_introspect_node (self, id->batch, id->path, node, id->interface == NULL);
+              g_dbus_node_info_unref (node);
+            }
+        }
+
+      if (id->error)
         {
-          process_introspect_node (self, id->batch, id->path, node, id->interface == NULL);
-          g_dbus_node_info_unref (node);
+          if (!dbus_error_matches_unknown (id->error))
+            g_message ("%s: couldn't introspect %s: %s", self->logname, id->path, id->error->message);
         }
-      g_variant_unref (retval);
+
+      introspect_complete (self, id);
     }
+}
 
-  if (error)
+static void
+on_introspect_reply (GObject *source,
+                     GAsyncResult *result,
+                     gpointer user_data)
+{
+  IntrospectData *id = user_data;
+  CockpitDBusCache *self = id->cache;
+
+  g_assert (id->introspecting);
+  id->introspecting = FALSE;
+  id->cache = NULL;
+
+  g_assert (self->introspecting > 0);
+  self->introspecting--;
+
+  id->retval = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &id->error);
+  id->replied = TRUE;
+
+  /* Introspects have been flushed, this was already completed */
+  if (id->flushed)
     {
-      if (!dbus_error_matches_unknown (error))
-        g_message ("%s: couldn't introspect %s: %s", self->logname, id->path, error->message);
-      g_error_free (error);
+      introspect_free (id);
+    }
+  else
+    {
+      introspect_process (self);
+      introspect_next (self);
     }
-
-  introspect_complete (self, id);
-  introspect_next (self);
 
   g_object_unref (self);
 }
@@ -533,27 +651,46 @@ static void
 introspect_next (CockpitDBusCache *self)
 {
   IntrospectData *id;
+  GList *l;
 
-  id = g_queue_peek_head (self->introspects);
-  if (id && !id->introspecting)
+  if (g_cancellable_is_cancelled (self->cancellable))
     {
-      if (g_cancellable_is_cancelled (self->cancellable))
+      /* Complete the oldest ones that never got called */
+      for (;;)
         {
-          g_queue_pop_head (self->introspects);
+          id = g_queue_peek_head (self->introspects);
+          if (!id || id->introspecting || id->replied)
+            return;
+          introspect_pop (self);
           introspect_complete (self, id);
         }
-      else
-        {
-          g_debug ("%s: calling Introspect() on %s", self->logname, id->path);
-
-          id->introspecting = TRUE;
-          g_dbus_connection_call (self->connection, self->name, id->path,
-                                  "org.freedesktop.DBus.Introspectable", "Introspect",
-                                  g_variant_new ("()"), G_VARIANT_TYPE ("(s)"),
-                                  G_DBUS_CALL_FLAGS_NONE, -1,
-                                  self->cancellable, on_introspect_reply,
-                                  g_object_ref (self));
-        }
+    }
+
+  /* Wait to see what we already know about */
+  if (self->preloading)
+    return;
+
+  /* Calls go out in queue order, everything before this has been sent */
+  while (self->introspect_unsent && self->introspecting < MAX_INTROSPECTS)
+    {
+      l = self->introspect_unsent;
+      self->introspect_unsent = g_list_next (l);
+
+      id = l->data;
+      if (id->replied)
+        continue;
+
+      g_debug ("%s: calling Introspect() on %s", self->logname, id->path);
+
+      id->introspecting = TRUE;
+      id->cache = g_object_ref (self);
+      self->introspecting++;
+
+      g_dbus_connection_call (self->connection, self->name, id->path,
+                              "org.freedesktop.DBus.Introspectable", "Introspect",
+                              g_variant_new ("()"), G_VARIANT_TYPE ("(s)"),
+                              G_DBUS_CALL_FLAGS_NONE, -1,
+                              self->cancellable, on_introspect_reply, id);
     }
 }
 
@@ -575,6 +712,7 @@ introspect_flush (CockpitDBusCache *self)
             break;
           g_queue_push_head (queue, id);
         }
+      self->introspect_unsent = NULL;
 
       id = g_queue_pop_head (queue);
       if (!id)
@@ -586,6 +724,10 @@ introspect_flush (CockpitDBusCache *self)
       if (!note)
         g_debug ("%s: flushing introspect queue", self->logname);
       note = TRUE;
+
+      /* Calls still in flight free these when they return */
+      if (id->introspecting)
+        id->flushed = TRUE;
       introspect_complete (self, id);
     }
 }
@@ -613,10 +755,17 @@ introspect_queue (CockpitDBusCache *self,
   g_debug ("%s: queueing introspect %s %s%s", self->logname, path,
            interface ? "for " : "", interface ? interface : "");
   g_queue_push_tail (self->introspects, id);
+  if (!self->introspect_unsent)
+    self->introspect_unsent = self->introspects->tail;
 
   introspect_next (self);
 }
 
+static void
+persist_check (CockpitDBusCache *self,
+               const gchar *path,
+               const gchar *interface);
+
 static void
 introspect_maybe (CockpitDBusCache *self,
                   BatchData *batch,
@@ -633,6 +782,7 @@ introspect_maybe (CockpitDBusCache *self,
   iface = cockpit_dbus_interface_info_lookup (self->introspected, interface);
   if (iface)
     {
+      persist_check (self, path, interface);
       (callback) (self, iface, user_data);
     }
   else
@@ -1221,6 +1371,428 @@ on_manager_signal (GDBusConnection *connection,
     }
 }
 
+/*
+ * Something that changes with each build of a service: the path and
+ * modification time of its executable, and its command line. Returns NULL
+ * when the executable changed after the process started, since what runs
+ * may no longer be what is on disk.
+ */
+static gchar *
+service_identity (guint32 pid)
+{
+  struct stat sb;
+  gchar *identity = NULL;
+  gchar *contents = NULL;
+  gchar *cmdline = NULL;
+  gchar *exe = NULL;
+  gchar **fields = NULL;
+  const gchar *line;
+  gchar *filename;
+  gdouble started;
+  guint64 boot;
+  gsize length;
+  gsize i;
+
+  /* Prefer the real executable, but it isn't visible for other users */
+  filename = g_strdup_printf ("/proc/%u/exe", pid);
+  exe = g_file_read_link (filename, NULL);
+  g_free (filename);
+
+  filename = g_strdup_printf ("/proc/%u/cmdline", pid);
+  if (!g_file_get_contents (filename, &cmdline, &length, NULL) || length == 0)
+    goto out;
+
+  if (!exe && cmdline[0] == '/')
+    exe = g_strdup (cmdline);
+  if (!exe || g_str_has_suffix (exe, " (deleted)") || stat (exe, &sb) < 0)
+    goto out;
+
+  g_free (filename);
+  filename = g_strdup_printf ("/proc/%u/stat", pid);
+  if (!g_file_get_contents (filename, &contents, NULL, NULL))
+    goto out;
+
+  /* The process name may contain spaces, so start after it */
+  line = strrchr (contents, ')');
+  if (!line || !line[1])
+    goto out;
+  fields = g_strsplit (line + 2, " ", 21);
+  if (g_strv_length (fields) < 20)
+    goto out;
+  started = g_ascii_strtod (fields[19], NULL) / sysconf (_SC_CLK_TCK);
+
+  g_free (contents);
+  contents = NULL;
+  if (!g_file_get_contents ("/proc/stat", &contents, NULL, NULL))
+    goto out;
+  line = strstr (contents, "\nbtime ");
+  if (!line)
+    goto out;
+  boot = g_ascii_strtoull (line + 7, NULL, 10);
+
+  if (sb.st_mtime > boot + started)
+    goto out;
+
+  /* Arguments are separated by nul */
+  for (i = 0; i + 1 < length; i++)
+    {
+      if (cmdline[i] == '\0')
+        cmdline[i] = ' ';
+    }
+
+  identity = g_strdup_printf ("%s %ld %s", exe, (long)sb.st_mtime, cmdline);
+
+out:
+  g_strfreev (fields);
+  g_free (filename);
+  g_free (contents);
+  g_free (cmdline);
+  g_free (exe);
+  return identity;
+}
+
+static gchar *
+persist_filename (CockpitDBusCache *self)
+{
+  gchar *basename;
+  gchar *filename;
+
+  /* The same name may be taken on the system and the session bus */
+  basename = g_strconcat (self->name, ".json", NULL);
+  filename = g_build_filename (cockpit_dbus_cache_directory, self->bus, basename, NULL);
+  g_free (basename);
+
+  return filename;
+}
+
+static void
+persist_load (CockpitDBusCache *self)
+{
+  GDBusInterfaceInfo *iface;
+  JsonObject *interfaces;
+  JsonObject *object = NULL;
+  JsonObject *meta;
+  const gchar *identity;
+  GError *error = NULL;
+  gchar *filename;
+  gchar *contents = NULL;
+  GList *names = NULL;
+  GList *l;
+  gsize length;
+
+  filename = persist_filename (self);
+  if (!g_file_get_contents (filename, &contents, &length, &error))
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_debug ("%s: couldn't read introspection cache: %s", self->logname, error->message);
+      goto out;
+    }
+
+  object = cockpit_json_parse_object (contents, length, &error);
+  if (!object)
+    {
+      g_debug ("%s: invalid introspection cache: %s", self->logname, error->message);
+      goto out;
+    }
+
+  if (!cockpit_json_get_string (object, "identity", NULL, &identity) ||
+      g_strcmp0 (identity, self->identity) != 0 ||
+      !cockpit_json_get_object (object, "interfaces", NULL, &interfaces) || !interfaces)
+    {
+      g_debug ("%s: introspection cache is out of date", self->logname);
+      goto out;
+    }
+
+  names = json_object_get_members (interfaces);
+  for (l = names; l != NULL; l = g_list_next (l))
+    {
+      if (cockpit_dbus_interface_info_lookup (self->introspected, l->data))
+        continue;
+      if (!cockpit_json_get_object (interfaces, l->data, NULL, &meta) || !meta)
+        continue;
+
+      iface = cockpit_dbus_meta_parse (l->data, meta, &error);
+      if (!iface)
+        {
+          g_debug ("%s: invalid interface in introspection cache: %s", self->logname, error->message);
+          g_clear_error (&error);
+          continue;
+        }
+
+      cockpit_dbus_interface_info_push (self->introspected, iface);
+      g_hash_table_add (self->persisted, g_strdup (iface->name));
+      g_hash_table_add (self->unverified, g_strdup (iface->name));
+      g_dbus_interface_info_unref (iface);
+    }
+
+  g_debug ("%s: loaded %u interfaces from introspection cache", self->logname,
+           g_hash_table_size (self->unverified));
+
+out:
+  g_clear_error (&error);
+  g_list_free (names);
+  if (object)
+    json_object_unref (object);
+  g_free (contents);
+  g_free (filename);
+}
+
+static void
+persist_save (CockpitDBusCache *self)
+{
+  GDBusInterfaceInfo *iface;
+  JsonObject *interfaces;
+  JsonObject *object;
+  GHashTableIter iter;
+  GError *error = NULL;
+  gpointer name;
+  gchar *directory;
+  gchar *filename;
+  gchar *contents;
+  gsize length;
+
+  interfaces = json_object_new ();
+  g_hash_table_iter_init (&iter, self->persisted);
+  while (g_hash_table_iter_next (&iter, &name, NULL))
+    {
+      iface = cockpit_dbus_interface_info_lookup (self->introspected, name);
+      if (iface)
+        json_object_set_object_member (interfaces, name, cockpit_dbus_meta_build (iface));
+    }
+
+  object = json_object_new ();
+  json_object_set_string_member (object, "identity", self->identity);
+  json_object_set_object_member (object, "interfaces", interfaces);
+  contents = cockpit_json_write_object (object, &length);
+  json_object_unref (object);
+
+  filename = persist_filename (self);
+  directory = g_path_get_dirname (filename);
+  if (g_mkdir_with_parents (directory, 0700) < 0)
+    {
+      g_message ("%s: couldn't create introspection cache directory: %s",
+                 self->logname, g_strerror (errno));
+    }
+  else if (!g_file_set_contents (filename, contents, length, &error))
+    {
+      g_message ("%s: couldn't write introspection cache: %s", self->logname, error->message);
+      g_error_free (error);
+    }
+  else
+    {
+      g_debug ("%s: wrote introspection cache: %s", self->logname, filename);
+    }
+
+  g_free (directory);
+  g_free (filename);
+  g_free (contents);
+}
+
+static GDBusInterfaceInfo *
+persist_verify (CockpitDBusCache *self,
+                GDBusInterfaceInfo *prev,
+                GDBusInterfaceInfo *iface)
+{
+  JsonObject *before;
+  JsonObject *after;
+  gboolean same;
+
+  if (!g_hash_table_remove (self->unverified, iface->name))
+    return prev;
+
+  before = cockpit_dbus_meta_build (prev);
+  after = cockpit_dbus_meta_build (iface);
+  same = cockpit_json_equal_object (before, after);
+  json_object_unref (before);
+  json_object_unref (after);
+
+  if (same)
+    return prev;
+
+  g_debug ("%s: introspection cache was wrong about %s", self->logname, iface->name);
+
+  /*
+   * Paths and callers may still point into what we loaded, so keep it
+   * around. And send meta again, with the real thing this time.
+   */
+  self->retired = g_list_prepend (self->retired, g_dbus_interface_info_ref (prev));
+  g_hash_table_remove (self->introsent, iface->name);
+  self->persist_dirty = TRUE;
+  return NULL;
+}
+
+static void
+persist_remember (CockpitDBusCache *self,
+                  GDBusInterfaceInfo *iface)
+{
+  if (self->identity && !g_hash_table_contains (self->persisted, iface->name))
+    {
+      g_hash_table_add (self->persisted, g_strdup (iface->name));
+      self->persist_dirty = TRUE;
+    }
+}
+
+typedef struct {
+  CockpitDBusCache *self;
+  const gchar *path;
+  const gchar *interface;
+} VerifyData;
+
+static void
+on_verify_reply (GObject *source,
+                 GAsyncResult *result,
+                 gpointer user_data)
+{
+  VerifyData *vd = user_data;
+  CockpitDBusCache *self = vd->self;
+  GDBusInterfaceInfo *iface = NULL;
+  GDBusInterfaceInfo *prev;
+  GDBusNodeInfo *node = NULL;
+  GError *error = NULL;
+  GVariant *retval;
+  const gchar *xml;
+  gboolean sent;
+
+  g_hash_table_remove (self->verifying, vd->interface);
+
+  retval = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &error);
+  if (retval)
+    {
+      g_variant_get (retval, "(&s)", &xml);
+      node = introspect_parse (self, xml, &error);
+      if (node)
+        iface = g_dbus_node_info_lookup_interface (node, vd->interface);
+    }
+
+  prev = cockpit_dbus_interface_info_lookup (self->introspected, vd->interface);
+  if (iface && prev)
+    {
+      sent = g_hash_table_contains (self->introsent, vd->interface);
+      if (!persist_verify (self, prev, iface))
+        {
+          cockpit_dbus_interface_info_push (self->introspected, iface);
+
+          /* Nothing else might come along to send the real thing */
+          if (sent)
+            {
+              g_hash_table_add (self->introsent, (gpointer)vd->interface);
+              g_signal_emit (self, signal_meta, 0, iface);
+            }
+        }
+    }
+
+  if (error)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) &&
+          !dbus_error_matches_unknown (error))
+        g_message ("%s: couldn't check %s at %s: %s", self->logname, vd->interface, vd->path, error->message);
+      g_error_free (error);
+    }
+
+  if (node)
+    g_dbus_node_info_unref (node);
+  if (retval)
+    g_variant_unref (retval);
+  g_object_unref (self);
+  g_slice_free (VerifyData, vd);
+}
+
+static void
+persist_check (CockpitDBusCache *self,
+               const gchar *path,
+               const gchar *interface)
+{
+  VerifyData *vd;
+
+  /* Answers already came from disk, this doesn't hold anything up */
+  if (!g_hash_table_contains (self->unverified, interface) ||
+      g_hash_table_contains (self->verifying, interface) ||
+      g_cancellable_is_cancelled (self->cancellable))
+    return;
+
+  vd = g_slice_new0 (VerifyData);
+  vd->self = g_object_ref (self);
+  vd->path = intern_string (self, path);
+  vd->interface = intern_string (self, interface);
+  g_hash_table_add (self->verifying, (gpointer)vd->interface);
+
+  g_debug ("%s: calling Introspect() on %s to check %s", self->logname, path, interface);
+
+  g_dbus_connection_call (self->connection, self->name, vd->path,
+                          "org.freedesktop.DBus.Introspectable", "Introspect",
+                          g_variant_new ("()"), G_VARIANT_TYPE ("(s)"),
+                          G_DBUS_CALL_FLAGS_NONE, -1,
+                          self->cancellable, on_verify_reply, vd);
+}
+
+static void
+on_process_id_reply (GObject *source,
+                     GAsyncResult *result,
+                     gpointer user_data)
+{
+  CockpitDBusCache *self = user_data;
+  IntrospectData *id;
+  GError *error = NULL;
+  GVariant *retval;
+  guint32 pid;
+  GList *l;
+
+  retval = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &error);
+  if (retval)
+    {
+      g_variant_get (retval, "(u)", &pid);
+      self->identity = service_identity (pid);
+      if (self->identity)
+        persist_load (self);
+      g_variant_unref (retval);
+    }
+  else
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_debug ("%s: couldn't find service process: %s", self->logname, error->message);
+      g_error_free (error);
+    }
+
+  self->preloading = FALSE;
+
+  if (!g_cancellable_is_cancelled (self->cancellable))
+    {
+      /* Anything we know about now needs no call */
+      for (l = self->introspects->head; l != NULL; l = g_list_next (l))
+        {
+          id = l->data;
+          if (id->interface && !id->introspecting && !id->replied &&
+              cockpit_dbus_interface_info_lookup (self->introspected, id->interface))
+            {
+              id->replied = TRUE;
+              persist_check (self, id->path, id->interface);
+            }
+        }
+
+      introspect_process (self);
+      introspect_next (self);
+    }
+
+  g_object_unref (self);
+}
+
+static void
+persist_start (CockpitDBusCache *self)
+{
+  /* Only for services with a well known name on a message bus */
+  if (!cockpit_dbus_cache_directory || !self->bus ||
+      !self->name || g_dbus_is_unique_name (self->name) ||
+      !g_dbus_connection_get_unique_name (self->connection))
+    return;
+
+  self->preloading = TRUE;
+  g_dbus_connection_call (self->connection, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                          "org.freedesktop.DBus", "GetConnectionUnixProcessID",
+                          g_variant_new ("(s)", self->name), G_VARIANT_TYPE ("(u)"),
+                          G_DBUS_CALL_FLAGS_NONE, -1, self->cancellable,
+                          on_process_id_reply, g_object_ref (self));
+}
+
 static void
 cockpit_dbus_cache_constructed (GObject *object)
 {
@@ -1252,6 +1824,8 @@ cockpit_dbus_cache_constructed (GObject *object)
                                                                 self, NULL);
 
   self->subscribed = TRUE;
+
+  persist_start (self);
 }
 
 static void
@@ -1267,6 +1841,9 @@ cockpit_dbus_cache_set_property (GObject *obj,
       case PROP_CONNECTION:
         self->connection = g_value_dup_object (value);
         break;
+      case PROP_BUS:
+        self->bus = g_value_dup_string (value);
+        break;
       case PROP_NAME:
         self->name = g_value_dup_string (value);
         break;
@@ -1300,6 +1877,12 @@ cockpit_dbus_cache_dispose (GObject *object)
   batch_flush (self);
   barrier_flush (self);
 
+  if (self->persist_dirty)
+    {
+      persist_save (self);
+      self->persist_dirty = FALSE;
+    }
+
   G_OBJECT_CLASS (cockpit_dbus_cache_parent_class)->dispose (object);
 }
 
@@ -1311,6 +1894,7 @@ cockpit_dbus_cache_finalize (GObject *object)
   g_clear_object (&self->connection);
   g_object_unref (self->cancellable);
 
+  g_free (self->bus);
   g_free (self->name);
   g_free (self->logname);
 
@@ -1322,8 +1906,14 @@ cockpit_dbus_cache_finalize (GObject *object)
 
   g_assert (self->introspects->head == NULL);
   g_queue_free (self->introspects);
+  g_hash_table_unref (self->introspect_xml);
 
   g_hash_table_unref (self->introsent);
+  g_hash_table_unref (self->persisted);
+  g_hash_table_unref (self->unverified);
+  g_hash_table_unref (self->verifying);
+  g_list_free_full (self->retired, (GDestroyNotify)g_dbus_interface_info_unref);
+  g_free (self->identity);
   g_hash_table_unref (self->introspected);
   g_hash_table_unref (self->cache);
 
@@ -1357,6 +1947,10 @@ cockpit_dbus_cache_class_init (CockpitDBusCacheClass *klass)
        g_param_spec_object ("connection", "connection", "connection", G_TYPE_DBUS_CONNECTION,
                             G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (gobject_class, PROP_BUS,
+       g_param_spec_string ("bus", "bus", "bus", NULL,
+                            G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
+
   g_object_class_install_property (gobject_class, PROP_NAME,
        g_param_spec_string ("name", "name", "name", NULL,
                             G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS));
@@ -1680,6 +2274,8 @@ process_introspect_node (CockpitDBusCache *self,
 
       /* Cache this interface for later use elsewhere */
       prev = cockpit_dbus_interface_info_lookup (self->introspected, iface->name);
+      if (prev)
+        prev = persist_verify (self, prev, iface);
       if (prev)
         {
           iface = prev;
@@ -1687,6 +2283,7 @@ process_introspect_node (CockpitDBusCache *self,
       else
         {
           cockpit_dbus_interface_info_push (self->introspected, iface);
+          persist_remember (self, iface);
         }
 
       /* Skip these interfaces */
@@ -1846,9 +2443,17 @@ cockpit_dbus_cache_unwatch (CockpitDBusCache *self,
   return cockpit_dbus_rules_remove (self->rules, path, is_namespace, interface, NULL, NULL);
 }
 
-static void
-scrape_variant_paths (GVariant *data,
-                      GHashTable *paths)
+/**
+ * cockpit_dbus_cache_scrape_paths:
+ * @data: a value
+ * @paths: a set of strings
+ *
+ * Add the object paths in @data to @paths, as cockpit_dbus_cache_scrape()
+ * finds them. The strings point into @data.
+ */
+void
+cockpit_dbus_cache_scrape_paths (GVariant *data,
+                                 GHashTable *paths)
 {
   GVariantIter iter;
   GVariant *child;
@@ -1862,7 +2467,7 @@ scrape_variant_paths (GVariant *data,
       g_variant_iter_init (&iter, data);
       while ((child = g_variant_iter_next_value (&iter)) != NULL)
         {
-          scrape_variant_paths (child, paths);
+          cockpit_dbus_cache_scrape_paths (child, paths);
           g_variant_unref (child);
         }
     }
@@ -1903,7 +2508,7 @@ scrape_variant (CockpitDBusCache *self,
   gpointer path;
 
   paths = g_hash_table_new (g_str_hash, g_str_equal);
-  scrape_variant_paths (data, paths);
+  cockpit_dbus_cache_scrape_paths (data, paths);
 
   if (batch)
     batch = batch_ref (batch);
@@ -2016,14 +2621,125 @@ cockpit_dbus_cache_poke (CockpitDBusCache *self,
   batch_unref (self, batch);
 }
 
+static GHashTable *
+copy_properties (GHashTable *properties)
+{
+  GHashTable *copy;
+  GHashTableIter iter;
+  gpointer property;
+  gpointer value;
+
+  copy = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                NULL, (GDestroyNotify)g_variant_unref);
+  g_hash_table_iter_init (&iter, properties);
+  while (g_hash_table_iter_next (&iter, &property, &value))
+    g_hash_table_replace (copy, property, g_variant_ref (value));
+  return copy;
+}
+
+GHashTable *
+cockpit_dbus_cache_snapshot (CockpitDBusCache *self,
+                             const gchar *path,
+                             gboolean is_namespace,
+                             const gchar *interface)
+{
+  CockpitDBusRules *rules;
+  GHashTable *snapshot = NULL;
+  GHashTable *interfaces;
+  GHashTable *properties;
+  GHashTable *copy;
+  GHashTableIter i, j;
+  const gchar *cached;
+  const gchar *name;
+
+  rules = cockpit_dbus_rules_new ();
+  cockpit_dbus_rules_add (rules, path, is_namespace, interface, NULL, NULL);
+
+  /* Same shape as the tables passed to the "update" signal */
+  g_hash_table_iter_init (&i, self->cache);
+  while (g_hash_table_iter_next (&i, (gpointer *)&cached, (gpointer *)&interfaces))
+    {
+      g_hash_table_iter_init (&j, interfaces);
+      while (g_hash_table_iter_next (&j, (gpointer *)&name, (gpointer *)&properties))
+        {
+          if (!cockpit_dbus_rules_match (rules, cached, name, NULL, NULL))
+            continue;
+
+          if (!snapshot)
+            {
+              snapshot = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                NULL, hash_table_unref_or_null);
+            }
+
+          copy = g_hash_table_lookup (snapshot, cached);
+          if (!copy)
+            {
+              copy = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            NULL, hash_table_unref_or_null);
+              g_hash_table_replace (snapshot, (gchar *)cached, copy);
+            }
+
+          g_hash_table_replace (copy, (gchar *)name, copy_properties (properties));
+        }
+    }
+
+  cockpit_dbus_rules_free (rules);
+  return snapshot;
+}
+
+/**
+ * cockpit_dbus_cache_interned:
+ * @self: a cache
+ * @string: a path or name
+ *
+ * Returns: the cache's own copy of @string, which stays valid as long as
+ *          the cache does, or %NULL if the cache never needed it.
+ */
+const gchar *
+cockpit_dbus_cache_interned (CockpitDBusCache *self,
+                             const gchar *string)
+{
+  g_return_val_if_fail (COCKPIT_IS_DBUS_CACHE (self), NULL);
+  return g_hash_table_lookup (self->interned, string);
+}
+
+/**
+ * cockpit_dbus_cache_holds:
+ * @self: a cache
+ * @path: an object path
+ *
+ * Returns: whether the cache has any interfaces at @path. This turns
+ *          %FALSE once the last of them has been removed.
+ */
+gboolean
+cockpit_dbus_cache_holds (CockpitDBusCache *self,
+                          const gchar *path)
+{
+  GHashTable *interfaces;
+
+  g_return_val_if_fail (COCKPIT_IS_DBUS_CACHE (self), FALSE);
+
+  interfaces = g_hash_table_lookup (self->cache, path);
+  return interfaces && g_hash_table_size (interfaces) > 0;
+}
+
+GHashTable *
+cockpit_dbus_cache_get_interface_info (CockpitDBusCache *self)
+{
+  g_return_val_if_fail (COCKPIT_IS_DBUS_CACHE (self), NULL);
+  return self->introspected;
+}
+
 CockpitDBusCache *
 cockpit_dbus_cache_new (GDBusConnection *connection,
+                        const gchar *bus,
                         const gchar *name,
                         const gchar *logname,
                         GHashTable *interface_info)
 {
   return g_object_new (COCKPIT_TYPE_DBUS_CACHE,
                        "connection", connection,
+                       "bus", bus,
                        "name", name,
                        "logname", logname,
                        "interface-info", interface_info,
@@ -52,6 +52,7 @@ typedef void       (* CockpitDBusBarrierFunc)              (CockpitDBusCache *ca
 GType                 cockpit_dbus_cache_get_type          (void) G_GNUC_CONST;
 
 CockpitDBusCache *    cockpit_dbus_cache_new               (GDBusConnection *connection,
+                                                            const gchar *bus,
                                                             const gchar *name,
                                                             const gchar *logname,
                                                             GHashTable *interface_info);
@@ -67,6 +68,9 @@ void                  cockpit_dbus_cache_poke              (CockpitDBusCache *se
 void                  cockpit_dbus_cache_scrape            (CockpitDBusCache *self,
                                                             GVariant *data);
 
+void                  cockpit_dbus_cache_scrape_paths      (GVariant *data,
+                                                            GHashTable *paths);
+
 void                  cockpit_dbus_cache_watch             (CockpitDBusCache *self,
                                                             const gchar *path,
                                                             gboolean is_namespace,
@@ -83,6 +87,19 @@ void                  cockpit_dbus_cache_introspect        (CockpitDBusCache *se
                                                             CockpitDBusIntrospectFunc callback,
                                                             gpointer user_data);
 
+GHashTable *          cockpit_dbus_cache_snapshot          (CockpitDBusCache *self,
+                                                            const gchar *path,
+                                                            gboolean is_namespace,
+                                                            const gchar *interface);
+
+const gchar *         cockpit_dbus_cache_interned          (CockpitDBusCache *self,
+                                                            const gchar *string);
+
+gboolean              cockpit_dbus_cache_holds             (CockpitDBusCache *self,
+                                                            const gchar *path);
+
+GHashTable *          cockpit_dbus_cache_get_interface_info (CockpitDBusCache *self);
+
 GHashTable *          cockpit_dbus_interface_info_new      (void);
 
 GDBusInterfaceInfo *  cockpit_dbus_interface_info_lookup   (GHashTable *interface_info,
@@ -91,6 +108,8 @@ GDBusInterfaceInfo *  cockpit_dbus_interface_info_lookup   (GHashTable *interfac
 void                  cockpit_dbus_interface_info_push     (GHashTable *interface_info,
                                                             GDBusInterfaceInfo *interface);
 
+extern const gchar *  cockpit_dbus_cache_directory;
+
 G_END_DECLS
 
 #endif /* __COCKPIT_DBUS_CACHE_H */
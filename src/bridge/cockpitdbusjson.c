@@ -27,6 +27,7 @@
 #include "cockpitdbusinternal.h"
 #include "cockpitdbusmeta.h"
 #include "cockpitdbusrules.h"
+#include "cockpitdbusvariant.h"
 
 #include "common/cockpitjson.h"
 
@@ -45,9 +46,6 @@
 
 gboolean cockpit_dbus_json_allow_external = TRUE;
 
-/* The maximum number of DBus passed fds open without a channel */
-#define MAX_RECEIVED_DBUS_FDS 16
-
 #define COCKPIT_DBUS_JSON(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_DBUS_JSON, CockpitDBusJson))
 
 typedef struct {
@@ -67,6 +65,9 @@ typedef struct {
   GList *active_calls;
   GHashTable *interface_info;
 
+  /* Minimum milliseconds between notify messages, or zero */
+  gint64 notify_interval;
+
   /* Per name information */
   GHashTable *peers;
 
@@ -79,6 +80,12 @@ typedef struct {
   GQueue *fd_channel_ids;
 } CockpitDBusJson;
 
+typedef struct {
+  gchar *key;
+  CockpitDBusCache *cache;
+  guint users;
+} SharedCache;
+
 typedef struct {
   gchar *name;
   CockpitDBusJson *dbus_json;
@@ -89,12 +96,28 @@ typedef struct {
   /* Signal related */
   CockpitDBusRules *rules;
 
-  /* Watch and introspection */
+  /* Watch and introspection, the cache is shared with other channels */
+  SharedCache *shared;
   CockpitDBusCache *cache;
+  CockpitDBusRules *watches;
+  GList *watched;
+  GHashTable *touched;
+  GHashTable *metasent;
   gulong meta_sig;
   gulong update_sig;
+
+  /* Updates held back by the notify interval */
+  GHashTable *notify_pending;
+  guint notify_timeout;
+  gint64 notify_sent;
 } CockpitDBusPeer;
 
+typedef struct {
+  gchar *path;
+  gboolean is_namespace;
+  gchar *interface;
+} WatchRule;
+
 typedef struct {
   CockpitChannelClass parent_class;
 } CockpitDBusJsonClass;
@@ -118,6 +141,18 @@ G_DEFINE_TYPE (CockpitDBusJson, cockpit_dbus_json, COCKPIT_TYPE_CHANNEL);
 static GHashTable *group_connections;
 static GHashTable *pending_group_connections;
 
+/*
+ * Shared D-Bus caches.
+ *
+ * @shared_caches maps "connection name" strings to SharedCache structs.
+ * Channels that watch the same name on the same connection use one
+ * cache, and with it one set of signal subscriptions and one copy of
+ * the properties. Each channel keeps its own watch rules, and only
+ * gets notified about what it watches, and about the paths it called
+ * methods on or got back from them.
+ */
+static GHashTable *shared_caches;
+
 static const gchar *
 value_type_name (JsonNode *node)
 {
@@ -614,291 +649,24 @@ parse_json (JsonNode *node,
   return NULL;
 }
 
-typedef struct {
-  GUnixFDList *fdlist;
-  GQueue *fdids;
-} VariantContext;
-
-static JsonNode *
-build_json (GVariant *value,
-            VariantContext *context);
-
-static JsonObject *
-build_json_variant (GVariant *value,
-                    VariantContext *context)
-{
-  GVariant *child;
-  JsonObject *object;
-
-  child = g_variant_get_variant (value);
-  object = json_object_new ();
-  json_object_set_string_member (object, "t", g_variant_get_type_string (child));
-  json_object_set_member (object, "v", build_json (child, context));
-
-  g_variant_unref (child);
-
-  return object;
-}
-
-static JsonNode *
-build_json_byte_array (GVariant *value)
-{
-  JsonNode *node;
-  gconstpointer data;
-  gsize length = 0;
-  gchar *string;
-
-  data = g_variant_get_fixed_array (value, &length, 1);
-  if (length > 0)
-    string = g_base64_encode (data, length);
-  else
-    string = NULL;
-  node = json_node_new (JSON_NODE_VALUE);
-  json_node_set_string (node, string ? string : "");
-  g_free (string); /* unfortunately :S */
-
-  return node;
-}
-
-static JsonArray *
-build_json_array_or_tuple (GVariant *value,
-                           VariantContext *context)
-{
-  GVariantIter iter;
-  GVariant *child;
-  JsonArray *array;
-
-  array = json_array_new ();
-
-  g_variant_iter_init (&iter, value);
-  while ((child = g_variant_iter_next_value (&iter)) != NULL)
-    {
-      json_array_add_element (array, build_json (child, context));
-      g_variant_unref (child);
-    }
-
-  return array;
-}
-
-static JsonObject *
-build_json_dictionary (const GVariantType *entry_type,
-                       GVariant *dict,
-                       VariantContext *context)
-{
-  const GVariantType *key_type;
-  GVariantIter iter;
-  GVariant *child;
-  GVariant *key;
-  GVariant *value;
-  gboolean is_string;
-  gchar *key_string;
-  JsonObject *object;
-
-  object = json_object_new ();
-  key_type = g_variant_type_key (entry_type);
-
-  is_string = (g_variant_type_equal (key_type, G_VARIANT_TYPE_STRING) ||
-               g_variant_type_equal (key_type, G_VARIANT_TYPE_OBJECT_PATH) ||
-               g_variant_type_equal (key_type, G_VARIANT_TYPE_SIGNATURE));
-
-  g_variant_iter_init (&iter, dict);
-  while ((child = g_variant_iter_next_value (&iter)) != NULL)
-    {
-      key = g_variant_get_child_value (child, 0);
-      value = g_variant_get_child_value (child, 1);
-
-      if (is_string)
-        {
-          json_object_set_member (object, g_variant_get_string (key, NULL), build_json (value, context));
-        }
-      else
-        {
-          key_string = g_variant_print (key, FALSE);
-          json_object_set_member (object, key_string, build_json (value, context));
-          g_free (key_string);
-        }
-
-      g_variant_unref (key);
-      g_variant_unref (value);
-    }
-
-  return object;
-}
-
-static JsonNode *
-build_json_fd_channel (GVariant *value,
-                       VariantContext *context)
-{
-  JsonObject *object;
-  GError *error = NULL;
-  JsonNode *node;
-  gint fd = -1;
-  gchar *old;
-  const gchar *id;
-
-  if (context->fdlist)
-    {
-      fd = g_unix_fd_list_get (context->fdlist, g_variant_get_handle (value), &error);
-      if (fd == -1)
-        {
-          g_warning ("couldn't dup file descriptor from DBus message: %s", error->message);
-          g_clear_error (&error);
-        }
-    }
-
-  if (fd < 0)
-    {
-      node = json_node_new (JSON_NODE_NULL);
-    }
-  else
-    {
-      g_assert (context->fdlist != NULL);
-      g_assert (context->fdids != NULL);
-
-      node = json_node_new (JSON_NODE_OBJECT);
-
-      /* Add a new internal channel name for this file descriptor */
-      id = cockpit_pipe_channel_add_internal_fd (fd);
-      g_queue_push_tail (context->fdids, (gpointer) g_strdup (id));
-
-      /* And only keep the last N ready for opening channels */
-      while (g_queue_get_length (context->fdids) > MAX_RECEIVED_DBUS_FDS)
-        {
-          old = (gchar *)g_queue_pop_head (context->fdids);
-          cockpit_pipe_channel_remove_internal_fd (old);
-
-          g_free (old);
-        }
-
-      /* This is sent back as the list of channel options to use */
-      object = json_object_new ();
-      json_object_set_string_member (object, "payload", "stream");
-      json_object_set_string_member (object, "internal", id);
-      json_node_set_object (node, object);
-      json_object_unref (object);
-    }
-
-  return node;
-}
-
-static JsonNode *
-build_json (GVariant *value,
-            VariantContext *context)
+static void
+send_json_object (CockpitDBusJson *self,
+                  JsonObject *object)
 {
-  const GVariantType *type;
-  const GVariantType *element_type;
-  JsonObject *object;
-  JsonArray *array;
-  JsonNode *node;
-
-  switch (g_variant_classify (value))
-    {
-    case G_VARIANT_CLASS_BOOLEAN:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_boolean (node, g_variant_get_boolean (value));
-      return node;
-
-    case G_VARIANT_CLASS_BYTE:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_int (node, g_variant_get_byte (value));
-      return node;
-
-    case G_VARIANT_CLASS_INT16:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_int (node, g_variant_get_int16 (value));
-      return node;
-
-    case G_VARIANT_CLASS_UINT16:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_int (node, g_variant_get_uint16 (value));
-      return node;
-
-    case G_VARIANT_CLASS_INT32:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_int (node, g_variant_get_int32 (value));
-      return node;
-
-    case G_VARIANT_CLASS_UINT32:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_int (node, g_variant_get_uint32 (value));
-      return node;
-
-    case G_VARIANT_CLASS_INT64:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_int (node, g_variant_get_int64 (value));
-      return node;
-
-    case G_VARIANT_CLASS_UINT64:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_int (node, g_variant_get_uint64 (value));
-      return node;
-
-    case G_VARIANT_CLASS_HANDLE:
-      node = build_json_fd_channel (value, context);
-      return node;
-
-    case G_VARIANT_CLASS_DOUBLE:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_double (node, g_variant_get_double (value));
-      return node;
-
-    case G_VARIANT_CLASS_STRING:      /* explicit fall-through */
-    case G_VARIANT_CLASS_OBJECT_PATH: /* explicit fall-through */
-    case G_VARIANT_CLASS_SIGNATURE:
-      node = json_node_new (JSON_NODE_VALUE);
-      json_node_set_string (node, g_variant_get_string (value, NULL));
-      return node;
-
-    case G_VARIANT_CLASS_VARIANT:
-      object = build_json_variant (value, context);
-      node = json_node_new (JSON_NODE_OBJECT);
-      json_node_take_object (node, object);
-      return node;
-
-    case G_VARIANT_CLASS_ARRAY:
-      type = g_variant_get_type (value);
-      element_type = g_variant_type_element (type);
-      if (g_variant_type_is_dict_entry (element_type))
-        {
-          object = build_json_dictionary (element_type, value, context);
-          node = json_node_new (JSON_NODE_OBJECT);
-          json_node_take_object (node, object);
-        }
-      else if (g_variant_type_equal (element_type, G_VARIANT_TYPE_BYTE))
-        {
-          node = build_json_byte_array (value);
-        }
-      else
-        {
-          array = build_json_array_or_tuple (value, context);
-          node = json_node_new (JSON_NODE_ARRAY);
-          json_node_set_array (node, array);
-          json_array_unref (array);
-        }
-      return node;
-
-    case G_VARIANT_CLASS_TUPLE:
-      array = build_json_array_or_tuple (value, context);
-      node = json_node_new (JSON_NODE_ARRAY);
-      json_node_set_array (node, array);
-      json_array_unref (array);
-      return node;
+  GBytes *bytes;
 
-    case G_VARIANT_CLASS_DICT_ENTRY:
-    case G_VARIANT_CLASS_MAYBE:
-    default:
-      g_return_val_if_reached (NULL);
-      break;
-    }
+  bytes = cockpit_json_write_bytes (object);
+  cockpit_channel_send (COCKPIT_CHANNEL (self), bytes, TRUE);
+  g_bytes_unref (bytes);
 }
 
 static void
-send_json_object (CockpitDBusJson *self,
-                  JsonObject *object)
+send_json_string (CockpitDBusJson *self,
+                  GString *string)
 {
   GBytes *bytes;
 
-  bytes = cockpit_json_write_bytes (object);
+  bytes = g_string_free_to_bytes (string);
   cockpit_channel_send (COCKPIT_CHANNEL (self), bytes, TRUE);
   g_bytes_unref (bytes);
 }
@@ -948,46 +716,6 @@ build_signature (GVariant *variant)
   return g_string_free (sig, FALSE);
 }
 
-static JsonNode *
-build_json_body (GVariant *body,
-                 VariantContext *context,
-                 gchar **type)
-{
-  if (body)
-    {
-      if (type)
-        *type = build_signature (body);
-      return build_json (body, context);
-    }
-  else
-    {
-      if (type)
-        *type = NULL;
-      return json_node_new (JSON_NODE_NULL);
-    }
-}
-
-static JsonObject *
-build_json_signal (const gchar *path,
-                   const gchar *interface,
-                   const gchar *member,
-                   GVariant *body)
-{
-  JsonObject *object;
-  JsonArray *signal;
-  VariantContext context = { NULL };
-
-  object = json_object_new ();
-  signal = json_array_new ();
-  json_array_add_string_element (signal, path);
-  json_array_add_string_element (signal, interface);
-  json_array_add_string_element (signal, member);
-  json_array_add_element (signal, build_json_body (body, &context, NULL));
-  json_object_set_array_member (object, "signal", signal);
-
-  return object;
-}
-
 /* ---------------------------------------------------------------------------------------------------- */
 
 typedef struct {
@@ -1017,6 +745,15 @@ static CockpitDBusPeer *
 ensure_peer (CockpitDBusJson *self,
              const gchar *name);
 
+static GDBusInterfaceInfo *
+lookup_interface_info (CockpitDBusJson *self,
+                       const gchar *interface_name);
+
+static void
+peer_touch (CockpitDBusPeer *peer,
+            const gchar *path,
+            GVariant *scrape);
+
 static void
 send_dbus_error (CockpitDBusJson *self,
                  CallData *call,
@@ -1038,9 +775,12 @@ send_dbus_error (CockpitDBusJson *self,
   json_object_unref (object);
 }
 
+static void
+flush_all_updates (CockpitDBusJson *self);
+
 typedef struct {
   CockpitDBusJson *dbus_json;
-  JsonObject *message;
+  GBytes *message;
 } WaitData;
 
 static void
@@ -1051,21 +791,25 @@ on_wait_complete (CockpitDBusCache *cache,
   CockpitDBusJson *self = wd->dbus_json;
 
   if (!g_cancellable_is_cancelled (self->cancellable))
-    send_json_object (self, wd->message);
+    {
+      /* Property changes from before the barrier go out first */
+      flush_all_updates (self);
+      cockpit_channel_send (COCKPIT_CHANNEL (self), wd->message, TRUE);
+    }
 
   g_object_unref (wd->dbus_json);
-  json_object_unref (wd->message);
+  g_bytes_unref (wd->message);
   g_slice_free (WaitData, wd);
 }
 
 static void
 send_with_barrier (CockpitDBusJson *self,
                    CockpitDBusPeer *peer,
-                   JsonObject *message)
+                   GBytes *message)
 {
   WaitData *wd = g_slice_new (WaitData);
   wd->dbus_json = g_object_ref (self);
-  wd->message = json_object_ref (message);
+  wd->message = g_bytes_ref (message);
   cockpit_dbus_cache_barrier (peer->cache, on_wait_complete, wd);
 }
 
@@ -1075,68 +819,72 @@ send_dbus_reply (CockpitDBusJson *self,
                  GDBusMessage *message)
 {
   CockpitDBusPeer *peer;
-  VariantContext context = { NULL };
+  GUnixFDList *fdlist;
   GVariant *scrape = NULL;
-  JsonObject *object;
-  GString *flags;
+  GVariant *body;
+  GString *output;
+  GBytes *bytes;
+  gchar *type;
 
   g_return_if_fail (call->cookie != NULL);
 
-  JsonArray *reply;
-  gchar *type = NULL;
+  output = g_string_new ("");
+  body = g_dbus_message_get_body (message);
 
-  object = json_object_new ();
-  reply = json_array_new ();
   if (g_dbus_message_get_message_type (message) == G_DBUS_MESSAGE_TYPE_ERROR)
     {
       g_debug ("%s: errorc for %s", self->logname, call->method);
-      json_array_add_string_element (reply, g_dbus_message_get_error_name (message));
-      json_object_set_array_member (object, "error", reply);
+      g_string_append (output, "{\"error\":[");
+      cockpit_json_append_string (output, g_dbus_message_get_error_name (message));
+      g_string_append_c (output, ',');
     }
   else
     {
       g_debug ("%s: reply for %s", self->logname, call->method);
-      json_object_set_array_member (object, "reply", reply);
-      scrape = g_dbus_message_get_body (message);
+      g_string_append (output, "{\"reply\":[");
+      scrape = body;
     }
 
-  context.fdlist = g_dbus_message_get_unix_fd_list (message);
-  if (context.fdlist)
-    {
-      if (!self->fd_channel_ids)
-        self->fd_channel_ids = g_queue_new ();
-      context.fdids = self->fd_channel_ids;
-    }
+  fdlist = g_dbus_message_get_unix_fd_list (message);
+  if (fdlist && !self->fd_channel_ids)
+    self->fd_channel_ids = g_queue_new ();
 
-  json_array_add_element (reply, build_json_body (g_dbus_message_get_body (message), &context,
-                                                  call->type != NULL ? &type : NULL));
+  if (body)
+    cockpit_dbus_variant_write (output, body, fdlist, self->fd_channel_ids);
+  else
+    g_string_append (output, "null");
+  g_string_append_c (output, ']');
 
-  if (type)
+  if (body && call->type)
     {
-      json_object_set_string_member (object, "type", type);
+      type = build_signature (body);
+      g_string_append (output, ",\"type\":");
+      cockpit_json_append_string (output, type);
       g_free (type);
     }
 
-  json_object_set_string_member (object, "id", call->cookie);
+  g_string_append (output, ",\"id\":");
+  cockpit_json_append_string (output, call->cookie);
 
   if (call->flags)
     {
-      flags = g_string_new ("");
       if (g_dbus_message_get_byte_order (message) == G_DBUS_MESSAGE_BYTE_ORDER_BIG_ENDIAN)
-        g_string_append_c (flags, '>');
+        g_string_append (output, ",\"flags\":\">\"");
       else
-        g_string_append_c (flags, '<');
-      json_object_set_string_member (object, "flags", flags->str);
-      g_string_free (flags, TRUE);
+        g_string_append (output, ",\"flags\":\"<\"");
     }
 
+  g_string_append_c (output, '}');
+  bytes = g_string_free_to_bytes (output);
+
   peer = ensure_peer (self, call->name);
   cockpit_dbus_cache_poke (peer->cache, call->path, call->interface);
   if (scrape)
     cockpit_dbus_cache_scrape (peer->cache, scrape);
-  send_with_barrier (self, peer, object);
+  peer_touch (peer, call->path, scrape);
+  send_with_barrier (self, peer, bytes);
 
-  json_object_unref (object);
+  g_bytes_unref (bytes);
 }
 
 static GVariantType *
@@ -1492,7 +1240,7 @@ calculate_signal_param_type (CockpitDBusJson *self,
   GDBusSignalInfo *signal_info = NULL;
   guint n;
 
-  info = g_hash_table_lookup (self->interface_info, iface);
+  info = lookup_interface_info (self, iface);
   if (info)
     signal_info = g_dbus_interface_info_lookup_signal (info, signal);
   if (signal_info == NULL)
@@ -1905,25 +1653,43 @@ handle_dbus_remove_match (CockpitDBusJson *self,
     }
 }
 
+static gboolean
+should_include_name (CockpitDBusJson *self,
+                     const gchar *name)
+{
+  return name && g_strcmp0 (name, self->default_name) != 0;
+}
+
 static void
 maybe_include_name (CockpitDBusJson *self,
                     JsonObject *object,
                     const gchar *name)
 {
-  if (name && g_strcmp0 (name, self->default_name) != 0)
+  if (should_include_name (self, name))
     json_object_set_string_member (object, "name", name);
 }
 
 static void
-on_cache_meta (CockpitDBusCache *cache,
-               GDBusInterfaceInfo *iface,
-               gpointer user_data)
+send_meta_once (CockpitDBusPeer *peer,
+                GDBusInterfaceInfo *iface)
 {
-  CockpitDBusPeer *peer = user_data;
   JsonObject *interface;
   JsonObject *meta;
   JsonObject *message;
 
+  /* The page has its own idea of this interface, leave it alone */
+  if (cockpit_dbus_interface_info_lookup (peer->dbus_json->interface_info, iface->name))
+    return;
+
+  /*
+   * The cache only emits each interface once, for whichever channel came
+   * first. But it replaces interface info that it loaded from disk and
+   * turned out to be wrong, and then that goes out again.
+   */
+  if (g_hash_table_lookup (peer->metasent, iface->name) == iface)
+    return;
+  g_hash_table_replace (peer->metasent, g_strdup (iface->name), g_dbus_interface_info_ref (iface));
+
   interface = cockpit_dbus_meta_build (iface);
 
   meta = json_object_new ();
@@ -1937,6 +1703,33 @@ on_cache_meta (CockpitDBusCache *cache,
   json_object_unref (message);
 }
 
+static void
+on_cache_meta (CockpitDBusCache *cache,
+               GDBusInterfaceInfo *iface,
+               gpointer user_data)
+{
+  send_meta_once (user_data, iface);
+}
+
+static GDBusInterfaceInfo *
+lookup_interface_info (CockpitDBusJson *self,
+                       const gchar *interface_name)
+{
+  GDBusInterfaceInfo *iface;
+  CockpitDBusPeer *peer;
+  GHashTableIter iter;
+
+  iface = cockpit_dbus_interface_info_lookup (self->interface_info, interface_name);
+
+  /* Or what the caches have introspected */
+  g_hash_table_iter_init (&iter, self->peers);
+  while (!iface && g_hash_table_iter_next (&iter, NULL, (gpointer *)&peer))
+    iface = cockpit_dbus_interface_info_lookup (cockpit_dbus_cache_get_interface_info (peer->cache),
+                                                interface_name);
+
+  return iface;
+}
+
 static void
 handle_dbus_meta (CockpitDBusJson *self,
                   JsonObject *object)
@@ -1985,50 +1778,330 @@ handle_dbus_meta (CockpitDBusJson *self,
   g_list_free (names);
 }
 
-static JsonObject *
-build_json_update (GHashTable *paths)
+static gboolean
+peer_wants (CockpitDBusPeer *peer,
+            const gchar *path,
+            const gchar *interface)
+{
+  /* The same whether or not other channels share the cache */
+  return cockpit_dbus_rules_match (peer->watches, path, interface, NULL, NULL) ||
+         g_hash_table_contains (peer->touched, path);
+}
+
+static void
+peer_touch_path (CockpitDBusPeer *peer,
+                 const gchar *path)
+{
+  const gchar *interned;
+
+  /*
+   * The cache will only ever tell us about paths it has interned, so
+   * borrow its copy. Paths it doesn't know can't get any notify.
+   */
+  interned = cockpit_dbus_cache_interned (peer->cache, path);
+  if (interned)
+    g_hash_table_add (peer->touched, (gchar *)interned);
+}
+
+static void
+peer_touch (CockpitDBusPeer *peer,
+            const gchar *path,
+            GVariant *scrape)
+{
+  GHashTableIter iter;
+  GHashTable *paths;
+  gpointer scraped;
+
+  if (path)
+    peer_touch_path (peer, path);
+
+  if (scrape)
+    {
+      paths = g_hash_table_new (g_str_hash, g_str_equal);
+      cockpit_dbus_cache_scrape_paths (scrape, paths);
+      g_hash_table_iter_init (&iter, paths);
+      while (g_hash_table_iter_next (&iter, &scraped, NULL))
+        peer_touch_path (peer, scraped);
+      g_hash_table_unref (paths);
+    }
+}
+
+static void
+peer_forget (CockpitDBusPeer *peer,
+             GHashTable *update)
+{
+  GHashTableIter iter;
+  gpointer path;
+
+  /* Once the cache no longer has anything at a path, neither do we */
+  g_hash_table_iter_init (&iter, update);
+  while (g_hash_table_iter_next (&iter, &path, NULL))
+    {
+      if (!cockpit_dbus_cache_holds (peer->cache, path))
+        g_hash_table_remove (peer->touched, path);
+    }
+}
+
+static gboolean
+write_json_update (CockpitDBusPeer *peer,
+                   GString *output,
+                   GHashTable *paths,
+                   gboolean filter)
 {
   GHashTableIter i, j, k;
   GHashTable *interfaces;
   GHashTable *properties;
+  GDBusInterfaceInfo *info;
   const gchar *interface;
   const gchar *property;
   const gchar *path;
-  JsonObject *notify;
-  JsonObject *object;
-  JsonObject *iface;
+  gboolean any_path = FALSE;
+  gboolean any_iface;
+  gboolean any_prop;
   GVariant *value;
+  gsize mark;
 
-  notify = json_object_new ();
+  g_string_append_c (output, '{');
 
   g_hash_table_iter_init (&i, paths);
   while (g_hash_table_iter_next (&i, (gpointer *)&path, (gpointer *)&interfaces))
     {
-      object = json_object_new ();
+      mark = output->len;
+      if (any_path)
+        g_string_append_c (output, ',');
+      cockpit_json_append_string (output, path);
+      g_string_append (output, ":{");
 
+      any_iface = FALSE;
       g_hash_table_iter_init (&j, interfaces);
       while (g_hash_table_iter_next (&j, (gpointer *)&interface, (gpointer *)&properties))
         {
+          if (filter && !peer_wants (peer, path, interface))
+            continue;
+
+          if (any_iface)
+            g_string_append_c (output, ',');
+          any_iface = TRUE;
+          cockpit_json_append_string (output, interface);
+          g_string_append_c (output, ':');
+
           if (properties == NULL)
             {
-              json_object_set_null_member (object, interface);
+              g_string_append (output, "null");
             }
           else
             {
-              iface = json_object_new ();
+              /* Interface info goes out before properties on that interface */
+              info = cockpit_dbus_interface_info_lookup (cockpit_dbus_cache_get_interface_info (peer->cache),
+                                                         interface);
+              if (info)
+                send_meta_once (peer, info);
 
+              g_string_append_c (output, '{');
+
+              any_prop = FALSE;
               g_hash_table_iter_init (&k, properties);
               while (g_hash_table_iter_next (&k, (gpointer *)&property, (gpointer *)&value))
-                json_object_set_member (iface, property, build_json (value, NULL));
+                {
+                  if (any_prop)
+                    g_string_append_c (output, ',');
+                  any_prop = TRUE;
+                  cockpit_json_append_string (output, property);
+                  g_string_append_c (output, ':');
+                  cockpit_dbus_variant_write (output, value, NULL, NULL);
+                }
 
-              json_object_set_object_member (object, interface, iface);
+              g_string_append_c (output, '}');
             }
         }
 
-      json_object_set_object_member (notify, path, object);
+      /* Paths where nothing matched are left out */
+      if (any_iface)
+        {
+          g_string_append_c (output, '}');
+          any_path = TRUE;
+        }
+      else
+        {
+          g_string_truncate (output, mark);
+        }
+    }
+
+  g_string_append_c (output, '}');
+
+  return any_path;
+}
+
+static void
+send_update (CockpitDBusPeer *peer,
+             GHashTable *update,
+             gboolean filter)
+{
+  GString *output;
+
+  output = g_string_new ("{");
+  if (should_include_name (peer->dbus_json, peer->name))
+    {
+      g_string_append (output, "\"name\":");
+      cockpit_json_append_string (output, peer->name);
+      g_string_append_c (output, ',');
     }
+  g_string_append (output, "\"notify\":");
+
+  if (write_json_update (peer, output, update, filter))
+    {
+      g_string_append_c (output, '}');
+      send_json_string (peer->dbus_json, output);
+    }
+  else
+    {
+      g_string_free (output, TRUE);
+    }
+
+  /* Only after the removals went out */
+  peer_forget (peer, update);
+}
+
+static void
+hash_table_unref_or_null (gpointer data)
+{
+  if (data)
+    g_hash_table_unref (data);
+}
+
+static void
+merge_update (CockpitDBusPeer *peer,
+              GHashTable *update)
+{
+  GHashTableIter i, j, k;
+  GHashTable *interfaces;
+  GHashTable *properties;
+  GHashTable *pending;
+  GHashTable *merged;
+  gpointer path;
+  gpointer interface;
+  gpointer property;
+  gpointer value;
+
+  /* Same shape as updates from the cache, and keys owned by the cache */
+  if (!peer->notify_pending)
+    {
+      peer->notify_pending = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    NULL, (GDestroyNotify)g_hash_table_unref);
+    }
+
+  g_hash_table_iter_init (&i, update);
+  while (g_hash_table_iter_next (&i, &path, (gpointer *)&interfaces))
+    {
+      pending = g_hash_table_lookup (peer->notify_pending, path);
+      if (!pending)
+        {
+          pending = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           NULL, hash_table_unref_or_null);
+          g_hash_table_replace (peer->notify_pending, path, pending);
+        }
+
+      g_hash_table_iter_init (&j, interfaces);
+      while (g_hash_table_iter_next (&j, &interface, (gpointer *)&properties))
+        {
+          /* A removed interface drops whatever was held back for it */
+          if (!properties)
+            {
+              g_hash_table_replace (pending, interface, NULL);
+              continue;
+            }
+
+          merged = g_hash_table_lookup (pending, interface);
+          if (!merged)
+            {
+              merged = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              NULL, (GDestroyNotify)g_variant_unref);
+              g_hash_table_replace (pending, interface, merged);
+            }
+
+          /* Only the latest value of each property is sent */
+          g_hash_table_iter_init (&k, properties);
+          while (g_hash_table_iter_next (&k, &property, &value))
+            g_hash_table_replace (merged, property, g_variant_ref (value));
+        }
+    }
+}
+
+static gboolean
+readds_removed_interface (CockpitDBusPeer *peer,
+                          GHashTable *update)
+{
+  GHashTableIter i, j;
+  GHashTable *interfaces;
+  GHashTable *properties;
+  GHashTable *pending;
+  gpointer path;
+  gpointer interface;
+  gpointer removed;
+
+  if (!peer->notify_pending)
+    return FALSE;
+
+  g_hash_table_iter_init (&i, update);
+  while (g_hash_table_iter_next (&i, &path, (gpointer *)&interfaces))
+    {
+      pending = g_hash_table_lookup (peer->notify_pending, path);
+      if (!pending)
+        continue;
+
+      g_hash_table_iter_init (&j, interfaces);
+      while (g_hash_table_iter_next (&j, &interface, (gpointer *)&properties))
+        {
+          if (properties &&
+              g_hash_table_lookup_extended (pending, interface, NULL, &removed) && !removed)
+            return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+static void
+flush_updates (CockpitDBusPeer *peer)
+{
+  GHashTable *pending;
+
+  if (peer->notify_timeout)
+    {
+      g_source_remove (peer->notify_timeout);
+      peer->notify_timeout = 0;
+    }
+
+  pending = peer->notify_pending;
+  if (pending)
+    {
+      peer->notify_pending = NULL;
+      peer->notify_sent = g_get_monotonic_time ();
+      send_update (peer, pending, TRUE);
+      g_hash_table_unref (pending);
+    }
+}
+
+static void
+flush_all_updates (CockpitDBusJson *self)
+{
+  GHashTableIter iter;
+  gpointer peer;
+
+  g_hash_table_iter_init (&iter, self->peers);
+  while (g_hash_table_iter_next (&iter, NULL, &peer))
+    flush_updates (peer);
+}
 
-  return notify;
+static gboolean
+on_notify_timeout (gpointer user_data)
+{
+  CockpitDBusPeer *peer = user_data;
+
+  peer->notify_timeout = 0;
+  flush_updates (peer);
+
+  return FALSE;
 }
 
 static void
@@ -2037,11 +2110,116 @@ on_cache_update (CockpitDBusCache *cache,
                  gpointer user_data)
 {
   CockpitDBusPeer *peer = user_data;
-  JsonObject *object = json_object_new ();
-  maybe_include_name (peer->dbus_json, object, peer->name);
-  json_object_set_object_member (object, "notify", build_json_update (update));
-  send_json_object (peer->dbus_json, object);
-  json_object_unref (object);
+  gint64 interval = peer->dbus_json->notify_interval;
+  gint64 elapsed;
+
+  /*
+   * With a notify interval, updates that come in quick succession are
+   * merged and sent together. The first after a quiet period goes out
+   * right away. Barriers flush what is held back, so the ordering of
+   * notify messages and replies stays the same.
+   */
+  if (interval > 0 && !peer->notify_timeout)
+    {
+      elapsed = (g_get_monotonic_time () - peer->notify_sent) / 1000;
+      if (elapsed < interval)
+        peer->notify_timeout = g_timeout_add (interval - elapsed, on_notify_timeout, peer);
+    }
+
+  if (peer->notify_timeout)
+    {
+      /*
+       * An interface that is removed and then added again can't be
+       * merged, the removal would be lost along with any properties it
+       * no longer has. So the removal goes out first.
+       */
+      if (readds_removed_interface (peer, update))
+        {
+          flush_updates (peer);
+          peer->notify_timeout = g_timeout_add (interval, on_notify_timeout, peer);
+        }
+
+      merge_update (peer, update);
+    }
+  else
+    {
+      peer->notify_sent = g_get_monotonic_time ();
+      send_update (peer, update, TRUE);
+    }
+}
+
+static gboolean
+watch_rule_equal (WatchRule *rule,
+                  const gchar *path,
+                  gboolean is_namespace,
+                  const gchar *interface)
+{
+  return g_strcmp0 (rule->path, path) == 0 &&
+         rule->is_namespace == is_namespace &&
+         g_strcmp0 (rule->interface, interface) == 0;
+}
+
+static void
+watch_rule_free (gpointer data)
+{
+  WatchRule *rule = data;
+  g_free (rule->path);
+  g_free (rule->interface);
+  g_slice_free (WatchRule, rule);
+}
+
+static void
+peer_watch (CockpitDBusPeer *peer,
+            const gchar *path,
+            gboolean is_namespace,
+            const gchar *interface)
+{
+  WatchRule *rule;
+
+  /* Same as the cache does */
+  if (!path)
+    {
+      path = "/";
+      is_namespace = TRUE;
+    }
+
+  rule = g_slice_new0 (WatchRule);
+  rule->path = g_strdup (path);
+  rule->is_namespace = is_namespace;
+  rule->interface = g_strdup (interface);
+  peer->watched = g_list_prepend (peer->watched, rule);
+
+  cockpit_dbus_rules_add (peer->watches, path, is_namespace, interface, NULL, NULL);
+  cockpit_dbus_cache_watch (peer->cache, path, is_namespace, interface);
+}
+
+static void
+peer_unwatch (CockpitDBusPeer *peer,
+              const gchar *path,
+              gboolean is_namespace,
+              const gchar *interface)
+{
+  GList *l;
+
+  /* Same as the cache does */
+  if (!path)
+    {
+      path = "/";
+      is_namespace = TRUE;
+    }
+
+  /* Only remove our own rules from the cache, not those of other channels */
+  for (l = peer->watched; l != NULL; l = g_list_next (l))
+    {
+      if (watch_rule_equal (l->data, path, is_namespace, interface))
+        {
+          cockpit_dbus_rules_remove (peer->watches, path, is_namespace, interface, NULL, NULL);
+          cockpit_dbus_cache_unwatch (peer->cache, path, is_namespace, interface);
+          watch_rule_free (l->data);
+          peer->watched = g_list_delete_link (peer->watched, l);
+          return;
+        }
+    }
 }
 
 static void
@@ -2055,6 +2233,7 @@ handle_dbus_watch (CockpitDBusJson *self,
   const gchar *interface;
   gboolean is_namespace = FALSE;
   const gchar *cookie;
+  GBytes *bytes;
   JsonNode *node;
 
   node = json_object_get_member (object, "watch");
@@ -2070,7 +2249,19 @@ handle_dbus_watch (CockpitDBusJson *self,
     }
 
   peer = ensure_peer (self, name);
-  cockpit_dbus_cache_watch (peer->cache, path, is_namespace, interface);
+  peer_watch (peer, path, is_namespace, interface);
+
+  /* Other channels may have filled the cache already, nothing would change for us */
+  if (peer->shared->users > 1)
+    {
+      GHashTable *snapshot = cockpit_dbus_cache_snapshot (peer->cache, path, is_namespace, interface);
+      if (snapshot)
+        {
+          flush_updates (peer);
+          send_update (peer, snapshot, FALSE);
+          g_hash_table_unref (snapshot);
+        }
+    }
 
   if (!path)
     path = "/";
@@ -2081,9 +2272,11 @@ handle_dbus_watch (CockpitDBusJson *self,
       object = json_object_new ();
       json_object_set_array_member (object, "reply", json_array_new ());
       json_object_set_string_member (object, "id", cookie);
+      bytes = cockpit_json_write_bytes (object);
       cockpit_dbus_cache_poke (peer->cache, path, NULL);
-      send_with_barrier (self, peer, object);
+      send_with_barrier (self, peer, bytes);
       json_object_unref (object);
+      g_bytes_unref (bytes);
     }
 }
 
@@ -2112,7 +2305,7 @@ handle_dbus_unwatch (CockpitDBusJson *self,
     }
 
   peer = ensure_peer (self, name);
-  cockpit_dbus_cache_unwatch (peer->cache, path, is_namespace, interface);
+  peer_unwatch (peer, path, is_namespace, interface);
 }
 
 static GVariantType *
@@ -2341,34 +2534,38 @@ on_method_invocation (GDBusConnection *connection,
   GDBusMessageFlags flags;
   GDBusMessage *message;
   gchar *cookie = NULL;
-  JsonObject *object;
-  JsonArray *call;
-  VariantContext context = { NULL };
+  GString *output;
 
   message = g_dbus_method_invocation_get_message (invocation);
   flags = g_dbus_message_get_flags (message);
 
-  object = json_object_new ();
-  call = json_array_new ();
-  json_array_add_string_element (call, object_path);
-  json_array_add_string_element (call, interface_name);
-  json_array_add_string_element (call, method_name);
-  json_array_add_element (call, build_json (parameters, &context));
-  json_object_set_array_member (object, "call", call);
+  output = g_string_new ("{\"call\":[");
+  cockpit_json_append_string (output, object_path);
+  g_string_append_c (output, ',');
+  cockpit_json_append_string (output, interface_name);
+  g_string_append_c (output, ',');
+  cockpit_json_append_string (output, method_name);
+  g_string_append_c (output, ',');
+  cockpit_dbus_variant_write (output, parameters, NULL, NULL);
+  g_string_append_c (output, ']');
 
   if (!(flags & G_DBUS_MESSAGE_FLAGS_NO_REPLY_EXPECTED))
     {
       g_assert (self->invocations != NULL);
       cookie = g_strdup_printf ("%d", self->last_invocation++);
       g_hash_table_insert (self->invocations, cookie, g_object_ref (invocation));
-      json_object_set_string_member (object, "id", cookie);
+      g_string_append (output, ",\"id\":");
+      cockpit_json_append_string (output, cookie);
     }
 
   if (sender)
-    json_object_set_string_member (object, "name", sender);
+    {
+      g_string_append (output, ",\"name\":");
+      cockpit_json_append_string (output, sender);
+    }
 
-  send_json_object (self, object);
-  json_object_unref (object);
+  g_string_append_c (output, '}');
+  send_json_string (self, output);
 }
 
 static gboolean
@@ -2440,7 +2637,7 @@ handle_dbus_publish (CockpitDBusJson *self,
   if (!parse_json_publish (channel, node, &object_path, &interface_name))
     return;
 
-  iface = g_hash_table_lookup (self->interface_info, interface_name);
+  iface = lookup_interface_info (self, interface_name);
   if (!iface)
     {
       cockpit_channel_fail (channel, "protocol-error",
@@ -2596,7 +2793,8 @@ on_signal_message (GDBusConnection *connection,
 
   CockpitDBusPeer *peer = user_data;
   const gchar *arg0 = NULL;
-  JsonObject *object;
+  GString *output;
+  GBytes *bytes;
 
   /* Unfortunately we also have to recalculate this */
   if (parameters &&
@@ -2612,11 +2810,30 @@ on_signal_message (GDBusConnection *connection,
 
   if (cockpit_dbus_rules_match (peer->rules, path, interface, signal, arg0))
     {
-      object = build_json_signal (path, interface, signal, parameters);
+      output = g_string_new ("{\"signal\":[");
+      cockpit_json_append_string (output, path);
+      g_string_append_c (output, ',');
+      cockpit_json_append_string (output, interface);
+      g_string_append_c (output, ',');
+      cockpit_json_append_string (output, signal);
+      g_string_append_c (output, ',');
+      if (parameters)
+        cockpit_dbus_variant_write (output, parameters, NULL, NULL);
+      else
+        g_string_append (output, "null");
+      g_string_append_c (output, ']');
+      if (should_include_name (peer->dbus_json, peer->name))
+        {
+          g_string_append (output, ",\"name\":");
+          cockpit_json_append_string (output, peer->name);
+        }
+      g_string_append_c (output, '}');
+      bytes = g_string_free_to_bytes (output);
+
       cockpit_dbus_cache_poke (peer->cache, path, interface);
-      maybe_include_name (peer->dbus_json, object, peer->name);
-      send_with_barrier (peer->dbus_json, peer, object);
-      json_object_unref (object);
+      peer_touch (peer, path, NULL);
+      send_with_barrier (peer->dbus_json, peer, bytes);
+      g_bytes_unref (bytes);
     }
 }
 
@@ -2703,22 +2920,81 @@ on_name_vanished (GDBusConnection *connection,
     cockpit_channel_close (channel, "not-found");
 }
 
+static SharedCache *
+shared_cache_ref (GDBusConnection *connection,
+                  const gchar *bus,
+                  const gchar *name,
+                  const gchar *logname)
+{
+  SharedCache *shared;
+  gchar *key;
+
+  /* The cache holds a reference to the connection, so its address is unique */
+  key = g_strdup_printf ("%p %s", connection, name ? name : "");
+
+  if (!shared_caches)
+    shared_caches = g_hash_table_new (g_str_hash, g_str_equal);
+
+  shared = g_hash_table_lookup (shared_caches, key);
+  if (shared)
+    {
+      g_free (key);
+      shared->users++;
+      return shared;
+    }
+
+  shared = g_slice_new0 (SharedCache);
+  shared->key = key;
+  shared->users = 1;
+  shared->cache = cockpit_dbus_cache_new (connection, bus, name, logname, NULL);
+  g_hash_table_insert (shared_caches, shared->key, shared);
+  return shared;
+}
+
+static void
+shared_cache_unref (SharedCache *shared)
+{
+  if (--shared->users > 0)
+    return;
+
+  g_hash_table_remove (shared_caches, shared->key);
+  if (g_hash_table_size (shared_caches) == 0)
+    g_clear_pointer (&shared_caches, g_hash_table_unref);
+
+  g_object_run_dispose (G_OBJECT (shared->cache));
+  g_object_unref (shared->cache);
+  g_free (shared->key);
+  g_slice_free (SharedCache, shared);
+}
+
 static CockpitDBusPeer *
 ensure_peer (CockpitDBusJson *self,
              const gchar *name)
 {
   CockpitDBusPeer *peer;
+  const gchar *bus = NULL;
 
   if (!name)
     name = self->default_name;
 
+  /* Tells the cache which file to keep introspection data in */
+  if (self->bus_type == G_BUS_TYPE_SYSTEM)
+    bus = "system";
+  else if (self->bus_type == G_BUS_TYPE_SESSION)
+    bus = "session";
+
   peer = g_hash_table_lookup (self->peers, name ? name : "");
   if (!peer)
     {
       peer = g_new0 (CockpitDBusPeer, 1);
       peer->name = g_strdup (name);
       peer->dbus_json = self;
-      peer->cache = cockpit_dbus_cache_new (self->connection, name, self->logname, self->interface_info);
+      peer->shared = shared_cache_ref (self->connection, bus, name, self->logname);
+      peer->cache = peer->shared->cache;
+      peer->watches = cockpit_dbus_rules_new ();
+      peer->touched = g_hash_table_new (g_str_hash, g_str_equal);
+      peer->metasent = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                              (GDestroyNotify)g_dbus_interface_info_unref);
       peer->meta_sig = g_signal_connect (peer->cache, "meta", G_CALLBACK (on_cache_meta), peer);
       peer->update_sig = g_signal_connect (peer->cache, "update", G_CALLBACK (on_cache_update), peer);
       peer->rules = cockpit_dbus_rules_new ();
@@ -2897,6 +3173,12 @@ cockpit_dbus_json_prepare (CockpitChannel *channel)
       cockpit_channel_fail (channel, "protocol-error", "invalid \"group\" option in dbus channel");
       return;
     }
+  if (!cockpit_json_get_int (options, "notify-interval", 0, &self->notify_interval) ||
+      self->notify_interval < 0 || self->notify_interval > G_MAXINT)
+    {
+      cockpit_channel_fail (channel, "protocol-error", "invalid \"notify-interval\" option in dbus channel");
+      return;
+    }
 
   /*
    * The default bus is the "user" bus which doesn't exist in many
@@ -3090,10 +3372,23 @@ cockpit_dbus_json_dispose (GObject *object)
         {
           g_signal_handler_disconnect (peer->cache, peer->meta_sig);
           g_signal_handler_disconnect (peer->cache, peer->update_sig);
-          g_object_run_dispose (G_OBJECT (peer->cache));
-          g_object_unref (peer->cache);
+          while (peer->watched)
+            {
+              WatchRule *rule = peer->watched->data;
+              peer_unwatch (peer, rule->path, rule->is_namespace, rule->interface);
+            }
+          shared_cache_unref (peer->shared);
         }
 
+      cockpit_dbus_rules_free (peer->watches);
+      g_hash_table_unref (peer->touched);
+      g_hash_table_unref (peer->metasent);
+
+      if (peer->notify_timeout)
+        g_source_remove (peer->notify_timeout);
+      if (peer->notify_pending)
+        g_hash_table_unref (peer->notify_pending);
+
       cockpit_dbus_rules_free (peer->rules);
 
       if (self->connection)
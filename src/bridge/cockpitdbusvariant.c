@@ -0,0 +1,349 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2018 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitdbusvariant.h"
+
+#include "cockpitpipechannel.h"
+
+#include "common/cockpitjson.h"
+
+/*
+ * Writes GVariants as dbus-json3 straight into a buffer. Large replies and
+ * notifications used to be built as a JsonNode tree first, and then walked
+ * again by cockpit_json_write(). The output here is exactly what that used
+ * to produce, including member order.
+ */
+
+/* The maximum number of DBus passed fds open without a channel */
+#define MAX_RECEIVED_DBUS_FDS 16
+
+static void
+write_variant (GString *output,
+               GVariant *value,
+               GUnixFDList *fdlist,
+               GQueue *fdids);
+
+static void
+write_byte_array (GString *output,
+                  GVariant *value)
+{
+  gconstpointer data;
+  gsize length = 0;
+  gsize len;
+  gint state = 0;
+  gint save = 0;
+
+  g_string_append_c (output, '"');
+
+  /* Base64 never needs escaping, so encode right into the buffer */
+  data = g_variant_get_fixed_array (value, &length, 1);
+  if (length > 0)
+    {
+      len = output->len;
+      g_string_set_size (output, len + (length / 3 + 1) * 4 + 4);
+      len += g_base64_encode_step (data, length, FALSE, output->str + len, &state, &save);
+      len += g_base64_encode_close (FALSE, output->str + len, &state, &save);
+      g_string_set_size (output, len);
+    }
+
+  g_string_append_c (output, '"');
+}
+
+static void
+write_array_or_tuple (GString *output,
+                      GVariant *value,
+                      GUnixFDList *fdlist,
+                      GQueue *fdids)
+{
+  GVariant *child;
+  gsize i, n;
+
+  g_string_append_c (output, '[');
+
+  n = g_variant_n_children (value);
+  for (i = 0; i < n; i++)
+    {
+      if (i > 0)
+        g_string_append_c (output, ',');
+      child = g_variant_get_child_value (value, i);
+      write_variant (output, child, fdlist, fdids);
+      g_variant_unref (child);
+    }
+
+  g_string_append_c (output, ']');
+}
+
+static void
+write_dictionary (GString *output,
+                  const GVariantType *entry_type,
+                  GVariant *dict,
+                  GUnixFDList *fdlist,
+                  GQueue *fdids)
+{
+  const GVariantType *key_type;
+  GHashTable *last = NULL;
+  GVariant *child;
+  GVariant *value;
+  GVariant **keys;
+  gchar **names;
+  gboolean is_string;
+  gboolean any = FALSE;
+  gsize i, j, n;
+
+  key_type = g_variant_type_key (entry_type);
+
+  is_string = (g_variant_type_equal (key_type, G_VARIANT_TYPE_STRING) ||
+               g_variant_type_equal (key_type, G_VARIANT_TYPE_OBJECT_PATH) ||
+               g_variant_type_equal (key_type, G_VARIANT_TYPE_SIGNATURE));
+
+  n = g_variant_n_children (dict);
+  keys = g_new (GVariant *, n);
+  names = g_new (gchar *, n);
+
+  /*
+   * Nothing stops a GVariant dictionary from repeating a key. A JsonObject
+   * kept such a member where it first appeared, with the last value.
+   */
+  if (n > 1)
+    last = g_hash_table_new (g_str_hash, g_str_equal);
+
+  for (i = 0; i < n; i++)
+    {
+      child = g_variant_get_child_value (dict, i);
+      keys[i] = g_variant_get_child_value (child, 0);
+      g_variant_unref (child);
+
+      if (is_string)
+        names[i] = (gchar *)g_variant_get_string (keys[i], NULL);
+      else
+        names[i] = g_variant_print (keys[i], FALSE);
+
+      if (last)
+        g_hash_table_insert (last, names[i], GSIZE_TO_POINTER (i + 1));
+    }
+
+  g_string_append_c (output, '{');
+
+  for (i = 0; i < n; i++)
+    {
+      j = i;
+      if (last)
+        {
+          /* Already written when the key came up before */
+          j = GPOINTER_TO_SIZE (g_hash_table_lookup (last, names[i]));
+          if (j == 0)
+            continue;
+          g_hash_table_remove (last, names[i]);
+          j--;
+        }
+
+      if (any)
+        g_string_append_c (output, ',');
+      any = TRUE;
+
+      cockpit_json_append_string (output, names[i]);
+      g_string_append_c (output, ':');
+
+      child = g_variant_get_child_value (dict, j);
+      value = g_variant_get_child_value (child, 1);
+      write_variant (output, value, fdlist, fdids);
+      g_variant_unref (value);
+      g_variant_unref (child);
+    }
+
+  g_string_append_c (output, '}');
+
+  for (i = 0; i < n; i++)
+    {
+      if (!is_string)
+        g_free (names[i]);
+      g_variant_unref (keys[i]);
+    }
+  if (last)
+    g_hash_table_unref (last);
+  g_free (names);
+  g_free (keys);
+}
+
+static void
+write_fd_channel (GString *output,
+                  GVariant *value,
+                  GUnixFDList *fdlist,
+                  GQueue *fdids)
+{
+  GError *error = NULL;
+  gint fd = -1;
+  gchar *old;
+  const gchar *id;
+
+  if (fdlist && fdids)
+    {
+      fd = g_unix_fd_list_get (fdlist, g_variant_get_handle (value), &error);
+      if (fd == -1)
+        {
+          g_warning ("couldn't dup file descriptor from DBus message: %s", error->message);
+          g_clear_error (&error);
+        }
+    }
+
+  if (fd < 0)
+    {
+      g_string_append (output, "null");
+      return;
+    }
+
+  /* Add a new internal channel name for this file descriptor */
+  id = cockpit_pipe_channel_add_internal_fd (fd);
+  g_queue_push_tail (fdids, (gpointer) g_strdup (id));
+
+  /* And only keep the last N ready for opening channels */
+  while (g_queue_get_length (fdids) > MAX_RECEIVED_DBUS_FDS)
+    {
+      old = (gchar *)g_queue_pop_head (fdids);
+      cockpit_pipe_channel_remove_internal_fd (old);
+
+      g_free (old);
+    }
+
+  /* This is sent back as the list of channel options to use */
+  g_string_append (output, "{\"payload\":\"stream\",\"internal\":");
+  cockpit_json_append_string (output, id);
+  g_string_append_c (output, '}');
+}
+
+static void
+write_variant (GString *output,
+               GVariant *value,
+               GUnixFDList *fdlist,
+               GQueue *fdids)
+{
+  const GVariantType *element_type;
+  GVariant *child;
+
+  switch (g_variant_classify (value))
+    {
+    case G_VARIANT_CLASS_BOOLEAN:
+      g_string_append (output, g_variant_get_boolean (value) ? "true" : "false");
+      break;
+
+    case G_VARIANT_CLASS_BYTE:
+      g_string_append_printf (output, "%u", (guint)g_variant_get_byte (value));
+      break;
+
+    case G_VARIANT_CLASS_INT16:
+      g_string_append_printf (output, "%d", (gint)g_variant_get_int16 (value));
+      break;
+
+    case G_VARIANT_CLASS_UINT16:
+      g_string_append_printf (output, "%u", (guint)g_variant_get_uint16 (value));
+      break;
+
+    case G_VARIANT_CLASS_INT32:
+      g_string_append_printf (output, "%d", (gint)g_variant_get_int32 (value));
+      break;
+
+    case G_VARIANT_CLASS_UINT32:
+      g_string_append_printf (output, "%u", (guint)g_variant_get_uint32 (value));
+      break;
+
+    case G_VARIANT_CLASS_INT64:
+      g_string_append_printf (output, "%" G_GINT64_FORMAT, g_variant_get_int64 (value));
+      break;
+
+    case G_VARIANT_CLASS_UINT64:
+      /* JsonNode only ever held a gint64, and clients expect that */
+      g_string_append_printf (output, "%" G_GINT64_FORMAT, (gint64)g_variant_get_uint64 (value));
+      break;
+
+    case G_VARIANT_CLASS_HANDLE:
+      write_fd_channel (output, value, fdlist, fdids);
+      break;
+
+    case G_VARIANT_CLASS_DOUBLE:
+      cockpit_json_append_double (output, g_variant_get_double (value));
+      break;
+
+    case G_VARIANT_CLASS_STRING:      /* explicit fall-through */
+    case G_VARIANT_CLASS_OBJECT_PATH: /* explicit fall-through */
+    case G_VARIANT_CLASS_SIGNATURE:
+      cockpit_json_append_string (output, g_variant_get_string (value, NULL));
+      break;
+
+    case G_VARIANT_CLASS_VARIANT:
+      child = g_variant_get_variant (value);
+      g_string_append (output, "{\"t\":");
+      cockpit_json_append_string (output, g_variant_get_type_string (child));
+      g_string_append (output, ",\"v\":");
+      write_variant (output, child, fdlist, fdids);
+      g_string_append_c (output, '}');
+      g_variant_unref (child);
+      break;
+
+    case G_VARIANT_CLASS_ARRAY:
+      element_type = g_variant_type_element (g_variant_get_type (value));
+      if (g_variant_type_is_dict_entry (element_type))
+        write_dictionary (output, element_type, value, fdlist, fdids);
+      else if (g_variant_type_equal (element_type, G_VARIANT_TYPE_BYTE))
+        write_byte_array (output, value);
+      else
+        write_array_or_tuple (output, value, fdlist, fdids);
+      break;
+
+    case G_VARIANT_CLASS_TUPLE:
+      write_array_or_tuple (output, value, fdlist, fdids);
+      break;
+
+    case G_VARIANT_CLASS_DICT_ENTRY:
+    case G_VARIANT_CLASS_MAYBE:
+    default:
+      /* Keep the output valid JSON */
+      g_string_append (output, "null");
+      g_return_if_reached ();
+      break;
+    }
+}
+
+/**
+ * cockpit_dbus_variant_write:
+ * @output: the buffer to append to
+ * @value: the value to write
+ * @fdlist: (nullable): file descriptors that came with @value
+ * @fdids: (nullable): queue of internal channel ids for received fds
+ *
+ * Append @value to @output as dbus-json3. Variants are written as
+ * objects with "t" and "v" members, byte arrays as base64 strings,
+ * and dictionaries as objects.
+ *
+ * Handles are turned into internal stream channel options when both
+ * @fdlist and @fdids are set. The ids are added to @fdids, and only the
+ * most recent ones are kept open. Otherwise handles are written as null.
+ */
+void
+cockpit_dbus_variant_write (GString *output,
+                            GVariant *value,
+                            GUnixFDList *fdlist,
+                            GQueue *fdids)
+{
+  g_return_if_fail (output != NULL);
+  g_return_if_fail (value != NULL);
+
+  write_variant (output, value, fdlist, fdids);
+}
@@ -21,53 +21,39 @@
 
 #include "cockpitdisksamples.h"
 
-#include <stdio.h>
-#include <string.h>
-#include <unistd.h>
+#include "cockpitprocfile.h"
 
-/* TODO: this should be optimized so we don't allocate network and call open()/close() all the time */
+#include <string.h>
 
 void
 cockpit_disk_samples (CockpitSamples *samples)
 {
-  gchar *contents = NULL;
-  GError *error = NULL;
-  gchar **lines = NULL;
+  static CockpitProcFile proc_diskstats = COCKPIT_PROC_FILE_INIT ("diskstats");
+  CockpitProcScanner scanner;
+  CockpitProcScanner line;
+  CockpitProcScanner whole;
   guint64 bytes_read;
   guint64 bytes_written;
   guint64 num_ops;
+  guint64 dev_major, dev_minor;
+  gchar dev_name[128];
+  guint64 num_reads_merged, num_sectors_read;
+  guint64 num_writes_merged, num_sectors_written;
   gsize len;
-  guint n;
-  static gboolean not_supported = FALSE;
 
-  if (not_supported)
-      goto out;
-
-  if (!g_file_get_contents ("/proc/diskstats", &contents, &len, &error))
-    {
-      g_message ("error loading contents /proc/diskstats: %s", error->message);
-      g_error_free (error);
-      not_supported = TRUE;
-      goto out;
-    }
+  if (!cockpit_proc_file_read (&proc_diskstats))
+    return;
 
   bytes_read = 0;
   bytes_written = 0;
   num_ops = 0;
 
-  lines = g_strsplit (contents, "\n", -1);
-  for (n = 0; lines != NULL && lines[n] != NULL; n++)
+  cockpit_proc_scanner_init (&scanner, &proc_diskstats);
+  while (cockpit_proc_scanner_line (&scanner, &line))
     {
-      const gchar *line = lines[n];
-      guint num_parsed;
-      gint dev_major, dev_minor;
-      gchar dev_name[128];
-      guint64 num_reads,  num_reads_merged,  num_sectors_read,    num_msec_reading;
-      guint64 num_writes, num_writes_merged, num_sectors_written, num_msec_writing;
-      guint64 num_io_in_progress, num_msec_doing_io, weighted_num_msec_doing_io;
-
-      if (strlen (line) == 0)
+      if (line.pos == line.end)
         continue;
+      whole = line;
 
       /* From http://www.kernel.org/doc/Documentation/iostats.txt
        *
@@ -103,18 +89,23 @@ cockpit_disk_samples (CockpitSamples *samples)
        *     I/O completion time and the backlog that may be accumulating.
        */
 
-      num_parsed = sscanf (line,
-                           "%d %d %127s"
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
-                           &dev_major, &dev_minor, dev_name,
-                           &num_reads,  &num_reads_merged, &num_sectors_read, &num_msec_reading,
-                           &num_writes, &num_writes_merged, &num_sectors_written, &num_msec_writing,
-                           &num_io_in_progress, &num_msec_doing_io, &weighted_num_msec_doing_io);
-      if (num_parsed != 14)
+      if (!cockpit_proc_scanner_uint64 (&line, &dev_major) ||
+          !cockpit_proc_scanner_uint64 (&line, &dev_minor) ||
+          !cockpit_proc_scanner_word (&line, 0, dev_name, sizeof (dev_name)) ||
+          !cockpit_proc_scanner_uint64 (&line, NULL) ||                 /* reads */
+          !cockpit_proc_scanner_uint64 (&line, &num_reads_merged) ||
+          !cockpit_proc_scanner_uint64 (&line, &num_sectors_read) ||
+          !cockpit_proc_scanner_uint64 (&line, NULL) ||                 /* msec reading */
+          !cockpit_proc_scanner_uint64 (&line, NULL) ||                 /* writes */
+          !cockpit_proc_scanner_uint64 (&line, &num_writes_merged) ||
+          !cockpit_proc_scanner_uint64 (&line, &num_sectors_written) ||
+          !cockpit_proc_scanner_uint64 (&line, NULL) ||                 /* msec writing */
+          !cockpit_proc_scanner_uint64 (&line, NULL) ||                 /* in progress */
+          !cockpit_proc_scanner_uint64 (&line, NULL) ||                 /* msec doing io */
+          !cockpit_proc_scanner_uint64 (&line, NULL))                   /* weighted msec */
         {
-          g_warning ("Error parsing line %d of file /proc/diskstats (num_parsed=%d): `%s'", n, num_parsed, line);
+          g_warning ("Error parsing line of file /proc/diskstats: `%.*s'",
+                     (int)(whole.end - whole.pos), whole.pos);
           continue;
         }
 
@@ -129,10 +120,11 @@ cockpit_disk_samples (CockpitSamples *samples)
           || dev_major == 9)   /* md */
         continue;
 
+      len = strlen (dev_name);
       if ((g_str_has_prefix (dev_name, "sd")
            || g_str_has_prefix (dev_name, "hd")
            || g_str_has_prefix (dev_name, "vd"))
-          && g_ascii_isdigit (dev_name[strlen (dev_name) - 1]))
+          && g_ascii_isdigit (dev_name[len - 1]))
         continue;
 
       bytes_read += num_sectors_read * 512;
@@ -143,8 +135,4 @@ cockpit_disk_samples (CockpitSamples *samples)
   cockpit_samples_sample (samples, "disk.all.read", NULL, bytes_read);
   cockpit_samples_sample (samples, "disk.all.written", NULL, bytes_written);
   cockpit_samples_sample (samples, "disk.all.ops", NULL, num_ops);
-
-out:
-  g_strfreev (lines);
-  g_free (contents);
 }
@@ -49,6 +49,7 @@ typedef struct {
   gchar *start_tag;
   GQueue *queue;
   guint idler;
+  gboolean paused;
 } CockpitFsread;
 
 typedef struct {
@@ -71,6 +72,8 @@ on_idle_send_block (gpointer data)
   if (payload == NULL)
     {
       self->idler = 0;
+      g_queue_free (self->queue);
+      self->queue = NULL;
       cockpit_channel_control (channel, "done", NULL);
 
       problem = NULL;
@@ -96,10 +99,30 @@ on_idle_send_block (gpointer data)
     {
       cockpit_channel_send (channel, payload, FALSE);
       g_bytes_unref (payload);
+
+      /* Under pressure, wait until the channel is relieved */
+      if (self->paused)
+        {
+          self->idler = 0;
+          return FALSE;
+        }
+
       return TRUE;
     }
 }
 
+static void
+on_channel_pressure (CockpitChannel *channel,
+                     gboolean throttle,
+                     gpointer user_data)
+{
+  CockpitFsread *self = user_data;
+
+  self->paused = throttle;
+  if (!self->paused && self->queue && !self->idler)
+    self->idler = g_idle_add (on_idle_send_block, self);
+}
+
 static void
 cockpit_fsread_recv (CockpitChannel *channel,
                      GBytes *message)
@@ -292,6 +315,7 @@ cockpit_fsread_prepare (CockpitChannel *channel)
   self->start_tag = cockpit_get_file_tag_from_fd (self->fd);
   self->queue = g_queue_new ();
   push_bytes (self->queue, bytes);
+  g_signal_connect (self, "pressure", G_CALLBACK (on_channel_pressure), self);
   self->idler = g_idle_add (on_idle_send_block, self);
   cockpit_channel_ready (channel, NULL);
   if (mapped)
@@ -24,6 +24,7 @@
 #include "cockpitconnect.h"
 #include "cockpitstream.h"
 
+#include "common/cockpitflow.h"
 #include "common/cockpitjson.h"
 #include "common/cockpitpipe.h"
 #include "common/cockpitwebresponse.h"
@@ -955,6 +956,7 @@ cockpit_http_stream_close (CockpitChannel *channel,
           g_signal_handler_disconnect (self->stream, self->sig_read);
           g_signal_handler_disconnect (self->stream, self->sig_close);
           g_signal_handler_disconnect (self->stream, self->sig_rejected_cert);
+          cockpit_flow_throttle (COCKPIT_FLOW (self->stream), NULL);
           cockpit_http_client_checkin (self->client, self->stream);
           g_object_unref (self->stream);
           self->stream = NULL;
@@ -1056,6 +1058,9 @@ cockpit_http_stream_prepare (CockpitChannel *channel)
   self->sig_rejected_cert = g_signal_connect (self->stream, "rejected-cert",
                                               G_CALLBACK (on_rejected_cert), self);
 
+  /* Stop reading the response while the channel is under pressure */
+  cockpit_flow_throttle (COCKPIT_FLOW (self->stream), COCKPIT_FLOW (self));
+
   /* If not waiting for open */
   if (!self->sig_open)
     cockpit_channel_ready (channel, NULL);
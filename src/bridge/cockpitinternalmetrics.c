@@ -25,6 +25,7 @@
 #include "cockpitmetrics.h"
 #include "cockpitinternalmetrics.h"
 #include "cockpitsamples.h"
+#include "cockpitsamplers.h"
 #include "cockpitcpusamples.h"
 #include "cockpitmemorysamples.h"
 #include "cockpitblocksamples.h"
@@ -32,6 +33,8 @@
 #include "cockpitmountsamples.h"
 #include "cockpitcgroupsamples.h"
 #include "cockpitdisksamples.h"
+#include "cockpitbridgesamples.h"
+#include "cockpitmetricshistory.h"
 
 #include "common/cockpitjson.h"
 
@@ -53,9 +56,24 @@ typedef enum {
   NETWORK_SAMPLER = 1 << 3,
   MOUNT_SAMPLER = 1 << 4,
   CGROUP_SAMPLER = 1 << 5,
-  DISK_SAMPLER = 1 << 6
+  DISK_SAMPLER = 1 << 6,
+  BRIDGE_SAMPLER = 1 << 7
 } SamplerSet;
 
+static const struct {
+  SamplerSet set;
+  CockpitSamplerFunc func;
+} samplers[] = {
+  { CPU_SAMPLER, cockpit_cpu_samples },
+  { MEMORY_SAMPLER, cockpit_memory_samples },
+  { BLOCK_SAMPLER, cockpit_block_samples },
+  { NETWORK_SAMPLER, cockpit_network_samples },
+  { MOUNT_SAMPLER, cockpit_mount_samples },
+  { CGROUP_SAMPLER, cockpit_cgroup_samples },
+  { DISK_SAMPLER, cockpit_disk_samples },
+  { BRIDGE_SAMPLER, cockpit_bridge_samples },
+};
+
 typedef struct {
   const gchar *name;
   const gchar *units;
@@ -95,6 +113,25 @@ static MetricDescription metric_descriptions[] = {
   { "cgroup.memory.sw-limit", "bytes",    "instant", TRUE, CGROUP_SAMPLER },
   { "cgroup.cpu.usage",       "millisec", "counter", TRUE, CGROUP_SAMPLER },
   { "cgroup.cpu.shares",      "count",    "instant", TRUE, CGROUP_SAMPLER },
+  { "cgroup.io.read",         "bytes",    "counter", TRUE, CGROUP_SAMPLER },
+  { "cgroup.io.written",      "bytes",    "counter", TRUE, CGROUP_SAMPLER },
+  { "cgroup.pids.current",    "count",    "instant", TRUE, CGROUP_SAMPLER },
+
+  { "cockpit.channel.rx",          "bytes", "counter", TRUE, BRIDGE_SAMPLER },
+  { "cockpit.channel.tx",          "bytes", "counter", TRUE, BRIDGE_SAMPLER },
+  { "cockpit.channel.rx-messages", "count", "counter", TRUE, BRIDGE_SAMPLER },
+  { "cockpit.channel.tx-messages", "count", "counter", TRUE, BRIDGE_SAMPLER },
+  { "cockpit.payload.rx",          "bytes", "counter", TRUE, BRIDGE_SAMPLER },
+  { "cockpit.payload.tx",          "bytes", "counter", TRUE, BRIDGE_SAMPLER },
+  { "cockpit.payload.rx-messages", "count", "counter", TRUE, BRIDGE_SAMPLER },
+  { "cockpit.payload.tx-messages", "count", "counter", TRUE, BRIDGE_SAMPLER },
+  { "cockpit.transport.rx",            "bytes", "counter", TRUE, BRIDGE_SAMPLER },
+  { "cockpit.transport.tx",            "bytes", "counter", TRUE, BRIDGE_SAMPLER },
+  { "cockpit.transport.rx-wire",       "bytes", "counter", TRUE, BRIDGE_SAMPLER },
+  { "cockpit.transport.tx-wire",       "bytes", "counter", TRUE, BRIDGE_SAMPLER },
+  { "cockpit.transport.queued",        "bytes", "instant", TRUE, BRIDGE_SAMPLER },
+  { "cockpit.transport.queued-blocks", "count", "instant", TRUE, BRIDGE_SAMPLER },
+  { "cockpit.transport.frozen",        "count", "instant", TRUE, BRIDGE_SAMPLER },
 
   { NULL }
 };
@@ -112,7 +149,8 @@ find_metric_description (const gchar *name)
 }
 
 typedef struct {
-  gboolean seen;
+  guint64 seen;
+  gboolean stale;
   int index;
   double value;
 } InstanceInfo;
@@ -122,9 +160,31 @@ typedef struct {
   const gchar *derive;
 
   GHashTable *instances;
+  guint n_seen;
   double value;
 } MetricInfo;
 
+/*
+ * The samplers report their values in the same order on every tick,
+ * with static metric names and instance names interned by the shared
+ * samplers. So we resolve each (metric, instance) pair once into a
+ * Route, and afterwards only compare pointers against the route at
+ * the same position. Samples that arrive in a different order are
+ * resolved again from that position on.
+ */
+
+typedef struct {
+  MetricInfo *info;
+  InstanceInfo *inst;
+} Target;
+
+typedef struct {
+  const gchar *metric;
+  const gchar *instance;
+  guint first_target;
+  guint n_targets;
+} Route;
+
 typedef struct {
   CockpitMetrics parent;
   const gchar *name;
@@ -135,8 +195,17 @@ typedef struct {
   const gchar **instances;
   const gchar **omit_instances;
   SamplerSet samplers;
+  gboolean subscribed;
 
   gboolean need_meta;
+  gboolean need_reset;
+  gint64 last_timestamp;
+
+  guint64 generation;
+  GArray *routes;
+  GArray *targets;
+  guint route_pos;
+  guint64 routes_epoch;
 } CockpitInternalMetrics;
 
 typedef struct {
@@ -150,6 +219,9 @@ G_DEFINE_TYPE_WITH_CODE (CockpitInternalMetrics, cockpit_internal_metrics, COCKP
 static void
 cockpit_internal_metrics_init (CockpitInternalMetrics *self)
 {
+  self->generation = 1;
+  self->routes = g_array_new (FALSE, FALSE, sizeof (Route));
+  self->targets = g_array_new (FALSE, FALSE, sizeof (Target));
 }
 
 static gint64
@@ -159,7 +231,9 @@ timestamp_from_timeval (struct timeval *tv)
 }
 
 static void
-send_meta (CockpitInternalMetrics *self)
+send_meta (CockpitInternalMetrics *self,
+           gint64 timestamp,
+           gboolean reset)
 {
   JsonArray *metrics;
   JsonObject *metric;
@@ -171,7 +245,7 @@ send_meta (CockpitInternalMetrics *self)
   now = timestamp_from_timeval (&now_timeval);
 
   root = json_object_new ();
-  json_object_set_int_member (root, "timestamp", now);
+  json_object_set_int_member (root, "timestamp", timestamp);
   json_object_set_int_member (root, "now", now);
   json_object_set_int_member (root, "interval", self->interval);
 
@@ -195,6 +269,7 @@ send_meta (CockpitInternalMetrics *self)
           gpointer key, value;
           int index;
           JsonArray *instances = json_array_new ();
+          JsonArray *stale = NULL;
 
           g_hash_table_iter_init (&iter, info->instances);
           index = 0;
@@ -214,9 +289,20 @@ send_meta (CockpitInternalMetrics *self)
                 json_array_add_element (instances, string_element);
               }
 
+              if (inst->stale)
+                {
+                  if (!stale)
+                    stale = json_array_new ();
+                  JsonNode *string_element = json_node_alloc ();
+                  json_node_init_string (string_element, name);
+                  json_array_add_element (stale, string_element);
+                }
+
               inst->index = index++;
             }
           json_object_set_array_member (metric, "instances", instances);
+          if (stale)
+            json_object_set_array_member (metric, "stale", stale);
         }
 
       /* Units and semantics
@@ -229,59 +315,167 @@ send_meta (CockpitInternalMetrics *self)
 
   json_object_set_array_member (root, "metrics", metrics);
 
-  cockpit_metrics_send_meta (COCKPIT_METRICS (self), root, FALSE);
+  cockpit_metrics_send_meta (COCKPIT_METRICS (self), root, reset);
 
   json_object_unref (root);
 }
 
-static void
-cockpit_internal_metrics_sample (CockpitSamples *samples,
-                                 const gchar *metric,
-                                 const gchar *instance,
-                                 gint64 value)
+static gboolean
+omit_instance (CockpitInternalMetrics *self,
+               const gchar *instance)
 {
-  CockpitInternalMetrics *self = COCKPIT_INTERNAL_METRICS (samples);
-
   if (self->omit_instances)
     {
       for (int i = 0; self->omit_instances[i]; i++)
         {
           if (g_strcmp0 (instance, self->omit_instances[i]) == 0)
-            return;
+            return TRUE;
         }
     }
 
-  for (int i = 0; i < self->n_metrics; i++)
+  return FALSE;
+}
+
+static InstanceInfo *
+ensure_instance (CockpitInternalMetrics *self,
+                 MetricInfo *info,
+                 const gchar *instance)
+{
+  InstanceInfo *inst = g_hash_table_lookup (info->instances, instance);
+  if (inst == NULL)
     {
-      MetricInfo *info = &self->metrics[i];
-      if (g_strcmp0 (metric, info->desc->name) != 0)
-        continue;
+      g_debug ("%s + %s", info->desc->name, instance);
+      inst = g_new0 (InstanceInfo, 1);
+      inst->value = NAN;
+      g_hash_table_insert (info->instances, g_strdup (instance), inst);
+      self->need_meta = TRUE;
+    }
+  return inst;
+}
 
-      if (info->desc->instanced)
+static void
+clear_routes (CockpitInternalMetrics *self)
+{
+  g_array_set_size (self->routes, 0);
+  g_array_set_size (self->targets, 0);
+  self->route_pos = 0;
+}
+
+static Route *
+resolve_route (CockpitInternalMetrics *self,
+               const gchar *metric,
+               const gchar *instance)
+{
+  Route *route;
+  Route fresh;
+  guint64 epoch;
+
+  /* Instance names we compare against may have been freed */
+  epoch = cockpit_samplers_get_epoch ();
+  if (epoch != self->routes_epoch)
+    {
+      clear_routes (self);
+      self->routes_epoch = epoch;
+    }
+
+  fresh.metric = metric;
+  fresh.instance = instance;
+  fresh.first_target = self->targets->len;
+  fresh.n_targets = 0;
+
+  if (self->route_pos < self->routes->len)
+    {
+      route = &g_array_index (self->routes, Route, self->route_pos);
+      if (route->metric == metric && route->instance == instance)
+        {
+          self->route_pos++;
+          return route;
+        }
+
+      /* Different order than last time, resolve the rest again */
+      fresh.first_target = route->first_target;
+      g_array_set_size (self->routes, self->route_pos);
+      g_array_set_size (self->targets, fresh.first_target);
+    }
+
+  if (!omit_instance (self, instance))
+    {
+      for (int i = 0; i < self->n_metrics; i++)
+        {
+          Target target = { &self->metrics[i], NULL };
+          if (g_strcmp0 (metric, target.info->desc->name) != 0)
+            continue;
+          if (target.info->desc->instanced)
+            target.inst = ensure_instance (self, target.info, instance);
+          g_array_append_val (self->targets, target);
+          fresh.n_targets++;
+        }
+    }
+
+  g_array_append_val (self->routes, fresh);
+  return &g_array_index (self->routes, Route, self->route_pos++);
+}
+
+static void
+mark_seen (CockpitInternalMetrics *self,
+           Target *target)
+{
+  if (target->inst->seen != self->generation)
+    {
+      target->inst->seen = self->generation;
+      target->info->n_seen++;
+    }
+}
+
+static void
+cockpit_internal_metrics_sample (CockpitSamples *samples,
+                                 const gchar *metric,
+                                 const gchar *instance,
+                                 gint64 value)
+{
+  CockpitInternalMetrics *self = COCKPIT_INTERNAL_METRICS (samples);
+  Route *route = resolve_route (self, metric, instance);
+
+  for (guint i = 0; i < route->n_targets; i++)
+    {
+      Target *target = &g_array_index (self->targets, Target, route->first_target + i);
+      if (target->inst)
         {
-          InstanceInfo *inst = g_hash_table_lookup (info->instances, instance);
-          if (inst == NULL)
+          mark_seen (self, target);
+          if (target->inst->stale)
             {
-              g_debug ("%s + %s", metric, instance);
-              inst = g_new0 (InstanceInfo, 1);
-              g_hash_table_insert (info->instances, g_strdup (instance), inst);
+              target->inst->stale = FALSE;
               self->need_meta = TRUE;
             }
-          inst->seen = TRUE;
-          inst->value = value;
+          target->inst->value = value;
         }
       else
-        info->value = value;
+        target->info->value = value;
     }
 }
 
 static void
-instance_reset (gpointer key,
-                gpointer value,
-                gpointer user_data)
+cockpit_internal_metrics_stale (CockpitSamples *samples,
+                                const gchar *metric,
+                                const gchar *instance)
 {
-  InstanceInfo *info = value;
-  info->seen = FALSE;
+  CockpitInternalMetrics *self = COCKPIT_INTERNAL_METRICS (samples);
+  Route *route = resolve_route (self, metric, instance);
+
+  /* Keep the instance and its previous value, but say it's stale */
+  for (guint i = 0; i < route->n_targets; i++)
+    {
+      Target *target = &g_array_index (self->targets, Target, route->first_target + i);
+      if (!target->inst)
+        continue;
+
+      mark_seen (self, target);
+      if (!target->inst->stale)
+        {
+          target->inst->stale = TRUE;
+          self->need_meta = TRUE;
+        }
+    }
 }
 
 static gboolean
@@ -290,65 +484,52 @@ instance_unseen (gpointer key,
                  gpointer user_data)
 {
   InstanceInfo *info = value;
-  return !info->seen;
+  CockpitInternalMetrics *self = user_data;
+  return info->seen != self->generation;
 }
 
 static void
-cockpit_internal_metrics_tick (CockpitMetrics *metrics,
-                               gint64 timestamp)
+reset_samples (CockpitInternalMetrics *self)
 {
-  CockpitInternalMetrics *self = (CockpitInternalMetrics *)metrics;
-  struct timeval now_timeval;
-  gint64 now;
-
-  gettimeofday (&now_timeval, NULL);
-  now = timestamp_from_timeval (&now_timeval);
-
-  /* Reset samples
-   */
+  /* Instances are seen again when their seen generation is the current one */
+  self->generation++;
   for (int i = 0; i < self->n_metrics; i++)
     {
       MetricInfo *info = &self->metrics[i];
       if (info->desc->instanced)
-        g_hash_table_foreach (info->instances, instance_reset, NULL);
+        info->n_seen = 0;
       else
         info->value = NAN;
     }
 
-  /* Sample
-   */
-  if (self->samplers & CPU_SAMPLER)
-    cockpit_cpu_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & MEMORY_SAMPLER)
-    cockpit_memory_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & BLOCK_SAMPLER)
-    cockpit_block_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & NETWORK_SAMPLER)
-    cockpit_network_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & MOUNT_SAMPLER)
-    cockpit_mount_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & CGROUP_SAMPLER)
-    cockpit_cgroup_samples (COCKPIT_SAMPLES (self));
-  if (self->samplers & DISK_SAMPLER)
-    cockpit_disk_samples (COCKPIT_SAMPLES (self));
+  self->route_pos = 0;
+}
 
+static void
+send_samples (CockpitInternalMetrics *self,
+              gint64 timestamp)
+{
   /* Check for disappeared instances
    */
   for (int i = 0; i < self->n_metrics; i++)
     {
       MetricInfo *info = &self->metrics[i];
-      if (info->desc->instanced)
-        if (g_hash_table_foreach_remove (info->instances, instance_unseen, NULL) > 0)
+      if (info->desc->instanced && info->n_seen < g_hash_table_size (info->instances))
+        {
+          g_hash_table_foreach_remove (info->instances, instance_unseen, self);
           self->need_meta = TRUE;
+          clear_routes (self);
+        }
     }
 
   /* Send a meta message if necessary.  This will also allocate a new
      buffer and setup the instance indices.
    */
-  if (self->need_meta)
+  if (self->need_meta || self->need_reset)
     {
-      send_meta (self);
+      send_meta (self, timestamp, self->need_reset);
       self->need_meta = FALSE;
+      self->need_reset = FALSE;
     }
 
   /* Ship them out
@@ -373,10 +554,73 @@ cockpit_internal_metrics_tick (CockpitMetrics *metrics,
         buffer[i][0] = info->value;
     }
 
-  cockpit_metrics_send_data (COCKPIT_METRICS (self), now);
+  cockpit_metrics_send_data (COCKPIT_METRICS (self), timestamp);
+  self->last_timestamp = timestamp;
+}
+
+static void
+cockpit_internal_metrics_tick (CockpitMetrics *metrics,
+                               gint64 timestamp)
+{
+  CockpitInternalMetrics *self = (CockpitInternalMetrics *)metrics;
+  struct timeval now_timeval;
+
+  gettimeofday (&now_timeval, NULL);
+
+  reset_samples (self);
+
+  /* Sample, sharing the results with other channels on the same tick
+   */
+  for (guint i = 0; i < G_N_ELEMENTS (samplers); i++)
+    {
+      if (self->samplers & samplers[i].set)
+        cockpit_samplers_run (samplers[i].func, timestamp, COCKPIT_SAMPLES (self));
+    }
+
+  send_samples (self, timestamp_from_timeval (&now_timeval));
   cockpit_metrics_flush_data (COCKPIT_METRICS (self));
 }
 
+static void
+on_history_point (gint64 timestamp,
+                  gpointer user_data)
+{
+  CockpitInternalMetrics *self = user_data;
+
+  /* Points missing from the history: start over, like after a gap in an archive */
+  if (self->last_timestamp && timestamp - self->last_timestamp > self->interval * 3 / 2)
+    self->need_reset = TRUE;
+
+  send_samples (self, timestamp);
+  reset_samples (self);
+}
+
+static void
+backfill_from_history (CockpitInternalMetrics *self,
+                       gint64 since)
+{
+  gint64 before;
+
+  for (guint i = 0; i < G_N_ELEMENTS (samplers); i++)
+    {
+      if ((self->samplers & samplers[i].set) &&
+          !cockpit_metrics_history_covers (samplers[i].func, self->interval))
+        return;
+    }
+
+  /* The first live tick is for the slot we're in, see cockpit_metrics_metronome() */
+  before = g_get_monotonic_time () / 1000;
+  before -= before % self->interval;
+
+  /* The history passes its own instance names, don't keep routes to them */
+  clear_routes (self);
+  reset_samples (self);
+  if (cockpit_metrics_history_replay (since, before, self->interval, COCKPIT_SAMPLES (self),
+                                      on_history_point, self) > 0)
+    cockpit_metrics_flush_data (COCKPIT_METRICS (self));
+  clear_routes (self);
+}
+
 static gboolean
 convert_metric_description (CockpitInternalMetrics *self,
                             JsonNode *node,
@@ -448,6 +692,7 @@ cockpit_internal_metrics_prepare (CockpitChannel *channel)
   CockpitInternalMetrics *self = COCKPIT_INTERNAL_METRICS (channel);
   JsonObject *options;
   JsonArray *metrics;
+  gint64 timestamp;
   int i;
 
   COCKPIT_CHANNEL_CLASS (cockpit_internal_metrics_parent_class)->prepare (channel);
@@ -507,7 +752,34 @@ cockpit_internal_metrics_prepare (CockpitChannel *channel)
       return;
     }
 
+  /* "timestamp" option */
+  if (!cockpit_json_get_int (options, "timestamp", 0, &timestamp))
+    {
+      cockpit_channel_fail (channel, "protocol-error", "invalid \"timestamp\" option");
+      return;
+    }
+  if (timestamp / 1000 < G_MINLONG || timestamp / 1000 > G_MAXLONG)
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "invalid \"timestamp\" value: %" G_GINT64_FORMAT, timestamp);
+      return;
+    }
+
+  if (timestamp < 0)
+    {
+      struct timeval now;
+      gettimeofday (&now, NULL);
+      timestamp = timestamp_from_timeval (&now) + timestamp;
+    }
+
   self->need_meta = TRUE;
+  self->subscribed = TRUE;
+  cockpit_samplers_subscribe ();
+
+  /* Recent samples in the past are served from memory, then we go live */
+  cockpit_metrics_history_ensure ();
+  if (timestamp != 0)
+    backfill_from_history (self, timestamp);
 
   cockpit_metrics_metronome (COCKPIT_METRICS (self), self->interval);
   cockpit_channel_ready (channel, NULL);
@@ -538,6 +810,11 @@ cockpit_internal_metrics_finalize (GObject *object)
     }
 
   g_free (self->metrics);
+  g_array_free (self->routes, TRUE);
+  g_array_free (self->targets, TRUE);
+
+  if (self->subscribed)
+    cockpit_samplers_unsubscribe ();
 
   G_OBJECT_CLASS (cockpit_internal_metrics_parent_class)->finalize (object);
 }
@@ -560,4 +837,5 @@ static void
 cockpit_samples_interface_init (CockpitSamplesIface *iface)
 {
   iface->sample = cockpit_internal_metrics_sample;
+  iface->stale = cockpit_internal_metrics_stale;
 }
@@ -21,18 +21,15 @@
 
 #include "cockpitmemorysamples.h"
 
-#include <stdio.h>
+#include "cockpitprocfile.h"
 
-/* TODO: this should be optimized so we don't allocate memory and call open()/close() all the time */
 
 void
 cockpit_memory_samples (CockpitSamples *samples)
 {
-  gchar *contents = NULL;
-  GError *error = NULL;
-  gchar **lines = NULL;
-  gsize len;
-  guint n;
+  static CockpitProcFile proc_meminfo = COCKPIT_PROC_FILE_INIT ("meminfo");
+  CockpitProcScanner scanner;
+  CockpitProcScanner line;
 
   guint64 free_kb = 0;
   guint64 total_kb = 0;
@@ -41,39 +38,30 @@ cockpit_memory_samples (CockpitSamples *samples)
   guint64 swap_total_kb = 0;
   guint64 swap_free_kb = 0;
 
-  if (!g_file_get_contents ("/proc/meminfo", &contents, &len, &error))
-    {
-      g_message ("error loading contents /proc/meminfo: %s", error->message);
-      g_error_free (error);
-      goto out;
-    }
+  if (!cockpit_proc_file_read (&proc_meminfo))
+    return;
 
-  /* see 'man proc' for the format of /proc/stat */
+  /* see 'man proc' for the format of /proc/meminfo */
 
-  lines = g_strsplit (contents, "\n", -1);
-  for (n = 0; lines != NULL && lines[n] != NULL; n++)
+  cockpit_proc_scanner_init (&scanner, &proc_meminfo);
+  while (cockpit_proc_scanner_line (&scanner, &line))
     {
-      const gchar *line = lines[n];
-      if (g_str_has_prefix (line, "MemTotal:"))
-        g_warn_if_fail (sscanf (line + sizeof ("MemTotal:") - 1, "%" G_GUINT64_FORMAT, &total_kb) == 1);
-      else if (g_str_has_prefix (line, "MemFree:"))
-        g_warn_if_fail (sscanf (line + sizeof ("MemFree:") - 1, "%" G_GUINT64_FORMAT, &free_kb) == 1);
-      else if (g_str_has_prefix (line, "SwapTotal:"))
-        g_warn_if_fail (sscanf (line + sizeof ("SwapTotal:") - 1, "%" G_GUINT64_FORMAT, &swap_total_kb) == 1);
-      else if (g_str_has_prefix (line, "SwapFree:"))
-        g_warn_if_fail (sscanf (line + sizeof ("SwapFree:") - 1, "%" G_GUINT64_FORMAT, &swap_free_kb) == 1);
-      else if (g_str_has_prefix (line, "Buffers:"))
-        g_warn_if_fail (sscanf (line + sizeof ("Buffers:") - 1, "%" G_GUINT64_FORMAT, &buffers_kb) == 1);
-      else if (g_str_has_prefix (line, "Cached:"))
-        g_warn_if_fail (sscanf (line + sizeof ("Cached:") - 1, "%" G_GUINT64_FORMAT, &cached_kb) == 1);
+      if (cockpit_proc_scanner_prefix (&line, "MemTotal:"))
+        g_warn_if_fail (cockpit_proc_scanner_uint64 (&line, &total_kb));
+      else if (cockpit_proc_scanner_prefix (&line, "MemFree:"))
+        g_warn_if_fail (cockpit_proc_scanner_uint64 (&line, &free_kb));
+      else if (cockpit_proc_scanner_prefix (&line, "SwapTotal:"))
+        g_warn_if_fail (cockpit_proc_scanner_uint64 (&line, &swap_total_kb));
+      else if (cockpit_proc_scanner_prefix (&line, "SwapFree:"))
+        g_warn_if_fail (cockpit_proc_scanner_uint64 (&line, &swap_free_kb));
+      else if (cockpit_proc_scanner_prefix (&line, "Buffers:"))
+        g_warn_if_fail (cockpit_proc_scanner_uint64 (&line, &buffers_kb));
+      else if (cockpit_proc_scanner_prefix (&line, "Cached:"))
+        g_warn_if_fail (cockpit_proc_scanner_uint64 (&line, &cached_kb));
     }
 
   cockpit_samples_sample (samples, "memory.free", NULL, free_kb * 1024);
   cockpit_samples_sample (samples, "memory.used", NULL, (total_kb - free_kb) * 1024);
   cockpit_samples_sample (samples, "memory.cached", NULL, (buffers_kb + cached_kb) * 1024);
   cockpit_samples_sample (samples, "memory.swap-used", NULL, (swap_total_kb - swap_free_kb) * 1024);
-
-out:
-  g_strfreev (lines);
-  g_free (contents);
 }
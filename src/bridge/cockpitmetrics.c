@@ -24,6 +24,7 @@
 #include "common/cockpitjson.h"
 
 #include <math.h>
+#include <string.h>
 
 enum {
   DERIVE_NONE = 0,
@@ -31,11 +32,32 @@ enum {
   DERIVE_RATE = 2,
 };
 
+enum {
+  REDUCE_NONE = 0,
+  REDUCE_SUM = 1,
+  REDUCE_TOP = 2,
+};
+
 typedef struct {
   gint derive;
   gboolean has_instances;
   gint n_last_instances;
   gint n_next_instances;
+
+  /* Instances reduced on our side, see "reduce", "top" and "match" */
+  gboolean reduced;
+  gint reduce;
+  gint top;
+  GPatternSpec *match;
+  gint n_candidates;
+  gint *candidates;
+  gint n_output;
+  gint *selected;
+  gint n_shown;
+  gint *shown;
+  double *output;
+  double *last_output;
+  gboolean output_valid;
 } MetricInfo;
 
 struct _CockpitMetricsPrivate {
@@ -60,7 +82,15 @@ struct _CockpitMetricsPrivate {
   gboolean derived_valid;
   double **derived;
 
+  /* Some metrics are reduced, and we send our own meta for them */
+  gboolean reducing;
+  gboolean output_meta_pending;
+
   JsonArray *message;
+
+  /* With "binary": "raw" data messages are packed instead of JSON */
+  gboolean binary;
+  GByteArray *frames;
 };
 
 G_DEFINE_ABSTRACT_TYPE (CockpitMetrics, cockpit_metrics, COCKPIT_TYPE_CHANNEL);
@@ -141,9 +171,33 @@ cockpit_metrics_dispose (GObject *object)
       self->priv->derived = NULL;
     }
 
+  for (int i = 0; self->priv->metric_info && i < self->priv->n_metrics; i++)
+    {
+      MetricInfo *info = &self->priv->metric_info[i];
+      if (info->match)
+        g_pattern_spec_free (info->match);
+      g_free (info->candidates);
+      g_free (info->selected);
+      g_free (info->shown);
+      g_free (info->output);
+      g_free (info->last_output);
+    }
+
   g_free (self->priv->metric_info);
   self->priv->metric_info = NULL;
 
+  if (self->priv->message)
+    {
+      json_array_unref (self->priv->message);
+      self->priv->message = NULL;
+    }
+
+  if (self->priv->frames)
+    {
+      g_byte_array_unref (self->priv->frames);
+      self->priv->frames = NULL;
+    }
+
   G_OBJECT_CLASS (cockpit_metrics_parent_class)->dispose (object);
 }
 
@@ -203,7 +257,13 @@ cockpit_metrics_metronome (CockpitMetrics *self,
   g_return_if_fail (self->priv->timeout == 0);
   g_return_if_fail (interval > 0);
 
+  /*
+   * Ticks fall on multiples of the interval, so that channels with the
+   * same interval tick together and can share samples. The first tick
+   * is right away, for the slot we're already in.
+   */
   self->priv->next = g_get_monotonic_time() / 1000;
+  self->priv->next -= self->priv->next % interval;
   self->priv->interval = interval;
   on_timeout_tick (self);
 }
@@ -233,6 +293,114 @@ realloc_derived_buffer (CockpitMetrics *self)
   self->priv->derived_valid = FALSE;
 }
 
+static gboolean
+parse_reductions (CockpitMetrics *self,
+                  JsonObject *options)
+{
+  CockpitChannel *channel = COCKPIT_CHANNEL (self);
+  JsonArray *metrics;
+  JsonNode *node;
+  const gchar *reduce;
+  const gchar *match;
+  gint64 top;
+
+  if (!options || !cockpit_json_get_array (options, "metrics", NULL, &metrics) || !metrics)
+    return TRUE;
+
+  for (int i = 0; i < self->priv->n_metrics && i < (int)json_array_get_length (metrics); i++)
+    {
+      MetricInfo *info = &self->priv->metric_info[i];
+      JsonObject *desc;
+
+      node = json_array_get_element (metrics, i);
+      if (!JSON_NODE_HOLDS_OBJECT (node))
+        continue;
+      desc = json_node_get_object (node);
+
+      if (!cockpit_json_get_string (desc, "reduce", NULL, &reduce))
+        {
+          cockpit_channel_fail (channel, "protocol-error",
+                                "invalid \"reduce\" value: not a string");
+          return FALSE;
+        }
+      if (!cockpit_json_get_int (desc, "top", 0, &top) || top < 0 || top > G_MAXINT)
+        {
+          cockpit_channel_fail (channel, "protocol-error",
+                                "invalid \"top\" value: not a positive number");
+          return FALSE;
+        }
+      if (!cockpit_json_get_string (desc, "match", NULL, &match))
+        {
+          cockpit_channel_fail (channel, "protocol-error",
+                                "invalid \"match\" value: not a string");
+          return FALSE;
+        }
+
+      if (reduce && top > 0)
+        {
+          cockpit_channel_fail (channel, "protocol-error",
+                                "only one of \"reduce\" and \"top\" can be specified");
+          return FALSE;
+        }
+      else if (!reduce)
+        {
+          info->reduce = top > 0 ? REDUCE_TOP : REDUCE_NONE;
+          info->top = top;
+        }
+      else if (g_str_equal (reduce, "sum"))
+        {
+          info->reduce = REDUCE_SUM;
+        }
+      else
+        {
+          cockpit_channel_fail (channel, "protocol-error",
+                                "unsupported reduce function: %s", reduce);
+          return FALSE;
+        }
+
+      if (match)
+        info->match = g_pattern_spec_new (match);
+
+      info->reduced = info->reduce != REDUCE_NONE || info->match != NULL;
+      if (info->reduced)
+        self->priv->reducing = TRUE;
+    }
+
+  return TRUE;
+}
+
+static void
+update_candidates (CockpitMetrics *self,
+                   int metric,
+                   JsonArray *instances)
+{
+  MetricInfo *info = &self->priv->metric_info[metric];
+  gint n_instances = info->n_next_instances;
+  const gchar *name;
+
+  info->candidates = g_renew (gint, info->candidates, n_instances);
+  info->selected = g_renew (gint, info->selected, n_instances);
+  info->output = g_renew (double, info->output, MAX (n_instances, 1));
+  info->last_output = g_renew (double, info->last_output, MAX (n_instances, 1));
+
+  /* Which instances are matched only changes along with the meta */
+  info->n_candidates = 0;
+  for (int j = 0; j < n_instances; j++)
+    {
+      if (instances && info->match)
+        {
+          name = json_array_get_string_element (instances, j);
+          if (!name || !g_pattern_match_string (info->match, name))
+            continue;
+        }
+      info->candidates[info->n_candidates++] = j;
+    }
+
+  /* Different instances in the same places */
+  if (info->reduce != REDUCE_SUM)
+    info->output_valid = FALSE;
+}
+
 static gboolean
 update_for_meta (CockpitMetrics *self,
                  JsonObject *meta,
@@ -244,6 +412,8 @@ update_for_meta (CockpitMetrics *self,
   JsonArray *instances;
   guint length;
   gchar const *derive;
+  const gchar *binary;
+  JsonObject *options;
 
   array = json_object_get_array_member (meta, "metrics");
   g_return_val_if_fail (array != NULL, FALSE);
@@ -251,12 +421,30 @@ update_for_meta (CockpitMetrics *self,
 
   if (self->priv->metric_info == NULL)
     {
+      options = cockpit_channel_get_options (channel);
+      binary = NULL;
+      if (options && !cockpit_json_get_string (options, "binary", NULL, &binary))
+        {
+          cockpit_channel_fail (channel, "protocol-error", "invalid \"binary\" option");
+          return FALSE;
+        }
+      if (binary && !g_str_equal (binary, "raw"))
+        {
+          cockpit_channel_fail (channel, "protocol-error",
+                                "invalid \"binary\" option: %s", binary);
+          return FALSE;
+        }
+      self->priv->binary = (binary != NULL);
+
       self->priv->n_metrics = length;
       self->priv->metric_info = g_new0 (MetricInfo, length);
       self->priv->last_data = g_new0 (double *, length);
       self->priv->next_data = g_new0 (double *, length);
       self->priv->derived = g_new0 (double *, length);
 
+      if (!parse_reductions (self, options))
+        return FALSE;
+
       reset = TRUE;
     }
   else if (self->priv->n_metrics != length)
@@ -314,6 +502,9 @@ update_for_meta (CockpitMetrics *self,
           self->priv->metric_info[i].has_instances = FALSE;
           self->priv->metric_info[i].n_next_instances = 1;
         }
+
+      if (self->priv->metric_info[i].reduced)
+        update_candidates (self, i, instances);
     }
 
   realloc_next_buffer (self);
@@ -357,7 +548,13 @@ cockpit_metrics_send_meta (CockpitMetrics *self,
     json_object_unref (self->priv->next_meta);
   self->priv->next_meta = json_object_ref (meta);
 
-  if (update_for_meta (self, meta, reset))
+  if (!update_for_meta (self, meta, reset))
+    return;
+
+  /* Which instances we send only becomes clear with the data */
+  if (self->priv->reducing)
+    self->priv->output_meta_pending = TRUE;
+  else
     send_object (self, meta);
 }
 
@@ -400,14 +597,13 @@ push_array_at (JsonArray *array,
   return array;
 }
 
-static JsonArray *
-compute_and_maybe_push_value (CockpitMetrics *self,
-                              double interpol_r,
-                              int metric,
-                              int next_instance,
-                              int last_instance,
-                              JsonArray *array,
-                              int index)
+static gboolean
+compute_value (CockpitMetrics *self,
+               double interpol_r,
+               int metric,
+               int next_instance,
+               int last_instance,
+               double *value)
 {
   double val = self->priv->next_data[metric][next_instance];
 
@@ -439,22 +635,19 @@ compute_and_maybe_push_value (CockpitMetrics *self,
         val = NAN;
     }
 
+  *value = val;
+
+  /* Whether the value needs to be sent, or is the same as last time */
   if (self->priv->compress == FALSE
       || next_instance != last_instance
       || !self->priv->derived_valid
       || val != self->priv->derived[metric][next_instance])
     {
       self->priv->derived[metric][next_instance] = val;
-
-      JsonNode *node = json_node_new (JSON_NODE_VALUE);
-      if (!isnan (val))
-        json_node_set_double (node, val);
-      else
-        json_node_set_boolean (node, FALSE);
-      array = push_array_at (array, index, node);
+      return TRUE;
     }
 
-  return array;
+  return FALSE;
 }
 
 static int
@@ -500,6 +693,322 @@ find_last_instance (CockpitMetrics *self,
   return -1;
 }
 
+static gint
+compare_by_value_desc (gconstpointer a,
+                       gconstpointer b,
+                       gpointer user_data)
+{
+  const double *values = user_data;
+  double va = values[*(const gint *)a];
+  double vb = values[*(const gint *)b];
+
+  /* Missing values come last */
+  if (isnan (va))
+    return isnan (vb) ? 0 : 1;
+  if (isnan (vb))
+    return -1;
+  return (va < vb) - (va > vb);
+}
+
+static gint
+compare_index (gconstpointer a,
+               gconstpointer b)
+{
+  return *(const gint *)a - *(const gint *)b;
+}
+
+static void
+reduce_metric (CockpitMetrics *self,
+               double interpol_r,
+               int metric)
+{
+  MetricInfo *info = &self->priv->metric_info[metric];
+  double *values = self->priv->derived[metric];
+  double val, sum;
+  gboolean any;
+  int last;
+
+  /* Derive all instances first, the results are kept in 'derived' */
+  for (int j = 0; j < info->n_next_instances; j++)
+    {
+      if (info->has_instances)
+        last = find_last_instance (self, metric, j);
+      else
+        last = self->priv->meta_reset ? -1 : 0;
+      compute_value (self, interpol_r, metric, j, last, &val);
+    }
+
+  if (self->priv->meta_reset)
+    info->output_valid = FALSE;
+
+  if (info->reduce == REDUCE_SUM)
+    {
+      sum = 0;
+      any = FALSE;
+      for (int k = 0; k < info->n_candidates; k++)
+        {
+          val = values[info->candidates[k]];
+          if (!isnan (val))
+            {
+              sum += val;
+              any = TRUE;
+            }
+        }
+      info->output[0] = any ? sum : NAN;
+      info->n_output = 1;
+      return;
+    }
+
+  memcpy (info->selected, info->candidates, info->n_candidates * sizeof (gint));
+  info->n_output = info->n_candidates;
+
+  if (info->reduce == REDUCE_TOP && info->n_output > info->top)
+    {
+      g_qsort_with_data (info->selected, info->n_output, sizeof (gint),
+                         compare_by_value_desc, values);
+      info->n_output = info->top;
+
+      /* Keep the original order, so the meta only changes with the selection */
+      qsort (info->selected, info->n_output, sizeof (gint), compare_index);
+    }
+
+  for (int k = 0; k < info->n_output; k++)
+    info->output[k] = values[info->selected[k]];
+}
+
+static gboolean
+selection_changed (MetricInfo *info)
+{
+  if (info->reduce == REDUCE_SUM)
+    return FALSE;
+  return info->n_output != info->n_shown ||
+         (info->n_output > 0 && memcmp (info->selected, info->shown, info->n_output * sizeof (gint)) != 0);
+}
+
+static void
+copy_members (JsonObject *to,
+              JsonObject *from,
+              const gchar *skip1,
+              const gchar *skip2)
+{
+  GList *members, *l;
+
+  members = json_object_get_members (from);
+  for (l = members; l != NULL; l = g_list_next (l))
+    {
+      if (g_strcmp0 (l->data, skip1) != 0 && g_strcmp0 (l->data, skip2) != 0)
+        json_object_set_member (to, l->data, json_node_copy (json_object_get_member (from, l->data)));
+    }
+  g_list_free (members);
+}
+
+static void
+add_string_element (JsonArray *array,
+                    const gchar *string)
+{
+  /* json_array_add_string_element() turns empty strings into null */
+  JsonNode *node = json_node_alloc ();
+  json_node_init_string (node, string);
+  json_array_add_element (array, node);
+}
+
+static gboolean
+array_has_string (JsonArray *array,
+                  const gchar *string)
+{
+  for (guint i = 0; array && i < json_array_get_length (array); i++)
+    {
+      if (g_strcmp0 (json_array_get_string_element (array, i), string) == 0)
+        return TRUE;
+    }
+  return FALSE;
+}
+
+/*
+ * The meta as the client sees it: summed metrics lose their
+ * instances, and the others only list the selected ones.
+ */
+static JsonObject *
+build_output_meta (CockpitMetrics *self)
+{
+  JsonObject *meta = self->priv->next_meta;
+  JsonObject *output;
+  JsonArray *metrics;
+  JsonArray *output_metrics;
+  JsonObject *metric;
+  JsonObject *output_metric;
+  JsonArray *instances;
+  JsonArray *stale;
+  JsonArray *output_instances;
+  JsonArray *output_stale;
+  const gchar *name;
+
+  output = json_object_new ();
+  copy_members (output, meta, "metrics", NULL);
+
+  /* This meta might come later than the original one */
+  if (json_object_has_member (meta, "timestamp"))
+    json_object_set_int_member (output, "timestamp", self->priv->next_timestamp);
+  if (json_object_has_member (meta, "now"))
+    json_object_set_int_member (output, "now", g_get_real_time () / 1000);
+
+  metrics = json_object_get_array_member (meta, "metrics");
+  output_metrics = json_array_new ();
+  for (int i = 0; i < self->priv->n_metrics; i++)
+    {
+      MetricInfo *info = &self->priv->metric_info[i];
+
+      metric = json_array_get_object_element (metrics, i);
+      if (!info->reduced)
+        {
+          json_array_add_object_element (output_metrics, json_object_ref (metric));
+          continue;
+        }
+
+      output_metric = json_object_new ();
+      copy_members (output_metric, metric, "instances", "stale");
+
+      instances = json_object_has_member (metric, "instances") ?
+                  json_object_get_array_member (metric, "instances") : NULL;
+      if (instances && info->reduce != REDUCE_SUM)
+        {
+          stale = json_object_has_member (metric, "stale") ?
+                  json_object_get_array_member (metric, "stale") : NULL;
+          output_instances = json_array_new ();
+          output_stale = NULL;
+          for (int k = 0; k < info->n_output; k++)
+            {
+              name = json_array_get_string_element (instances, info->selected[k]);
+              add_string_element (output_instances, name);
+              if (array_has_string (stale, name))
+                {
+                  if (!output_stale)
+                    output_stale = json_array_new ();
+                  add_string_element (output_stale, name);
+                }
+            }
+          json_object_set_array_member (output_metric, "instances", output_instances);
+          if (output_stale)
+            json_object_set_array_member (output_metric, "stale", output_stale);
+        }
+
+      json_array_add_object_element (output_metrics, output_metric);
+    }
+
+  json_object_set_array_member (output, "metrics", output_metrics);
+  return output;
+}
+
+static void
+reduce_instances (CockpitMetrics *self,
+                  double interpol_r)
+{
+  gboolean changed = self->priv->output_meta_pending;
+  JsonObject *meta;
+
+  for (int i = 0; i < self->priv->n_metrics; i++)
+    {
+      MetricInfo *info = &self->priv->metric_info[i];
+      if (info->reduced)
+        {
+          reduce_metric (self, interpol_r, i);
+          if (selection_changed (info))
+            {
+              info->output_valid = FALSE;
+              changed = TRUE;
+            }
+        }
+    }
+
+  if (!changed)
+    return;
+
+  /* Queued data belongs to the previous meta */
+  cockpit_metrics_flush_data (self);
+
+  meta = build_output_meta (self);
+  send_object (self, meta);
+  json_object_unref (meta);
+
+  for (int i = 0; i < self->priv->n_metrics; i++)
+    {
+      MetricInfo *info = &self->priv->metric_info[i];
+      if (info->reduced && info->reduce != REDUCE_SUM)
+        {
+          info->shown = g_renew (gint, info->shown, MAX (info->n_output, 1));
+          memcpy (info->shown, info->selected, info->n_output * sizeof (gint));
+          info->n_shown = info->n_output;
+        }
+    }
+
+  self->priv->output_meta_pending = FALSE;
+}
+
+static gboolean
+output_has_instances (CockpitMetrics *self,
+                      int metric)
+{
+  MetricInfo *info = &self->priv->metric_info[metric];
+  return info->has_instances && info->reduce != REDUCE_SUM;
+}
+
+static int
+output_instances (CockpitMetrics *self,
+                  int metric)
+{
+  MetricInfo *info = &self->priv->metric_info[metric];
+  return info->reduced ? info->n_output : info->n_next_instances;
+}
+
+static gboolean
+output_value (CockpitMetrics *self,
+              double interpol_r,
+              int metric,
+              int instance,
+              double *value)
+{
+  MetricInfo *info = &self->priv->metric_info[metric];
+  int last;
+
+  if (info->reduced)
+    {
+      *value = info->output[instance];
+      if (self->priv->compress && info->output_valid && info->last_output[instance] == *value)
+        return FALSE;
+      info->last_output[instance] = *value;
+      return TRUE;
+    }
+
+  if (info->has_instances)
+    last = find_last_instance (self, metric, instance);
+  else
+    last = self->priv->meta_reset ? -1 : 0;
+  return compute_value (self, interpol_r, metric, instance, last, value);
+}
+
+static JsonArray *
+maybe_push_value (CockpitMetrics *self,
+                  double interpol_r,
+                  int metric,
+                  int instance,
+                  JsonArray *array,
+                  int index)
+{
+  double val;
+
+  if (output_value (self, interpol_r, metric, instance, &val))
+    {
+      JsonNode *node = json_node_new (JSON_NODE_VALUE);
+      if (!isnan (val))
+        json_node_set_double (node, val);
+      else
+        json_node_set_boolean (node, FALSE);
+      array = push_array_at (array, index, node);
+    }
+
+  return array;
+}
+
 static JsonArray *
 build_json_data (CockpitMetrics *self, double interpol_r)
 {
@@ -508,17 +1017,17 @@ build_json_data (CockpitMetrics *self, double interpol_r)
 
   for (int i = 0; i < self->priv->n_metrics; i++)
     {
-      if (self->priv->metric_info[i].has_instances)
+      if (output_has_instances (self, i))
         {
           JsonArray *res = NULL;
-          for (int j = 0; j < self->priv->metric_info[i].n_next_instances; j++)
-            res = compute_and_maybe_push_value (self, interpol_r, i, j, find_last_instance (self, i, j), res, j);
+          for (int j = 0; j < output_instances (self, i); j++)
+            res = maybe_push_value (self, interpol_r, i, j, res, j);
           node = json_node_new (JSON_NODE_ARRAY);
           json_node_take_array (node, res ? res : json_array_new ());
           output = push_array_at (output, i, node);
         }
       else
-        output = compute_and_maybe_push_value (self, interpol_r, i, 0, (self->priv->meta_reset? -1 : 0), output, i);
+        output = maybe_push_value (self, interpol_r, i, 0, output, i);
     }
 
   if (output == NULL)
@@ -526,6 +1035,66 @@ build_json_data (CockpitMetrics *self, double interpol_r)
   return output;
 }
 
+static void
+append_double_le (GByteArray *frames,
+                  double value)
+{
+  union { double d; guint64 u; } bits;
+
+  bits.d = value;
+  bits.u = GUINT64_TO_LE (bits.u);
+  g_byte_array_append (frames, (const guint8 *)&bits.u, sizeof (bits.u));
+}
+
+/*
+ * A point in time in a binary 'data' message:
+ *
+ *   float64  timestamp
+ *   uint32   number of values, N
+ *   bitmap   (N + 7) / 8 bytes, bit i set when value i is present
+ *   float64  each present value, in order
+ *
+ * All little endian. The values are those of all instances of the
+ * first metric, then of the second metric, and so on. Absent values
+ * are the same as at the previous point in time, just like "null" in
+ * the JSON encoding.
+ */
+static void
+build_binary_data (CockpitMetrics *self,
+                   double interpol_r,
+                   gint64 timestamp)
+{
+  guint32 n_values = 0;
+  guint32 count;
+  guint bitmap;
+  guint index;
+  double val;
+
+  for (int i = 0; i < self->priv->n_metrics; i++)
+    n_values += output_instances (self, i);
+
+  append_double_le (self->priv->frames, timestamp);
+  count = GUINT32_TO_LE (n_values);
+  g_byte_array_append (self->priv->frames, (const guint8 *)&count, sizeof (count));
+
+  bitmap = self->priv->frames->len;
+  g_byte_array_set_size (self->priv->frames, bitmap + (n_values + 7) / 8);
+  memset (self->priv->frames->data + bitmap, 0, (n_values + 7) / 8);
+
+  index = 0;
+  for (int i = 0; i < self->priv->n_metrics; i++)
+    {
+      for (int j = 0; j < output_instances (self, i); j++, index++)
+        {
+          if (output_value (self, interpol_r, i, j, &val))
+            {
+              self->priv->frames->data[bitmap + index / 8] |= 1 << (index % 8);
+              append_double_le (self->priv->frames, val);
+            }
+        }
+    }
+}
+
 double **
 cockpit_metrics_get_data_buffer (CockpitMetrics *self)
 {
@@ -546,9 +1115,6 @@ cockpit_metrics_send_data (CockpitMetrics *self, gint64 timestamp)
   JsonArray *res;
   double interpol_r = 1.0;
 
-  if (self->priv->message == NULL)
-    self->priv->message = json_array_new ();
-
   if (self->priv->interpolate && !self->priv->meta_reset)
     {
       double interval = ((double)(timestamp - self->priv->last_timestamp));
@@ -561,8 +1127,25 @@ cockpit_metrics_send_data (CockpitMetrics *self, gint64 timestamp)
 
   self->priv->next_timestamp = timestamp;
 
-  res = build_json_data (self, interpol_r);
-  json_array_add_array_element (self->priv->message, res);
+  if (self->priv->reducing)
+    reduce_instances (self, interpol_r);
+
+  if (self->priv->binary)
+    {
+      if (self->priv->frames == NULL)
+        {
+          self->priv->frames = g_byte_array_new ();
+          g_byte_array_append (self->priv->frames, (const guint8 *)"", 1);
+        }
+      build_binary_data (self, interpol_r, timestamp);
+    }
+  else
+    {
+      if (self->priv->message == NULL)
+        self->priv->message = json_array_new ();
+      res = build_json_data (self, interpol_r);
+      json_array_add_array_element (self->priv->message, res);
+    }
 
   /* Now setup for the next round by swapping buffers and then making
      sure that the new 'next' buffer has the right layout.
@@ -584,6 +1167,9 @@ cockpit_metrics_send_data (CockpitMetrics *self, gint64 timestamp)
       self->priv->last_meta = json_object_ref (self->priv->next_meta);
     }
 
+  for (int i = 0; i < self->priv->n_metrics; i++)
+    self->priv->metric_info[i].output_valid = TRUE;
+
   self->priv->derived_valid = TRUE;
   self->priv->last_timestamp = self->priv->next_timestamp;
   self->priv->meta_reset = FALSE;
@@ -592,12 +1178,22 @@ cockpit_metrics_send_data (CockpitMetrics *self, gint64 timestamp)
 void
 cockpit_metrics_flush_data (CockpitMetrics *self)
 {
+  GBytes *bytes;
+
   if (self->priv->message)
     {
       send_array (self, self->priv->message);
       json_array_unref (self->priv->message);
       self->priv->message = NULL;
     }
+
+  if (self->priv->frames)
+    {
+      bytes = g_byte_array_free_to_bytes (self->priv->frames);
+      self->priv->frames = NULL;
+      cockpit_channel_send (COCKPIT_CHANNEL (self), bytes, FALSE);
+      g_bytes_unref (bytes);
+    }
 }
 
 void
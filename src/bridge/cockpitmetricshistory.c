@@ -0,0 +1,436 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2018 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitmetricshistory.h"
+
+#include "cockpitcpusamples.h"
+#include "cockpitmemorysamples.h"
+#include "cockpitblocksamples.h"
+#include "cockpitnetworksamples.h"
+#include "cockpitdisksamples.h"
+
+#include <math.h>
+#include <string.h>
+#include <sys/time.h>
+
+/*
+ * Recent samples of the cheap internal metrics, kept in the bridge.
+ *
+ * While started, the samplers below run on every slot of the history
+ * interval, whether or not any channel is open, and their values are
+ * kept in a ring of a fixed number of slots. A metrics channel that asks
+ * for a "timestamp" in the past can then be backfilled from here before
+ * it starts live sampling.
+ *
+ * Memory is bounded: at most MAX_SERIES metric/instance pairs are kept,
+ * each with one double per slot. A series that has had no value for a
+ * whole ring is dropped again. A sampler that had series left out
+ * during the last ring doesn't backfill channels, since they would only
+ * get some of its instances.
+ *
+ * The bridge only enables the history. It starts with the first
+ * internal metrics channel, so a session that never shows a graph
+ * doesn't sample every second.
+ *
+ * This is only used from the main thread.
+ */
+
+#define MAX_SERIES 256
+
+static const CockpitSamplerFunc recorded[] = {
+  cockpit_cpu_samples,
+  cockpit_memory_samples,
+  cockpit_disk_samples,
+  cockpit_network_samples,
+  cockpit_block_samples,
+};
+
+typedef struct {
+  const gchar *metric;
+  gchar *instance;
+  guint64 last;
+  gdouble *values;
+} Series;
+
+#define COCKPIT_TYPE_HISTORY_RECORDER (cockpit_history_recorder_get_type ())
+
+typedef struct {
+  GObject parent;
+} CockpitHistoryRecorder;
+
+typedef struct {
+  GObjectClass parent_class;
+} CockpitHistoryRecorderClass;
+
+static GType cockpit_history_recorder_get_type (void) G_GNUC_CONST;
+
+static void cockpit_samples_interface_init (CockpitSamplesIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (CockpitHistoryRecorder, cockpit_history_recorder, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_SAMPLES,
+                                                cockpit_samples_interface_init))
+
+static struct {
+  CockpitSamples *recorder;
+  gint64 interval;
+  guint length;
+
+  /* The ring: slot and wall clock time of each position */
+  guint head;
+  guint count;
+  gint64 *slots;
+  gint64 *timestamps;
+
+  /* Series, a set keyed by metric and instance */
+  GHashTable *series;
+  gboolean full;
+  guint64 ticks;
+
+  /* The sampler being recorded, and the tick it last had series left out */
+  guint current;
+  guint64 lost[G_N_ELEMENTS (recorded)];
+
+  gint64 next;
+  guint timeout;
+
+  /* Started by cockpit_metrics_history_ensure() when enabled */
+  gint64 enabled_interval;
+  guint enabled_length;
+} history;
+
+static guint
+series_hash (gconstpointer v)
+{
+  const Series *series = v;
+  return g_str_hash (series->metric) ^ (series->instance ? g_str_hash (series->instance) : 0);
+}
+
+static gboolean
+series_equal (gconstpointer v1,
+              gconstpointer v2)
+{
+  const Series *s1 = v1;
+  const Series *s2 = v2;
+  return g_str_equal (s1->metric, s2->metric) && g_strcmp0 (s1->instance, s2->instance) == 0;
+}
+
+static void
+series_free (gpointer data)
+{
+  Series *series = data;
+  g_free (series->instance);
+  g_free (series->values);
+  g_free (series);
+}
+
+static void
+cockpit_history_recorder_init (CockpitHistoryRecorder *self)
+{
+}
+
+static void
+cockpit_history_recorder_class_init (CockpitHistoryRecorderClass *klass)
+{
+}
+
+static void
+cockpit_history_recorder_sample (CockpitSamples *samples,
+                                 const gchar *metric,
+                                 const gchar *instance,
+                                 gint64 value)
+{
+  Series key = { metric, (gchar *)instance, };
+  Series *series;
+  guint i;
+
+  series = g_hash_table_lookup (history.series, &key);
+  if (!series)
+    {
+      if (g_hash_table_size (history.series) >= MAX_SERIES)
+        {
+          if (!history.full)
+            g_debug ("metrics history is full, not recording %s %s", metric, instance ? instance : "");
+          history.full = TRUE;
+          history.lost[history.current] = history.ticks;
+          return;
+        }
+
+      /* Metric names are static */
+      series = g_new0 (Series, 1);
+      series->metric = metric;
+      series->instance = g_strdup (instance);
+      series->values = g_new (gdouble, history.length);
+      for (i = 0; i < history.length; i++)
+        series->values[i] = NAN;
+      g_hash_table_add (history.series, series);
+    }
+
+  series->values[history.head] = value;
+  series->last = history.ticks;
+}
+
+static void
+cockpit_samples_interface_init (CockpitSamplesIface *iface)
+{
+  iface->sample = cockpit_history_recorder_sample;
+}
+
+static gboolean
+series_expired (gpointer key,
+                gpointer value,
+                gpointer user_data)
+{
+  Series *series = key;
+  return history.ticks - series->last >= history.length;
+}
+
+static void
+record_slot (gint64 slot)
+{
+  GHashTableIter iter;
+  struct timeval now;
+  gpointer key;
+  guint i;
+
+  g_hash_table_iter_init (&iter, history.series);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    ((Series *)key)->values[history.head] = NAN;
+
+  gettimeofday (&now, NULL);
+  history.slots[history.head] = slot;
+  history.timestamps[history.head] = now.tv_sec * 1000 + now.tv_usec / 1000;
+
+  history.ticks++;
+  for (i = 0; i < G_N_ELEMENTS (recorded); i++)
+    {
+      history.current = i;
+      cockpit_samplers_run (recorded[i], slot, history.recorder);
+    }
+
+  if (g_hash_table_foreach_remove (history.series, series_expired, NULL) > 0)
+    history.full = FALSE;
+
+  history.head = (history.head + 1) % history.length;
+  if (history.count < history.length)
+    history.count++;
+}
+
+static gboolean
+on_history_tick (gpointer user_data)
+{
+  gint64 next_interval;
+
+  history.timeout = 0;
+
+  record_slot (history.next);
+
+  /* Same alignment as cockpit_metrics_metronome(), so that channels share the samples */
+  history.next += history.interval;
+  next_interval = history.next - g_get_monotonic_time () / 1000;
+  if (next_interval < 0)
+    {
+      /* We were not scheduled for a while, skip the missed slots */
+      history.next = g_get_monotonic_time () / 1000;
+      history.next -= history.next % history.interval;
+      history.next += history.interval;
+      next_interval = history.next - g_get_monotonic_time () / 1000;
+      if (next_interval < 0)
+        next_interval = 0;
+    }
+
+  history.timeout = g_timeout_add (next_interval, on_history_tick, NULL);
+  return FALSE;
+}
+
+/**
+ * cockpit_metrics_history_start:
+ * @interval: the history interval in milliseconds
+ * @length: the number of slots to keep
+ *
+ * Start recording the recent history of the cheap internal
+ * samplers. The first slot is recorded right away.
+ */
+void
+cockpit_metrics_history_start (gint64 interval,
+                               guint length)
+{
+  g_return_if_fail (interval > 0 && interval <= G_MAXUINT);
+  g_return_if_fail (length > 0);
+  g_return_if_fail (history.recorder == NULL);
+
+  history.recorder = g_object_new (COCKPIT_TYPE_HISTORY_RECORDER, NULL);
+  history.interval = interval;
+  history.length = length;
+  history.head = 0;
+  history.count = 0;
+  history.slots = g_new0 (gint64, length);
+  history.timestamps = g_new0 (gint64, length);
+  history.series = g_hash_table_new_full (series_hash, series_equal, series_free, NULL);
+  history.full = FALSE;
+  history.ticks = 0;
+  memset (history.lost, 0, sizeof (history.lost));
+
+  cockpit_samplers_subscribe ();
+
+  history.next = g_get_monotonic_time () / 1000;
+  history.next -= history.next % interval;
+  on_history_tick (NULL);
+}
+
+/**
+ * cockpit_metrics_history_enable:
+ * @interval: the history interval in milliseconds
+ * @length: the number of slots to keep
+ *
+ * Have cockpit_metrics_history_ensure() start recording the recent
+ * history, as in cockpit_metrics_history_start().
+ */
+void
+cockpit_metrics_history_enable (gint64 interval,
+                                guint length)
+{
+  g_return_if_fail (interval > 0 && interval <= G_MAXUINT);
+  g_return_if_fail (length > 0);
+
+  history.enabled_interval = interval;
+  history.enabled_length = length;
+}
+
+/**
+ * cockpit_metrics_history_ensure:
+ *
+ * Start recording the history if it has been enabled, and isn't
+ * being recorded yet. Called as metrics channels open.
+ */
+void
+cockpit_metrics_history_ensure (void)
+{
+  if (history.recorder == NULL && history.enabled_interval > 0)
+    cockpit_metrics_history_start (history.enabled_interval, history.enabled_length);
+}
+
+void
+cockpit_metrics_history_stop (void)
+{
+  history.enabled_interval = 0;
+  history.enabled_length = 0;
+
+  if (history.recorder == NULL)
+    return;
+
+  if (history.timeout)
+    g_source_remove (history.timeout);
+  history.timeout = 0;
+
+  cockpit_samplers_unsubscribe ();
+
+  g_hash_table_unref (history.series);
+  history.series = NULL;
+  g_free (history.slots);
+  history.slots = NULL;
+  g_free (history.timestamps);
+  history.timestamps = NULL;
+  g_object_unref (history.recorder);
+  history.recorder = NULL;
+}
+
+/**
+ * cockpit_metrics_history_covers:
+ * @func: a sampler
+ * @interval: the interval of a channel
+ *
+ * Returns: whether the history can backfill a channel that
+ *   uses @func every @interval milliseconds, with all its instances
+ */
+gboolean
+cockpit_metrics_history_covers (CockpitSamplerFunc func,
+                                gint64 interval)
+{
+  guint i;
+
+  if (history.recorder == NULL || interval % history.interval != 0)
+    return FALSE;
+
+  for (i = 0; i < G_N_ELEMENTS (recorded); i++)
+    {
+      if (recorded[i] == func)
+        return history.lost[i] == 0 || history.ticks - history.lost[i] >= history.length;
+    }
+
+  return FALSE;
+}
+
+/**
+ * cockpit_metrics_history_replay:
+ * @since: wall clock time in milliseconds of the earliest wanted point
+ * @before: the slot at which live sampling starts
+ * @interval: the interval of the channel
+ * @samples: receives the samples of each point
+ * @func: called after the samples of each point
+ * @user_data: passed to @func
+ *
+ * Replay the recorded points from @since onwards that fall on
+ * @interval, oldest first. Points at or after the @before slot are
+ * left to live sampling, so that nothing is sent twice.
+ *
+ * Returns: the number of points replayed
+ */
+guint
+cockpit_metrics_history_replay (gint64 since,
+                                gint64 before,
+                                gint64 interval,
+                                CockpitSamples *samples,
+                                CockpitMetricsHistoryFunc func,
+                                gpointer user_data)
+{
+  GHashTableIter iter;
+  Series *series;
+  gpointer key;
+  guint replayed = 0;
+  guint i, pos;
+
+  g_return_val_if_fail (interval > 0, 0);
+
+  if (history.recorder == NULL || interval % history.interval != 0)
+    return 0;
+
+  for (i = 0; i < history.count; i++)
+    {
+      pos = (history.head + history.length - history.count + i) % history.length;
+      if (history.timestamps[pos] < since || history.slots[pos] >= before ||
+          history.slots[pos] % interval != 0)
+        continue;
+
+      g_hash_table_iter_init (&iter, history.series);
+      while (g_hash_table_iter_next (&iter, &key, NULL))
+        {
+          series = key;
+          if (!isnan (series->values[pos]))
+            cockpit_samples_sample (samples, series->metric, series->instance,
+                                    (gint64)series->values[pos]);
+        }
+
+      (func) (history.timestamps[pos], user_data);
+      replayed++;
+    }
+
+  return replayed;
+}
@@ -0,0 +1,52 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2018 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COCKPIT_METRICS_HISTORY_H__
+#define COCKPIT_METRICS_HISTORY_H__
+
+#include "cockpitsamplers.h"
+
+G_BEGIN_DECLS
+
+typedef void    (* CockpitMetricsHistoryFunc)           (gint64 timestamp,
+                                                         gpointer user_data);
+
+void            cockpit_metrics_history_start           (gint64 interval,
+                                                         guint length);
+
+void            cockpit_metrics_history_enable          (gint64 interval,
+                                                         guint length);
+
+void            cockpit_metrics_history_ensure          (void);
+
+void            cockpit_metrics_history_stop            (void);
+
+gboolean        cockpit_metrics_history_covers          (CockpitSamplerFunc func,
+                                                         gint64 interval);
+
+guint           cockpit_metrics_history_replay          (gint64 since,
+                                                         gint64 before,
+                                                         gint64 interval,
+                                                         CockpitSamples *samples,
+                                                         CockpitMetricsHistoryFunc func,
+                                                         gpointer user_data);
+
+G_END_DECLS
+
+#endif /* COCKPIT_METRICS_HISTORY_H__ */
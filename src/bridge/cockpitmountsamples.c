@@ -20,75 +20,212 @@
 #include "config.h"
 
 #include "cockpitmountsamples.h"
+#include "cockpitprocfile.h"
 
-#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
 #include <string.h>
-#include <unistd.h>
-#include <math.h>
-#include <fts.h>
-#include <ctype.h>
 #include <sys/statvfs.h>
 
-void
-cockpit_mount_samples (CockpitSamples *samples)
-{
-  gchar *contents = NULL;
-  GError *error = NULL;
-  gchar **lines = NULL;
-  gchar *line;
-  gchar *esc_dir, *dir;
-  struct statvfs buf;
+/*
+ * statvfs() can hang for a long time on a network file system that
+ * isn't responding. So it's called from worker threads, with at most
+ * one call in flight for each mount. The main loop never waits for
+ * them: each tick reports the values from calls that have completed
+ * since, and starts new ones. A mount whose call from an earlier tick
+ * still hasn't returned is reported as stale, and isn't asked about
+ * again until it does.
+ *
+ * The mount table is only parsed again when /proc/mounts says it has
+ * changed, by way of poll() and POLLPRI.
+ */
+
+int (* cockpit_mount_statvfs) (const gchar *dir, struct statvfs *buf) = statvfs;
+
+typedef struct {
+  volatile gint refs;
+  gchar *dir;
+  gboolean present;
+  gboolean busy;
+
+  /* Only touched by the worker thread while busy */
+  gboolean valid;
   gint64 total;
-  gsize len;
-  guint n;
+  gint64 used;
+} Mount;
+
+static struct {
+  CockpitProcFile file;
+  GHashTable *table;
+  GThreadPool *pool;
+  GMainContext *context;
+} mounts = { COCKPIT_PROC_FILE_INIT ("mounts"), };
+
+static Mount *
+mount_ref (Mount *mount)
+{
+  g_atomic_int_inc (&mount->refs);
+  return mount;
+}
+
+static void
+mount_unref (gpointer data)
+{
+  Mount *mount = data;
 
-  if (!g_file_get_contents ("/proc/mounts", &contents, &len, &error))
+  if (g_atomic_int_dec_and_test (&mount->refs))
     {
-      g_message ("error loading contents /proc/mounts: %s", error->message);
-      g_error_free (error);
-      goto out;
+      g_free (mount->dir);
+      g_slice_free (Mount, mount);
     }
+}
+
+/* Runs in the main loop once a worker is done with a mount */
+static gboolean
+on_mount_done (gpointer data)
+{
+  Mount *mount = data;
+
+  mount->busy = FALSE;
+  mount_unref (mount);
+  return FALSE;
+}
+
+/* Runs in a worker thread */
+static void
+stat_mount (gpointer data,
+            gpointer user_data)
+{
+  Mount *mount = data;
+  struct statvfs buf;
+  gint64 frsize;
 
-  lines = g_strsplit (contents, "\n", -1);
-  for (n = 0; lines != NULL && lines[n] != NULL; n++)
+  mount->valid = (cockpit_mount_statvfs) (mount->dir, &buf) >= 0;
+  if (mount->valid)
     {
-      line = lines[n];
+      // We explicitly store the fragment size as 64 bits so that
+      // computations with it don't overflow on 32 bit
+      // architectures.
+
+      frsize = buf.f_frsize;
+      mount->total = frsize * buf.f_blocks;
+      mount->used = mount->total - frsize * buf.f_bfree;
+    }
+
+  g_main_context_invoke (mounts.context, on_mount_done, mount);
+}
+
+static gboolean
+mount_table_changed (void)
+{
+  struct pollfd pfd = { mounts.file.fd, POLLPRI, 0 };
+
+  /* Not open yet, or closed by cockpit_proc_file_close_all() */
+  if (!mounts.file.data || mounts.file.fd < 0)
+    return TRUE;
 
-      if (strlen (line) == 0)
+  if (poll (&pfd, 1, 0) < 0)
+    return TRUE;
+
+  return (pfd.revents & (POLLPRI | POLLERR)) != 0;
+}
+
+static void
+parse_mount_table (void)
+{
+  CockpitProcScanner scanner;
+  CockpitProcScanner line;
+  gchar device[PATH_MAX];
+  gchar escaped[PATH_MAX];
+  GHashTableIter iter;
+  Mount *mount;
+  gchar *dir;
+
+  if (!cockpit_proc_file_read (&mounts.file))
+    return;
+
+  g_hash_table_iter_init (&iter, mounts.table);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&mount))
+    mount->present = FALSE;
+
+  cockpit_proc_scanner_init (&scanner, &mounts.file);
+  while (cockpit_proc_scanner_line (&scanner, &line))
+    {
+      if (!cockpit_proc_scanner_word (&line, 0, device, sizeof (device)) ||
+          !cockpit_proc_scanner_word (&line, 0, escaped, sizeof (escaped)))
         continue;
 
       /* Only look at real devices
        */
-      if (line[0] != '/')
+      if (device[0] != '/')
         continue;
 
-      while (*line && !isspace (*line))
-        line++;
-      while (*line && isspace (*line))
-        line++;
-      esc_dir = line;
-      while (*line && !isspace (*line))
-        line++;
-      *line = '\0';
+      dir = g_strcompress (escaped);
+      mount = g_hash_table_lookup (mounts.table, dir);
+      if (mount)
+        {
+          g_free (dir);
+        }
+      else
+        {
+          mount = g_slice_new0 (Mount);
+          mount->refs = 1;
+          mount->dir = dir;
+          g_hash_table_insert (mounts.table, mount->dir, mount);
+        }
+      mount->present = TRUE;
+    }
+
+  g_hash_table_iter_init (&iter, mounts.table);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&mount))
+    {
+      if (!mount->present)
+        g_hash_table_iter_remove (&iter);
+    }
+}
+
+void
+cockpit_mount_samples (CockpitSamples *samples)
+{
+  GError *error = NULL;
+  GHashTableIter iter;
+  Mount *mount;
+
+  if (!mounts.pool)
+    {
+      /* Unlimited, since a hung thread only ever blocks its own mount */
+      mounts.pool = g_thread_pool_new (stat_mount, NULL, -1, FALSE, &error);
+      if (!mounts.pool)
+        {
+          g_message ("couldn't create thread pool for mounts: %s", error->message);
+          g_error_free (error);
+          return;
+        }
+      mounts.table = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, mount_unref);
+      mounts.context = g_main_context_ref_thread_default ();
+    }
+
+  if (mount_table_changed ())
+    parse_mount_table ();
 
-      dir = g_strcompress (esc_dir);
+  g_hash_table_iter_init (&iter, mounts.table);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&mount))
+    {
+      if (mount->busy)
+        {
+          cockpit_samples_stale (samples, "mount.total", mount->dir);
+          cockpit_samples_stale (samples, "mount.used", mount->dir);
+          continue;
+        }
 
-      if (statvfs (dir, &buf) >= 0)
+      if (mount->valid)
         {
-          // We explicitly store the fragment size as 64 bits so that
-          // computations with it don't overflow on 32 bit
-          // architectures.
-
-          gint64 frsize = buf.f_frsize;
-          total = frsize * buf.f_blocks;
-          cockpit_samples_sample (samples, "mount.total", dir, total);
-          cockpit_samples_sample (samples, "mount.used", dir, total - frsize * buf.f_bfree);
+          cockpit_samples_sample (samples, "mount.total", mount->dir, mount->total);
+          cockpit_samples_sample (samples, "mount.used", mount->dir, mount->used);
         }
 
-      g_free (dir);
+      mount->busy = TRUE;
+      g_thread_pool_push (mounts.pool, mount_ref (mount), NULL);
     }
-
- out:
-  g_strfreev (lines);
-  g_free (contents);
 }
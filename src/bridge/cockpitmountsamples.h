@@ -22,10 +22,15 @@
 
 #include "cockpitsamples.h"
 
+#include <sys/statvfs.h>
+
 G_BEGIN_DECLS
 
 void            cockpit_mount_samples         (CockpitSamples *samples);
 
+/* For testing */
+extern int   (* cockpit_mount_statvfs)        (const gchar *dir,
+                                               struct statvfs *buf);
 
 G_END_DECLS
 
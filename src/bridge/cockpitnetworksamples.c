@@ -21,41 +21,29 @@
 
 #include "cockpitnetworksamples.h"
 
-#include <stdio.h>
-#include <string.h>
-#include <unistd.h>
-
-/* TODO: this should be optimized so we don't allocate network and call open()/close() all the time */
+#include "cockpitprocfile.h"
 
 void
 cockpit_network_samples (CockpitSamples *samples)
 {
-  gchar *contents = NULL;
-  GError *error = NULL;
-  gchar **lines = NULL;
-  gsize len;
-  guint n;
-
+  static CockpitProcFile proc_net_dev = COCKPIT_PROC_FILE_INIT ("net/dev");
+  CockpitProcScanner scanner;
+  CockpitProcScanner line;
+  CockpitProcScanner whole;
+  gchar iface_name[64]; /* guaranteed to be max 16 chars */
+  guint64 bytes_rx;
+  guint64 bytes_tx;
   guint64 total_rx = 0;
   guint64 total_tx = 0;
+  guint n;
+  guint i;
 
-  if (!g_file_get_contents ("/proc/net/dev", &contents, &len, &error))
-    {
-      g_warning ("error loading contents /proc/net/dev: %s", error->message);
-      g_error_free (error);
-      goto out;
-    }
+  if (!cockpit_proc_file_read (&proc_net_dev))
+    return;
 
-  lines = g_strsplit (contents, "\n", -1);
-  for (n = 0; lines != NULL && lines[n] != NULL; n++)
+  cockpit_proc_scanner_init (&scanner, &proc_net_dev);
+  for (n = 0; cockpit_proc_scanner_line (&scanner, &line); n++)
     {
-      const gchar *line = lines[n];
-      gchar iface_name[64]; /* guaranteed to be max 16 chars */
-      guint64 bytes_rx, packets_rx, errors_rx, dropped_rx, fifo_rx, frame_rx, compressed_rx, multicast_rx;
-      guint64 bytes_tx, packets_tx, errors_tx, dropped_tx, fifo_tx, frame_tx, compressed_tx, multicast_tx;
-      gint num_parsed;
-      gchar *ptr;
-
       /* Format is
        *
        * Inter-|   Receive                                                |  Transmit
@@ -66,41 +54,36 @@ cockpit_network_samples (CockpitSamples *samples)
        * tap0:    7714      81    0    0    0     0          0         0     7714      81    0    0    0     0       0          0
        */
 
-      if (n < 2 || strlen (line) == 0)
+      if (n < 2 || line.pos == line.end)
         continue;
+      whole = line;
+
+      if (!cockpit_proc_scanner_word (&line, ':', iface_name, sizeof (iface_name)) ||
+          !cockpit_proc_scanner_uint64 (&line, &bytes_rx))
+        goto invalid;
 
-      num_parsed = sscanf (line,
-                           "%s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
-                           " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
-                           iface_name,
-                           &bytes_rx, &packets_rx, &errors_rx, &dropped_rx,
-                           &fifo_rx, &frame_rx, &compressed_rx, &multicast_rx,
-                           &bytes_tx, &packets_tx, &errors_tx, &dropped_tx,
-                           &fifo_tx, &frame_tx, &compressed_tx, &multicast_tx);
-      if (num_parsed != 17)
+      /* packets, errs, drop, fifo, frame, compressed, multicast */
+      for (i = 0; i < 7; i++)
         {
-          g_warning ("Error parsing line %d of file /proc/net/dev (num_parsed=%d): `%s'", n, num_parsed, line);
-          continue;
+          if (!cockpit_proc_scanner_uint64 (&line, NULL))
+            goto invalid;
         }
 
-      /* remove trailing ':' from interface name */
-      ptr = strrchr (iface_name, ':');
-      if (ptr)
-        *ptr = '\0';
+      if (!cockpit_proc_scanner_uint64 (&line, &bytes_tx))
+        goto invalid;
 
       cockpit_samples_sample (samples, "network.interface.rx", iface_name, bytes_rx);
       cockpit_samples_sample (samples, "network.interface.tx", iface_name, bytes_tx);
 
       total_rx += bytes_rx;
       total_tx += bytes_tx;
+      continue;
+
+invalid:
+      g_warning ("Error parsing line %d of file /proc/net/dev: `%.*s'",
+                 n, (int)(whole.end - whole.pos), whole.pos);
     }
 
   cockpit_samples_sample (samples, "network.all.rx", NULL, total_rx);
   cockpit_samples_sample (samples, "network.all.tx", NULL, total_tx);
-
-out:
-  g_strfreev (lines);
-  g_free (contents);
 }
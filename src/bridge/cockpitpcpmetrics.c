@@ -24,10 +24,12 @@
 #include "cockpitmetrics.h"
 #include "cockpitpcpmetrics.h"
 
+#include "common/cockpitflow.h"
 #include "common/cockpitjson.h"
 
 #include <pcp/pmapi.h>
 #include <math.h>
+#include <string.h>
 
 /**
  * CockpitPcpMetrics:
@@ -37,15 +39,35 @@
 
 #define COCKPIT_PCP_METRICS(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_PCP_METRICS, CockpitPcpMetrics))
 
+typedef enum {
+  AGGREGATE_MEAN,
+  AGGREGATE_MIN,
+  AGGREGATE_MAX
+} Aggregate;
+
+typedef struct {
+  gdouble sum;
+  gdouble min;
+  gdouble max;
+  gint count;
+  gdouble previous;
+} BucketValue;
+
 typedef struct {
   const gchar *name;
   const gchar *derive;
+  const gchar *aggregate_name;
+  Aggregate aggregate;
   pmID id;
   pmDesc desc;
   pmUnits *units;
   gdouble factor;
 
   pmUnits units_buf;
+
+  /* The bucket being filled, one value per instance */
+  BucketValue *bucket;
+  int n_bucket;
 } MetricInfo;
 
 typedef struct {
@@ -62,15 +84,67 @@ typedef struct {
   MetricInfo *metrics;
   gint64 interval;
   gint64 limit;
-  guint idler;
+
+  /* Downsampling of archives, several samples to a bucket */
+  gint64 buckets;
+  gint64 per_bucket;
+  gint64 bucket_fill;
+  gint64 bucket_timestamp;
+  gint64 previous_timestamp;
 
   GList *archives;  /* of ArchiveInfo */
   GList *cur_archive;
 
   /* The previous samples sent */
   pmResult *last;
+
+  /*
+   * Archives are read by archive_thread() with its own PCP contexts.
+   * It hands blocks of frames to the main loop through a short queue,
+   * and waits while the queue is full or the channel is throttled.
+   * Everything above is owned by the thread while it runs.
+   */
+  gboolean threaded;
+  gchar *archive_name;
+  gint64 archive_timestamp;
+  GThread *thread;
+  GMutex lock;
+  GCond cond;
+  GQueue *blocks;
+  gboolean cancelled;
+  gboolean dispatching;
+  gboolean pressure;
+
+  /* Layout of the rows built by the thread */
+  int *offsets;
+  int n_values;
+  double **row;
+
+  /* Why the thread stopped, sent after its last frames */
+  const gchar *problem;
+  gchar *message;
+
+  /* Layout of the last meta sent by the main loop */
+  int *counts;
+  guint n_counts;
+  gboolean ready;
 } CockpitPcpMetrics;
 
+typedef struct {
+  JsonObject *meta;
+  gboolean reset;
+  gint64 timestamp;
+  double *values;
+} Frame;
+
+typedef struct {
+  GArray *frames;
+  gboolean last;
+} Block;
+
+/* Number of blocks the thread reads ahead */
+#define MAX_BLOCKS 4
+
 typedef struct {
   CockpitMetricsClass parent_class;
 } CockpitPcpMetricsClass;
@@ -81,6 +155,74 @@ static void
 cockpit_pcp_metrics_init (CockpitPcpMetrics *self)
 {
   self->direct_context = -1;
+  g_mutex_init (&self->lock);
+  g_cond_init (&self->cond);
+  self->blocks = g_queue_new ();
+}
+
+static void
+block_free (gpointer data)
+{
+  Block *block = data;
+  Frame *frame;
+  guint i;
+
+  for (i = 0; i < block->frames->len; i++)
+    {
+      frame = &g_array_index (block->frames, Frame, i);
+      if (frame->meta)
+        json_object_unref (frame->meta);
+      g_free (frame->values);
+    }
+  g_array_free (block->frames, TRUE);
+  g_free (block);
+}
+
+/*
+ * Close the channel, failing it when there's a @message. In the archive
+ * thread this is remembered, and done once its frames have been sent.
+ */
+static void
+metrics_close (CockpitPcpMetrics *self,
+               const gchar *problem,
+               gchar *message)
+{
+  if (!self->threaded)
+    {
+      if (message)
+        cockpit_channel_fail (COCKPIT_CHANNEL (self), problem, "%s", message);
+      else
+        cockpit_channel_close (COCKPIT_CHANNEL (self), problem);
+      g_free (message);
+    }
+  else if (!self->problem && !self->message)
+    {
+      self->problem = problem;
+      self->message = message;
+    }
+  else
+    {
+      g_free (message);
+    }
+}
+
+static void
+metrics_fail (CockpitPcpMetrics *self,
+              const gchar *problem,
+              const gchar *format,
+              ...) G_GNUC_PRINTF (3, 4);
+
+static void
+metrics_fail (CockpitPcpMetrics *self,
+              const gchar *problem,
+              const gchar *format,
+              ...)
+{
+  va_list va;
+
+  va_start (va, format);
+  metrics_close (self, problem, g_strdup_vprintf (format, va));
+  va_end (va);
 }
 
 static gboolean
@@ -147,7 +289,10 @@ build_meta (CockpitPcpMetrics *self,
   root = json_object_new ();
   json_object_set_int_member (root, "timestamp", timestamp);
   json_object_set_int_member (root, "now", now);
-  json_object_set_int_member (root, "interval", self->interval);
+  if (self->buckets)
+    json_object_set_int_member (root, "interval", self->interval * self->per_bucket);
+  else
+    json_object_set_int_member (root, "interval", self->interval);
 
   metrics = json_array_new ();
   for (i = 0; i < result->numpmid; i++)
@@ -157,7 +302,11 @@ build_meta (CockpitPcpMetrics *self,
       /* Name and derivation mode
        */
       json_object_set_string_member (metric, "name", self->metrics[i].name);
-      if (self->metrics[i].derive)
+
+      /* When downsampling, derivation happens before aggregation, here */
+      if (self->buckets)
+        json_object_set_string_member (metric, "aggregate", self->metrics[i].aggregate_name);
+      else if (self->metrics[i].derive)
         json_object_set_string_member (metric, "derive", self->metrics[i].derive);
 
       /* Instances
@@ -252,9 +401,8 @@ build_meta_if_necessary (CockpitPcpMetrics *self,
   return build_meta (self, result);
 }
 
-static void
-build_sample (CockpitPcpMetrics *self,
-              double **buffer,
+static double
+sample_value (CockpitPcpMetrics *self,
               pmResult *result,
               int metric,
               int instance)
@@ -264,13 +412,11 @@ build_sample (CockpitPcpMetrics *self,
   pmValue *value = &result->vset[metric]->vlist[instance];
   pmAtomValue sample;
 
-  buffer[metric][instance] = NAN;
-
   if (info->desc.type == PM_TYPE_AGGREGATE || info->desc.type == PM_TYPE_EVENT)
-    return;
+    return NAN;
 
   if (result->vset[metric]->numval <= instance)
-    return;
+    return NAN;
 
   /* Make sure we keep the least 48 significant bits of 64 bit numbers
      since "delta" and "rate" derivation works on those, and the whole
@@ -280,42 +426,41 @@ build_sample (CockpitPcpMetrics *self,
   if (info->desc.type == PM_TYPE_64)
     {
       if (pmExtractValue (valfmt, value, PM_TYPE_64, &sample, PM_TYPE_64) < 0)
-        return;
+        return NAN;
 
       sample.d = (sample.ll << 16) >> 16;
     }
   else if (info->desc.type == PM_TYPE_U64)
     {
       if (pmExtractValue (valfmt, value, PM_TYPE_U64, &sample, PM_TYPE_U64) < 0)
-        return;
+        return NAN;
 
       sample.d = (sample.ull << 16) >> 16;
     }
   else
     {
       if (pmExtractValue (valfmt, value, info->desc.type, &sample, PM_TYPE_DOUBLE) < 0)
-        return;
+        return NAN;
     }
 
   if (info->units != &info->desc.units)
     {
       if (pmConvScale (PM_TYPE_DOUBLE, &sample, &info->desc.units, &sample, info->units) < 0)
-        return;
+        return NAN;
       sample.d *= info->factor;
     }
 
-  buffer[metric][instance] = sample.d;
+  return sample.d;
 }
 
 static void
 build_samples (CockpitPcpMetrics *self,
+               double **buffer,
                pmResult *result)
 {
-  double **buffer;
   pmValueSet *vs;
   int i, j;
 
-  buffer = cockpit_metrics_get_data_buffer (COCKPIT_METRICS (self));
   for (i = 0; i < result->numpmid; i++)
     {
       vs = result->vset[i];
@@ -323,18 +468,143 @@ build_samples (CockpitPcpMetrics *self,
       /* When negative numval is an error code ... we don't care */
       if (vs->numval < 0)
         {
-          ;
+          buffer[i][0] = NAN;
         }
       else if (self->metrics[i].desc.indom == PM_INDOM_NULL)
         {
-          build_sample (self, buffer, result, i, 0);
+          buffer[i][0] = sample_value (self, result, i, 0);
         }
       else
         {
           for (j = 0; j < vs->numval; j++)
-            build_sample (self, buffer, result, i, j);
+            buffer[i][j] = sample_value (self, result, i, j);
+        }
+    }
+}
+
+static int
+instance_count (CockpitPcpMetrics *self,
+                pmResult *result,
+                int metric)
+{
+  /* The same as the instances in the meta message */
+  if (result->vset[metric]->numval < 0 || self->metrics[metric].desc.indom == PM_INDOM_NULL)
+    return 1;
+  return result->vset[metric]->numval;
+}
+
+static void
+clear_bucket (MetricInfo *info)
+{
+  for (int j = 0; j < info->n_bucket; j++)
+    {
+      info->bucket[j].sum = 0;
+      info->bucket[j].min = INFINITY;
+      info->bucket[j].max = -INFINITY;
+      info->bucket[j].count = 0;
+    }
+}
+
+static void
+reset_buckets (CockpitPcpMetrics *self,
+               pmResult *result)
+{
+  int i, j;
+
+  /* A new layout of instances, as sent in the last meta message */
+  for (i = 0; i < result->numpmid; i++)
+    {
+      MetricInfo *info = &self->metrics[i];
+
+      info->n_bucket = instance_count (self, result, i);
+
+      g_free (info->bucket);
+      info->bucket = g_new (BucketValue, info->n_bucket);
+      for (j = 0; j < info->n_bucket; j++)
+        info->bucket[j].previous = NAN;
+      clear_bucket (info);
+    }
+
+  /* Rates start over with the next sample */
+  self->bucket_fill = 0;
+  self->previous_timestamp = 0;
+}
+
+static void
+accumulate_samples (CockpitPcpMetrics *self,
+                    pmResult *result)
+{
+  gint64 timestamp = timestamp_from_timeval (&result->timestamp);
+  double value, previous;
+  int i, j;
+
+  for (i = 0; i < result->numpmid; i++)
+    {
+      MetricInfo *info = &self->metrics[i];
+      for (j = 0; j < info->n_bucket; j++)
+        {
+          BucketValue *bv = &info->bucket[j];
+
+          value = sample_value (self, result, i, j);
+          if (info->derive)
+            {
+              previous = bv->previous;
+              bv->previous = value;
+              if (g_str_equal (info->derive, "delta"))
+                value = value - previous;
+              else if (self->previous_timestamp == 0 || timestamp <= self->previous_timestamp)
+                value = NAN;
+              else
+                value = (value - previous) / (timestamp - self->previous_timestamp) * 1000;
+            }
+
+          if (!isnan (value))
+            {
+              bv->sum += value;
+              bv->min = MIN (bv->min, value);
+              bv->max = MAX (bv->max, value);
+              bv->count++;
+            }
         }
     }
+
+  if (self->bucket_fill++ == 0)
+    self->bucket_timestamp = timestamp;
+  self->previous_timestamp = timestamp;
+}
+
+static double **add_frame (CockpitPcpMetrics *self, Block *block, gint64 timestamp);
+
+static void
+send_bucket (CockpitPcpMetrics *self,
+             Block *block)
+{
+  double **buffer;
+  int i, j;
+
+  if (self->bucket_fill == 0)
+    return;
+
+  buffer = add_frame (self, block, self->bucket_timestamp);
+  for (i = 0; i < self->numpmid; i++)
+    {
+      MetricInfo *info = &self->metrics[i];
+      for (j = 0; j < info->n_bucket; j++)
+        {
+          BucketValue *bv = &info->bucket[j];
+          if (bv->count == 0)
+            buffer[i][j] = NAN;
+          else if (info->aggregate == AGGREGATE_MIN)
+            buffer[i][j] = bv->min;
+          else if (info->aggregate == AGGREGATE_MAX)
+            buffer[i][j] = bv->max;
+          else
+            buffer[i][j] = bv->sum / bv->count;
+        }
+      clear_bucket (info);
+    }
+
+  self->bucket_fill = 0;
 }
 
 static void
@@ -365,7 +635,7 @@ cockpit_pcp_metrics_tick (CockpitMetrics *metrics,
     }
 
   /* Send one set of samples */
-  build_samples (self, result);
+  build_samples (self, cockpit_metrics_get_data_buffer (metrics), result);
   cockpit_metrics_send_data (metrics, timestamp_from_timeval (&result->timestamp));
   cockpit_metrics_flush_data (metrics);
 
@@ -374,13 +644,51 @@ cockpit_pcp_metrics_tick (CockpitMetrics *metrics,
   self->last = result;
 }
 
-static void next_archive (CockpitPcpMetrics *self);
+static gboolean next_archive (CockpitPcpMetrics *self);
+
+static double **
+add_frame (CockpitPcpMetrics *self,
+           Block *block,
+           gint64 timestamp)
+{
+  Frame frame = { NULL, FALSE, timestamp, NULL };
+  int i;
+
+  frame.values = g_new (double, self->n_values);
+  for (i = 0; i < self->numpmid; i++)
+    self->row[i] = frame.values + self->offsets[i];
+
+  g_array_append_val (block->frames, frame);
+  return self->row;
+}
+
+static void
+add_meta_frame (CockpitPcpMetrics *self,
+                Block *block,
+                JsonObject *meta,
+                gboolean reset,
+                pmResult *result)
+{
+  Frame frame = { meta, reset, 0, NULL };
+  int i;
 
+  g_array_append_val (block->frames, frame);
+
+  /* Rows from here on have the instances of this meta */
+  self->n_values = 0;
+  for (i = 0; i < self->numpmid; i++)
+    {
+      self->offsets[i] = self->n_values;
+      self->n_values += instance_count (self, result, i);
+    }
+}
+
+/* Returns FALSE when there's nothing more to read */
 static gboolean
-on_idle_batch (gpointer user_data)
+read_archive_batch (CockpitPcpMetrics *self,
+                    Block *block)
 {
   const int archive_batch = 60;
-  CockpitPcpMetrics *self = user_data;
   ArchiveInfo *info;
   JsonObject *meta;
   pmResult *result;
@@ -389,9 +697,11 @@ on_idle_batch (gpointer user_data)
 
   info = (ArchiveInfo *)(self->cur_archive->data);
 
-  if (pmUseContext (info->context) < 0)
+  rc = pmUseContext (info->context);
+  if (rc < 0)
     {
-      self->idler = 0;
+      metrics_fail (self, "internal-error",
+                    "%s: couldn't switch pcp context: %s", self->name, pmErrStr (rc));
       return FALSE;
     }
 
@@ -401,50 +711,237 @@ on_idle_batch (gpointer user_data)
       self->limit--;
       if (self->limit < 0)
         {
-          cockpit_metrics_flush_data (COCKPIT_METRICS (self));
-          cockpit_channel_close (COCKPIT_CHANNEL (self), NULL);
-          self->idler = 0;
+          send_bucket (self, block);
           return FALSE;
         }
 
       rc = pmFetch (self->numpmid, self->pmidlist, &result);
       if (rc < 0)
         {
-          self->idler = 0;
-
           if (rc == PM_ERR_EOL)
             {
-              cockpit_metrics_flush_data (COCKPIT_METRICS (self));
-              next_archive (self);
-            }
-          else
-            {
-              cockpit_channel_fail (COCKPIT_CHANNEL (self), "internal-error",
-                                    "%s: couldn't read from archive: %s", self->name, pmErrStr (rc));
+              send_bucket (self, block);
+              return next_archive (self);
             }
 
+          metrics_fail (self, "internal-error",
+                        "%s: couldn't read from archive: %s", self->name, pmErrStr (rc));
           return FALSE;
         }
 
       meta = build_meta_if_necessary (self, result);
       if (meta)
         {
-          cockpit_metrics_send_meta (COCKPIT_METRICS (self), meta, self->last == NULL);
-          json_object_unref (meta);
+          /* The bucket so far belongs to the previous set of instances */
+          if (self->buckets)
+            send_bucket (self, block);
+          add_meta_frame (self, block, meta, self->last == NULL, result);
+          if (self->buckets)
+            reset_buckets (self, result);
         }
 
-      build_samples (self, result);
-      cockpit_metrics_send_data (COCKPIT_METRICS (self), timestamp_from_timeval (&result->timestamp));
+      if (self->buckets)
+        {
+          accumulate_samples (self, result);
+          if (self->bucket_fill == self->per_bucket)
+            send_bucket (self, block);
+        }
+      else
+        {
+          build_samples (self, add_frame (self, block, timestamp_from_timeval (&result->timestamp)), result);
+        }
 
       if (self->last)
         pmFreeResult (self->last);
       self->last = result;
     }
 
-  cockpit_metrics_flush_data (COCKPIT_METRICS (self));
   return TRUE;
 }
 
+static void
+send_block (CockpitPcpMetrics *self,
+            Block *block)
+{
+  CockpitMetrics *metrics = COCKPIT_METRICS (self);
+  CockpitChannel *channel = COCKPIT_CHANNEL (self);
+  JsonArray *array;
+  JsonObject *info;
+  double **buffer;
+  Frame *frame;
+  guint i, j, offset;
+
+  /* Only ready once some archive could be read */
+  if (!self->ready && !(block->last && block->frames->len == 0))
+    {
+      cockpit_channel_ready (channel, NULL);
+      self->ready = TRUE;
+    }
+
+  for (i = 0; i < block->frames->len; i++)
+    {
+      frame = &g_array_index (block->frames, Frame, i);
+      if (frame->meta)
+        {
+          cockpit_metrics_send_meta (metrics, frame->meta, frame->reset);
+
+          array = json_object_get_array_member (frame->meta, "metrics");
+          g_free (self->counts);
+          self->n_counts = json_array_get_length (array);
+          self->counts = g_new (int, self->n_counts);
+          for (j = 0; j < self->n_counts; j++)
+            {
+              info = json_array_get_object_element (array, j);
+              if (json_object_has_member (info, "instances"))
+                self->counts[j] = json_array_get_length (json_object_get_array_member (info, "instances"));
+              else
+                self->counts[j] = 1;
+            }
+        }
+      else
+        {
+          buffer = cockpit_metrics_get_data_buffer (metrics);
+          offset = 0;
+          for (j = 0; j < self->n_counts; j++)
+            {
+              memcpy (buffer[j], frame->values + offset, self->counts[j] * sizeof (double));
+              offset += self->counts[j];
+            }
+          cockpit_metrics_send_data (metrics, frame->timestamp);
+        }
+    }
+
+  cockpit_metrics_flush_data (metrics);
+
+  if (block->last)
+    {
+      if (self->message)
+        cockpit_channel_fail (channel, self->problem, "%s", self->message);
+      else
+        cockpit_channel_close (channel, self->problem);
+    }
+}
+
+static gboolean
+on_archive_blocks (gpointer user_data)
+{
+  CockpitPcpMetrics *self = user_data;
+  Block *block = NULL;
+
+  /* One block per main loop iteration, and none while throttled */
+  g_mutex_lock (&self->lock);
+  if (!self->cancelled && !self->pressure)
+    block = g_queue_pop_head (self->blocks);
+  if (block)
+    g_cond_signal (&self->cond);
+  else
+    self->dispatching = FALSE;
+  g_mutex_unlock (&self->lock);
+
+  if (!block)
+    return FALSE;
+
+  send_block (self, block);
+  block_free (block);
+  return TRUE;
+}
+
+/* Called with the lock held */
+static void
+dispatch_blocks (CockpitPcpMetrics *self)
+{
+  if (!self->dispatching && !self->pressure && !g_queue_is_empty (self->blocks))
+    {
+      self->dispatching = TRUE;
+      g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, on_archive_blocks,
+                       g_object_ref (self), g_object_unref);
+    }
+}
+
+static void
+on_pressure (CockpitFlow *flow,
+             gboolean throttle,
+             gpointer user_data)
+{
+  CockpitPcpMetrics *self = user_data;
+
+  g_mutex_lock (&self->lock);
+  self->pressure = throttle;
+  dispatch_blocks (self);
+  g_mutex_unlock (&self->lock);
+}
+
+static void
+stop_archive_thread (CockpitPcpMetrics *self)
+{
+  g_mutex_lock (&self->lock);
+  self->cancelled = TRUE;
+  g_cond_broadcast (&self->cond);
+  g_mutex_unlock (&self->lock);
+}
+
+static void
+on_closed (CockpitChannel *channel,
+           const gchar *problem,
+           gpointer user_data)
+{
+  stop_archive_thread (user_data);
+}
+
+/* Waits while the queue is full. Returns FALSE when cancelled */
+static gboolean
+push_block (CockpitPcpMetrics *self,
+            Block *block)
+{
+  gboolean pushed = FALSE;
+
+  g_mutex_lock (&self->lock);
+  while (!self->cancelled && g_queue_get_length (self->blocks) >= MAX_BLOCKS)
+    g_cond_wait (&self->cond, &self->lock);
+  if (!self->cancelled)
+    {
+      g_queue_push_tail (self->blocks, block);
+      dispatch_blocks (self);
+      pushed = TRUE;
+    }
+  g_mutex_unlock (&self->lock);
+
+  if (!pushed)
+    block_free (block);
+  return pushed;
+}
+
+static void free_archives (CockpitPcpMetrics *self);
+static gboolean prepare_archives (CockpitPcpMetrics *self, const gchar *name, gint64 timestamp);
+
+static gpointer
+archive_thread (gpointer data)
+{
+  CockpitPcpMetrics *self = data;
+  gboolean more;
+  Block *block;
+
+  /*
+   * This reads ahead of the main loop, including into the next
+   * archive, while the blocks before are still being sent.
+   */
+  more = prepare_archives (self, self->archive_name, self->archive_timestamp);
+  for (;;)
+    {
+      block = g_new0 (Block, 1);
+      block->frames = g_array_new (FALSE, FALSE, sizeof (Frame));
+      if (more)
+        more = read_archive_batch (self, block);
+      block->last = !more;
+      if (!push_block (self, block) || !more)
+        break;
+    }
+
+  /* The PCP contexts are used from this thread only */
+  free_archives (self);
+  return NULL;
+}
+
 static gboolean
 units_equal (pmUnits *a,
              pmUnits *b)
@@ -473,7 +970,6 @@ convert_metric_description (CockpitPcpMetrics *self,
                             int index,
                             gboolean *not_found)
 {
-  CockpitChannel *channel = COCKPIT_CHANNEL (self);
   const gchar *units;
   char *errmsg;
   int rc;
@@ -483,33 +979,61 @@ convert_metric_description (CockpitPcpMetrics *self,
       if (!cockpit_json_get_string (json_node_get_object (node), "name", NULL, &info->name)
           || info->name == NULL)
         {
-          cockpit_channel_fail (channel, "protocol-error",
-                                "%s: invalid \"metrics\" option was specified (no name for metric %d)",
-                                self->name, index);
+          metrics_fail (self, "protocol-error",
+                        "%s: invalid \"metrics\" option was specified (no name for metric %d)",
+                        self->name, index);
           return FALSE;
         }
 
       if (!cockpit_json_get_string (json_node_get_object (node), "units", NULL, &units))
         {
-          cockpit_channel_fail (channel, "protocol-error",
-                                "%s: invalid units for metric %s (not a string)",
-                                self->name, info->name);
+          metrics_fail (self, "protocol-error",
+                        "%s: invalid units for metric %s (not a string)",
+                        self->name, info->name);
           return FALSE;
         }
 
       if (!cockpit_json_get_string (json_node_get_object (node), "derive", NULL, &info->derive))
         {
-          cockpit_channel_fail (channel, "protocol-error",
-                                "%s: invalid derivation mode for metric %s (not a string)",
-                                self->name, info->name);
+          metrics_fail (self, "protocol-error",
+                        "%s: invalid derivation mode for metric %s (not a string)",
+                        self->name, info->name);
+          return FALSE;
+        }
+      if (self->buckets && info->derive &&
+          !g_str_equal (info->derive, "delta") && !g_str_equal (info->derive, "rate"))
+        {
+          metrics_fail (self, "protocol-error",
+                        "%s: unsupported derive function: %s", self->name, info->derive);
+          return FALSE;
+        }
+
+      if (!cockpit_json_get_string (json_node_get_object (node), "aggregate", "mean", &info->aggregate_name))
+        {
+          metrics_fail (self, "protocol-error",
+                        "%s: invalid aggregate for metric %s (not a string)",
+                        self->name, info->name);
+          return FALSE;
+        }
+      if (g_str_equal (info->aggregate_name, "mean"))
+        info->aggregate = AGGREGATE_MEAN;
+      else if (g_str_equal (info->aggregate_name, "min"))
+        info->aggregate = AGGREGATE_MIN;
+      else if (g_str_equal (info->aggregate_name, "max"))
+        info->aggregate = AGGREGATE_MAX;
+      else
+        {
+          metrics_fail (self, "protocol-error",
+                        "%s: unsupported aggregate for metric %s: %s",
+                        self->name, info->name, info->aggregate_name);
           return FALSE;
         }
     }
   else
     {
-      cockpit_channel_fail (channel, "protocol-error",
-                            "%s: invalid \"metrics\" option was specified (not an object for metric %d)",
-                            self->name, index);
+      metrics_fail (self, "protocol-error",
+                    "%s: invalid \"metrics\" option was specified (not an object for metric %d)",
+                    self->name, index);
       return FALSE;
     }
 
@@ -523,8 +1047,8 @@ convert_metric_description (CockpitPcpMetrics *self,
         }
       else
         {
-          cockpit_channel_fail (channel, "not-found",
-                                "%s: no such metric: %s: %s", self->name, info->name, pmErrStr (rc));
+          metrics_fail (self, "not-found",
+                        "%s: no such metric: %s: %s", self->name, info->name, pmErrStr (rc));
         }
       return FALSE;
     }
@@ -538,8 +1062,8 @@ convert_metric_description (CockpitPcpMetrics *self,
         }
       else
         {
-          cockpit_channel_fail (channel, "not-found",
-                                "%s: no such metric: %s: %s", self->name, info->name, pmErrStr (rc));
+          metrics_fail (self, "not-found",
+                        "%s: no such metric: %s: %s", self->name, info->name, pmErrStr (rc));
         }
       return FALSE;
     }
@@ -548,16 +1072,16 @@ convert_metric_description (CockpitPcpMetrics *self,
     {
       if (pmParseUnitsStr (units, &info->units_buf, &info->factor, &errmsg) < 0)
         {
-          cockpit_channel_fail (channel, "protocol-error",
-                                "%s: failed to parse units %s: %s", self->name, units, errmsg);
+          metrics_fail (self, "protocol-error",
+                        "%s: failed to parse units %s: %s", self->name, units, errmsg);
           free (errmsg);
           return FALSE;
         }
 
       if (!units_convertible (&info->desc.units, &info->units_buf))
         {
-          cockpit_channel_fail (channel, "protocol-error",
-                                "%s: can't convert metric %s to units %s", self->name, info->name, units);
+          metrics_fail (self, "protocol-error",
+                        "%s: can't convert metric %s to units %s", self->name, info->name, units);
           return FALSE;
         }
 
@@ -574,6 +1098,15 @@ convert_metric_description (CockpitPcpMetrics *self,
   return TRUE;
 }
 
+static void
+free_metrics (CockpitPcpMetrics *self)
+{
+  for (int i = 0; i < self->numpmid; i++)
+    g_free (self->metrics[i].bucket);
+  g_free (self->metrics);
+  self->metrics = NULL;
+}
+
 static gboolean
 prepare_current_context (CockpitPcpMetrics *self,
                          gboolean *not_found)
@@ -586,11 +1119,10 @@ prepare_current_context (CockpitPcpMetrics *self,
   gboolean ret = FALSE;
   int i;
 
-  g_free (self->metrics);
+  free_metrics (self);
   g_free (self->pmidlist);
 
   self->numpmid = 0;
-  self->metrics = NULL;
   self->pmidlist = NULL;
 
   options = cockpit_channel_get_options (channel);
@@ -598,24 +1130,24 @@ prepare_current_context (CockpitPcpMetrics *self,
   /* "instances" option */
   if (!cockpit_json_get_strv (options, "instances", NULL, (gchar ***)&instances))
     {
-      cockpit_channel_fail (channel, "protocol-error",
-                            "%s: invalid \"instances\" option (not an array of strings)", self->name);
+      metrics_fail (self, "protocol-error",
+                    "%s: invalid \"instances\" option (not an array of strings)", self->name);
       goto out;
     }
 
   /* "omit-instances" option */
   if (!cockpit_json_get_strv (options, "omit-instances", NULL, (gchar ***)&omit_instances))
     {
-      cockpit_channel_fail (channel, "protocol-error",
-                            "%s: invalid \"omit-instances\" option (not an array of strings)", self->name);
+      metrics_fail (self, "protocol-error",
+                    "%s: invalid \"omit-instances\" option (not an array of strings)", self->name);
       goto out;
     }
 
   /* "metrics" option */
   if (!cockpit_json_get_array (options, "metrics", NULL, &metrics))
     {
-      cockpit_channel_fail (channel, "protocol-error",
-                            "%s: invalid \"metrics\" option was specified (not an array)", self->name);
+      metrics_fail (self, "protocol-error",
+                    "%s: invalid \"metrics\" option was specified (not an array)", self->name);
       goto out;
     }
   if (metrics)
@@ -664,7 +1196,7 @@ prepare_current_context (CockpitPcpMetrics *self,
   return ret;
 }
 
-static void start_archive (CockpitPcpMetrics *self, gint64 timestamp);
+static gboolean start_archive (CockpitPcpMetrics *self, gint64 timestamp);
 
 static gboolean
 add_archive (CockpitPcpMetrics *self,
@@ -681,13 +1213,13 @@ add_archive (CockpitPcpMetrics *self,
       if (info->context == -ENOENT)
         {
           g_debug ("%s: couldn't find pcp archive for %s", self->name, name);
-          cockpit_channel_close (COCKPIT_CHANNEL (self), "not-found");
+          metrics_close (self, "not-found", NULL);
         }
       else
         {
-          cockpit_channel_fail (COCKPIT_CHANNEL (self), "internal-error",
-                                "%s: couldn't create pcp archive context for %s: %s",
-                                self->name, name, pmErrStr (info->context));
+          metrics_fail (self, "internal-error",
+                        "%s: couldn't create pcp archive context for %s: %s",
+                        self->name, name, pmErrStr (info->context));
         }
       g_free (info);
       return FALSE;
@@ -696,9 +1228,9 @@ add_archive (CockpitPcpMetrics *self,
   rc = pmGetArchiveLabel (&label);
   if (rc < 0)
     {
-      cockpit_channel_fail (COCKPIT_CHANNEL (self), "internal-error",
-                            "%s: couldn't read archive label of %s: %s",
-                            self->name, name, pmErrStr (rc));
+      metrics_fail (self, "internal-error",
+                    "%s: couldn't read archive label of %s: %s",
+                    self->name, name, pmErrStr (rc));
       pmDestroyContext (info->context);
       g_free (info);
       return FALSE;
@@ -760,8 +1292,8 @@ prepare_archives (CockpitPcpMetrics *self,
     }
   else
     {
-      cockpit_channel_fail (COCKPIT_CHANNEL (self), "internal-error",
-                            "%s: %s", name, error->message);
+      metrics_fail (self, "internal-error",
+                    "%s: %s", name, error->message);
       ret = FALSE;
     }
 
@@ -770,22 +1302,25 @@ prepare_archives (CockpitPcpMetrics *self,
   if (self->archives == NULL)
     {
       if (ret)
-        cockpit_channel_close (COCKPIT_CHANNEL (self), "not-found");
+        metrics_close (self, "not-found", NULL);
+      return FALSE;
+    }
+  else if (!ret)
+    {
       return FALSE;
     }
 
   self->archives = g_list_sort (self->archives, cmp_archive_start);
 
   self->cur_archive = self->archives;
-  start_archive (self, timestamp);
-  return TRUE;
+  return start_archive (self, timestamp);
 }
 
-static void
+/* Returns FALSE when there's nothing to read */
+static gboolean
 start_archive (CockpitPcpMetrics *self,
                gint64 timestamp)
 {
-  CockpitChannel *channel = COCKPIT_CHANNEL (self);
   ArchiveInfo *info;
   struct timeval stamp;
   gboolean not_found;
@@ -797,10 +1332,7 @@ start_archive (CockpitPcpMetrics *self,
 
  again:
   if (self->cur_archive == NULL)
-    {
-      cockpit_channel_close (channel, NULL);
-      return;
-    }
+    return FALSE;
 
   info = self->cur_archive->data;
 
@@ -813,17 +1345,17 @@ start_archive (CockpitPcpMetrics *self,
   rc = pmUseContext (info->context);
   if (rc < 0)
     {
-      cockpit_channel_fail (channel, "internal-error",
-                            "%s: couldn't switch pcp context: %s", self->name, pmErrStr (rc));
-      return;
+      metrics_fail (self, "internal-error",
+                    "%s: couldn't switch pcp context: %s", self->name, pmErrStr (rc));
+      return FALSE;
     }
 
   rc = pmSetMode (PM_MODE_INTERP | PM_XTB_SET(PM_TIME_MSEC), &stamp, self->interval);
   if (rc < 0)
     {
-      cockpit_channel_fail (channel, "internal-error",
-                            "%s: couldn't set pcp mode: %s", self->name, pmErrStr (rc));
-      return;
+      metrics_fail (self, "internal-error",
+                    "%s: couldn't set pcp mode: %s", self->name, pmErrStr (rc));
+      return FALSE;
     }
 
   not_found = TRUE;
@@ -834,24 +1366,29 @@ start_archive (CockpitPcpMetrics *self,
           self->cur_archive = self->cur_archive->next;
           goto again;
         }
-      return;
+      return FALSE;
     }
 
+  /* Rows for this context */
+  g_free (self->offsets);
+  self->offsets = g_new0 (int, self->numpmid);
+  g_free (self->row);
+  self->row = g_new0 (double *, self->numpmid);
+
   /* Make sure we send a meta message.
    */
   if (self->last)
     pmFreeResult (self->last);
   self->last = NULL;
 
-  g_assert (self->idler == 0);
-  self->idler = g_idle_add (on_idle_batch, self);
+  return TRUE;
 }
 
-static void
+static gboolean
 next_archive (CockpitPcpMetrics *self)
 {
   self->cur_archive = self->cur_archive->next;
-  start_archive (self, 0);
+  return start_archive (self, 0);
 }
 
 static gboolean
@@ -994,6 +1531,28 @@ cockpit_pcp_metrics_prepare (CockpitChannel *channel)
       goto out;
     }
 
+  /* "buckets" option */
+  if (!cockpit_json_get_int (options, "buckets", 0, &self->buckets))
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "%s: invalid \"buckets\" option", self->name);
+      goto out;
+    }
+  else if (self->buckets < 0 || (self->buckets > 0 && self->limit == G_MAXINT64))
+    {
+      cockpit_channel_fail (channel, "protocol-error",
+                            "%s: invalid \"buckets\" option value: %" G_GINT64_FORMAT, self->name, self->buckets);
+      goto out;
+    }
+  else if (type != PM_CONTEXT_ARCHIVE)
+    {
+      self->buckets = 0;
+    }
+  else if (self->buckets > 0)
+    {
+      self->per_bucket = (self->limit + self->buckets - 1) / self->buckets;
+    }
+
   /* "interval" option */
   if (!cockpit_json_get_int (options, "interval", 1000, &self->interval))
     {
@@ -1010,8 +1569,16 @@ cockpit_pcp_metrics_prepare (CockpitChannel *channel)
 
   if (type == PM_CONTEXT_ARCHIVE)
     {
-      if (!prepare_archives (self, name, timestamp))
-        goto out;
+      /* Ready once the thread has opened the archives, see send_block() */
+      self->threaded = TRUE;
+      self->archive_name = name;
+      self->archive_timestamp = timestamp;
+      name = NULL;
+
+      g_signal_connect (self, "pressure", G_CALLBACK (on_pressure), self);
+      g_signal_connect (self, "closed", G_CALLBACK (on_closed), self);
+      self->thread = g_thread_new ("pcp-archive", archive_thread, self);
+      goto out;
     }
   else
     {
@@ -1036,8 +1603,7 @@ cockpit_pcp_metrics_prepare (CockpitChannel *channel)
         goto out;
     }
 
-  if (type != PM_CONTEXT_ARCHIVE)
-      cockpit_metrics_metronome (COCKPIT_METRICS (self), self->interval);
+  cockpit_metrics_metronome (COCKPIT_METRICS (self), self->interval);
   cockpit_channel_ready (channel, NULL);
 
 out:
@@ -1045,16 +1611,8 @@ out:
 }
 
 static void
-cockpit_pcp_metrics_dispose (GObject *object)
+free_archives (CockpitPcpMetrics *self)
 {
-  CockpitPcpMetrics *self = COCKPIT_PCP_METRICS (object);
-
-  if (self->idler)
-    {
-      g_source_remove (self->idler);
-      self->idler = 0;
-    }
-
   if (self->last)
     {
       pmFreeResult (self->last);
@@ -1070,6 +1628,25 @@ cockpit_pcp_metrics_dispose (GObject *object)
     }
   g_list_free (self->archives);
   self->archives = NULL;
+  self->cur_archive = NULL;
+}
+
+static void
+cockpit_pcp_metrics_dispose (GObject *object)
+{
+  CockpitPcpMetrics *self = COCKPIT_PCP_METRICS (object);
+
+  if (self->thread)
+    {
+      stop_archive_thread (self);
+      g_thread_join (self->thread);
+      self->thread = NULL;
+    }
+
+  g_queue_foreach (self->blocks, (GFunc)block_free, NULL);
+  g_queue_clear (self->blocks);
+
+  free_archives (self);
 
   if (self->direct_context >= 0)
     {
@@ -1085,8 +1662,17 @@ cockpit_pcp_metrics_finalize (GObject *object)
 {
   CockpitPcpMetrics *self = COCKPIT_PCP_METRICS (object);
 
-  g_free (self->metrics);
+  free_metrics (self);
   g_free (self->pmidlist);
+  g_free (self->offsets);
+  g_free (self->row);
+  g_free (self->counts);
+  g_free (self->message);
+  g_free (self->archive_name);
+
+  g_queue_free (self->blocks);
+  g_mutex_clear (&self->lock);
+  g_cond_clear (&self->cond);
 
   G_OBJECT_CLASS (cockpit_pcp_metrics_parent_class)->finalize (object);
 }
@@ -124,6 +124,41 @@ clear_authorize_value (gpointer pointer)
   g_free (data);
 }
 
+static gboolean
+on_transport_recv (CockpitTransport *transport,
+                   const gchar *channel,
+                   GBytes *payload,
+                   gpointer user_data);
+
+static void
+track_channel (CockpitPeer *self,
+               const gchar *channel)
+{
+  /* Messages for the channel go straight to us, without the "recv" signal */
+  g_hash_table_add (self->channels, (gpointer)cockpit_transport_intern_channel (channel, -1));
+  cockpit_transport_add_channel (self->transport, channel, on_transport_recv, NULL, self);
+}
+
+static void
+untrack_channel (CockpitPeer *self,
+                 const gchar *channel)
+{
+  cockpit_transport_remove_channel (self->transport, channel);
+  g_hash_table_remove (self->channels, cockpit_transport_find_channel (channel));
+}
+
+static void
+untrack_all_channels (CockpitPeer *self)
+{
+  GHashTableIter iter;
+  gpointer channel;
+
+  g_hash_table_iter_init (&iter, self->channels);
+  while (g_hash_table_iter_next (&iter, &channel, NULL))
+    cockpit_transport_remove_channel (self->transport, channel);
+  g_hash_table_remove_all (self->channels);
+}
+
 static gboolean
 on_other_recv (CockpitTransport *transport,
               const gchar *channel,
@@ -156,6 +191,59 @@ on_timeout_reset (gpointer user_data)
   return FALSE;
 }
 
+static gboolean
+peer_is_remote (CockpitPeer *self)
+{
+  return self->init_host && !g_str_equal (self->init_host, "localhost");
+}
+
+/*
+ * The "init" message we forward to the peer bridge asks for
+ * compression only when that bridge is on another machine.
+ */
+static GBytes *
+build_peer_init (CockpitPeer *self,
+                 GBytes *init)
+{
+  JsonArray *capabilities;
+  JsonObject *object;
+  gchar **strv = NULL;
+  GBytes *bytes;
+  gint i;
+
+  object = cockpit_json_parse_bytes (init, NULL);
+  if (!object)
+    return g_bytes_ref (init);
+
+  capabilities = json_array_new ();
+  if (cockpit_json_get_strv (object, "capabilities", NULL, &strv) && strv)
+    {
+      for (i = 0; strv[i] != NULL; i++)
+        {
+          if (!g_str_equal (strv[i], "compression"))
+            json_array_add_string_element (capabilities, strv[i]);
+        }
+    }
+  g_free (strv);
+
+  if (peer_is_remote (self))
+    json_array_add_string_element (capabilities, "compression");
+
+  if (json_array_get_length (capabilities) > 0)
+    {
+      json_object_set_array_member (object, "capabilities", capabilities);
+    }
+  else
+    {
+      json_array_unref (capabilities);
+      json_object_remove_member (object, "capabilities");
+    }
+
+  bytes = cockpit_json_write_bytes (object);
+  json_object_unref (object);
+  return bytes;
+}
+
 static gboolean
 on_other_control (CockpitTransport *transport,
                   const char *command,
@@ -166,6 +254,7 @@ on_other_control (CockpitTransport *transport,
 {
   gchar *default_init = NULL;
   CockpitPeer *self = user_data;
+  GBytes *init;
   const gchar *problem = NULL;
   const gchar *cookie = NULL;
   const gchar *challenge = NULL;
@@ -224,7 +313,12 @@ on_other_control (CockpitTransport *transport,
                                        self->init_host ? self->init_host : "localhost");
               self->last_init = g_bytes_new_take (default_init, strlen (default_init));
             }
-          cockpit_transport_send (transport, NULL, self->last_init);
+          init = build_peer_init (self, self->last_init);
+          cockpit_transport_send (transport, NULL, init);
+          g_bytes_unref (init);
+
+          if (peer_is_remote (self))
+            cockpit_pipe_transport_negotiate_compression (transport, options);
 
           if (self->frozen)
             {
@@ -279,7 +373,7 @@ on_other_control (CockpitTransport *transport,
       /* Stop keeping track of channels that are closed */
       if (g_str_equal (command, "close"))
         {
-          g_hash_table_remove (self->channels, channel);
+          untrack_channel (self, channel);
           if (g_hash_table_size (self->channels) == 0)
             {
               g_debug ("%s: removed last channel for peer", self->name);
@@ -400,6 +494,7 @@ on_other_closed (CockpitTransport *transport,
   for (l = channels; l != NULL; l = g_list_next (l))
     {
       channel = l->data;
+      cockpit_transport_remove_channel (self->transport, channel);
 
       /*
        * If we have a problem code, that either means that we failed
@@ -418,7 +513,7 @@ on_other_closed (CockpitTransport *transport,
 
       cockpit_transport_thaw (self->transport, channel);
     }
-  g_list_free_full (channels, g_free);
+  g_list_free_full (channels, (GDestroyNotify)cockpit_transport_release_channel);
 
   /* If the timeout is set, then expect that this bridge can cycle back up */
   if (cockpit_json_get_int (self->config, "timeout", -1, &timeout) && timeout >= 0)
@@ -433,7 +528,7 @@ on_transport_recv (CockpitTransport *transport,
 {
   CockpitPeer *self = COCKPIT_PEER (user_data);
 
-  if (self->other && channel && g_hash_table_lookup (self->channels, channel))
+  if (self->other && cockpit_transport_lookup_channel (self->channels, channel))
     {
       cockpit_transport_send (self->other, channel, payload);
       return TRUE;
@@ -461,11 +556,11 @@ on_transport_control (CockpitTransport *transport,
         g_bytes_unref (self->last_init);
       self->last_init = g_bytes_ref (payload);
     }
-  else if (channel && g_hash_table_lookup (self->channels, channel))
+  else if (cockpit_transport_lookup_channel (self->channels, channel))
     {
       handled = forward = TRUE;
       if (g_str_equal (command, "close"))
-        g_hash_table_remove (self->channels, channel);
+        untrack_channel (self, channel);
     }
   else if (g_str_equal (command, "authorize"))
     {
@@ -496,7 +591,9 @@ on_transport_control (CockpitTransport *transport,
 static void
 cockpit_peer_init (CockpitPeer *self)
 {
-  self->channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  /* Keyed by interned channel ids */
+  self->channels = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                          (GDestroyNotify)cockpit_transport_release_channel, NULL);
   self->authorizes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   self->authorize_values = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                   NULL, clear_authorize_value);
@@ -822,7 +919,7 @@ cockpit_peer_handle (CockpitPeer *self,
         }
     }
 
-  g_hash_table_add (self->channels, g_strdup (channel));
+  track_channel (self, channel);
 
   if (self->timeout)
     {
@@ -907,7 +1004,7 @@ cockpit_peer_reset (CockpitPeer *self)
     g_queue_free_full (self->frozen, g_free);
   self->frozen = NULL;
 
-  g_hash_table_remove_all (self->channels);
+  untrack_all_channels (self);
   g_hash_table_remove_all (self->authorizes);
   g_hash_table_remove_all (self->authorize_values);
 
@@ -21,6 +21,7 @@
 
 #include "cockpitpipechannel.h"
 
+#include "common/cockpitflow.h"
 #include "common/cockpitpipe.h"
 #include "common/cockpitjson.h"
 #include "common/cockpitunicode.h"
@@ -501,6 +502,10 @@ cockpit_pipe_channel_prepare (CockpitChannel *channel)
 
   self->sig_read = g_signal_connect (self->pipe, "read", G_CALLBACK (on_pipe_read), self);
   self->sig_close = g_signal_connect (self->pipe, "close", G_CALLBACK (on_pipe_close), self);
+
+  /* Stop reading from the pipe while the channel is under pressure */
+  cockpit_flow_throttle (COCKPIT_FLOW (self->pipe), COCKPIT_FLOW (self));
+
   self->open = TRUE;
   cockpit_channel_ready (channel, NULL);
 
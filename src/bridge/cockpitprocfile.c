@@ -0,0 +1,373 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2018 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitprocfile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Files in /proc that samplers read on every tick.
+ *
+ * The file stays open, and is read again from the start with pread()
+ * into the same buffer. The buffer only grows when the file does. The
+ * scanner functions parse the contents in place without allocating.
+ *
+ * This is only used from the main thread.
+ */
+
+const gchar *cockpit_proc_root = "/proc";
+
+/* All the files that have been opened */
+static GSList *open_files;
+
+static gboolean
+open_file (CockpitProcFile *file)
+{
+  gchar *path;
+
+  path = g_build_filename (cockpit_proc_root, file->name, NULL);
+  file->fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (file->fd < 0)
+    {
+      g_message ("couldn't open %s: %s", path, g_strerror (errno));
+      file->failed = TRUE;
+    }
+  else if (!g_slist_find (open_files, file))
+    {
+      open_files = g_slist_prepend (open_files, file);
+    }
+
+  g_free (path);
+  return file->fd >= 0;
+}
+
+static gboolean
+read_contents (CockpitProcFile *file,
+               gsize initial)
+{
+  gssize ret;
+
+  if (!file->data)
+    {
+      file->size = initial;
+      file->data = g_malloc (file->size);
+    }
+
+  file->len = 0;
+  for (;;)
+    {
+      /* Always leave room for the nul terminator */
+      if (file->len + 1 >= file->size)
+        {
+          file->size *= 2;
+          file->data = g_realloc (file->data, file->size);
+        }
+
+      ret = pread (file->fd, file->data + file->len, file->size - file->len - 1, file->len);
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          file->len = 0;
+          file->data[0] = '\0';
+          return FALSE;
+        }
+      else if (ret == 0)
+        {
+          break;
+        }
+
+      file->len += ret;
+    }
+
+  file->data[file->len] = '\0';
+  return TRUE;
+}
+
+/**
+ * cockpit_proc_file_read:
+ * @file: the file to read
+ *
+ * Read the current contents of @file, which is opened the first
+ * time. The contents are in file->data, and are nul terminated.
+ *
+ * If the file can't be opened, the failure is logged once and
+ * this returns FALSE from then on.
+ *
+ * Returns: whether the file was read
+ */
+gboolean
+cockpit_proc_file_read (CockpitProcFile *file)
+{
+  if (file->failed)
+    return FALSE;
+  if (file->fd < 0 && !open_file (file))
+    return FALSE;
+
+  if (!read_contents (file, 4096))
+    {
+      g_message ("couldn't read %s/%s: %s", cockpit_proc_root, file->name, g_strerror (errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * cockpit_proc_file_read_in:
+ * @file: the file to read
+ * @directory: the directory that contains the file
+ * @keep_open: whether to keep the file open after reading it
+ *
+ * Like cockpit_proc_file_read() but for a file outside of
+ * cockpit_proc_root, such as one in a cgroup directory. Nothing
+ * is logged, and the file isn't closed by cockpit_proc_file_close_all().
+ * Use cockpit_proc_file_clear() when done with it.
+ *
+ * If the file can't be opened it is marked as failed, and isn't
+ * tried again until file->failed is cleared by the caller.
+ *
+ * Returns: whether the file was read, errno is set if not
+ */
+gboolean
+cockpit_proc_file_read_in (CockpitProcFile *file,
+                           const gchar *directory,
+                           gboolean keep_open)
+{
+  gchar path[PATH_MAX];
+  gboolean ret;
+  gint errn;
+
+  if (file->failed)
+    {
+      errno = ENOENT;
+      return FALSE;
+    }
+
+  if (file->fd < 0)
+    {
+      if (g_snprintf (path, sizeof (path), "%s/%s", directory, file->name) >= (gint)sizeof (path))
+        {
+          errno = ENAMETOOLONG;
+          file->failed = TRUE;
+          return FALSE;
+        }
+
+      file->fd = open (path, O_RDONLY | O_CLOEXEC);
+      if (file->fd < 0)
+        {
+          file->failed = TRUE;
+          return FALSE;
+        }
+    }
+
+  /* These are usually tiny, and there can be thousands of them */
+  ret = read_contents (file, 128);
+
+  if (!keep_open)
+    {
+      errn = errno;
+      close (file->fd);
+      file->fd = -1;
+      errno = errn;
+    }
+
+  return ret;
+}
+
+/**
+ * cockpit_proc_file_clear:
+ * @file: the file
+ *
+ * Close @file and free its buffer.
+ */
+void
+cockpit_proc_file_clear (CockpitProcFile *file)
+{
+  if (file->fd >= 0)
+    close (file->fd);
+  file->fd = -1;
+  file->failed = FALSE;
+  g_free (file->data);
+  file->data = NULL;
+  file->len = file->size = 0;
+}
+
+/**
+ * cockpit_proc_file_close_all:
+ *
+ * Close all the files and free their buffers. They are opened
+ * again, from cockpit_proc_root, when next read.
+ */
+void
+cockpit_proc_file_close_all (void)
+{
+  CockpitProcFile *file;
+  GSList *l;
+
+  for (l = open_files; l != NULL; l = g_slist_next (l))
+    {
+      file = l->data;
+      cockpit_proc_file_clear (file);
+    }
+
+  g_slist_free (open_files);
+  open_files = NULL;
+}
+
+void
+cockpit_proc_scanner_init (CockpitProcScanner *scanner,
+                           CockpitProcFile *file)
+{
+  scanner->pos = file->data;
+  scanner->end = file->data + file->len;
+}
+
+/**
+ * cockpit_proc_scanner_line:
+ * @scanner: scanner over a whole file
+ * @line: set to the next line
+ *
+ * Returns: FALSE when there are no more lines
+ */
+gboolean
+cockpit_proc_scanner_line (CockpitProcScanner *scanner,
+                           CockpitProcScanner *line)
+{
+  const gchar *eol;
+
+  if (scanner->pos >= scanner->end)
+    return FALSE;
+
+  eol = memchr (scanner->pos, '\n', scanner->end - scanner->pos);
+  if (!eol)
+    eol = scanner->end;
+
+  line->pos = scanner->pos;
+  line->end = eol;
+  scanner->pos = eol < scanner->end ? eol + 1 : eol;
+  return TRUE;
+}
+
+static void
+skip_space (CockpitProcScanner *line)
+{
+  while (line->pos < line->end && (*line->pos == ' ' || *line->pos == '\t'))
+    line->pos++;
+}
+
+/**
+ * cockpit_proc_scanner_prefix:
+ * @line: a line
+ * @prefix: the text expected at the start of the line
+ *
+ * Returns: whether @line starts with @prefix, in which case
+ *          the prefix is skipped
+ */
+gboolean
+cockpit_proc_scanner_prefix (CockpitProcScanner *line,
+                             const gchar *prefix)
+{
+  gsize len = strlen (prefix);
+
+  if ((gsize)(line->end - line->pos) < len || memcmp (line->pos, prefix, len) != 0)
+    return FALSE;
+
+  line->pos += len;
+  return TRUE;
+}
+
+/**
+ * cockpit_proc_scanner_word:
+ * @line: a line
+ * @delimiter: a character that also ends the word, or zero
+ * @buffer: receives the nul terminated word
+ * @size: size of @buffer
+ *
+ * Parse the next word, after any leading white space. The word ends
+ * at white space or at @delimiter, which is skipped.
+ *
+ * Returns: FALSE if there is no word, or it doesn't fit in @buffer
+ */
+gboolean
+cockpit_proc_scanner_word (CockpitProcScanner *line,
+                           gchar delimiter,
+                           gchar *buffer,
+                           gsize size)
+{
+  const gchar *start;
+  gsize len;
+
+  skip_space (line);
+
+  start = line->pos;
+  while (line->pos < line->end && *line->pos != ' ' && *line->pos != '\t' &&
+         (delimiter == 0 || *line->pos != delimiter))
+    line->pos++;
+
+  len = line->pos - start;
+  if (line->pos < line->end && delimiter != 0 && *line->pos == delimiter)
+    line->pos++;
+
+  if (len == 0 || len >= size)
+    return FALSE;
+
+  memcpy (buffer, start, len);
+  buffer[len] = '\0';
+  return TRUE;
+}
+
+/**
+ * cockpit_proc_scanner_uint64:
+ * @line: a line
+ * @value: receives the number, or NULL to skip it
+ *
+ * Parse the next decimal number, after any leading white space.
+ *
+ * Returns: FALSE if there is no number
+ */
+gboolean
+cockpit_proc_scanner_uint64 (CockpitProcScanner *line,
+                             guint64 *value)
+{
+  guint64 result = 0;
+  const gchar *start;
+
+  skip_space (line);
+
+  start = line->pos;
+  while (line->pos < line->end && *line->pos >= '0' && *line->pos <= '9')
+    {
+      result = result * 10 + (*line->pos - '0');
+      line->pos++;
+    }
+
+  if (line->pos == start)
+    return FALSE;
+
+  if (value)
+    *value = result;
+  return TRUE;
+}
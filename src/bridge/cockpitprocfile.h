@@ -0,0 +1,74 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2018 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COCKPIT_PROC_FILE_H__
+#define COCKPIT_PROC_FILE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct {
+  const gchar *name;
+  gint fd;
+  gboolean failed;
+  gchar *data;
+  gsize len;
+  gsize size;
+} CockpitProcFile;
+
+#define COCKPIT_PROC_FILE_INIT(name) { (name), -1, FALSE, NULL, 0, 0 }
+
+typedef struct {
+  const gchar *pos;
+  const gchar *end;
+} CockpitProcScanner;
+
+extern const gchar *cockpit_proc_root;
+
+gboolean        cockpit_proc_file_read          (CockpitProcFile *file);
+
+gboolean        cockpit_proc_file_read_in       (CockpitProcFile *file,
+                                                 const gchar *directory,
+                                                 gboolean keep_open);
+
+void            cockpit_proc_file_clear         (CockpitProcFile *file);
+
+void            cockpit_proc_file_close_all     (void);
+
+void            cockpit_proc_scanner_init       (CockpitProcScanner *scanner,
+                                                 CockpitProcFile *file);
+
+gboolean        cockpit_proc_scanner_line       (CockpitProcScanner *scanner,
+                                                 CockpitProcScanner *line);
+
+gboolean        cockpit_proc_scanner_prefix     (CockpitProcScanner *line,
+                                                 const gchar *prefix);
+
+gboolean        cockpit_proc_scanner_word       (CockpitProcScanner *line,
+                                                 gchar delimiter,
+                                                 gchar *buffer,
+                                                 gsize size);
+
+gboolean        cockpit_proc_scanner_uint64     (CockpitProcScanner *line,
+                                                 guint64 *value);
+
+G_END_DECLS
+
+#endif /* COCKPIT_PROC_FILE_H__ */
@@ -365,6 +365,9 @@ process_init (CockpitRouter *self,
       g_assert (host != NULL);
       self->init_host = g_strdup (host);
       problem = NULL;
+
+      /* The caller knows whether it's worth compressing what we send */
+      cockpit_pipe_transport_negotiate_compression (transport, options);
     }
 }
 
@@ -527,9 +530,10 @@ process_open_channel (CockpitRouter *self,
   channel_type = type_function ();
 
   if (g_str_equal (group, "fence"))
-    g_hash_table_add (self->fences, g_strdup (channel));
+    g_hash_table_add (self->fences, (gpointer)cockpit_transport_intern_channel (channel, -1));
 
-  g_hash_table_insert (self->groups, g_strdup (channel), g_strdup (group));
+  g_hash_table_insert (self->groups, (gpointer)cockpit_transport_intern_channel (channel, -1),
+                       g_strdup (group));
 
   create_channel (self, channel, options, channel_type);
   return TRUE;
@@ -698,7 +702,7 @@ process_open (CockpitRouter *self,
     }
 
   /* Check that this isn't a local channel */
-  else if (g_hash_table_lookup (self->channels, channel))
+  else if (cockpit_transport_lookup_channel (self->channels, channel))
     {
       g_warning ("%s: caller tried to reuse a channel that's already in use", channel);
       cockpit_transport_close (self->transport, "protocol-error");
@@ -706,7 +710,7 @@ process_open (CockpitRouter *self,
     }
 
   /* Request that this channel is frozen, and requeue its open message for later */
-  else if (g_hash_table_size (self->fences) > 0 && !g_hash_table_lookup (self->fences, channel))
+  else if (g_hash_table_size (self->fences) > 0 && !cockpit_transport_lookup_channel (self->fences, channel))
     {
       if (!self->fenced)
         self->fenced = g_queue_new ();
@@ -803,6 +807,67 @@ process_kill (CockpitRouter *self,
   g_list_free (list);
 }
 
+static void
+add_channel_stats (const gchar *name,
+                   const CockpitChannelStats *stats,
+                   gpointer user_data)
+{
+  JsonObject *object;
+
+  object = json_object_new ();
+  json_object_set_int_member (object, "rx-messages", stats->rx_messages);
+  json_object_set_int_member (object, "rx-bytes", stats->rx_bytes);
+  json_object_set_int_member (object, "tx-messages", stats->tx_messages);
+  json_object_set_int_member (object, "tx-bytes", stats->tx_bytes);
+  json_object_set_object_member (user_data, name, object);
+}
+
+static void
+add_transport_stats (CockpitTransport *transport,
+                     const CockpitTransportStats *stats,
+                     gpointer user_data)
+{
+  JsonArray *array = user_data;
+  JsonObject *object;
+  gchar *name = NULL;
+
+  object = cockpit_transport_build_stats (stats);
+  g_object_get (transport, "name", &name, NULL);
+  json_object_set_string_member (object, "name", name);
+  json_array_add_object_element (array, object);
+  g_free (name);
+}
+
+static void
+process_statistics (CockpitRouter *self,
+                    CockpitTransport *transport)
+{
+  JsonObject *object;
+  JsonObject *block;
+  JsonArray *array;
+  GBytes *reply;
+
+  object = json_object_new ();
+  json_object_set_string_member (object, "command", "statistics");
+
+  block = json_object_new ();
+  cockpit_channel_foreach_stats (add_channel_stats, block);
+  json_object_set_object_member (object, "channels", block);
+
+  block = json_object_new ();
+  cockpit_channel_foreach_payload_stats (add_channel_stats, block);
+  json_object_set_object_member (object, "payloads", block);
+
+  array = json_array_new ();
+  cockpit_transport_foreach_stats (add_transport_stats, array);
+  json_object_set_array_member (object, "transports", array);
+
+  reply = cockpit_json_write_bytes (object);
+  json_object_unref (object);
+  cockpit_transport_send (transport, NULL, reply);
+  g_bytes_unref (reply);
+}
+
 static gboolean
 on_transport_control (CockpitTransport *transport,
                       const char *command,
@@ -835,6 +900,11 @@ on_transport_control (CockpitTransport *transport,
     {
       process_kill (self, options);
     }
+  else if (g_str_equal (command, "statistics"))
+    {
+      process_statistics (self, transport);
+      return TRUE;
+    }
   else if (g_str_equal (command, "close"))
     {
       if (!channel_id)
@@ -859,10 +929,12 @@ cockpit_router_init (CockpitRouter *self)
 {
   RouterRule *rule;
 
-  /* Owns the channels */
-  self->channels = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, object_unref_if_not_null);
-  self->groups = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
-  self->fences = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  /* Owns the channels, all keyed by interned channel ids */
+  self->channels = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, object_unref_if_not_null);
+  self->groups = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                        (GDestroyNotify)cockpit_transport_release_channel, g_free);
+  self->fences = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                        (GDestroyNotify)cockpit_transport_release_channel, NULL);
 
   /* The rules, including a default */
   rule = g_new0 (RouterRule, 1);
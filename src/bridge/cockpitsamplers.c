@@ -0,0 +1,273 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2018 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitsamplers.h"
+
+/*
+ * Samplers shared between all the metrics channels in the process.
+ *
+ * Each sampler runs at most once per slot. The samples it produces are
+ * recorded, and handed to every channel that asks for the same slot.
+ * Channels tick on slots aligned by cockpit_metrics_metronome(), so
+ * several channels with the same interval read /proc only once.
+ *
+ * A channel that is opened in the middle of a slot that has already
+ * been sampled gets the recorded samples as its first ones, so they
+ * may be up to one interval old. The sampler isn't run again for it,
+ * so that all channels see the same values for a slot.
+ *
+ * Instance names are interned, and the same name is passed with the
+ * same pointer on every run. Channels can use that to skip looking up
+ * instances, until cockpit_samplers_get_epoch() changes.
+ *
+ * This is only used from the main thread.
+ */
+
+#define COCKPIT_TYPE_SHARED_SAMPLER (cockpit_shared_sampler_get_type ())
+#define COCKPIT_SHARED_SAMPLER(o)   (G_TYPE_CHECK_INSTANCE_CAST ((o), COCKPIT_TYPE_SHARED_SAMPLER, CockpitSharedSampler))
+
+typedef struct {
+  const gchar *metric;
+  const gchar *instance;
+  gint64 value;
+  gboolean stale;
+} Sample;
+
+typedef struct {
+  GObject parent;
+  CockpitSamplerFunc func;
+  gboolean valid;
+  gint64 slot;
+  GArray *samples;
+  GStringChunk *strings;
+  GHashTable *interned;
+  guint64 runs;
+} CockpitSharedSampler;
+
+typedef struct {
+  GObjectClass parent_class;
+} CockpitSharedSamplerClass;
+
+static GType cockpit_shared_sampler_get_type (void) G_GNUC_CONST;
+
+static void cockpit_samples_interface_init (CockpitSamplesIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (CockpitSharedSampler, cockpit_shared_sampler, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_SAMPLES,
+                                                cockpit_samples_interface_init))
+
+/* CockpitSamplerFunc -> CockpitSharedSampler */
+static GHashTable *registry;
+static guint subscribers;
+static guint64 epoch;
+
+static void
+cockpit_shared_sampler_init (CockpitSharedSampler *self)
+{
+  self->samples = g_array_new (FALSE, FALSE, sizeof (Sample));
+  self->strings = g_string_chunk_new (1024);
+  self->interned = g_hash_table_new (g_str_hash, g_str_equal);
+}
+
+static void
+cockpit_shared_sampler_finalize (GObject *object)
+{
+  CockpitSharedSampler *self = COCKPIT_SHARED_SAMPLER (object);
+
+  g_array_free (self->samples, TRUE);
+  g_hash_table_unref (self->interned);
+  g_string_chunk_free (self->strings);
+
+  G_OBJECT_CLASS (cockpit_shared_sampler_parent_class)->finalize (object);
+}
+
+static void
+cockpit_shared_sampler_class_init (CockpitSharedSamplerClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  object_class->finalize = cockpit_shared_sampler_finalize;
+}
+
+static const gchar *
+intern_instance (CockpitSharedSampler *self,
+                 const gchar *instance)
+{
+  gchar *interned;
+
+  if (!instance)
+    return NULL;
+
+  interned = g_hash_table_lookup (self->interned, instance);
+  if (!interned)
+    {
+      interned = g_string_chunk_insert (self->strings, instance);
+      g_hash_table_add (self->interned, interned);
+    }
+  return interned;
+}
+
+static void
+cockpit_shared_sampler_sample (CockpitSamples *samples,
+                               const gchar *metric,
+                               const gchar *instance,
+                               gint64 value)
+{
+  CockpitSharedSampler *self = COCKPIT_SHARED_SAMPLER (samples);
+  Sample sample;
+
+  /* Metric names are static, instance names are often on the stack */
+  sample.metric = metric;
+  sample.instance = intern_instance (self, instance);
+  sample.value = value;
+  sample.stale = FALSE;
+  g_array_append_val (self->samples, sample);
+}
+
+static void
+cockpit_shared_sampler_stale (CockpitSamples *samples,
+                              const gchar *metric,
+                              const gchar *instance)
+{
+  CockpitSharedSampler *self = COCKPIT_SHARED_SAMPLER (samples);
+  Sample sample;
+
+  sample.metric = metric;
+  sample.instance = intern_instance (self, instance);
+  sample.value = 0;
+  sample.stale = TRUE;
+  g_array_append_val (self->samples, sample);
+}
+
+static void
+cockpit_samples_interface_init (CockpitSamplesIface *iface)
+{
+  iface->sample = cockpit_shared_sampler_sample;
+  iface->stale = cockpit_shared_sampler_stale;
+}
+
+/**
+ * cockpit_samplers_subscribe:
+ *
+ * Called by each channel that uses cockpit_samplers_run(). The
+ * recorded samples are kept until the last channel unsubscribes.
+ */
+void
+cockpit_samplers_subscribe (void)
+{
+  if (subscribers++ == 0 && !registry)
+    registry = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_object_unref);
+}
+
+void
+cockpit_samplers_unsubscribe (void)
+{
+  g_return_if_fail (subscribers > 0);
+
+  if (--subscribers == 0)
+    {
+      g_hash_table_remove_all (registry);
+      epoch++;
+    }
+}
+
+/**
+ * cockpit_samplers_run:
+ * @func: the sampler
+ * @slot: the metronome tick being sampled
+ * @samples: receives the samples
+ *
+ * Pass the samples from @func for @slot to @samples. The
+ * sampler itself only runs the first time a given @slot is asked for.
+ */
+void
+cockpit_samplers_run (CockpitSamplerFunc func,
+                      gint64 slot,
+                      CockpitSamples *samples)
+{
+  CockpitSharedSampler *sampler;
+  Sample *sample;
+  guint i;
+
+  g_return_if_fail (func != NULL);
+  g_return_if_fail (subscribers > 0);
+
+  sampler = g_hash_table_lookup (registry, func);
+  if (!sampler)
+    {
+      sampler = g_object_new (COCKPIT_TYPE_SHARED_SAMPLER, NULL);
+      sampler->func = func;
+      g_hash_table_insert (registry, func, sampler);
+    }
+
+  if (!sampler->valid || sampler->slot != slot)
+    {
+      /* Forget instances that are gone, once there are many of them */
+      if (g_hash_table_size (sampler->interned) > sampler->samples->len * 2 + 64)
+        {
+          g_hash_table_remove_all (sampler->interned);
+          g_string_chunk_clear (sampler->strings);
+          epoch++;
+        }
+
+      g_array_set_size (sampler->samples, 0);
+      (func) (COCKPIT_SAMPLES (sampler));
+      sampler->slot = slot;
+      sampler->valid = TRUE;
+      sampler->runs++;
+    }
+
+  for (i = 0; i < sampler->samples->len; i++)
+    {
+      sample = &g_array_index (sampler->samples, Sample, i);
+      if (sample->stale)
+        cockpit_samples_stale (samples, sample->metric, sample->instance);
+      else
+        cockpit_samples_sample (samples, sample->metric, sample->instance, sample->value);
+    }
+}
+
+/**
+ * cockpit_samplers_get_epoch:
+ *
+ * Returns: a counter that changes whenever an instance name pointer
+ *   passed by cockpit_samplers_run() may have been freed
+ */
+guint64
+cockpit_samplers_get_epoch (void)
+{
+  return epoch;
+}
+
+/**
+ * cockpit_samplers_get_runs:
+ * @func: the sampler
+ *
+ * Returns: how many times @func has actually run
+ */
+guint64
+cockpit_samplers_get_runs (CockpitSamplerFunc func)
+{
+  CockpitSharedSampler *sampler = NULL;
+
+  if (registry)
+    sampler = g_hash_table_lookup (registry, func);
+  return sampler ? sampler->runs : 0;
+}
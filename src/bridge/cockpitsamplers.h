@@ -0,0 +1,43 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2018 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COCKPIT_SAMPLERS_H__
+#define COCKPIT_SAMPLERS_H__
+
+#include "cockpitsamples.h"
+
+G_BEGIN_DECLS
+
+typedef void    (* CockpitSamplerFunc)          (CockpitSamples *samples);
+
+void            cockpit_samplers_subscribe      (void);
+
+void            cockpit_samplers_unsubscribe    (void);
+
+void            cockpit_samplers_run            (CockpitSamplerFunc func,
+                                                 gint64 slot,
+                                                 CockpitSamples *samples);
+
+guint64         cockpit_samplers_get_epoch      (void);
+
+guint64         cockpit_samplers_get_runs       (CockpitSamplerFunc func);
+
+G_END_DECLS
+
+#endif /* COCKPIT_SAMPLERS_H__ */
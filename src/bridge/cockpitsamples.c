@@ -44,3 +44,27 @@ cockpit_samples_sample (CockpitSamples *self,
   g_assert (iface->sample);
   (iface->sample) (self, metric, instance, value);
 }
+
+/**
+ * cockpit_samples_stale:
+ * @self: the samples
+ * @metric: the metric name
+ * @instance: the instance
+ *
+ * Called instead of cockpit_samples_sample() when @instance still
+ * exists, but no current value could be had for it. Any previous
+ * value is kept.
+ */
+void
+cockpit_samples_stale (CockpitSamples *self,
+                       const gchar *metric,
+                       const gchar *instance)
+{
+  CockpitSamplesIface *iface;
+
+  iface = COCKPIT_SAMPLES_GET_IFACE (self);
+  g_return_if_fail (iface != NULL);
+
+  if (iface->stale)
+    (iface->stale) (self, metric, instance);
+}
@@ -39,6 +39,10 @@ struct _CockpitSamplesIface {
                                    const gchar *metric,
                                    const gchar *instance,
                                    gint64 value);
+
+  void       (* stale)            (CockpitSamples *samples,
+                                   const gchar *metric,
+                                   const gchar *instance);
 };
 
 GType               cockpit_samples_get_type        (void) G_GNUC_CONST;
@@ -48,6 +52,10 @@ void                cockpit_samples_sample          (CockpitSamples *self,
                                                      const gchar *instance,
                                                      gint64 value);
 
+void                cockpit_samples_stale           (CockpitSamples *self,
+                                                     const gchar *metric,
+                                                     const gchar *instance);
+
 G_END_DECLS
 
 #endif /* COCKPIT_SAMPLES_H__ */
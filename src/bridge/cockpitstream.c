@@ -21,6 +21,7 @@
 
 #include "cockpitstream.h"
 
+#include "common/cockpitflow.h"
 #include "common/cockpitjson.h"
 
 #include <errno.h>
@@ -59,6 +60,11 @@ struct _CockpitStreamPrivate {
   GByteArray *in_buffer;
   gboolean received;
   gulong sig_accept_cert;
+
+  /* Flow control: input is paused while throttled */
+  CockpitFlow *throttle;
+  gulong throttle_sig;
+  gboolean in_paused;
 };
 
 static guint cockpit_stream_sig_open;
@@ -68,7 +74,13 @@ static guint cockpit_stream_sig_rejected_cert;
 
 static void  cockpit_close_later (CockpitStream *self);
 
-G_DEFINE_TYPE (CockpitStream, cockpit_stream, G_TYPE_OBJECT);
+static void  cockpit_stream_flow_iface_init (CockpitFlowIface *iface);
+
+static void  start_input (CockpitStream *self);
+
+G_DEFINE_TYPE_WITH_CODE (CockpitStream, cockpit_stream, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_FLOW, cockpit_stream_flow_iface_init)
+);
 
 static void
 cockpit_stream_init (CockpitStream *self)
@@ -114,6 +126,8 @@ close_immediately (CockpitStream *self,
       self->priv->problem = g_strdup (problem);
     }
 
+  self->priv->in_paused = FALSE;
+
   if (self->priv->connecting)
     {
       cockpit_connectable_unref (self->priv->connecting);
@@ -160,7 +174,7 @@ close_maybe (CockpitStream *self)
 {
   if (!self->priv->closed)
     {
-      if (!self->priv->in_source && !self->priv->out_source)
+      if (!self->priv->in_source && !self->priv->in_paused && !self->priv->out_source)
         {
           g_debug ("%s: input and output done", self->priv->name);
           close_immediately (self, NULL);
@@ -514,6 +528,20 @@ start_output (CockpitStream *self)
   g_source_attach (self->priv->out_source, self->priv->context);
 }
 
+static void
+start_input (CockpitStream *self)
+{
+  GInputStream *is;
+
+  g_assert (self->priv->in_source == NULL);
+
+  is = g_io_stream_get_input_stream (self->priv->io);
+  self->priv->in_source = g_pollable_input_stream_create_source (G_POLLABLE_INPUT_STREAM (is), NULL);
+  g_source_set_name (self->priv->in_source, "stream-input");
+  g_source_set_callback (self->priv->in_source, (GSourceFunc)dispatch_input, self, NULL);
+  g_source_attach (self->priv->in_source, self->priv->context);
+}
+
 static void
 initialize_io (CockpitStream *self)
 {
@@ -541,10 +569,10 @@ initialize_io (CockpitStream *self)
       self->priv->connecting = NULL;
     }
 
-  self->priv->in_source = g_pollable_input_stream_create_source (G_POLLABLE_INPUT_STREAM (is), NULL);
-  g_source_set_name (self->priv->in_source, "stream-input");
-  g_source_set_callback (self->priv->in_source, (GSourceFunc)dispatch_input, self, NULL);
-  g_source_attach (self->priv->in_source, self->priv->context);
+  if (self->priv->in_paused)
+    g_debug ("%s: not reading input while under pressure", self->priv->name);
+  else
+    start_input (self);
 
   if (G_IS_TLS_CONNECTION (self->priv->io))
     {
@@ -626,11 +654,89 @@ cockpit_stream_get_property (GObject *obj,
   }
 }
 
+static void
+on_throttle_pressure (GObject *object,
+                      gboolean throttle,
+                      gpointer user_data)
+{
+  CockpitStream *self = COCKPIT_STREAM (user_data);
+
+  if (throttle)
+    {
+      if (self->priv->in_source)
+        {
+          g_debug ("%s: applying back pressure in stream", self->priv->name);
+          stop_input (self);
+          self->priv->in_paused = TRUE;
+        }
+      else if (self->priv->connecting)
+        {
+          /* Input will start once connected */
+          self->priv->in_paused = TRUE;
+        }
+    }
+  else
+    {
+      if (self->priv->in_paused && !self->priv->closed)
+        {
+          g_debug ("%s: relieving back pressure in stream", self->priv->name);
+          self->priv->in_paused = FALSE;
+          if (!self->priv->connecting)
+            start_input (self);
+        }
+    }
+}
+
+static void
+on_throttle_weak (gpointer data,
+                  GObject *where_the_object_was)
+{
+  CockpitStream *self = COCKPIT_STREAM (data);
+  self->priv->throttle = NULL;
+  self->priv->throttle_sig = 0;
+  on_throttle_pressure (NULL, FALSE, self);
+}
+
+static void
+cockpit_stream_throttle (CockpitFlow *flow,
+                         CockpitFlow *controlling)
+{
+  CockpitStream *self = COCKPIT_STREAM (flow);
+
+  if (self->priv->throttle)
+    {
+      g_signal_handler_disconnect (self->priv->throttle, self->priv->throttle_sig);
+      g_object_weak_unref (G_OBJECT (self->priv->throttle), on_throttle_weak, self);
+      self->priv->throttle = NULL;
+      self->priv->throttle_sig = 0;
+    }
+
+  if (controlling)
+    {
+      self->priv->throttle = controlling;
+      self->priv->throttle_sig = g_signal_connect (controlling, "pressure",
+                                                   G_CALLBACK (on_throttle_pressure), self);
+      g_object_weak_ref (G_OBJECT (controlling), on_throttle_weak, self);
+    }
+  else
+    {
+      on_throttle_pressure (NULL, FALSE, self);
+    }
+}
+
+static void
+cockpit_stream_flow_iface_init (CockpitFlowIface *iface)
+{
+  iface->throttle = cockpit_stream_throttle;
+}
+
 static void
 cockpit_stream_dispose (GObject *object)
 {
   CockpitStream *self = COCKPIT_STREAM (object);
 
+  cockpit_flow_throttle (COCKPIT_FLOW (self), NULL);
+
   if (!self->priv->closed)
     close_immediately (self, "terminated");
 
@@ -58,6 +58,7 @@ test_bridge_init (void)
   JsonObject *os_release;
   JsonObject *packages;
   GError *error = NULL;
+  gchar **capabilities;
   GList *list;
 
   const gchar *argv[] = {
@@ -102,6 +103,12 @@ test_bridge_init (void)
   g_assert_cmpstr (list->next->next->data, ==, "test");
   g_list_free (list);
 
+  /* The bridge understands compressed messages */
+  g_assert (cockpit_json_get_strv (object, "capabilities", NULL, &capabilities));
+  g_assert (capabilities != NULL);
+  g_assert_cmpstr (capabilities[0], ==, "compression");
+  g_free (capabilities);
+
   json_object_unref (object);
 }
 
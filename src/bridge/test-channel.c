@@ -91,7 +91,8 @@ mock_echo_channel_class_init (MockEchoChannelClass *klass)
 
 static CockpitChannel *
 mock_echo_channel_open (CockpitTransport *transport,
-                        const gchar *channel_id)
+                        const gchar *channel_id,
+                        gboolean flow_control)
 {
   CockpitChannel *channel;
   JsonObject *options;
@@ -99,6 +100,8 @@ mock_echo_channel_open (CockpitTransport *transport,
   g_assert (channel_id != NULL);
 
   options = json_object_new ();
+  if (flow_control)
+    json_object_set_boolean_member (options, "flow-control", TRUE);
   channel = g_object_new (mock_echo_channel_get_type (),
                           "transport", transport,
                           "id", channel_id,
@@ -123,7 +126,8 @@ setup (TestCase *tc,
        gconstpointer unused)
 {
   tc->transport = g_object_new (mock_transport_get_type (), NULL);
-  tc->channel = mock_echo_channel_open (COCKPIT_TRANSPORT (tc->transport), "554");
+  tc->channel = mock_echo_channel_open (COCKPIT_TRANSPORT (tc->transport), "554",
+                                       GPOINTER_TO_INT (unused));
   while (g_main_context_iteration (NULL, FALSE));
 }
 
@@ -325,6 +329,122 @@ test_close_transport (TestCase *tc,
   g_free (problem);
 }
 
+static void
+on_pressure_set_flag (CockpitChannel *channel,
+                      gboolean pressure,
+                      gpointer user_data)
+{
+  gint *flag = user_data;
+  *flag = pressure ? 1 : 0;
+}
+
+static void
+send_control_message (MockTransport *transport,
+                      const gchar *json)
+{
+  GBytes *payload;
+
+  payload = g_bytes_new (json, strlen (json));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (transport), NULL, payload);
+  g_bytes_unref (payload);
+}
+
+static void
+test_flow_ping_reply (TestCase *tc,
+                      gconstpointer unused)
+{
+  JsonObject *sent;
+
+  cockpit_channel_ready (tc->channel, NULL);
+  sent = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (sent, "command"), ==, "ready");
+
+  send_control_message (tc->transport, "{ \"command\": \"ping\", \"channel\": \"554\", \"sequence\": 5 }");
+
+  sent = mock_transport_pop_control (tc->transport);
+  g_assert (sent != NULL);
+  cockpit_assert_json_eq (sent, "{ \"command\": \"pong\", \"channel\": \"554\", \"sequence\": 5 }");
+}
+
+static void
+test_flow_pressure (TestCase *tc,
+                    gconstpointer unused)
+{
+  JsonObject *sent;
+  GBytes *payload;
+  gchar *block;
+  gint pressure = -1;
+  gint64 sequence = 0;
+  gint pings = 0;
+  gchar *pong;
+  gint i;
+
+  g_signal_connect (tc->channel, "pressure", G_CALLBACK (on_pressure_set_flag), &pressure);
+  cockpit_channel_ready (tc->channel, NULL);
+
+  block = g_strnfill (64 * 1024, 'x');
+  payload = g_bytes_new_take (block, 64 * 1024);
+
+  /* 32 blocks of 64k is exactly at the 2MB window */
+  for (i = 0; i < 32; i++)
+    cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "554", payload);
+  g_assert_cmpint (pressure, ==, -1);
+
+  /* One more pushes us over the window */
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "554", payload);
+  g_assert_cmpint (pressure, ==, 1);
+
+  /* A ping was sent after every 16k of data */
+  while ((sent = mock_transport_pop_control (tc->transport)) != NULL)
+    {
+      if (!g_str_equal (json_object_get_string_member (sent, "command"), "ping"))
+        continue;
+      g_assert_cmpstr (json_object_get_string_member (sent, "channel"), ==, "554");
+      g_assert_cmpint (json_object_get_int_member (sent, "sequence"), >, sequence);
+      sequence = json_object_get_int_member (sent, "sequence");
+      pings++;
+    }
+  g_assert_cmpint (pings, ==, 33);
+  g_assert_cmpint (sequence, ==, 33 * 64 * 1024);
+
+  /* Acknowledging part of the data is not enough */
+  send_control_message (tc->transport, "{ \"command\": \"pong\", \"channel\": \"554\", \"sequence\": 1 }");
+  g_assert_cmpint (pressure, ==, 1);
+
+  pong = g_strdup_printf ("{ \"command\": \"pong\", \"channel\": \"554\", \"sequence\": %" G_GINT64_FORMAT " }", sequence);
+  send_control_message (tc->transport, pong);
+  g_assert_cmpint (pressure, ==, 0);
+  g_free (pong);
+
+  g_bytes_unref (payload);
+}
+
+static void
+test_flow_disabled (TestCase *tc,
+                    gconstpointer unused)
+{
+  JsonObject *sent;
+  GBytes *payload;
+  gchar *block;
+  gint pressure = -1;
+  gint i;
+
+  g_signal_connect (tc->channel, "pressure", G_CALLBACK (on_pressure_set_flag), &pressure);
+  cockpit_channel_ready (tc->channel, NULL);
+
+  block = g_strnfill (64 * 1024, 'x');
+  payload = g_bytes_new_take (block, 64 * 1024);
+  for (i = 0; i < 64; i++)
+    cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), "554", payload);
+  g_bytes_unref (payload);
+
+  /* Only the ready message, no pings */
+  sent = mock_transport_pop_control (tc->transport);
+  g_assert_cmpstr (json_object_get_string_member (sent, "command"), ==, "ready");
+  g_assert (mock_transport_pop_control (tc->transport) == NULL);
+  g_assert_cmpint (pressure, ==, -1);
+}
+
 static void
 test_get_option (void)
 {
@@ -676,6 +796,12 @@ main (int argc,
               setup, test_close_json_option, teardown);
   g_test_add ("/channel/close-transport", TestCase, NULL,
               setup, test_close_transport, teardown);
+  g_test_add ("/channel/flow/ping-reply", TestCase, NULL,
+              setup, test_flow_ping_reply, teardown);
+  g_test_add ("/channel/flow/pressure", TestCase, GINT_TO_POINTER (TRUE),
+              setup, test_flow_pressure, teardown);
+  g_test_add ("/channel/flow/disabled", TestCase, NULL,
+              setup, test_flow_disabled, teardown);
 
   return g_test_run ();
 }
@@ -0,0 +1,524 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2018 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitdbuscache.h"
+
+#include "common/cockpittest.h"
+
+#include <glib/gstdio.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A service with a flat tree of objects under /tree, without an
+ * ObjectManager. So the cache has to introspect each object.
+ */
+
+static const gchar tree_xml[] =
+  "<node>"
+  "  <interface name=\"com.example.Tree\">"
+  "    <property name=\"Number\" type=\"u\" access=\"read\"/>"
+  "    <property name=\"Name\" type=\"s\" access=\"read\"/>"
+  "  </interface>"
+  "</node>";
+
+typedef struct {
+  GTestDBus *bus;
+  GDBusConnection *service;
+  GDBusConnection *client;
+  GDBusNodeInfo *node;
+  guint subtree;
+  gint objects;
+  gint introspects;
+
+  /* Introspect() calls the service has received but not answered */
+  GMutex mutex;
+  guint filter;
+  GHashTable *unanswered;
+  guint peak_unanswered;
+
+  /* What the cache told us */
+  GHashTable *metas;
+  GHashTable *paths;
+  gboolean out_of_order;
+  gdouble first_meta;
+  gboolean done;
+  GDBusInterfaceInfo *iface;
+} TestCase;
+
+static GVariant *
+tree_get_property (GDBusConnection *connection,
+                   const gchar *sender,
+                   const gchar *object_path,
+                   const gchar *interface_name,
+                   const gchar *property_name,
+                   GError **error,
+                   gpointer user_data)
+{
+  const gchar *name = strrchr (object_path, '/') + 1;
+
+  if (g_str_equal (property_name, "Number"))
+    return g_variant_new_uint32 (atoi (name + 3));
+  else
+    return g_variant_new_string (name);
+}
+
+static const GDBusInterfaceVTable tree_vtable = {
+  NULL, tree_get_property, NULL,
+};
+
+static gchar **
+tree_enumerate (GDBusConnection *connection,
+                const gchar *sender,
+                const gchar *object_path,
+                gpointer user_data)
+{
+  TestCase *tc = user_data;
+  gchar **nodes;
+  gint i;
+
+  nodes = g_new0 (gchar *, tc->objects + 1);
+  for (i = 0; i < tc->objects; i++)
+    nodes[i] = g_strdup_printf ("obj%d", i);
+  return nodes;
+}
+
+static GDBusInterfaceInfo **
+tree_introspect (GDBusConnection *connection,
+                 const gchar *sender,
+                 const gchar *object_path,
+                 const gchar *node,
+                 gpointer user_data)
+{
+  TestCase *tc = user_data;
+  GDBusInterfaceInfo **ifaces;
+
+  tc->introspects++;
+
+  if (node == NULL)
+    return NULL;
+
+  ifaces = g_new0 (GDBusInterfaceInfo *, 2);
+  ifaces[0] = g_dbus_interface_info_ref (tc->node->interfaces[0]);
+  return ifaces;
+}
+
+static const GDBusInterfaceVTable *
+tree_dispatch (GDBusConnection *connection,
+               const gchar *sender,
+               const gchar *object_path,
+               const gchar *interface_name,
+               const gchar *node,
+               gpointer *out_user_data,
+               gpointer user_data)
+{
+  if (node && g_strcmp0 (interface_name, "com.example.Tree") == 0)
+    return &tree_vtable;
+  return NULL;
+}
+
+static const GDBusSubtreeVTable tree_subtree_vtable = {
+  tree_enumerate, tree_introspect, tree_dispatch,
+};
+
+/* Runs in the GDBus worker thread, for messages in both directions */
+static GDBusMessage *
+count_unanswered (GDBusConnection *connection,
+                  GDBusMessage *message,
+                  gboolean incoming,
+                  gpointer user_data)
+{
+  TestCase *tc = user_data;
+  guint32 serial;
+
+  g_mutex_lock (&tc->mutex);
+
+  if (incoming)
+    {
+      if (g_dbus_message_get_message_type (message) == G_DBUS_MESSAGE_TYPE_METHOD_CALL &&
+          g_strcmp0 (g_dbus_message_get_member (message), "Introspect") == 0)
+        {
+          serial = g_dbus_message_get_serial (message);
+          g_hash_table_add (tc->unanswered, GUINT_TO_POINTER (serial));
+          tc->peak_unanswered = MAX (tc->peak_unanswered, g_hash_table_size (tc->unanswered));
+        }
+    }
+  else
+    {
+      serial = g_dbus_message_get_reply_serial (message);
+      if (serial)
+        g_hash_table_remove (tc->unanswered, GUINT_TO_POINTER (serial));
+    }
+
+  g_mutex_unlock (&tc->mutex);
+
+  return message;
+}
+
+static GDBusConnection *
+connect_to_bus (TestCase *tc)
+{
+  GDBusConnection *connection;
+  GError *error = NULL;
+
+  connection = g_dbus_connection_new_for_address_sync (g_test_dbus_get_bus_address (tc->bus),
+                                                       G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                       G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                       NULL, NULL, &error);
+  g_assert_no_error (error);
+  return connection;
+}
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  GError *error = NULL;
+
+  tc->objects = GPOINTER_TO_INT (data);
+
+  tc->bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (tc->bus);
+
+  tc->service = connect_to_bus (tc);
+  tc->client = connect_to_bus (tc);
+
+  g_mutex_init (&tc->mutex);
+  tc->unanswered = g_hash_table_new (g_direct_hash, g_direct_equal);
+  tc->filter = g_dbus_connection_add_filter (tc->service, count_unanswered, tc, NULL);
+
+  tc->node = g_dbus_node_info_new_for_xml (tree_xml, &error);
+  g_assert_no_error (error);
+
+  tc->subtree = g_dbus_connection_register_subtree (tc->service, "/tree", &tree_subtree_vtable,
+                                                    G_DBUS_SUBTREE_FLAGS_NONE, tc, NULL, &error);
+  g_assert_no_error (error);
+
+  tc->metas = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  tc->paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  g_dbus_connection_unregister_subtree (tc->service, tc->subtree);
+  g_dbus_node_info_unref (tc->node);
+  g_dbus_connection_remove_filter (tc->service, tc->filter);
+
+  g_object_unref (tc->client);
+  g_object_unref (tc->service);
+
+  g_test_dbus_down (tc->bus);
+  g_object_unref (tc->bus);
+
+  g_hash_table_destroy (tc->metas);
+  g_hash_table_destroy (tc->paths);
+  g_hash_table_destroy (tc->unanswered);
+  g_mutex_clear (&tc->mutex);
+}
+
+static void
+on_cache_meta (CockpitDBusCache *cache,
+               GDBusInterfaceInfo *iface,
+               gpointer user_data)
+{
+  TestCase *tc = user_data;
+
+  if (g_hash_table_size (tc->metas) == 0)
+    tc->first_meta = g_test_timer_elapsed ();
+  g_hash_table_add (tc->metas, g_strdup (iface->name));
+}
+
+static void
+on_cache_update (CockpitDBusCache *cache,
+                 GHashTable *update,
+                 gpointer user_data)
+{
+  TestCase *tc = user_data;
+  GHashTableIter i, j;
+  GHashTable *interfaces;
+  GHashTable *properties;
+  const gchar *interface;
+  const gchar *path;
+  GVariant *value;
+
+  g_hash_table_iter_init (&i, update);
+  while (g_hash_table_iter_next (&i, (gpointer *)&path, (gpointer *)&interfaces))
+    {
+      g_hash_table_iter_init (&j, interfaces);
+      while (g_hash_table_iter_next (&j, (gpointer *)&interface, (gpointer *)&properties))
+        {
+          /* Interface info must always come first */
+          if (!g_hash_table_contains (tc->metas, interface))
+            tc->out_of_order = TRUE;
+
+          if (properties && g_str_equal (interface, "com.example.Tree"))
+            {
+              value = g_hash_table_lookup (properties, "Name");
+              if (value && g_str_equal (g_variant_get_string (value, NULL), strrchr (path, '/') + 1))
+                g_hash_table_add (tc->paths, g_strdup (path));
+            }
+        }
+    }
+}
+
+static void
+on_barrier (CockpitDBusCache *cache,
+            gpointer user_data)
+{
+  TestCase *tc = user_data;
+  tc->done = TRUE;
+}
+
+static CockpitDBusCache *
+watch_tree (TestCase *tc)
+{
+  CockpitDBusCache *cache;
+
+  cache = cockpit_dbus_cache_new (tc->client, NULL,
+                                  g_dbus_connection_get_unique_name (tc->service),
+                                  "test", NULL);
+  g_signal_connect (cache, "meta", G_CALLBACK (on_cache_meta), tc);
+  g_signal_connect (cache, "update", G_CALLBACK (on_cache_update), tc);
+
+  g_test_timer_start ();
+  cockpit_dbus_cache_watch (cache, "/tree", TRUE, NULL);
+  cockpit_dbus_cache_barrier (cache, on_barrier, tc);
+
+  while (!tc->done)
+    g_main_context_iteration (NULL, TRUE);
+
+  return cache;
+}
+
+static void
+test_introspect_tree (TestCase *tc,
+                      gconstpointer data)
+{
+  CockpitDBusCache *cache;
+
+  cache = watch_tree (tc);
+
+  /* Every object is there once the barrier passes, and in order */
+  g_assert_cmpint (g_hash_table_size (tc->paths), ==, tc->objects);
+  g_assert (g_hash_table_contains (tc->paths, "/tree/obj0"));
+  g_assert (g_hash_table_contains (tc->paths, "/tree/obj99"));
+  g_assert (g_hash_table_contains (tc->metas, "com.example.Tree"));
+  g_assert (!tc->out_of_order);
+
+  /* Several calls were in flight at once, but never more than the cache allows */
+  g_mutex_lock (&tc->mutex);
+  g_assert_cmpuint (tc->peak_unanswered, >, 1);
+  g_assert_cmpuint (tc->peak_unanswered, <=, 16);
+  g_mutex_unlock (&tc->mutex);
+
+  g_object_unref (cache);
+}
+
+static void
+test_introspect_dispose (TestCase *tc,
+                         gconstpointer data)
+{
+  CockpitDBusCache *cache;
+  gint i;
+
+  cache = cockpit_dbus_cache_new (tc->client, NULL,
+                                  g_dbus_connection_get_unique_name (tc->service),
+                                  "test", NULL);
+  cockpit_dbus_cache_watch (cache, "/tree", TRUE, NULL);
+  cockpit_dbus_cache_barrier (cache, on_barrier, tc);
+
+  /* Go away while introspection calls are still in flight */
+  for (i = 0; i < 10 && !tc->done; i++)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_object_run_dispose (G_OBJECT (cache));
+  g_assert (tc->done);
+
+  /* Outstanding replies still arrive, and hold the last references */
+  g_object_add_weak_pointer (G_OBJECT (cache), (gpointer *)&cache);
+  g_object_unref (cache);
+  while (cache != NULL)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+on_introspected (CockpitDBusCache *cache,
+                 GDBusInterfaceInfo *iface,
+                 gpointer user_data)
+{
+  TestCase *tc = user_data;
+  g_assert (iface != NULL);
+  tc->iface = g_dbus_interface_info_ref (iface);
+}
+
+static void
+test_introspect_persist (TestCase *tc,
+                         gconstpointer data)
+{
+  CockpitDBusCache *cache;
+  GError *error = NULL;
+  GVariant *retval;
+  gchar *directory;
+  gchar *filename;
+  gchar *other;
+
+  directory = g_dir_make_tmp ("test-dbus-cache.XXXXXX", &error);
+  g_assert_no_error (error);
+  filename = g_build_filename (directory, "session", "com.example.Tree.json", NULL);
+  other = g_build_filename (directory, "system", "com.example.Tree.json", NULL);
+  cockpit_dbus_cache_directory = directory;
+
+  /* Only services with a well known name are kept */
+  retval = g_dbus_connection_call_sync (tc->service, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                        "org.freedesktop.DBus", "RequestName",
+                                        g_variant_new ("(su)", "com.example.Tree", 4),
+                                        G_VARIANT_TYPE ("(u)"), G_DBUS_CALL_FLAGS_NONE,
+                                        -1, NULL, &error);
+  g_assert_no_error (error);
+  g_variant_unref (retval);
+
+  cache = cockpit_dbus_cache_new (tc->client, "session", "com.example.Tree", "test", NULL);
+  g_signal_connect (cache, "meta", G_CALLBACK (on_cache_meta), tc);
+  cockpit_dbus_cache_watch (cache, "/tree/obj1", FALSE, NULL);
+  cockpit_dbus_cache_barrier (cache, on_barrier, tc);
+  while (!tc->done)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpint (tc->introspects, >, 0);
+  g_assert (g_hash_table_contains (tc->metas, "com.example.Tree"));
+
+  /* Written when the cache goes away */
+  g_object_unref (cache);
+  g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
+
+  /* The next cache knows the interface without calling Introspect() */
+  tc->introspects = 0;
+  cache = cockpit_dbus_cache_new (tc->client, "session", "com.example.Tree", "test", NULL);
+  cockpit_dbus_cache_introspect (cache, "/tree/obj2", "com.example.Tree", on_introspected, tc);
+  while (!tc->iface)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpint (tc->introspects, ==, 0);
+  g_assert_cmpstr (tc->iface->name, ==, "com.example.Tree");
+  g_assert (g_dbus_interface_info_lookup_property (tc->iface, "Number") != NULL);
+  g_assert (g_dbus_interface_info_lookup_property (tc->iface, "Name") != NULL);
+  g_dbus_interface_info_unref (tc->iface);
+  tc->iface = NULL;
+
+  /* But checks it with one Introspect() in the background */
+  while (tc->introspects == 0)
+    g_main_context_iteration (NULL, TRUE);
+  cockpit_dbus_cache_introspect (cache, "/tree/obj3", "com.example.Tree", on_introspected, tc);
+  g_assert (tc->iface != NULL);
+  g_dbus_interface_info_unref (tc->iface);
+  tc->iface = NULL;
+  g_object_unref (cache);
+
+  g_assert_cmpint (tc->introspects, ==, 1);
+  tc->introspects = 0;
+
+  /* The same name on another bus keeps a file of its own */
+  cache = cockpit_dbus_cache_new (tc->client, "system", "com.example.Tree", "test", NULL);
+  cockpit_dbus_cache_introspect (cache, "/tree/obj2", "com.example.Tree", on_introspected, tc);
+  while (!tc->iface)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpint (tc->introspects, >, 0);
+  g_dbus_interface_info_unref (tc->iface);
+  tc->iface = NULL;
+  g_object_unref (cache);
+
+  g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
+  g_assert (g_file_test (other, G_FILE_TEST_EXISTS));
+  tc->introspects = 0;
+
+  /* Not used for another build of the service */
+  g_file_set_contents (filename, "{\"identity\":\"other\",\"interfaces\":{}}", -1, &error);
+  g_assert_no_error (error);
+
+  cache = cockpit_dbus_cache_new (tc->client, "session", "com.example.Tree", "test", NULL);
+  cockpit_dbus_cache_introspect (cache, "/tree/obj2", "com.example.Tree", on_introspected, tc);
+  while (!tc->iface)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpint (tc->introspects, >, 0);
+  g_dbus_interface_info_unref (tc->iface);
+  tc->iface = NULL;
+  g_object_unref (cache);
+
+  cockpit_dbus_cache_directory = NULL;
+  g_unlink (filename);
+  g_unlink (other);
+  g_free (filename);
+  filename = g_path_get_dirname (other);
+  g_rmdir (filename);
+  g_free (filename);
+  filename = g_build_filename (directory, "session", NULL);
+  g_rmdir (filename);
+  g_rmdir (directory);
+  g_free (filename);
+  g_free (other);
+  g_free (directory);
+}
+
+static void
+test_introspect_perf (TestCase *tc,
+                      gconstpointer data)
+{
+  CockpitDBusCache *cache;
+  gdouble elapsed;
+
+  cache = watch_tree (tc);
+  elapsed = g_test_timer_elapsed ();
+
+  g_assert_cmpint (g_hash_table_size (tc->paths), ==, tc->objects);
+  g_assert (!tc->out_of_order);
+
+  g_test_message ("%d objects: first meta after %.1f ms, all properties after %.1f ms",
+                  tc->objects, tc->first_meta * 1000, elapsed * 1000);
+
+  g_object_unref (cache);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/dbus-cache/introspect-tree", TestCase, GINT_TO_POINTER (100),
+              setup, test_introspect_tree, teardown);
+  g_test_add ("/dbus-cache/introspect-dispose", TestCase, GINT_TO_POINTER (100),
+              setup, test_introspect_dispose, teardown);
+  g_test_add ("/dbus-cache/introspect-persist", TestCase, GINT_TO_POINTER (10),
+              setup, test_introspect_persist, teardown);
+
+  if (g_test_perf ())
+    {
+      g_test_add ("/dbus-cache/introspect-perf", TestCase, GINT_TO_POINTER (5000),
+                  setup, test_introspect_perf, teardown);
+    }
+
+  return g_test_run ();
+}
@@ -0,0 +1,673 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2018 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitdbuscache.h"
+#include "cockpitdbusjson.h"
+#include "mock-transport.h"
+
+#include "common/cockpitjson.h"
+#include "common/cockpittest.h"
+
+#include <glib/gstdio.h>
+
+#include <string.h>
+
+/*
+ * A service with one object whose Count property changes a lot, and a
+ * dbus-json3 channel watching it.
+ */
+
+static const gchar storm_xml[] =
+  "<node>"
+  "  <interface name=\"com.example.Storm\">"
+  "    <property name=\"Count\" type=\"u\" access=\"read\"/>"
+  "    <method name=\"Break\">"
+  "      <arg name=\"what\" type=\"s\" direction=\"in\"/>"
+  "    </method>"
+  "    <signal name=\"Changed\">"
+  "      <arg name=\"what\" type=\"s\"/>"
+  "      <arg name=\"details\" type=\"a{sv}\"/>"
+  "      <arg name=\"data\" type=\"ay\"/>"
+  "    </signal>"
+  "  </interface>"
+  "</node>";
+
+typedef struct {
+  gint64 interval;
+  gint signals;
+} Fixture;
+
+typedef struct {
+  GTestDBus *bus;
+  GDBusConnection *service;
+  GDBusNodeInfo *node;
+  guint registration;
+  guint32 count;
+
+  MockTransport *transport;
+  CockpitChannel *channel;
+} TestCase;
+
+static GVariant *
+storm_get_property (GDBusConnection *connection,
+                    const gchar *sender,
+                    const gchar *object_path,
+                    const gchar *interface_name,
+                    const gchar *property_name,
+                    GError **error,
+                    gpointer user_data)
+{
+  TestCase *tc = user_data;
+  return g_variant_new_uint32 (tc->count);
+}
+
+static void
+storm_method_call (GDBusConnection *connection,
+                   const gchar *sender,
+                   const gchar *object_path,
+                   const gchar *interface_name,
+                   const gchar *method_name,
+                   GVariant *parameters,
+                   GDBusMethodInvocation *invocation,
+                   gpointer user_data)
+{
+  const gchar *what;
+  gchar *message;
+
+  g_variant_get (parameters, "(&s)", &what);
+  message = g_strdup_printf ("Broken \"%s\"", what);
+  g_dbus_method_invocation_return_dbus_error (invocation, "com.example.Error", message);
+  g_free (message);
+}
+
+static const GDBusInterfaceVTable storm_vtable = {
+  storm_method_call, storm_get_property, NULL,
+};
+
+static JsonObject *
+recv_channel_json (TestCase *tc,
+                   const gchar *channel)
+{
+  JsonObject *object;
+  GBytes *bytes;
+
+  while ((bytes = mock_transport_pop_channel (tc->transport, channel)) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  object = cockpit_json_parse_bytes (bytes, NULL);
+  g_assert (object != NULL);
+  return object;
+}
+
+static JsonObject *
+recv_json (TestCase *tc)
+{
+  return recv_channel_json (tc, "1234");
+}
+
+/* Reads messages until one with @member, and returns it as it was sent */
+static gchar *
+recv_message (TestCase *tc,
+              const gchar *member)
+{
+  JsonObject *object;
+  GBytes *bytes;
+  gchar *message = NULL;
+
+  while (message == NULL)
+    {
+      while ((bytes = mock_transport_pop_channel (tc->transport, "1234")) == NULL)
+        g_main_context_iteration (NULL, TRUE);
+
+      object = cockpit_json_parse_bytes (bytes, NULL);
+      g_assert (object != NULL);
+      if (json_object_has_member (object, member))
+        message = g_strndup (g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes));
+      json_object_unref (object);
+    }
+
+  return message;
+}
+
+static void
+send_channel_json (TestCase *tc,
+                   const gchar *channel,
+                   const gchar *json)
+{
+  GBytes *bytes = g_bytes_new_static (json, strlen (json));
+  cockpit_transport_emit_recv (COCKPIT_TRANSPORT (tc->transport), channel, bytes);
+  g_bytes_unref (bytes);
+}
+
+static void
+send_json (TestCase *tc,
+           const gchar *json)
+{
+  send_channel_json (tc, "1234", json);
+}
+
+static CockpitChannel *
+open_channel (TestCase *tc,
+              const gchar *channel_id,
+              const gchar *name,
+              gint64 notify_interval)
+{
+  CockpitChannel *channel;
+  JsonObject *options;
+  JsonObject *control;
+  const gchar *command;
+  const gchar *id;
+  gboolean ready = FALSE;
+
+  options = json_object_new ();
+  json_object_set_string_member (options, "bus", "session");
+  json_object_set_string_member (options, "name", name);
+  json_object_set_string_member (options, "payload", "dbus-json3");
+  json_object_set_int_member (options, "notify-interval", notify_interval);
+
+  channel = g_object_new (COCKPIT_TYPE_DBUS_JSON,
+                          "transport", tc->transport,
+                          "id", channel_id,
+                          "options", options,
+                          NULL);
+  json_object_unref (options);
+  cockpit_channel_prepare (channel);
+
+  while (!ready)
+    {
+      while ((control = mock_transport_pop_control (tc->transport)) == NULL)
+        g_main_context_iteration (NULL, TRUE);
+      g_assert (cockpit_json_get_string (control, "command", NULL, &command));
+      g_assert (cockpit_json_get_string (control, "channel", NULL, &id));
+      ready = (g_strcmp0 (command, "ready") == 0 && g_strcmp0 (id, channel_id) == 0);
+    }
+
+  return channel;
+}
+
+static void
+setup (TestCase *tc,
+       gconstpointer data)
+{
+  const Fixture *fixture = data;
+  GError *error = NULL;
+
+  /* Also sets the session bus address for the channel */
+  tc->bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (tc->bus);
+
+  tc->service = g_dbus_connection_new_for_address_sync (g_test_dbus_get_bus_address (tc->bus),
+                                                        G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                        G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                        NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  tc->node = g_dbus_node_info_new_for_xml (storm_xml, &error);
+  g_assert_no_error (error);
+
+  tc->registration = g_dbus_connection_register_object (tc->service, "/storm", tc->node->interfaces[0],
+                                                        &storm_vtable, tc, NULL, &error);
+  g_assert_no_error (error);
+
+  tc->transport = mock_transport_new ();
+  tc->channel = open_channel (tc, "1234", g_dbus_connection_get_unique_name (tc->service),
+                              fixture->interval);
+}
+
+static void
+teardown (TestCase *tc,
+          gconstpointer data)
+{
+  g_object_unref (tc->channel);
+  g_object_unref (tc->transport);
+
+  g_dbus_connection_unregister_object (tc->service, tc->registration);
+  g_dbus_node_info_unref (tc->node);
+  g_object_unref (tc->service);
+
+  g_test_dbus_down (tc->bus);
+  g_object_unref (tc->bus);
+}
+
+/* Reads messages until the reply, returns the number of notify messages */
+static gint
+wait_channel_reply (TestCase *tc,
+                    const gchar *channel,
+                    const gchar *id,
+                    gint64 *count)
+{
+  JsonObject *object;
+  JsonObject *notify;
+  JsonObject *path;
+  JsonObject *properties;
+  const gchar *cookie;
+  gint notifies = 0;
+  gboolean done = FALSE;
+
+  while (!done)
+    {
+      object = recv_channel_json (tc, channel);
+      g_assert (!json_object_has_member (object, "error"));
+
+      if (cockpit_json_get_object (object, "notify", NULL, &notify) && notify)
+        {
+          notifies++;
+          if (cockpit_json_get_object (notify, "/storm", NULL, &path) && path &&
+              cockpit_json_get_object (path, "com.example.Storm", NULL, &properties) && properties)
+            {
+              g_assert (cockpit_json_get_int (properties, "Count", *count, count));
+            }
+        }
+      else if (cockpit_json_get_string (object, "id", NULL, &cookie) && cookie)
+        {
+          done = g_str_equal (cookie, id);
+        }
+
+      json_object_unref (object);
+    }
+
+  return notifies;
+}
+
+static gint
+wait_reply (TestCase *tc,
+            const gchar *id,
+            gint64 *count)
+{
+  return wait_channel_reply (tc, "1234", id, count);
+}
+
+static void
+emit_count (TestCase *tc,
+            guint32 count)
+{
+  const gchar *invalidated[] = { NULL };
+  GVariantBuilder changed;
+  GError *error = NULL;
+
+  tc->count = count;
+
+  g_variant_builder_init (&changed, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&changed, "{sv}", "Count", g_variant_new_uint32 (count));
+  g_dbus_connection_emit_signal (tc->service, NULL, "/storm",
+                                 "org.freedesktop.DBus.Properties", "PropertiesChanged",
+                                 g_variant_new ("(sa{sv}^as)", "com.example.Storm", &changed, invalidated),
+                                 &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_notify_burst (TestCase *tc,
+                   gconstpointer data)
+{
+  const Fixture *fixture = data;
+  gint64 count = -1;
+  gint64 elapsed;
+  gint64 started;
+  gint notifies;
+  gint i;
+
+  send_json (tc, "{\"watch\":{\"path\":\"/storm\"},\"id\":\"1\"}");
+  wait_reply (tc, "1", &count);
+  g_assert_cmpint (count, ==, 0);
+
+  started = g_get_monotonic_time ();
+  for (i = 1; i <= fixture->signals; i++)
+    emit_count (tc, i);
+  g_dbus_connection_flush_sync (tc->service, NULL, NULL);
+
+  /* Comes back after all the signals, and after notify about them */
+  send_json (tc, "{\"call\":[\"/storm\",\"org.freedesktop.DBus.Peer\",\"Ping\",[]],\"id\":\"2\"}");
+  notifies = wait_reply (tc, "2", &count);
+  elapsed = (g_get_monotonic_time () - started) / 1000;
+
+  g_test_message ("%d signals in %d ms: %d notify messages", fixture->signals, (gint)elapsed, notifies);
+
+  /* Only the last value matters */
+  g_assert_cmpint (count, ==, fixture->signals);
+
+  if (fixture->interval == 0)
+    {
+      g_assert_cmpint (notifies, ==, fixture->signals);
+    }
+  else
+    {
+      /* One right away, then one per interval, and one more before the reply */
+      g_assert_cmpint (notifies, <=, elapsed / fixture->interval + 2);
+      g_assert_cmpint (notifies, <, fixture->signals);
+    }
+}
+
+/*
+ * An ObjectManager at /om that reports another com.example.Storm
+ * object, so its interface info is used without introspecting.
+ */
+
+static const gchar manager_xml[] =
+  "<node>"
+  "  <interface name=\"org.freedesktop.DBus.ObjectManager\">"
+  "    <method name=\"GetManagedObjects\">"
+  "      <arg name=\"objects\" type=\"a{oa{sa{sv}}}\" direction=\"out\"/>"
+  "    </method>"
+  "  </interface>"
+  "</node>";
+
+static void
+manager_method_call (GDBusConnection *connection,
+                     const gchar *sender,
+                     const gchar *object_path,
+                     const gchar *interface_name,
+                     const gchar *method_name,
+                     GVariant *parameters,
+                     GDBusMethodInvocation *invocation,
+                     gpointer user_data)
+{
+  g_dbus_method_invocation_return_value (invocation,
+      g_variant_new_parsed ("({objectpath '/om/storm': {'com.example.Storm': {'Count': <uint32 0>}}},)"));
+}
+
+static const GDBusInterfaceVTable manager_vtable = {
+  manager_method_call, NULL, NULL,
+};
+
+/* Reads messages until the reply, and the last meta for com.example.Storm */
+static JsonObject *
+wait_meta (TestCase *tc,
+           const gchar *channel,
+           const gchar *id,
+           JsonObject *previous)
+{
+  JsonObject *object;
+  JsonObject *meta;
+  JsonObject *storm;
+  const gchar *cookie;
+  gboolean done = FALSE;
+
+  while (!done)
+    {
+      object = recv_channel_json (tc, channel);
+      g_assert (!json_object_has_member (object, "error"));
+
+      if (cockpit_json_get_object (object, "meta", NULL, &meta) && meta &&
+          cockpit_json_get_object (meta, "com.example.Storm", NULL, &storm) && storm)
+        {
+          if (previous)
+            json_object_unref (previous);
+          previous = json_object_ref (storm);
+        }
+      else if (cockpit_json_get_string (object, "id", NULL, &cookie) && cookie)
+        {
+          done = g_str_equal (cookie, id);
+        }
+
+      json_object_unref (object);
+    }
+
+  return previous;
+}
+
+/* Waits until the channel and its cache are gone */
+static void
+close_channel (CockpitChannel *channel)
+{
+  g_object_add_weak_pointer (G_OBJECT (channel), (gpointer *)&channel);
+  g_object_unref (channel);
+  while (channel != NULL)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static gboolean
+meta_has_property (JsonObject *meta,
+                   const gchar *property)
+{
+  JsonObject *properties;
+
+  g_assert (meta != NULL);
+  g_assert (cockpit_json_get_object (meta, "properties", NULL, &properties));
+  return properties && json_object_has_member (properties, property);
+}
+
+static void
+test_meta_persist_wrong (TestCase *tc,
+                         gconstpointer data)
+{
+  CockpitChannel *channel;
+  JsonObject *interfaces;
+  JsonObject *properties;
+  JsonObject *property;
+  JsonObject *object;
+  JsonObject *meta;
+  GError *error = NULL;
+  GDBusNodeInfo *node;
+  GVariant *retval;
+  gchar *directory;
+  gchar *filename;
+  gchar *contents;
+  guint registration;
+
+  directory = g_dir_make_tmp ("test-dbus-json.XXXXXX", &error);
+  g_assert_no_error (error);
+  filename = g_build_filename (directory, "session", "com.example.Storm.json", NULL);
+  cockpit_dbus_cache_directory = directory;
+
+  /* Only services with a well known name are kept */
+  retval = g_dbus_connection_call_sync (tc->service, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                        "org.freedesktop.DBus", "RequestName",
+                                        g_variant_new ("(su)", "com.example.Storm", 4),
+                                        G_VARIANT_TYPE ("(u)"), G_DBUS_CALL_FLAGS_NONE,
+                                        -1, NULL, &error);
+  g_assert_no_error (error);
+  g_variant_unref (retval);
+
+  node = g_dbus_node_info_new_for_xml (manager_xml, &error);
+  g_assert_no_error (error);
+  registration = g_dbus_connection_register_object (tc->service, "/om", node->interfaces[0],
+                                                    &manager_vtable, tc, NULL, &error);
+  g_assert_no_error (error);
+
+  /* Written when the last channel for the name goes away */
+  channel = open_channel (tc, "a", "com.example.Storm", 0);
+  send_channel_json (tc, "a", "{\"watch\":{\"path\":\"/storm\"},\"id\":\"1\"}");
+  meta = wait_meta (tc, "a", "1", NULL);
+  g_assert (meta_has_property (meta, "Count"));
+  json_object_unref (meta);
+  close_channel (channel);
+  g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
+
+  /* Same build of the service, but the contents are wrong */
+  g_file_get_contents (filename, &contents, NULL, &error);
+  g_assert_no_error (error);
+  object = cockpit_json_parse_object (contents, -1, &error);
+  g_assert_no_error (error);
+  g_free (contents);
+
+  g_assert (cockpit_json_get_object (object, "interfaces", NULL, &interfaces) && interfaces);
+  g_assert (cockpit_json_get_object (interfaces, "com.example.Storm", NULL, &meta) && meta);
+  g_assert (cockpit_json_get_object (meta, "properties", NULL, &properties) && properties);
+  property = json_object_new ();
+  json_object_set_string_member (property, "flags", "r");
+  json_object_set_string_member (property, "type", "s");
+  json_object_set_object_member (properties, "Bogus", property);
+
+  contents = cockpit_json_write_object (object, NULL);
+  g_file_set_contents (filename, contents, -1, &error);
+  g_assert_no_error (error);
+  json_object_unref (object);
+  g_free (contents);
+
+  /* The ObjectManager makes the cache use what it loaded */
+  channel = open_channel (tc, "b", "com.example.Storm", 0);
+  send_channel_json (tc, "b", "{\"watch\":{\"path_namespace\":\"/om\"},\"id\":\"2\"}");
+  meta = wait_meta (tc, "b", "2", NULL);
+  g_assert (meta_has_property (meta, "Bogus"));
+
+  /* Introspecting finds out it was wrong, and the channel gets the real thing */
+  send_channel_json (tc, "b", "{\"watch\":{\"path\":\"/storm\"},\"id\":\"3\"}");
+  meta = wait_meta (tc, "b", "3", meta);
+  g_assert (meta_has_property (meta, "Count"));
+  g_assert (!meta_has_property (meta, "Bogus"));
+  json_object_unref (meta);
+  close_channel (channel);
+
+  g_dbus_connection_unregister_object (tc->service, registration);
+  g_dbus_node_info_unref (node);
+
+  cockpit_dbus_cache_directory = NULL;
+  g_unlink (filename);
+  g_free (filename);
+  filename = g_build_filename (directory, "session", NULL);
+  g_rmdir (filename);
+  g_rmdir (directory);
+  g_free (filename);
+  g_free (directory);
+}
+
+static void
+test_shared_unwatch (TestCase *tc,
+                     gconstpointer data)
+{
+  CockpitChannel *other;
+  gint64 count = -1;
+  gint64 other_count = -1;
+
+  other = open_channel (tc, "other", g_dbus_connection_get_unique_name (tc->service), 0);
+
+  /* Both channels watch the same object through one cache */
+  send_json (tc, "{\"watch\":{\"path\":\"/storm\"},\"id\":\"1\"}");
+  wait_reply (tc, "1", &count);
+  g_assert_cmpint (count, ==, 0);
+  send_channel_json (tc, "other", "{\"watch\":{\"path\":\"/storm\"},\"id\":\"1\"}");
+  wait_channel_reply (tc, "other", "1", &other_count);
+  g_assert_cmpint (other_count, ==, 0);
+
+  /* Once the other channel stops watching, only this one hears about changes */
+  send_channel_json (tc, "other", "{\"unwatch\":{\"path\":\"/storm\"}}");
+  emit_count (tc, 1);
+  g_dbus_connection_flush_sync (tc->service, NULL, NULL);
+
+  send_json (tc, "{\"call\":[\"/storm\",\"org.freedesktop.DBus.Peer\",\"Ping\",[]],\"id\":\"2\"}");
+  g_assert_cmpint (wait_reply (tc, "2", &count), ==, 1);
+  g_assert_cmpint (count, ==, 1);
+  send_channel_json (tc, "other", "{\"call\":[\"/\",\"org.freedesktop.DBus.Peer\",\"Ping\",[]],\"id\":\"2\"}");
+  g_assert_cmpint (wait_channel_reply (tc, "other", "2", &other_count), ==, 0);
+  g_assert_cmpint (other_count, ==, 0);
+
+  /* And this one keeps its watch when the other one goes away */
+  send_channel_json (tc, "other", "{\"watch\":{\"path\":\"/storm\"},\"id\":\"3\"}");
+  wait_channel_reply (tc, "other", "3", &other_count);
+  close_channel (other);
+
+  emit_count (tc, 2);
+  g_dbus_connection_flush_sync (tc->service, NULL, NULL);
+
+  send_json (tc, "{\"call\":[\"/storm\",\"org.freedesktop.DBus.Peer\",\"Ping\",[]],\"id\":\"3\"}");
+  g_assert_cmpint (wait_reply (tc, "3", &count), ==, 1);
+  g_assert_cmpint (count, ==, 2);
+}
+
+static void
+test_wire_format (TestCase *tc,
+                  gconstpointer data)
+{
+  const gchar *flags = G_BYTE_ORDER == G_BIG_ENDIAN ? ">" : "<";
+  GError *error = NULL;
+  gint64 count = -1;
+  gchar *expected;
+  gchar *message;
+
+  /*
+   * Exactly the bytes that the channel sent when it still built each
+   * message as a JsonObject and wrote it with cockpit_json_write().
+   */
+
+  send_json (tc, "{\"watch\":{\"path\":\"/storm\"},\"id\":\"1\"}");
+  wait_reply (tc, "1", &count);
+
+  emit_count (tc, 7);
+  message = recv_message (tc, "notify");
+  g_assert_cmpstr (message, ==, "{\"notify\":{\"/storm\":{\"com.example.Storm\":{\"Count\":7}}}}");
+  g_free (message);
+
+  send_json (tc, "{\"call\":[\"/storm\",\"org.freedesktop.DBus.Properties\",\"Get\","
+             "[\"com.example.Storm\",\"Count\"]],\"id\":\"2\",\"type\":\"ss\",\"flags\":\"\"}");
+  message = recv_message (tc, "reply");
+  expected = g_strdup_printf ("{\"reply\":[[{\"t\":\"u\",\"v\":7}]],\"type\":\"v\",\"id\":\"2\",\"flags\":\"%s\"}", flags);
+  g_assert_cmpstr (message, ==, expected);
+  g_free (expected);
+  g_free (message);
+
+  send_json (tc, "{\"call\":[\"/storm\",\"com.example.Storm\",\"Break\",[\"it\"]],\"id\":\"3\"}");
+  message = recv_message (tc, "error");
+  g_assert_cmpstr (message, ==, "{\"error\":[\"com.example.Error\",[\"Broken \\\"it\\\"\"]],\"id\":\"3\"}");
+  g_free (message);
+
+  send_json (tc, "{\"call\":[\"/storm\",\"com.example.Storm\",\"Break\",[\"it\"]],\"id\":\"4\","
+             "\"type\":\"s\",\"flags\":\"\"}");
+  message = recv_message (tc, "error");
+  expected = g_strdup_printf ("{\"error\":[\"com.example.Error\",[\"Broken \\\"it\\\"\"]],\"type\":\"s\",\"id\":\"4\",\"flags\":\"%s\"}", flags);
+  g_assert_cmpstr (message, ==, expected);
+  g_free (expected);
+  g_free (message);
+
+  /* The match is in place once a later call comes back */
+  send_json (tc, "{\"add-match\":{\"path\":\"/storm\",\"interface\":\"com.example.Storm\"}}");
+  send_json (tc, "{\"call\":[\"/storm\",\"org.freedesktop.DBus.Peer\",\"Ping\",[]],\"id\":\"5\"}");
+  wait_reply (tc, "5", &count);
+
+  g_dbus_connection_emit_signal (tc->service, NULL, "/storm", "com.example.Storm", "Changed",
+                                 g_variant_new_parsed ("('it', {'x': <1>, 'y': <@ay [byte 1, 2]>}, [byte 0x68, 0x69])"),
+                                 &error);
+  g_assert_no_error (error);
+  message = recv_message (tc, "signal");
+  g_assert_cmpstr (message, ==, "{\"signal\":[\"/storm\",\"com.example.Storm\",\"Changed\","
+                   "[\"it\",{\"x\":{\"t\":\"i\",\"v\":1},\"y\":{\"t\":\"ay\",\"v\":\"AQI=\"}},\"aGk=\"]]}");
+  g_free (message);
+}
+
+static const Fixture fixture_each = {
+  .interval = 0,
+  .signals = 100,
+};
+
+static const Fixture fixture_burst = {
+  .interval = 50,
+  .signals = 10000,
+};
+
+int
+main (int argc,
+      char *argv[])
+{
+  cockpit_test_init (&argc, &argv);
+
+  g_test_add ("/dbus-json/notify-each", TestCase, &fixture_each,
+              setup, test_notify_burst, teardown);
+  g_test_add ("/dbus-json/notify-interval", TestCase, &fixture_burst,
+              setup, test_notify_burst, teardown);
+  g_test_add ("/dbus-json/meta-persist-wrong", TestCase, &fixture_each,
+              setup, test_meta_persist_wrong, teardown);
+  g_test_add ("/dbus-json/shared-unwatch", TestCase, &fixture_each,
+              setup, test_shared_unwatch, teardown);
+  g_test_add ("/dbus-json/wire-format", TestCase, &fixture_each,
+              setup, test_wire_format, teardown);
+
+  return g_test_run ();
+}
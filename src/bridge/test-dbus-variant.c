@@ -0,0 +1,384 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2018 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitdbusvariant.h"
+
+#include "common/cockpitjson.h"
+#include "common/cockpittest.h"
+
+#include <string.h>
+
+typedef struct {
+  const gchar *name;
+  const gchar *variant;
+  const gchar *expected;
+} WriteFixture;
+
+static const WriteFixture write_fixtures[] = {
+  { "boolean", "(true, false)", "[true,false]" },
+  { "numbers", "(byte 0x10, int16 -5, uint16 6, -7, uint32 8, int64 -9, uint64 10, 1.5)",
+    "[16,-5,6,-7,8,-9,10,1.5]" },
+  { "strings", "('string', objectpath '/path', signature 'a{sv}')", "[\"string\",\"/path\",\"a{sv}\"]" },
+  { "escaped", "('tab\\there \"quoted\" back\\\\slash',)", "[\"tab\\there \\\"quoted\\\" back\\\\slash\"]" },
+  { "variant", "<'value'>", "{\"t\":\"s\",\"v\":\"value\"}" },
+  { "nested-variant", "<<uint32 5>>", "{\"t\":\"v\",\"v\":{\"t\":\"u\",\"v\":5}}" },
+  { "dictionary", "{'one': <1>, 'two': <'deux'>}",
+    "{\"one\":{\"t\":\"i\",\"v\":1},\"two\":{\"t\":\"s\",\"v\":\"deux\"}}" },
+  { "dictionary-int", "{1: 'one', 2: 'two'}", "{\"1\":\"one\",\"2\":\"two\"}" },
+  { "dictionary-empty", "@a{sv} {}", "{}" },
+  { "dictionary-repeated", "{'a': <1>, 'b': <2>, 'a': <3>, 'b': <4>, 'c': <5>}",
+    "{\"a\":{\"t\":\"i\",\"v\":3},\"b\":{\"t\":\"i\",\"v\":4},\"c\":{\"t\":\"i\",\"v\":5}}" },
+  { "dictionary-repeated-int", "{1: 'one', 2: 'two', 1: 'uno'}", "{\"1\":\"uno\",\"2\":\"two\"}" },
+  { "byte-array", "[byte 0x68, 0x65, 0x6c, 0x6c, 0x6f]", "\"aGVsbG8=\"" },
+  { "byte-array-empty", "@ay []", "\"\"" },
+  { "arrays", "[[1, 2], [3], []]", "[[1,2],[3],[]]" },
+  { "tuple-empty", "()", "[]" },
+  { "handle", "@ah [handle 0]", "[null]" },
+  { "managed-objects", "{objectpath '/obj': {'org.Iface': {'Prop': <'value'>, 'Bytes': <@ay [byte 1]>}}}",
+    "{\"/obj\":{\"org.Iface\":{\"Prop\":{\"t\":\"s\",\"v\":\"value\"},\"Bytes\":{\"t\":\"ay\",\"v\":\"AQ==\"}}}}" },
+};
+
+static GVariant *
+build_managed_objects (gint objects)
+{
+  GVariantBuilder builder;
+  GVariantBuilder props;
+  gchar key[32];
+  gchar *path;
+  gint i, j;
+
+  /* Shaped like what UDisks2 returns from GetManagedObjects */
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{oa{sa{sv}}}"));
+  for (i = 0; i < objects; i++)
+    {
+      path = g_strdup_printf ("/org/freedesktop/UDisks2/block_devices/sd%d", i);
+      g_variant_builder_open (&builder, G_VARIANT_TYPE ("{oa{sa{sv}}}"));
+      g_variant_builder_add (&builder, "o", path);
+      g_variant_builder_open (&builder, G_VARIANT_TYPE ("a{sa{sv}}"));
+
+      g_variant_builder_init (&props, G_VARIANT_TYPE ("a{sv}"));
+      g_variant_builder_add (&props, "{sv}", "Device", g_variant_new_bytestring ("/dev/sda"));
+      g_variant_builder_add (&props, "{sv}", "Size", g_variant_new_uint64 (G_GUINT64_CONSTANT (500107862016)));
+      g_variant_builder_add (&props, "{sv}", "ReadOnly", g_variant_new_boolean (FALSE));
+      g_variant_builder_add (&props, "{sv}", "Drive", g_variant_new_object_path ("/org/freedesktop/UDisks2/drives/disk"));
+      g_variant_builder_add (&props, "{sv}", "IdLabel", g_variant_new_string ("Label with \"quotes\""));
+      for (j = 0; j < 10; j++)
+        {
+          g_snprintf (key, sizeof (key), "Configuration%d", j);
+          g_variant_builder_add (&props, "{sv}", key, g_variant_new_strv (NULL, 0));
+        }
+      g_variant_builder_add (&builder, "{s@a{sv}}", "org.freedesktop.UDisks2.Block",
+                             g_variant_builder_end (&props));
+
+      g_variant_builder_init (&props, G_VARIANT_TYPE ("a{sv}"));
+      g_variant_builder_add (&props, "{sv}", "Offset", g_variant_new_uint64 (1048576));
+      g_variant_builder_add (&props, "{sv}", "Number", g_variant_new_uint32 (i));
+      g_variant_builder_add (&props, "{sv}", "Type", g_variant_new_string ("0x83"));
+      g_variant_builder_add (&builder, "{s@a{sv}}", "org.freedesktop.UDisks2.Partition",
+                             g_variant_builder_end (&props));
+
+      g_variant_builder_close (&builder);
+      g_variant_builder_close (&builder);
+      g_free (path);
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/*
+ * The JsonNode tree that the dbus-json3 channel used to build for each
+ * value, before cockpit_dbus_variant_write(). Kept here so the output can
+ * be compared with what cockpit_json_write() made of it.
+ */
+
+static JsonNode *
+build_reference (GVariant *value);
+
+static JsonNode *
+build_reference_dictionary (const GVariantType *entry_type,
+                            GVariant *dict)
+{
+  const GVariantType *key_type;
+  GVariantIter iter;
+  GVariant *child;
+  GVariant *key;
+  GVariant *value;
+  JsonObject *object;
+  JsonNode *node;
+  gchar *key_string;
+
+  object = json_object_new ();
+  key_type = g_variant_type_key (entry_type);
+
+  g_variant_iter_init (&iter, dict);
+  while ((child = g_variant_iter_next_value (&iter)) != NULL)
+    {
+      key = g_variant_get_child_value (child, 0);
+      value = g_variant_get_child_value (child, 1);
+
+      if (g_variant_type_equal (key_type, G_VARIANT_TYPE_STRING) ||
+          g_variant_type_equal (key_type, G_VARIANT_TYPE_OBJECT_PATH) ||
+          g_variant_type_equal (key_type, G_VARIANT_TYPE_SIGNATURE))
+        {
+          json_object_set_member (object, g_variant_get_string (key, NULL), build_reference (value));
+        }
+      else
+        {
+          key_string = g_variant_print (key, FALSE);
+          json_object_set_member (object, key_string, build_reference (value));
+          g_free (key_string);
+        }
+
+      g_variant_unref (key);
+      g_variant_unref (value);
+      g_variant_unref (child);
+    }
+
+  node = json_node_new (JSON_NODE_OBJECT);
+  json_node_take_object (node, object);
+  return node;
+}
+
+static JsonNode *
+build_reference_array (GVariant *value)
+{
+  GVariantIter iter;
+  GVariant *child;
+  JsonArray *array;
+  JsonNode *node;
+
+  array = json_array_new ();
+
+  g_variant_iter_init (&iter, value);
+  while ((child = g_variant_iter_next_value (&iter)) != NULL)
+    {
+      json_array_add_element (array, build_reference (child));
+      g_variant_unref (child);
+    }
+
+  node = json_node_new (JSON_NODE_ARRAY);
+  json_node_take_array (node, array);
+  return node;
+}
+
+static JsonNode *
+build_reference (GVariant *value)
+{
+  const GVariantType *element_type;
+  gconstpointer data;
+  JsonObject *object;
+  JsonNode *node;
+  GVariant *child;
+  gchar *string;
+  gsize length;
+
+  node = json_node_new (JSON_NODE_VALUE);
+
+  switch (g_variant_classify (value))
+    {
+    case G_VARIANT_CLASS_BOOLEAN:
+      json_node_set_boolean (node, g_variant_get_boolean (value));
+      break;
+    case G_VARIANT_CLASS_BYTE:
+      json_node_set_int (node, g_variant_get_byte (value));
+      break;
+    case G_VARIANT_CLASS_INT16:
+      json_node_set_int (node, g_variant_get_int16 (value));
+      break;
+    case G_VARIANT_CLASS_UINT16:
+      json_node_set_int (node, g_variant_get_uint16 (value));
+      break;
+    case G_VARIANT_CLASS_INT32:
+      json_node_set_int (node, g_variant_get_int32 (value));
+      break;
+    case G_VARIANT_CLASS_UINT32:
+      json_node_set_int (node, g_variant_get_uint32 (value));
+      break;
+    case G_VARIANT_CLASS_INT64:
+      json_node_set_int (node, g_variant_get_int64 (value));
+      break;
+    case G_VARIANT_CLASS_UINT64:
+      json_node_set_int (node, g_variant_get_uint64 (value));
+      break;
+    case G_VARIANT_CLASS_DOUBLE:
+      json_node_set_double (node, g_variant_get_double (value));
+      break;
+
+    /* Without a file descriptor list */
+    case G_VARIANT_CLASS_HANDLE:
+      json_node_free (node);
+      node = json_node_new (JSON_NODE_NULL);
+      break;
+
+    case G_VARIANT_CLASS_STRING:
+    case G_VARIANT_CLASS_OBJECT_PATH:
+    case G_VARIANT_CLASS_SIGNATURE:
+      json_node_set_string (node, g_variant_get_string (value, NULL));
+      break;
+
+    case G_VARIANT_CLASS_VARIANT:
+      child = g_variant_get_variant (value);
+      object = json_object_new ();
+      json_object_set_string_member (object, "t", g_variant_get_type_string (child));
+      json_object_set_member (object, "v", build_reference (child));
+      json_node_free (node);
+      node = json_node_new (JSON_NODE_OBJECT);
+      json_node_take_object (node, object);
+      g_variant_unref (child);
+      break;
+
+    case G_VARIANT_CLASS_ARRAY:
+      element_type = g_variant_type_element (g_variant_get_type (value));
+      if (g_variant_type_is_dict_entry (element_type))
+        {
+          json_node_free (node);
+          node = build_reference_dictionary (element_type, value);
+        }
+      else if (g_variant_type_equal (element_type, G_VARIANT_TYPE_BYTE))
+        {
+          length = 0;
+          data = g_variant_get_fixed_array (value, &length, 1);
+          string = length > 0 ? g_base64_encode (data, length) : NULL;
+          json_node_set_string (node, string ? string : "");
+          g_free (string);
+        }
+      else
+        {
+          json_node_free (node);
+          node = build_reference_array (value);
+        }
+      break;
+
+    case G_VARIANT_CLASS_TUPLE:
+      json_node_free (node);
+      node = build_reference_array (value);
+      break;
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  return node;
+}
+
+static void
+test_write (gconstpointer data)
+{
+  const WriteFixture *fixture = data;
+  GVariant *variant;
+  GString *output;
+  JsonNode *node;
+  gchar *reference;
+
+  variant = g_variant_ref_sink (g_variant_new_parsed (fixture->variant));
+
+  output = g_string_new ("");
+  cockpit_dbus_variant_write (output, variant, NULL, NULL);
+  g_assert_cmpstr (output->str, ==, fixture->expected);
+
+  /* Byte for byte what the JsonNode tree used to be written as */
+  node = build_reference (variant);
+  reference = cockpit_json_write (node, NULL);
+  g_assert_cmpstr (output->str, ==, reference);
+
+  g_free (reference);
+  json_node_free (node);
+  g_string_free (output, TRUE);
+  g_variant_unref (variant);
+}
+
+static void
+test_write_managed_objects (void)
+{
+  GVariant *variant;
+  GString *output;
+  JsonNode *node;
+  gchar *reference;
+
+  variant = build_managed_objects (50);
+
+  output = g_string_new ("");
+  cockpit_dbus_variant_write (output, variant, NULL, NULL);
+
+  node = build_reference (variant);
+  reference = cockpit_json_write (node, NULL);
+  g_assert_cmpstr (output->str, ==, reference);
+
+  g_free (reference);
+  json_node_free (node);
+  g_string_free (output, TRUE);
+  g_variant_unref (variant);
+}
+
+static void
+test_write_perf (void)
+{
+  const gint objects = 5000;
+  const gint rounds = 20;
+  GVariant *variant;
+  GString *output;
+  gdouble elapsed;
+  gsize length = 0;
+  gint i;
+
+  variant = build_managed_objects (objects);
+  output = g_string_new ("");
+
+  g_test_timer_start ();
+  for (i = 0; i < rounds; i++)
+    {
+      g_string_truncate (output, 0);
+      cockpit_dbus_variant_write (output, variant, NULL, NULL);
+      length = output->len;
+    }
+  elapsed = g_test_timer_elapsed ();
+
+  g_test_message ("GetManagedObjects: %d objects, %" G_GSIZE_FORMAT " bytes, %.2f ms/write, %.1f MB/s",
+                  objects, length, (elapsed * 1000) / rounds,
+                  ((gdouble)length * rounds) / (elapsed * 1024 * 1024));
+
+  g_string_free (output, TRUE);
+  g_variant_unref (variant);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  gchar *name;
+  guint i;
+
+  cockpit_test_init (&argc, &argv);
+
+  for (i = 0; i < G_N_ELEMENTS (write_fixtures); i++)
+    {
+      name = g_strdup_printf ("/dbus-variant/write/%s", write_fixtures[i].name);
+      g_test_add_data_func (name, write_fixtures + i, test_write);
+      g_free (name);
+    }
+
+  g_test_add_func ("/dbus-variant/write-managed-objects", test_write_managed_objects);
+
+  if (g_test_perf ())
+    g_test_add_func ("/dbus-variant/write-perf", test_write_perf);
+
+  return g_test_run ();
+}
@@ -24,10 +24,24 @@
 #include "mock-transport.h"
 
 #include "cockpitinternalmetrics.h"
+#include "cockpitsamplers.h"
+#include "cockpitmetricshistory.h"
+#include "cockpitprocfile.h"
+#include "cockpitcpusamples.h"
+#include "cockpitmemorysamples.h"
+#include "cockpitdisksamples.h"
+#include "cockpitblocksamples.h"
+#include "cockpitnetworksamples.h"
+#include "cockpitcgroupsamples.h"
+#include "cockpitmountsamples.h"
 
 #include "common/cockpittest.h"
 #include "common/cockpitjson.h"
 
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
 typedef struct {
   MockTransport *transport;
   CockpitMetrics *channel;
@@ -77,12 +91,24 @@ static void
 setup (TestCase *tc,
        gconstpointer data)
 {
+  JsonObject *options = NULL;
+
+  /* Some tests pass the channel options as data */
+  if (data)
+    {
+      options = cockpit_json_parse_object (data, -1, NULL);
+      g_assert (options != NULL);
+    }
+
   tc->transport = mock_transport_new ();
   g_signal_connect (tc->transport, "closed", G_CALLBACK (on_transport_closed), NULL);
   tc->channel = g_object_new (mock_metrics_get_type (),
                               "transport", tc->transport,
                               "id", "1234",
+                              "options", options,
                               NULL);
+  if (options)
+    json_object_unref (options);
   g_signal_connect (tc->channel, "closed", G_CALLBACK (on_channel_close), tc);
 
   /* Switch off compression by default.  Compression is done by
@@ -271,6 +297,168 @@ test_compression_reset (TestCase *tc,
   json_object_unref (meta);
 }
 
+static void
+setup_binary (TestCase *tc,
+              gconstpointer data)
+{
+  JsonObject *options = json_obj ("{ 'binary': 'raw' }");
+
+  tc->transport = mock_transport_new ();
+  g_signal_connect (tc->transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+  tc->channel = g_object_new (mock_metrics_get_type (),
+                              "transport", tc->transport,
+                              "id", "1234",
+                              "options", options,
+                              NULL);
+  g_signal_connect (tc->channel, "closed", G_CALLBACK (on_channel_close), tc);
+  json_object_unref (options);
+
+  /* So that payloads are not forced to UTF-8 */
+  cockpit_channel_prepare (COCKPIT_CHANNEL (tc->channel));
+}
+
+static gdouble
+read_double_le (const guint8 *data)
+{
+  union { double d; guint64 u; } bits;
+
+  memcpy (&bits.u, data, sizeof (bits.u));
+  bits.u = GUINT64_FROM_LE (bits.u);
+  return bits.d;
+}
+
+/* Describe a binary data message with a single point, absent values are "-" */
+static gchar *
+recv_binary (TestCase *tc,
+             gint64 *timestamp)
+{
+  const guint8 *data;
+  const guint8 *bitmap;
+  GString *string;
+  guint32 count;
+  GBytes *msg;
+  gsize length;
+  gsize pos;
+  guint i;
+
+  msg = recv_bytes (tc);
+  data = g_bytes_get_data (msg, &length);
+
+  g_assert_cmpuint (length, >=, 13);
+  g_assert_cmpint (data[0], ==, 0);
+  *timestamp = read_double_le (data + 1);
+  memcpy (&count, data + 9, sizeof (count));
+  count = GUINT32_FROM_LE (count);
+
+  bitmap = data + 13;
+  pos = 13 + (count + 7) / 8;
+
+  string = g_string_new ("");
+  for (i = 0; i < count; i++)
+    {
+      if (i > 0)
+        g_string_append_c (string, ' ');
+      if (bitmap[i / 8] & (1 << (i % 8)))
+        {
+          g_assert_cmpuint (pos + 8, <=, length);
+          g_string_append_printf (string, "%g", read_double_le (data + pos));
+          pos += 8;
+        }
+      else
+        {
+          g_string_append_c (string, '-');
+        }
+    }
+
+  g_assert_cmpuint (pos, ==, length);
+  g_bytes_unref (msg);
+  return g_string_free (string, FALSE);
+}
+
+static void
+send_binary_sample (TestCase *tc,
+                    gint64 timestamp,
+                    double a,
+                    double b,
+                    double c)
+{
+  double **buffer = cockpit_metrics_get_data_buffer (tc->channel);
+  buffer[0][0] = a;
+  buffer[0][1] = b;
+  buffer[1][0] = c;
+  cockpit_metrics_send_data (tc->channel, timestamp);
+  cockpit_metrics_flush_data (tc->channel);
+}
+
+static void
+test_binary (TestCase *tc,
+             gconstpointer unused)
+{
+  gint64 timestamp;
+  gchar *values;
+  GBytes *msg;
+
+  JsonObject *meta = json_obj ("{ 'metrics': [ { 'name': 'foo', 'instances': [ 'a', 'b' ] },"
+                               "               { 'name': 'bar' }"
+                               "             ],"
+                               "  'interval': 1000"
+                               "}");
+  cockpit_metrics_send_meta (tc->channel, meta, FALSE);
+
+  /* Meta messages are still JSON */
+  msg = recv_bytes (tc);
+  g_assert_cmpint (((const gchar *)g_bytes_get_data (msg, NULL))[0], ==, '{');
+  g_bytes_unref (msg);
+
+  send_binary_sample (tc, 0, 1.0, 2.0, 3.0);
+  values = recv_binary (tc, &timestamp);
+  g_assert_cmpint (timestamp, ==, 0);
+  g_assert_cmpstr (values, ==, "1 2 3");
+  g_free (values);
+
+  /* Compression works just like with JSON */
+  send_binary_sample (tc, 1000, 1.0, 2.0, 3.0);
+  values = recv_binary (tc, &timestamp);
+  g_assert_cmpint (timestamp, ==, 1000);
+  g_assert_cmpstr (values, ==, "- - -");
+  g_free (values);
+
+  send_binary_sample (tc, 2000, 1.0, 5.5, NAN);
+  values = recv_binary (tc, &timestamp);
+  g_assert_cmpint (timestamp, ==, 2000);
+  g_assert_cmpstr (values, ==, "- 5.5 nan");
+  g_free (values);
+
+  /* After new meta, everything is sent again */
+  cockpit_metrics_send_meta (tc->channel, meta, FALSE);
+  json_object_unref (recv_object (tc));
+
+  send_binary_sample (tc, 3000, 1.0, 5.5, 3.0);
+  values = recv_binary (tc, &timestamp);
+  g_assert_cmpstr (values, ==, "1 5.5 3");
+  g_free (values);
+
+  json_object_unref (meta);
+}
+
+static void
+test_binary_invalid (TestCase *tc,
+                     gconstpointer unused)
+{
+  JsonObject *meta = json_obj ("{ 'metrics': [ { 'name': 'foo' } ],"
+                               "  'interval': 1000"
+                               "}");
+
+  cockpit_expect_message ("*invalid \"binary\" option*");
+
+  /* Only "raw" packs data messages, anything else is refused */
+  cockpit_metrics_send_meta (tc->channel, meta, FALSE);
+  g_assert (tc->channel_closed);
+  g_assert_cmpstr (tc->problem, ==, "protocol-error");
+
+  json_object_unref (meta);
+}
+
 static void
 test_derive_delta (TestCase *tc,
                    gconstpointer unused)
@@ -540,6 +728,104 @@ test_dynamic_instances (TestCase *tc,
   json_object_unref (meta);
 }
 
+static void
+assert_meta_instances (TestCase *tc,
+                       const gchar *json)
+{
+  JsonObject *meta = recv_object (tc);
+  JsonArray *metrics = json_object_get_array_member (meta, "metrics");
+  JsonObject *metric = json_array_get_object_element (metrics, 0);
+
+  if (json)
+    cockpit_assert_json_eq (json_object_get_array_member (metric, "instances"), json);
+  else
+    g_assert (!json_object_has_member (metric, "instances"));
+  json_object_unref (meta);
+}
+
+static void
+test_reduce_sum (TestCase *tc,
+                 gconstpointer unused)
+{
+  JsonObject *meta = json_obj ("{ 'metrics': [ { 'name': 'foo',"
+                               "                 'instances': [ 'a', 'b', 'c' ],"
+                               "                 'derive': 'delta'"
+                               "               }"
+                               "             ],"
+                               "  'interval': 100"
+                               "}");
+  cockpit_metrics_send_meta (tc->channel, meta, FALSE);
+
+  /* The meta is sent along with the first data, without instances */
+  send_instance_sample (tc,    0, 3, 1.0, 2.0, 3.0);
+  assert_meta_instances (tc, NULL);
+  assert_sample (tc, "[[false]]");
+  send_instance_sample (tc,  100, 3, 2.0, 4.0, 6.0);
+  assert_sample (tc, "[[6]]");
+  send_instance_sample (tc,  200, 3, 2.0, 5.0, 6.0);
+  assert_sample (tc, "[[1]]");
+
+  json_object_unref (meta);
+}
+
+static void
+test_reduce_top (TestCase *tc,
+                 gconstpointer unused)
+{
+  JsonObject *meta = json_obj ("{ 'metrics': [ { 'name': 'foo',"
+                               "                 'instances': [ 'a', 'b', 'c' ]"
+                               "               }"
+                               "             ],"
+                               "  'interval': 100"
+                               "}");
+  cockpit_metrics_send_meta (tc->channel, meta, FALSE);
+
+  send_instance_sample (tc,    0, 3, 1.0, 5.0, 3.0);
+  assert_meta_instances (tc, "['b','c']");
+  assert_sample (tc, "[[[5,3]]]");
+  send_instance_sample (tc,  100, 3, 1.0, 6.0, 4.0);
+  assert_sample (tc, "[[[6,4]]]");
+
+  /* Another instance makes it, so a new meta comes first */
+  send_instance_sample (tc,  200, 3, 7.0, 6.0, 4.0);
+  assert_meta_instances (tc, "['a','b']");
+  assert_sample (tc, "[[[7,6]]]");
+
+  json_object_unref (meta);
+}
+
+static void
+test_reduce_match (TestCase *tc,
+                   gconstpointer unused)
+{
+  JsonObject *meta = json_obj ("{ 'metrics': [ { 'name': 'foo',"
+                               "                 'instances': [ 'eth0', 'lo', 'eth1' ]"
+                               "               }"
+                               "             ],"
+                               "  'interval': 100"
+                               "}");
+  cockpit_metrics_send_meta (tc->channel, meta, FALSE);
+
+  send_instance_sample (tc,    0, 3, 1.0, 2.0, 3.0);
+  assert_meta_instances (tc, "['eth0','eth1']");
+  assert_sample (tc, "[[[1,3]]]");
+  json_object_unref (meta);
+
+  /* A new meta from the source is filtered the same way */
+  meta = json_obj ("{ 'metrics': [ { 'name': 'foo',"
+                   "                 'instances': [ 'eth2', 'lo' ]"
+                   "               }"
+                   "             ],"
+                   "  'interval': 100"
+                   "}");
+  cockpit_metrics_send_meta (tc->channel, meta, FALSE);
+  send_instance_sample (tc,  100, 2, 4.0, 5.0);
+  assert_meta_instances (tc, "['eth2']");
+  assert_sample (tc, "[[[4]]]");
+
+  json_object_unref (meta);
+}
+
 static void
 assert_not_root_mount (JsonArray *array,
                        guint index_,
@@ -719,6 +1005,1332 @@ test_deprecated_net_all (void)
   g_object_unref (transport);
 }
 
+static void
+test_shared_samplers (void)
+{
+  MockTransport *transport = mock_transport_new ();
+  CockpitChannel *channels[4];
+  gchar *ids[G_N_ELEMENTS (channels)];
+  guint received[G_N_ELEMENTS (channels)] = { 0, };
+  JsonObject *options = json_obj ("{ 'metrics': [ { 'name': 'cpu.basic.user' } ],"
+                                  "  'interval': 100"
+                                  "}");
+  guint64 runs;
+  GBytes *msg;
+  guint least;
+  guint i;
+
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+
+  /* The earlier tests have let go of their samplers */
+  g_assert_cmpuint (cockpit_samplers_get_runs (cockpit_cpu_samples), ==, 0);
+
+  for (i = 0; i < G_N_ELEMENTS (channels); i++)
+    {
+      ids[i] = g_strdup_printf ("%u", i);
+      channels[i] = g_object_new (cockpit_internal_metrics_get_type (),
+                                  "transport", transport,
+                                  "id", ids[i],
+                                  "options", options,
+                                  NULL);
+      cockpit_channel_prepare (channels[i]);
+    }
+
+  /* Meta and a few rounds of data on each channel */
+  for (least = 0; least < 6; )
+    {
+      g_main_context_iteration (NULL, TRUE);
+      least = G_MAXUINT;
+      for (i = 0; i < G_N_ELEMENTS (channels); i++)
+        {
+          while ((msg = mock_transport_pop_channel (transport, ids[i])) != NULL)
+            received[i]++;
+          least = MIN (least, received[i]);
+        }
+    }
+
+  /* /proc/stat was read once per tick, not once per channel per tick */
+  runs = cockpit_samplers_get_runs (cockpit_cpu_samples);
+  g_assert_cmpuint (runs, >=, least - 1);
+  g_assert_cmpuint (runs, <=, least + 1);
+
+  for (i = 0; i < G_N_ELEMENTS (channels); i++)
+    {
+      g_object_unref (channels[i]);
+      g_free (ids[i]);
+    }
+
+  /* Nothing is kept once the last channel is gone */
+  g_assert_cmpuint (cockpit_samplers_get_runs (cockpit_cpu_samples), ==, 0);
+
+  json_object_unref (options);
+  g_object_unref (transport);
+}
+
+static gboolean
+has_instance (JsonObject *metric,
+              const gchar *instance)
+{
+  JsonArray *instances;
+  guint i;
+
+  instances = json_object_get_array_member (metric, "instances");
+  g_assert (instances != NULL);
+  for (i = 0; i < json_array_get_length (instances); i++)
+    {
+      if (g_str_equal (json_array_get_string_element (instances, i), instance))
+        return TRUE;
+    }
+  return FALSE;
+}
+
+static void
+test_cockpit_metrics (void)
+{
+  MockTransport *transport = mock_transport_new ();
+  CockpitChannel *channel;
+  JsonObject *options = json_obj ("{ 'metrics': [ { 'name': 'cockpit.channel.tx' },"
+                                  "               { 'name': 'cockpit.payload.tx-messages' },"
+                                  "               { 'name': 'cockpit.transport.tx-wire' } ],"
+                                  "  'payload': 'metrics1',"
+                                  "  'interval': 100"
+                                  "}");
+  GBytes *msg;
+  JsonObject *res;
+  JsonNode *node;
+  JsonArray *metrics, *samples;
+
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+
+  channel = g_object_new (cockpit_internal_metrics_get_type (),
+                          "transport", transport,
+                          "id", "1234",
+                          "options", options,
+                          NULL);
+
+  cockpit_metrics_set_compress (COCKPIT_METRICS (channel), FALSE);
+  cockpit_channel_prepare (channel);
+
+  /* The metrics channel counts its own traffic */
+  while ((msg = mock_transport_pop_channel (transport, "1234")) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  res = cockpit_json_parse_bytes (msg, NULL);
+  g_assert (res != NULL);
+  metrics = json_object_get_array_member (res, "metrics");
+  g_assert_cmpint (json_array_get_length (metrics), ==, 3);
+  g_assert_cmpstr (json_object_get_string_member (json_array_get_object_element (metrics, 0), "name"),
+                   ==, "cockpit.channel.tx");
+  g_assert (has_instance (json_array_get_object_element (metrics, 0), "1234"));
+  g_assert (has_instance (json_array_get_object_element (metrics, 1), "metrics1"));
+  g_assert_cmpint (json_array_get_length (json_object_get_array_member (json_array_get_object_element (metrics, 2),
+                                                                        "instances")), >=, 1);
+  json_object_unref (res);
+
+  /* Data should have the form [[[tx],[tx-messages],[tx-wire]]] */
+  while ((msg = mock_transport_pop_channel (transport, "1234")) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  node = cockpit_json_parse (g_bytes_get_data (msg, NULL), g_bytes_get_size (msg), NULL);
+  g_assert (node);
+  metrics = json_node_get_array (node);
+  g_assert (metrics != NULL);
+  g_assert_cmpint (json_array_get_length (metrics), ==, 1);
+  samples = json_array_get_array_element (metrics, 0);
+  g_assert_cmpint (json_array_get_length (samples), ==, 3);
+  json_node_free (node);
+
+  g_object_unref (channel);
+  json_object_unref (options);
+  g_object_unref (transport);
+}
+
+/*
+ * Samples that are recorded as "metric/instance" -> value, or
+ * only counted.
+ */
+
+typedef struct {
+  GObject parent;
+  GHashTable *values;
+  GHashTable *stale;
+  const gchar *instance;
+  guint64 count;
+} MockSamples;
+
+typedef GObjectClass MockSamplesClass;
+
+static void mock_samples_iface_init (CockpitSamplesIface *iface);
+
+GType mock_samples_get_type (void);
+
+G_DEFINE_TYPE_WITH_CODE (MockSamples, mock_samples, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_SAMPLES, mock_samples_iface_init));
+
+static void
+mock_samples_init (MockSamples *self)
+{
+}
+
+static void
+mock_samples_finalize (GObject *object)
+{
+  MockSamples *self = (MockSamples *)object;
+  if (self->values)
+    g_hash_table_unref (self->values);
+  if (self->stale)
+    g_hash_table_unref (self->stale);
+  G_OBJECT_CLASS (mock_samples_parent_class)->finalize (object);
+}
+
+static void
+mock_samples_class_init (MockSamplesClass *klass)
+{
+  klass->finalize = mock_samples_finalize;
+}
+
+static void
+mock_samples_sample (CockpitSamples *samples,
+                     const gchar *metric,
+                     const gchar *instance,
+                     gint64 value)
+{
+  MockSamples *self = (MockSamples *)samples;
+
+  self->count++;
+  self->instance = instance;
+  if (self->values)
+    {
+      g_hash_table_replace (self->values, g_strdup_printf ("%s/%s", metric, instance ? instance : ""),
+                            g_memdup (&value, sizeof (value)));
+    }
+}
+
+static void
+mock_samples_stale (CockpitSamples *samples,
+                    const gchar *metric,
+                    const gchar *instance)
+{
+  MockSamples *self = (MockSamples *)samples;
+
+  if (self->stale)
+    g_hash_table_add (self->stale, g_strdup_printf ("%s/%s", metric, instance ? instance : ""));
+}
+
+static void
+mock_samples_iface_init (CockpitSamplesIface *iface)
+{
+  iface->sample = mock_samples_sample;
+  iface->stale = mock_samples_stale;
+}
+
+static gint64
+mock_samples_get (MockSamples *self,
+                  const gchar *metric,
+                  const gchar *instance)
+{
+  gchar *key = g_strdup_printf ("%s/%s", metric, instance ? instance : "");
+  gint64 *value = g_hash_table_lookup (self->values, key);
+  g_free (key);
+  g_assert (value != NULL);
+  return *value;
+}
+
+/* A fake /proc for a machine of the given size */
+static gchar *
+build_proc_root (guint cpus,
+                 guint disks,
+                 guint interfaces)
+{
+  GError *error = NULL;
+  GString *contents;
+  gchar *directory;
+  gchar *path;
+  guint i;
+
+  directory = g_dir_make_tmp ("test-metrics-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  contents = g_string_new ("cpu  4705 150 1120 16250 520 0 30 0 0 0\n");
+  for (i = 0; i < cpus; i++)
+    g_string_append_printf (contents, "cpu%u 1%u 2 3 4 5 0 0 0 0 0\n", i, i);
+  g_string_append (contents, "intr 114930548 113199788 3 0 5 263 0 4 [...]\n"
+                             "ctxt 1990473\nbtime 1062191376\nprocesses 2915\n");
+  path = g_build_filename (directory, "stat", NULL);
+  g_file_set_contents (path, contents->str, contents->len, &error);
+  g_assert_no_error (error);
+  g_string_free (contents, TRUE);
+  g_free (path);
+
+  path = g_build_filename (directory, "meminfo", NULL);
+  g_file_set_contents (path,
+                       "MemTotal:        8000000 kB\n"
+                       "MemFree:         3000000 kB\n"
+                       "MemAvailable:    5000000 kB\n"
+                       "Buffers:          100000 kB\n"
+                       "Cached:          1000000 kB\n"
+                       "SwapCached:            0 kB\n"
+                       "SwapTotal:       2000000 kB\n"
+                       "SwapFree:        1500000 kB\n", -1, &error);
+  g_assert_no_error (error);
+  g_free (path);
+
+  contents = g_string_new ("");
+  for (i = 0; i < disks; i++)
+    {
+      g_string_append_printf (contents, " 252 %u vd%c%c 100 10 %u 50 200 20 %u 60 0 70 80\n",
+                              i * 16, 'a' + i / 26, 'a' + i % 26, 1000 + i, 2000 + i);
+      g_string_append_printf (contents, " 252 %u vd%c%c1 1 1 1 1 1 1 1 1 0 1 1\n",
+                              i * 16 + 1, 'a' + i / 26, 'a' + i % 26);
+    }
+  path = g_build_filename (directory, "diskstats", NULL);
+  g_file_set_contents (path, contents->str, contents->len, &error);
+  g_assert_no_error (error);
+  g_string_free (contents, TRUE);
+  g_free (path);
+
+  contents = g_string_new ("Inter-|   Receive                                                |  Transmit\n"
+                           " face |bytes    packets errs drop fifo frame compressed multicast|bytes    packets errs drop fifo colls carrier compressed\n");
+  for (i = 0; i < interfaces; i++)
+    {
+      g_string_append_printf (contents, "%6s%u: %7u %7u    0    0    0     0          0         0 %8u %7u    0    0    0     0       0          0\n",
+                              "veth", i, 10000 + i, 100, 20000 + i, 200);
+    }
+  path = g_build_filename (directory, "net", NULL);
+  g_assert (g_mkdir (path, 0700) == 0);
+  g_free (path);
+  path = g_build_filename (directory, "net", "dev", NULL);
+  g_file_set_contents (path, contents->str, contents->len, &error);
+  g_assert_no_error (error);
+  g_string_free (contents, TRUE);
+  g_free (path);
+
+  return directory;
+}
+
+static void
+remove_proc_root (gchar *directory)
+{
+  const gchar *files[] = { "stat", "meminfo", "diskstats", "net/dev", "net" };
+  gchar *path;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (files); i++)
+    {
+      path = g_build_filename (directory, files[i], NULL);
+      g_assert (remove (path) == 0);
+      g_free (path);
+    }
+
+  g_assert (rmdir (directory) == 0);
+  g_free (directory);
+}
+
+static void
+test_proc_samplers (void)
+{
+  const gchar *previous = cockpit_proc_root;
+  MockSamples *samples;
+  gchar *directory;
+  gint round;
+
+  directory = build_proc_root (4, 3, 5);
+  cockpit_proc_root = directory;
+  cockpit_proc_file_close_all ();
+
+  samples = g_object_new (mock_samples_get_type (), NULL);
+  samples->values = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  /* The second round reads the same open files again */
+  for (round = 0; round < 2; round++)
+    {
+      cockpit_cpu_samples (COCKPIT_SAMPLES (samples));
+      cockpit_memory_samples (COCKPIT_SAMPLES (samples));
+      cockpit_disk_samples (COCKPIT_SAMPLES (samples));
+      cockpit_block_samples (COCKPIT_SAMPLES (samples));
+      cockpit_network_samples (COCKPIT_SAMPLES (samples));
+
+      g_assert_cmpint (mock_samples_get (samples, "cpu.basic.user", NULL), ==, 4705 * 1000 / sysconf (_SC_CLK_TCK));
+      g_assert_cmpint (mock_samples_get (samples, "cpu.basic.iowait", NULL), ==, 520 * 1000 / sysconf (_SC_CLK_TCK));
+
+      g_assert_cmpint (mock_samples_get (samples, "memory.free", NULL), ==, 3000000 * 1024LL);
+      g_assert_cmpint (mock_samples_get (samples, "memory.used", NULL), ==, 5000000 * 1024LL);
+      g_assert_cmpint (mock_samples_get (samples, "memory.cached", NULL), ==, 1100000 * 1024LL);
+      g_assert_cmpint (mock_samples_get (samples, "memory.swap-used", NULL), ==, 500000 * 1024LL);
+
+      /* Partitions aren't counted twice */
+      g_assert_cmpint (mock_samples_get (samples, "disk.all.read", NULL), ==, (1000 + 1001 + 1002) * 512);
+      g_assert_cmpint (mock_samples_get (samples, "disk.all.written", NULL), ==, (2000 + 2001 + 2002) * 512);
+      g_assert_cmpint (mock_samples_get (samples, "block.device.read", "vdac"), ==, 1002 * 512);
+      g_assert_cmpint (mock_samples_get (samples, "block.device.written", "vdab1"), ==, 512);
+
+      g_assert_cmpint (mock_samples_get (samples, "network.interface.rx", "veth3"), ==, 10003);
+      g_assert_cmpint (mock_samples_get (samples, "network.interface.tx", "veth4"), ==, 20004);
+      g_assert_cmpint (mock_samples_get (samples, "network.all.rx", NULL), ==, 5 * 10000 + 10);
+    }
+
+  g_object_unref (samples);
+
+  cockpit_proc_file_close_all ();
+  cockpit_proc_root = previous;
+  remove_proc_root (directory);
+}
+
+/*
+ * A /proc with only net/dev, for interfaces veth<N>. The values say which
+ * instance and which phase they belong to, so every value that the channel
+ * sends can be checked against the instance it is sent for.
+ */
+static void
+write_net_dev (const gchar *directory,
+               const guint *interfaces,
+               guint n_interfaces,
+               guint phase)
+{
+  GError *error = NULL;
+  GString *contents;
+  gchar *path;
+  guint i;
+
+  contents = g_string_new ("Inter-|   Receive                                                |  Transmit\n"
+                           " face |bytes    packets errs drop fifo frame compressed multicast|bytes    packets errs drop fifo colls carrier compressed\n");
+  for (i = 0; i < n_interfaces; i++)
+    {
+      g_string_append_printf (contents, "%6s%u: %7u %7u    0    0    0     0          0         0 %8u %7u    0    0    0     0       0          0\n",
+                              "veth", interfaces[i], 100000 + interfaces[i] * 1000 + phase, 100,
+                              200000 + interfaces[i] * 1000 + phase, 200);
+    }
+
+  path = g_build_filename (directory, "net", "dev", NULL);
+  g_file_set_contents (path, contents->str, contents->len, &error);
+  g_assert_no_error (error);
+  g_string_free (contents, TRUE);
+  g_free (path);
+
+  /* The sampler keeps the old file open otherwise */
+  cockpit_proc_file_close_all ();
+}
+
+/* Reads until data from @phase arrives, checking each value on the way */
+static void
+recv_interface_phase (MockTransport *transport,
+                      JsonObject **meta,
+                      guint phase)
+{
+  JsonArray *instances;
+  JsonArray *metrics;
+  JsonArray *values;
+  JsonArray *rows;
+  JsonNode *node;
+  GBytes *msg;
+  const gchar *name;
+  gint64 value;
+  guint seen = G_MAXUINT;
+  guint row_phase;
+  guint r, m, i;
+
+  while (seen != phase)
+    {
+      while ((msg = mock_transport_pop_channel (transport, "1234")) == NULL)
+        g_main_context_iteration (NULL, TRUE);
+
+      if (((const gchar *)g_bytes_get_data (msg, NULL))[0] == '{')
+        {
+          if (*meta)
+            json_object_unref (*meta);
+          *meta = cockpit_json_parse_bytes (msg, NULL);
+          g_assert (*meta != NULL);
+          continue;
+        }
+
+      g_assert (*meta != NULL);
+      metrics = json_object_get_array_member (*meta, "metrics");
+
+      node = cockpit_json_parse (g_bytes_get_data (msg, NULL), g_bytes_get_size (msg), NULL);
+      g_assert (node != NULL);
+      rows = json_node_get_array (node);
+
+      for (r = 0; r < json_array_get_length (rows); r++)
+        {
+          row_phase = G_MAXUINT;
+          for (m = 0; m < 2; m++)
+            {
+              /* Each metric has its own order of instances */
+              instances = json_object_get_array_member (json_array_get_object_element (metrics, m), "instances");
+              values = json_array_get_array_element (json_array_get_array_element (rows, r), m);
+              g_assert_cmpuint (json_array_get_length (values), ==, json_array_get_length (instances));
+
+              for (i = 0; i < json_array_get_length (values); i++)
+                {
+                  name = json_array_get_string_element (instances, i);
+                  g_assert (g_str_has_prefix (name, "veth"));
+                  value = json_array_get_int_element (values, i);
+                  if (row_phase == G_MAXUINT)
+                    row_phase = value % 1000;
+                  g_assert_cmpint (value, ==, (m + 1) * 100000 + g_ascii_strtoull (name + 4, NULL, 10) * 1000 + row_phase);
+                }
+            }
+          seen = row_phase;
+        }
+
+      json_node_free (node);
+    }
+}
+
+static void
+assert_interfaces (JsonObject *meta,
+                   const guint *interfaces,
+                   guint n_interfaces)
+{
+  JsonArray *metrics;
+  JsonObject *metric;
+  gchar *name;
+  guint m, i;
+
+  metrics = json_object_get_array_member (meta, "metrics");
+  for (m = 0; m < 2; m++)
+    {
+      metric = json_array_get_object_element (metrics, m);
+      g_assert_cmpuint (json_array_get_length (json_object_get_array_member (metric, "instances")), ==, n_interfaces);
+      for (i = 0; i < n_interfaces; i++)
+        {
+          name = g_strdup_printf ("veth%u", interfaces[i]);
+          g_assert (has_instance (metric, name));
+          g_free (name);
+        }
+    }
+}
+
+static void
+test_instances_change (void)
+{
+  const gchar *previous = cockpit_proc_root;
+  MockTransport *transport = mock_transport_new ();
+  CockpitChannel *channel;
+  JsonObject *options = json_obj ("{ 'metrics': [ { 'name': 'network.interface.rx' },"
+                                  "               { 'name': 'network.interface.tx' } ],"
+                                  "  'interval': 100"
+                                  "}");
+  JsonObject *meta = NULL;
+  const guint first[] = { 0, 1, 2 };
+  const guint reordered[] = { 2, 0, 1 };
+  const guint removed[] = { 3, 1 };
+  const guint returned[] = { 1, 3, 0 };
+  gchar *directory;
+  gchar *path;
+  GError *error = NULL;
+
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+
+  directory = g_dir_make_tmp ("test-metrics-XXXXXX", &error);
+  g_assert_no_error (error);
+  path = g_build_filename (directory, "net", NULL);
+  g_assert (g_mkdir (path, 0700) == 0);
+  g_free (path);
+
+  cockpit_proc_root = directory;
+  write_net_dev (directory, first, G_N_ELEMENTS (first), 1);
+
+  channel = g_object_new (cockpit_internal_metrics_get_type (),
+                          "transport", transport,
+                          "id", "1234",
+                          "options", options,
+                          NULL);
+  cockpit_metrics_set_compress (COCKPIT_METRICS (channel), FALSE);
+  cockpit_metrics_set_interpolate (COCKPIT_METRICS (channel), FALSE);
+  cockpit_channel_prepare (channel);
+
+  recv_interface_phase (transport, &meta, 1);
+  assert_interfaces (meta, first, G_N_ELEMENTS (first));
+
+  /* Same instances in a different order, routed again by name */
+  write_net_dev (directory, reordered, G_N_ELEMENTS (reordered), 2);
+  recv_interface_phase (transport, &meta, 2);
+  assert_interfaces (meta, reordered, G_N_ELEMENTS (reordered));
+
+  /* Instances go away, and a new one comes first */
+  write_net_dev (directory, removed, G_N_ELEMENTS (removed), 3);
+  recv_interface_phase (transport, &meta, 3);
+  assert_interfaces (meta, removed, G_N_ELEMENTS (removed));
+
+  /* And one of them comes back in between */
+  write_net_dev (directory, returned, G_N_ELEMENTS (returned), 4);
+  recv_interface_phase (transport, &meta, 4);
+  assert_interfaces (meta, returned, G_N_ELEMENTS (returned));
+
+  json_object_unref (meta);
+  g_object_unref (channel);
+  json_object_unref (options);
+  g_object_unref (transport);
+
+  cockpit_proc_file_close_all ();
+  cockpit_proc_root = previous;
+
+  path = g_build_filename (directory, "net", "dev", NULL);
+  g_assert (remove (path) == 0);
+  g_free (path);
+  path = g_build_filename (directory, "net", NULL);
+  g_assert (rmdir (path) == 0);
+  g_free (path);
+  g_assert (rmdir (directory) == 0);
+  g_free (directory);
+}
+
+static const struct {
+  const gchar *name;
+  const gchar *contents;
+} cgroup_files[] = {
+  { "memory.current", NULL },
+  { "memory.max", "max\n" },
+  { "cpu.stat", "usage_usec 1234000\nuser_usec 1000000\nsystem_usec 234000\n" },
+  { "io.stat", "8:0 rbytes=1000 wbytes=2000 rios=1 wios=2 dbytes=0 dios=0\n"
+               "8:16 rbytes=10 wbytes=20 rios=1 wios=2 dbytes=0 dios=0\n" },
+  { "pids.current", "3\n" },
+};
+
+static void
+add_mock_cgroup (const gchar *directory,
+                 guint64 memory)
+{
+  GError *error = NULL;
+  gchar *contents;
+  gchar *path;
+  guint i;
+
+  g_assert (g_mkdir (directory, 0700) == 0);
+
+  for (i = 0; i < G_N_ELEMENTS (cgroup_files); i++)
+    {
+      if (cgroup_files[i].contents)
+        contents = g_strdup (cgroup_files[i].contents);
+      else
+        contents = g_strdup_printf ("%" G_GUINT64_FORMAT "\n", memory);
+
+      path = g_build_filename (directory, cgroup_files[i].name, NULL);
+      g_file_set_contents (path, contents, -1, &error);
+      g_assert_no_error (error);
+      g_free (contents);
+      g_free (path);
+    }
+}
+
+static void
+remove_mock_cgroup (const gchar *directory)
+{
+  gchar *path;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (cgroup_files); i++)
+    {
+      path = g_build_filename (directory, cgroup_files[i].name, NULL);
+      g_assert (remove (path) == 0);
+      g_free (path);
+    }
+
+  g_assert (rmdir (directory) == 0);
+}
+
+static void
+test_cgroup_unified (void)
+{
+  const gchar *previous = cockpit_cgroup_unified_root;
+  GError *error = NULL;
+  MockSamples *samples;
+  gchar *directory;
+  gchar *controllers;
+  gchar *parent;
+  gchar *child;
+  gchar *added;
+  gchar *moved;
+
+  directory = g_dir_make_tmp ("test-cgroup-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  controllers = g_build_filename (directory, "cgroup.controllers", NULL);
+  g_file_set_contents (controllers, "cpu io memory pids\n", -1, &error);
+  g_assert_no_error (error);
+
+  parent = g_build_filename (directory, "machine.slice", NULL);
+  child = g_build_filename (parent, "vm.scope", NULL);
+  added = g_build_filename (parent, "container.scope", NULL);
+  add_mock_cgroup (parent, 4096);
+  add_mock_cgroup (child, 1024);
+
+  cockpit_cgroup_unified_root = directory;
+  cockpit_cgroup_samples_reset ();
+
+  samples = g_object_new (mock_samples_get_type (), NULL);
+  samples->values = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  cockpit_cgroup_samples (COCKPIT_SAMPLES (samples));
+  g_assert_cmpint (mock_samples_get (samples, "cgroup.memory.usage", "machine.slice"), ==, 4096);
+  g_assert_cmpint (mock_samples_get (samples, "cgroup.memory.usage", "machine.slice/vm.scope"), ==, 1024);
+  g_assert_cmpint (mock_samples_get (samples, "cgroup.memory.limit", "machine.slice/vm.scope"), ==, 0);
+  g_assert_cmpint (mock_samples_get (samples, "cgroup.cpu.usage", "machine.slice/vm.scope"), ==, 1234);
+  g_assert_cmpint (mock_samples_get (samples, "cgroup.io.read", "machine.slice/vm.scope"), ==, 1010);
+  g_assert_cmpint (mock_samples_get (samples, "cgroup.io.written", "machine.slice/vm.scope"), ==, 2020);
+  g_assert_cmpint (mock_samples_get (samples, "cgroup.pids.current", "machine.slice/vm.scope"), ==, 3);
+
+  /* The root has none of the files */
+  g_assert (!g_hash_table_lookup (samples->values, "cgroup.memory.usage/"));
+  g_assert_cmpuint (g_hash_table_size (samples->values), ==, 12);
+
+  /* New cgroups are noticed, and removed ones are forgotten */
+  add_mock_cgroup (added, 2048);
+  remove_mock_cgroup (child);
+
+  g_hash_table_remove_all (samples->values);
+  cockpit_cgroup_samples (COCKPIT_SAMPLES (samples));
+  g_assert_cmpint (mock_samples_get (samples, "cgroup.memory.usage", "machine.slice/container.scope"), ==, 2048);
+  g_assert (!g_hash_table_lookup (samples->values, "cgroup.memory.usage/machine.slice/vm.scope"));
+  g_assert_cmpuint (g_hash_table_size (samples->values), ==, 12);
+
+  /* A moved subtree goes away, children and all, and comes back under its new name */
+  moved = g_build_filename (directory, "other.slice", NULL);
+  g_assert (rename (parent, moved) == 0);
+
+  g_hash_table_remove_all (samples->values);
+  cockpit_cgroup_samples (COCKPIT_SAMPLES (samples));
+  g_assert_cmpint (mock_samples_get (samples, "cgroup.memory.usage", "other.slice"), ==, 4096);
+  g_assert_cmpint (mock_samples_get (samples, "cgroup.memory.usage", "other.slice/container.scope"), ==, 2048);
+  g_assert (!g_hash_table_lookup (samples->values, "cgroup.memory.usage/machine.slice/container.scope"));
+  g_assert_cmpuint (g_hash_table_size (samples->values), ==, 12);
+  g_assert (rename (moved, parent) == 0);
+
+  g_object_unref (samples);
+
+  cockpit_cgroup_samples_reset ();
+  cockpit_cgroup_unified_root = previous;
+
+  remove_mock_cgroup (added);
+  remove_mock_cgroup (parent);
+  g_assert (remove (controllers) == 0);
+  g_assert (rmdir (directory) == 0);
+
+  g_free (controllers);
+  g_free (directory);
+  g_free (parent);
+  g_free (child);
+  g_free (added);
+  g_free (moved);
+}
+
+static void
+test_mount_samplers (void)
+{
+  const gchar *previous = cockpit_proc_root;
+  GError *error = NULL;
+  MockSamples *samples;
+  gchar *directory;
+  gchar *mounted;
+  gchar *contents;
+  gchar *path;
+
+  directory = g_dir_make_tmp ("test-metrics-XXXXXX", &error);
+  g_assert_no_error (error);
+  mounted = g_build_filename (directory, "with space", NULL);
+  g_assert (g_mkdir (mounted, 0700) == 0);
+
+  /* Only the first one is a real device that exists */
+  path = g_build_filename (directory, "mounts", NULL);
+  contents = g_strdup_printf ("/dev/vda1 %s/with\\040space ext4 rw 0 0\n"
+                              "tmpfs %s tmpfs rw 0 0\n"
+                              "/dev/vdb1 /nonexistent ext4 rw 0 0\n",
+                              directory, directory);
+  g_file_set_contents (path, contents, -1, &error);
+  g_assert_no_error (error);
+  g_free (contents);
+
+  cockpit_proc_root = directory;
+  cockpit_proc_file_close_all ();
+
+  samples = g_object_new (mock_samples_get_type (), NULL);
+  samples->values = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  samples->stale = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  /* The first tick only starts the calls, the values come with the next */
+  cockpit_mount_samples (COCKPIT_SAMPLES (samples));
+  g_assert_cmpuint (g_hash_table_size (samples->values), ==, 0);
+  while (g_hash_table_size (samples->values) == 0)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      g_hash_table_remove_all (samples->stale);
+      cockpit_mount_samples (COCKPIT_SAMPLES (samples));
+    }
+
+  g_assert_cmpint (mock_samples_get (samples, "mount.total", mounted), >, 0);
+  g_assert_cmpint (mock_samples_get (samples, "mount.used", mounted), <=,
+                   mock_samples_get (samples, "mount.total", mounted));
+  g_assert_cmpuint (g_hash_table_size (samples->values), ==, 2);
+  g_assert_cmpuint (g_hash_table_size (samples->stale), ==, 0);
+
+  g_object_unref (samples);
+
+  cockpit_proc_file_close_all ();
+  cockpit_proc_root = previous;
+
+  g_assert (remove (path) == 0);
+  g_assert (rmdir (mounted) == 0);
+  g_assert (rmdir (directory) == 0);
+  g_free (directory);
+  g_free (mounted);
+  g_free (path);
+}
+
+/* statvfs() that doesn't return for hung_dir until it is cleared */
+static GMutex hung_lock;
+static GCond hung_cond;
+static gchar *hung_dir;
+
+static int
+mock_statvfs (const gchar *dir,
+              struct statvfs *buf)
+{
+  g_mutex_lock (&hung_lock);
+  while (hung_dir && g_str_equal (dir, hung_dir))
+    g_cond_wait (&hung_cond, &hung_lock);
+  g_mutex_unlock (&hung_lock);
+
+  return statvfs (dir, buf);
+}
+
+static void
+release_hung_mount (void)
+{
+  g_mutex_lock (&hung_lock);
+  g_free (hung_dir);
+  hung_dir = NULL;
+  g_cond_broadcast (&hung_cond);
+  g_mutex_unlock (&hung_lock);
+}
+
+/* A fake /proc with a "fast" and a "hung" mount */
+static gchar *
+build_hung_mounts (gchar **fast,
+                   gchar **hung)
+{
+  GError *error = NULL;
+  gchar *directory;
+  gchar *contents;
+  gchar *path;
+
+  directory = g_dir_make_tmp ("test-metrics-XXXXXX", &error);
+  g_assert_no_error (error);
+  *fast = g_build_filename (directory, "fast", NULL);
+  g_assert (g_mkdir (*fast, 0700) == 0);
+  *hung = g_build_filename (directory, "hung", NULL);
+  g_assert (g_mkdir (*hung, 0700) == 0);
+
+  path = g_build_filename (directory, "mounts", NULL);
+  contents = g_strdup_printf ("/dev/vda1 %s ext4 rw 0 0\n"
+                              "server:/export %s nfs rw 0 0\n"
+                              "/dev/vdb1 %s ext4 rw 0 0\n",
+                              *fast, *hung, *hung);
+  g_file_set_contents (path, contents, -1, &error);
+  g_assert_no_error (error);
+  g_free (contents);
+  g_free (path);
+
+  g_mutex_lock (&hung_lock);
+  g_free (hung_dir);
+  hung_dir = g_strdup (*hung);
+  g_mutex_unlock (&hung_lock);
+
+  cockpit_mount_statvfs = mock_statvfs;
+  cockpit_proc_root = directory;
+  cockpit_proc_file_close_all ();
+
+  return directory;
+}
+
+static void
+remove_hung_mounts (gchar *directory,
+                    gchar *fast,
+                    gchar *hung)
+{
+  gchar *path;
+
+  release_hung_mount ();
+  cockpit_proc_file_close_all ();
+
+  path = g_build_filename (directory, "mounts", NULL);
+  g_assert (remove (path) == 0);
+  g_assert (rmdir (fast) == 0);
+  g_assert (rmdir (hung) == 0);
+  g_assert (rmdir (directory) == 0);
+  g_free (directory);
+  g_free (fast);
+  g_free (hung);
+  g_free (path);
+}
+
+static void
+test_mount_stale (void)
+{
+  const gchar *previous = cockpit_proc_root;
+  MockSamples *samples;
+  gchar *directory;
+  gchar *fast;
+  gchar *hung;
+  gchar *key;
+
+  directory = build_hung_mounts (&fast, &hung);
+
+  samples = g_object_new (mock_samples_get_type (), NULL);
+  samples->values = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  samples->stale = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  /* The tick never waits: the fast mount is reported and the hung one is stale */
+  cockpit_mount_samples (COCKPIT_SAMPLES (samples));
+  g_assert_cmpuint (g_hash_table_size (samples->values), ==, 0);
+  while (g_hash_table_size (samples->values) == 0)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      g_hash_table_remove_all (samples->stale);
+      cockpit_mount_samples (COCKPIT_SAMPLES (samples));
+    }
+
+  g_assert_cmpint (mock_samples_get (samples, "mount.total", fast), >, 0);
+  g_assert_cmpuint (g_hash_table_size (samples->values), ==, 2);
+  key = g_strdup_printf ("mount.total/%s", hung);
+  g_assert (g_hash_table_contains (samples->stale, key));
+  g_free (key);
+  key = g_strdup_printf ("mount.used/%s", hung);
+  g_assert (g_hash_table_contains (samples->stale, key));
+  g_free (key);
+  g_assert_cmpuint (g_hash_table_size (samples->stale), ==, 2);
+
+  /* Once statvfs() returns, the mount is reported again */
+  release_hung_mount ();
+  while (g_hash_table_size (samples->stale) > 0)
+    {
+      g_main_context_iteration (NULL, TRUE);
+      g_hash_table_remove_all (samples->stale);
+      cockpit_mount_samples (COCKPIT_SAMPLES (samples));
+    }
+
+  g_assert_cmpint (mock_samples_get (samples, "mount.total", hung), >, 0);
+  g_assert_cmpuint (g_hash_table_size (samples->values), ==, 4);
+
+  g_object_unref (samples);
+
+  remove_hung_mounts (directory, fast, hung);
+  cockpit_proc_root = previous;
+}
+
+static JsonObject *
+recv_mount_meta (MockTransport *transport,
+                 const gchar *channel_id)
+{
+  JsonObject *meta = NULL;
+  GBytes *msg;
+
+  while (!meta)
+    {
+      while ((msg = mock_transport_pop_channel (transport, channel_id)) == NULL)
+        g_main_context_iteration (NULL, TRUE);
+      if (((const gchar *)g_bytes_get_data (msg, NULL))[0] == '{')
+        meta = cockpit_json_parse_bytes (msg, NULL);
+    }
+
+  return meta;
+}
+
+static gboolean
+has_stale_instance (JsonObject *metric,
+                    const gchar *instance)
+{
+  JsonArray *stale;
+  guint i;
+
+  stale = json_object_get_array_member (metric, "stale");
+  for (i = 0; stale && i < json_array_get_length (stale); i++)
+    {
+      if (g_str_equal (json_array_get_string_element (stale, i), instance))
+        return TRUE;
+    }
+  return FALSE;
+}
+
+static void
+test_mount_stale_meta (void)
+{
+  const gchar *previous = cockpit_proc_root;
+  MockTransport *transport = mock_transport_new ();
+  CockpitChannel *channel;
+  JsonObject *options = json_obj ("{ 'metrics': [ { 'name': 'mount.total' } ],"
+                                  "  'interval': 100"
+                                  "}");
+  JsonObject *metric;
+  JsonObject *meta;
+  gchar *directory;
+  gchar *fast;
+  gchar *hung;
+
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+  directory = build_hung_mounts (&fast, &hung);
+
+  channel = g_object_new (cockpit_internal_metrics_get_type (),
+                          "transport", transport,
+                          "id", "1234",
+                          "options", options,
+                          NULL);
+  cockpit_channel_prepare (channel);
+
+  /* The hung mount shows up as a stale instance */
+  for (;;)
+    {
+      meta = recv_mount_meta (transport, "1234");
+      metric = json_array_get_object_element (json_object_get_array_member (meta, "metrics"), 0);
+      if (has_stale_instance (metric, hung))
+        break;
+      json_object_unref (meta);
+    }
+  g_assert (has_instance (metric, hung));
+  g_assert (!has_stale_instance (metric, fast));
+  json_object_unref (meta);
+
+  /* And stops being stale once statvfs() returns */
+  release_hung_mount ();
+  for (;;)
+    {
+      meta = recv_mount_meta (transport, "1234");
+      metric = json_array_get_object_element (json_object_get_array_member (meta, "metrics"), 0);
+      if (!json_object_has_member (metric, "stale"))
+        break;
+      json_object_unref (meta);
+    }
+  g_assert (has_instance (metric, hung));
+  g_assert (has_instance (metric, fast));
+  json_object_unref (meta);
+
+  g_object_unref (channel);
+  json_object_unref (options);
+  g_object_unref (transport);
+
+  remove_hung_mounts (directory, fast, hung);
+  cockpit_proc_root = previous;
+}
+
+static void
+stale_sampler (CockpitSamples *samples)
+{
+  cockpit_samples_sample (samples, "mount.total", "/fast", 5);
+  cockpit_samples_stale (samples, "mount.total", "/hung");
+}
+
+static void
+test_shared_stale (void)
+{
+  MockSamples *one;
+  MockSamples *two;
+
+  cockpit_samplers_subscribe ();
+
+  one = g_object_new (mock_samples_get_type (), NULL);
+  one->values = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  one->stale = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  two = g_object_new (mock_samples_get_type (), NULL);
+  two->values = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  two->stale = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  /* The second channel gets the stale instance from the recording */
+  cockpit_samplers_run (stale_sampler, 1000, COCKPIT_SAMPLES (one));
+  cockpit_samplers_run (stale_sampler, 1000, COCKPIT_SAMPLES (two));
+  g_assert_cmpuint (cockpit_samplers_get_runs (stale_sampler), ==, 1);
+
+  g_assert_cmpint (mock_samples_get (two, "mount.total", "/fast"), ==, 5);
+  g_assert (g_hash_table_contains (one->stale, "mount.total//hung"));
+  g_assert (g_hash_table_contains (two->stale, "mount.total//hung"));
+  g_assert (!g_hash_table_lookup (two->values, "mount.total//hung"));
+
+  g_object_unref (one);
+  g_object_unref (two);
+
+  cockpit_samplers_unsubscribe ();
+}
+
+static void
+stack_instance_sampler (CockpitSamples *samples)
+{
+  gchar instance[] = "/fast";
+  cockpit_samples_sample (samples, "mount.total", instance, 5);
+}
+
+static void
+test_shared_instances (void)
+{
+  MockSamples *samples;
+  const gchar *instance;
+  guint64 epoch;
+
+  cockpit_samplers_subscribe ();
+  samples = g_object_new (mock_samples_get_type (), NULL);
+  epoch = cockpit_samplers_get_epoch ();
+
+  /* The same instance name is passed with the same pointer on each run */
+  cockpit_samplers_run (stack_instance_sampler, 1000, COCKPIT_SAMPLES (samples));
+  instance = samples->instance;
+  g_assert_cmpstr (instance, ==, "/fast");
+  cockpit_samplers_run (stack_instance_sampler, 2000, COCKPIT_SAMPLES (samples));
+  g_assert (samples->instance == instance);
+  g_assert_cmpuint (cockpit_samplers_get_epoch (), ==, epoch);
+
+  g_object_unref (samples);
+
+  /* And only until the names are freed */
+  cockpit_samplers_unsubscribe ();
+  g_assert_cmpuint (cockpit_samplers_get_epoch (), !=, epoch);
+}
+
+static void
+test_history_full (void)
+{
+  const gchar *previous = cockpit_proc_root;
+  gchar *directory;
+
+  /* More network interfaces than the history keeps series */
+  directory = build_proc_root (2, 2, 200);
+  cockpit_proc_root = directory;
+  cockpit_proc_file_close_all ();
+
+  /* The first slot is recorded right away */
+  cockpit_metrics_history_start (100, 50);
+
+  g_assert (cockpit_metrics_history_covers (cockpit_cpu_samples, 100));
+  g_assert (cockpit_metrics_history_covers (cockpit_memory_samples, 100));
+  g_assert (!cockpit_metrics_history_covers (cockpit_network_samples, 100));
+  g_assert (!cockpit_metrics_history_covers (cockpit_block_samples, 100));
+
+  cockpit_metrics_history_stop ();
+
+  cockpit_proc_file_close_all ();
+  cockpit_proc_root = previous;
+  remove_proc_root (directory);
+}
+
+static JsonObject *
+open_with_timestamp (MockTransport *transport,
+                     const gchar *id,
+                     const gchar *json,
+                     CockpitChannel **channel)
+{
+  JsonObject *options = json_obj (json);
+  JsonObject *meta;
+  GBytes *msg;
+
+  *channel = g_object_new (cockpit_internal_metrics_get_type (),
+                           "transport", transport,
+                           "id", id,
+                           "options", options,
+                           NULL);
+  cockpit_metrics_set_compress (COCKPIT_METRICS (*channel), FALSE);
+  cockpit_channel_prepare (*channel);
+  json_object_unref (options);
+
+  while ((msg = mock_transport_pop_channel (transport, id)) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  meta = cockpit_json_parse_bytes (msg, NULL);
+  g_assert (meta != NULL);
+  g_assert (json_object_has_member (meta, "metrics"));
+  return meta;
+}
+
+static void
+test_history_enable (void)
+{
+  MockTransport *transport = mock_transport_new ();
+  CockpitChannel *channel;
+  JsonObject *meta;
+
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+
+  /* Nothing is sampled until a channel wants metrics */
+  cockpit_metrics_history_enable (100, 50);
+  g_assert (!cockpit_metrics_history_covers (cockpit_cpu_samples, 100));
+  g_assert_cmpuint (cockpit_samplers_get_runs (cockpit_cpu_samples), ==, 0);
+
+  meta = open_with_timestamp (transport, "1", "{ 'metrics': [ { 'name': 'mount.total' } ],"
+                              "  'interval': 100 }", &channel);
+  json_object_unref (meta);
+  g_assert (cockpit_metrics_history_covers (cockpit_cpu_samples, 100));
+
+  /* And the history carries on after the channel is gone */
+  g_object_unref (channel);
+  g_assert (cockpit_metrics_history_covers (cockpit_cpu_samples, 100));
+
+  cockpit_metrics_history_stop ();
+  g_assert (!cockpit_metrics_history_covers (cockpit_cpu_samples, 100));
+  g_object_unref (transport);
+}
+
+static void
+test_history_backfill (void)
+{
+  MockTransport *transport = mock_transport_new ();
+  CockpitChannel *channel;
+  JsonObject *meta;
+  JsonNode *node;
+  JsonArray *data;
+  GBytes *msg;
+  guint64 runs;
+  gint64 now;
+
+  g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), NULL);
+
+  /* Record at least six slots, however long that takes */
+  runs = cockpit_samplers_get_runs (cockpit_cpu_samples);
+  cockpit_metrics_history_start (100, 50);
+  while (cockpit_samplers_get_runs (cockpit_cpu_samples) - runs < 7)
+    g_main_context_iteration (NULL, TRUE);
+  runs = cockpit_samplers_get_runs (cockpit_cpu_samples) - runs;
+
+  /* The past is sent right away, starting several intervals ago */
+  now = g_get_real_time () / 1000;
+  meta = open_with_timestamp (transport, "1", "{ 'metrics': [ { 'name': 'cpu.basic.user' } ],"
+                              "  'interval': 200, 'timestamp': -10000 }", &channel);
+  g_assert_cmpint (json_object_get_int_member (meta, "timestamp"), <=, now - 400);
+  g_assert_cmpint (json_object_get_int_member (meta, "interval"), ==, 200);
+  json_object_unref (meta);
+
+  msg = mock_transport_pop_channel (transport, "1");
+  g_assert (msg != NULL);
+  node = cockpit_json_parse (g_bytes_get_data (msg, NULL), g_bytes_get_size (msg), NULL);
+  data = json_node_get_array (node);
+
+  /* Every other slot, apart from the one live sampling starts with */
+  g_assert_cmpint (json_array_get_length (data), >=, 1);
+  g_assert_cmpint (json_array_get_length (data), <=, runs / 2 + 1);
+  g_assert_cmpint (json_array_get_length (json_array_get_array_element (data, 0)), ==, 1);
+  json_node_free (node);
+
+  /* And then live sampling continues without another meta */
+  msg = mock_transport_pop_channel (transport, "1");
+  g_assert (msg != NULL);
+  node = cockpit_json_parse (g_bytes_get_data (msg, NULL), g_bytes_get_size (msg), NULL);
+  g_assert (json_node_get_node_type (node) == JSON_NODE_ARRAY);
+  g_assert_cmpint (json_array_get_length (json_node_get_array (node)), ==, 1);
+  json_node_free (node);
+  g_object_unref (channel);
+
+  /* An interval that doesn't fall on the history slots is only live */
+  now = g_get_real_time () / 1000;
+  meta = open_with_timestamp (transport, "2", "{ 'metrics': [ { 'name': 'cpu.basic.user' } ],"
+                              "  'interval': 150, 'timestamp': -10000 }", &channel);
+  g_assert_cmpint (json_object_get_int_member (meta, "timestamp"), >=, now);
+  json_object_unref (meta);
+  g_object_unref (channel);
+
+  /* As are metrics that are not recorded */
+  now = g_get_real_time () / 1000;
+  meta = open_with_timestamp (transport, "3", "{ 'metrics': [ { 'name': 'mount.total' } ],"
+                              "  'interval': 200, 'timestamp': -10000 }", &channel);
+  g_assert_cmpint (json_object_get_int_member (meta, "timestamp"), >=, now);
+  json_object_unref (meta);
+  g_object_unref (channel);
+
+  cockpit_metrics_history_stop ();
+  g_object_unref (transport);
+}
+
+#ifdef __GLIBC__
+
+/* Count allocations while sampling, by standing in for malloc() */
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static volatile gint allocations = -1;
+
+void *
+malloc (size_t size)
+{
+  if (allocations >= 0)
+    g_atomic_int_inc (&allocations);
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb,
+        size_t size)
+{
+  if (allocations >= 0)
+    g_atomic_int_inc (&allocations);
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr,
+         size_t size)
+{
+  if (allocations >= 0)
+    g_atomic_int_inc (&allocations);
+  return __libc_realloc (ptr, size);
+}
+
+#endif /* __GLIBC__ */
+
+static void
+test_proc_samplers_perf (void)
+{
+  const struct {
+    const gchar *name;
+    void (* func) (CockpitSamples *samples);
+  } samplers[] = {
+    { "cpu", cockpit_cpu_samples },
+    { "memory", cockpit_memory_samples },
+    { "disk", cockpit_disk_samples },
+    { "block", cockpit_block_samples },
+    { "network", cockpit_network_samples },
+  };
+
+  const gchar *previous = cockpit_proc_root;
+  const gint ticks = 2000;
+  MockSamples *samples;
+  gchar *directory;
+  gdouble elapsed;
+  gint counted;
+  guint i;
+  gint j;
+
+  directory = build_proc_root (256, 64, 200);
+  cockpit_proc_root = directory;
+  cockpit_proc_file_close_all ();
+
+  samples = g_object_new (mock_samples_get_type (), NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (samplers); i++)
+    {
+      /* The first tick opens the file and sizes the buffer */
+      (samplers[i].func) (COCKPIT_SAMPLES (samples));
+
+#ifdef __GLIBC__
+      allocations = 0;
+#endif
+      g_test_timer_start ();
+      for (j = 0; j < ticks; j++)
+        (samplers[i].func) (COCKPIT_SAMPLES (samples));
+      elapsed = g_test_timer_elapsed ();
+#ifdef __GLIBC__
+      counted = allocations;
+      allocations = -1;
+#else
+      counted = -1;
+#endif
+
+      g_test_message ("%s: %.0f ns/tick, %.2f allocations/tick", samplers[i].name,
+                      (elapsed * 1000000000) / ticks, counted < 0 ? NAN : (gdouble)counted / ticks);
+#ifdef __GLIBC__
+      g_assert_cmpint (counted, ==, 0);
+#endif
+    }
+
+  g_object_unref (samples);
+
+  cockpit_proc_file_close_all ();
+  cockpit_proc_root = previous;
+  remove_proc_root (directory);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -727,6 +2339,10 @@ main (int argc,
 
   g_test_add ("/metrics/compression", TestCase, NULL,
               setup, test_compression, teardown);
+  g_test_add ("/metrics/binary", TestCase, NULL,
+              setup_binary, test_binary, teardown);
+  g_test_add ("/metrics/binary-invalid", TestCase, "{ 'binary': 'base64' }",
+              setup, test_binary_invalid, teardown);
   g_test_add ("/metrics/compression-reset", TestCase, NULL,
               setup, test_compression_reset, teardown);
   g_test_add ("/metrics/derive-delta", TestCase, NULL,
@@ -738,6 +2354,15 @@ main (int argc,
 
   g_test_add ("/metrics/instances", TestCase, NULL,
               setup, test_instances, teardown);
+  g_test_add ("/metrics/reduce-sum", TestCase,
+              "{ 'metrics': [ { 'name': 'foo', 'reduce': 'sum' } ] }",
+              setup, test_reduce_sum, teardown);
+  g_test_add ("/metrics/reduce-top", TestCase,
+              "{ 'metrics': [ { 'name': 'foo', 'top': 2 } ] }",
+              setup, test_reduce_top, teardown);
+  g_test_add ("/metrics/reduce-match", TestCase,
+              "{ 'metrics': [ { 'name': 'foo', 'match': 'eth*' } ] }",
+              setup, test_reduce_match, teardown);
   g_test_add ("/metrics/dynamic-instances", TestCase, NULL,
               setup, test_dynamic_instances, teardown);
   g_test_add_func ("/metrics/omit-instances", test_omit_instances);
@@ -745,6 +2370,22 @@ main (int argc,
   g_test_add_func ("/metrics/not-supported", test_not_supported);
 
   g_test_add_func ("/metrics/deprecated-net-all", test_deprecated_net_all);
+  g_test_add_func ("/metrics/cockpit", test_cockpit_metrics);
+  g_test_add_func ("/metrics/shared-samplers", test_shared_samplers);
+  g_test_add_func ("/metrics/proc-samplers", test_proc_samplers);
+  g_test_add_func ("/metrics/instances-change", test_instances_change);
+  g_test_add_func ("/metrics/cgroup-unified", test_cgroup_unified);
+  g_test_add_func ("/metrics/mount-samplers", test_mount_samplers);
+  g_test_add_func ("/metrics/mount-stale", test_mount_stale);
+  g_test_add_func ("/metrics/mount-stale-meta", test_mount_stale_meta);
+  g_test_add_func ("/metrics/shared-stale", test_shared_stale);
+  g_test_add_func ("/metrics/shared-instances", test_shared_instances);
+  g_test_add_func ("/metrics/history-enable", test_history_enable);
+  g_test_add_func ("/metrics/history-backfill", test_history_backfill);
+  g_test_add_func ("/metrics/history-full", test_history_full);
+
+  if (g_test_perf ())
+    g_test_add_func ("/metrics/proc-samplers-perf", test_proc_samplers_perf);
 
   return g_test_run ();
 }
@@ -35,6 +35,8 @@
 #include <pcp/impl.h>
 #include <pcp/import.h>
 
+#define MOCK_LONG_SAMPLES 20000
+
 static void
 init_mock_archives (void)
 {
@@ -69,6 +71,20 @@ init_mock_archives (void)
   g_assert (pmiPutValue ("mock.late", NULL, "32") >= 0);
   g_assert (pmiWrite (5, 0) >= 0);
   g_assert (pmiEnd () >= 0);
+
+  g_assert (system ("rm -rf mock-long && mkdir mock-long") == 0);
+  g_assert (pmiStart ("mock-long/0", 0) >= 0);
+  g_assert (pmiAddMetric ("mock.value", PM_ID_NULL,
+                          PM_TYPE_U32, PM_INDOM_NULL, PM_SEM_INSTANT,
+                          pmiUnits (0, 0, 0, 0, 0, 0)) >= 0);
+  for (int i = 0; i < MOCK_LONG_SAMPLES; i++)
+    {
+      gchar *value = g_strdup_printf ("%d", i);
+      g_assert (pmiPutValue ("mock.value", NULL, value) >= 0);
+      g_assert (pmiWrite (i, 0) >= 0);
+      g_free (value);
+    }
+  g_assert (pmiEnd () >= 0);
 }
 
 typedef struct AtTeardown {
@@ -356,6 +372,127 @@ test_metrics_archive_directory_late_metric (TestCase *tc,
   json_object_unref (options);
 }
 
+static void
+test_metrics_archive_buckets (TestCase *tc,
+                              gconstpointer unused)
+{
+  JsonObject *options = json_obj("{ 'source': '" BUILDDIR "/mock-archives/0',"
+                                 "  'metrics': [ { 'name': 'mock.value', 'aggregate': 'mean' },"
+                                 "               { 'name': 'mock.value', 'aggregate': 'min' },"
+                                 "               { 'name': 'mock.value', 'aggregate': 'max' } ],"
+                                 "  'interval': 1000,"
+                                 "  'limit': 3,"
+                                 "  'buckets': 2"
+                                 "}");
+
+  setup_metrics_channel_json (tc, options);
+
+  JsonObject *meta = recv_json_object (tc);
+  g_assert_cmpint (json_object_get_int_member (meta, "interval"), ==, 2000);
+  cockpit_assert_json_eq (json_object_get_array_member (meta, "metrics"),
+                          "[ { 'name': 'mock.value', 'aggregate': 'mean', 'units': '', 'semantics': 'instant' },"
+                          "  { 'name': 'mock.value', 'aggregate': 'min', 'units': '', 'semantics': 'instant' },"
+                          "  { 'name': 'mock.value', 'aggregate': 'max', 'units': '', 'semantics': 'instant' } ]");
+
+  /* The last bucket is only partly filled */
+  assert_sample (tc, "[[10.5,10,11],[12,12,12]]");
+
+  json_object_unref (options);
+}
+
+static void
+test_metrics_archive_buckets_derive (TestCase *tc,
+                                     gconstpointer unused)
+{
+  JsonObject *options = json_obj("{ 'source': '" BUILDDIR "/mock-archives/0',"
+                                 "  'metrics': [ { 'name': 'mock.value', 'derive': 'rate', 'aggregate': 'max' } ],"
+                                 "  'interval': 1000,"
+                                 "  'limit': 3,"
+                                 "  'buckets': 1"
+                                 "}");
+
+  setup_metrics_channel_json (tc, options);
+
+  /* Derived by the bridge, before aggregating */
+  JsonObject *meta = recv_json_object (tc);
+  cockpit_assert_json_eq (json_object_get_array_member (meta, "metrics"),
+                          "[ { 'name': 'mock.value', 'aggregate': 'max', 'units': '', 'semantics': 'instant' } ]");
+
+  assert_sample (tc, "[[1]]");
+
+  json_object_unref (options);
+}
+
+static gboolean
+on_timeout_stall (gpointer user_data)
+{
+  gint64 *stall = user_data;
+  gint64 now = g_get_monotonic_time ();
+
+  /* stall[0] is the last time we ran, stall[1] the longest gap */
+  if (stall[0] && now - stall[0] > stall[1])
+    stall[1] = now - stall[0];
+  stall[0] = now;
+  return TRUE;
+}
+
+static void
+test_metrics_archive_long (TestCase *tc,
+                           gconstpointer unused)
+{
+  JsonObject *options = json_obj("{ 'source': '" BUILDDIR "/mock-long',"
+                                 "  'metrics': [ { 'name': 'mock.value' } ],"
+                                 "  'interval': 1000"
+                                 "}");
+  gint64 stall[2] = { 0, 0 };
+  JsonArray *rows;
+  JsonNode *node;
+  GBytes *msg;
+  gint64 count = 0;
+  guint timeout;
+  guint i;
+
+  timeout = g_timeout_add (10, on_timeout_stall, stall);
+  setup_metrics_channel_json (tc, options);
+
+  JsonObject *meta = recv_json_object (tc);
+  cockpit_assert_json_eq (json_object_get_array_member (meta, "metrics"),
+                          "[ { 'name': 'mock.value', 'units': '', 'semantics': 'instant' } ]");
+
+  /* Every sample arrives, in order, while the main loop keeps running */
+  while (!tc->channel_closed)
+    {
+      msg = mock_transport_pop_channel (tc->transport, "1234");
+      if (!msg)
+        {
+          g_main_context_iteration (NULL, TRUE);
+          continue;
+        }
+
+      node = cockpit_json_parse (g_bytes_get_data (msg, NULL), g_bytes_get_size (msg), NULL);
+      g_assert (node != NULL);
+      rows = json_node_get_array (node);
+      for (i = 0; i < json_array_get_length (rows); i++)
+        {
+          JsonArray *row = json_array_get_array_element (rows, i);
+          g_assert_cmpint (json_array_get_int_element (row, 0), ==, count);
+          count++;
+        }
+      json_node_free (node);
+    }
+
+  g_assert_cmpint (count, ==, MOCK_LONG_SAMPLES);
+  g_assert_cmpstr (tc->problem, ==, NULL);
+
+  g_source_remove (timeout);
+
+  if (g_test_perf ())
+    g_test_maximized_result (stall[1] / 1000.0, "longest main loop stall: %g ms", stall[1] / 1000.0);
+  g_assert_cmpint (stall[1], <, G_USEC_PER_SEC);
+
+  json_object_unref (options);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -379,6 +516,12 @@ main (int argc,
               setup, test_metrics_archive_directory_timestamp, teardown);
   g_test_add ("/metrics/archive-directory-late-metric", TestCase, NULL,
               setup, test_metrics_archive_directory_late_metric, teardown);
+  g_test_add ("/metrics/archive-buckets", TestCase, NULL,
+              setup, test_metrics_archive_buckets, teardown);
+  g_test_add ("/metrics/archive-buckets-derive", TestCase, NULL,
+              setup, test_metrics_archive_buckets_derive, teardown);
+  g_test_add ("/metrics/archive-long", TestCase, NULL,
+              setup, test_metrics_archive_long, teardown);
 
   return g_test_run ();
 }
@@ -25,6 +25,7 @@
 #include "mock-transport.h"
 
 #include "common/cockpitjson.h"
+#include "common/cockpitpipetransport.h"
 #include "common/cockpittest.h"
 
 #include <json-glib/json-glib.h>
@@ -850,6 +851,144 @@ test_fail_access_denied (void)
   cockpit_assert_expected ();
 }
 
+typedef struct {
+  CockpitTransport *transport;
+  GQueue pings;
+  guint timeout;
+  gint64 received;
+  gint64 acked;
+  gint64 max_outstanding;
+  gboolean closed;
+} SlowConsumer;
+
+static gboolean
+on_slow_consumer_recv (CockpitTransport *transport,
+                       const gchar *channel,
+                       GBytes *payload,
+                       gpointer user_data)
+{
+  SlowConsumer *slow = user_data;
+
+  if (!channel)
+    return FALSE;
+
+  g_assert_cmpstr (channel, ==, "548");
+
+  /* Just count the bytes, don't hold onto them */
+  slow->received += g_bytes_get_size (payload);
+  slow->max_outstanding = MAX (slow->max_outstanding, slow->received - slow->acked);
+  return TRUE;
+}
+
+static gboolean
+on_slow_consumer_control (CockpitTransport *transport,
+                          const gchar *command,
+                          const gchar *channel,
+                          JsonObject *options,
+                          GBytes *payload,
+                          gpointer user_data)
+{
+  SlowConsumer *slow = user_data;
+
+  g_assert_cmpstr (channel, ==, "548");
+
+  if (g_str_equal (command, "ping"))
+    g_queue_push_tail (&slow->pings, json_object_ref (options));
+  else if (g_str_equal (command, "close"))
+    slow->closed = TRUE;
+
+  return TRUE;
+}
+
+static gboolean
+on_slow_consumer_timeout (gpointer user_data)
+{
+  SlowConsumer *slow = user_data;
+  JsonObject *ping;
+  GBytes *bytes;
+  gint64 sequence;
+
+  /* Acknowledge everything that arrived since last time */
+  while ((ping = g_queue_pop_head (&slow->pings)) != NULL)
+    {
+      g_assert (cockpit_json_get_int (ping, "sequence", -1, &sequence));
+      g_assert_cmpint (sequence, <=, slow->received);
+      slow->acked = sequence;
+
+      json_object_set_string_member (ping, "command", "pong");
+      bytes = cockpit_json_write_bytes (ping);
+      cockpit_transport_send (slow->transport, NULL, bytes);
+      g_bytes_unref (bytes);
+      json_object_unref (ping);
+    }
+
+  return TRUE;
+}
+
+static void
+test_flow_control (void)
+{
+  CockpitTransport *transport;
+  CockpitChannel *channel;
+  SlowConsumer slow = { NULL, G_QUEUE_INIT, 0, 0, 0, 0, FALSE };
+  gchar *problem = NULL;
+  JsonObject *options;
+  JsonArray *array;
+  gint64 length;
+  gchar *command;
+  int fds[2];
+
+  /* A gigabyte when running slow tests, otherwise a more modest amount */
+  length = g_test_slow () ? 1024 * 1024 * 1024 : 64 * 1024 * 1024;
+
+  /* Real transports, MockTransport would hold onto all the data */
+  if (socketpair (PF_LOCAL, SOCK_STREAM, 0, fds) < 0)
+    g_assert_not_reached ();
+  transport = cockpit_pipe_transport_new_fds ("bridge", fds[0], fds[0]);
+  slow.transport = cockpit_pipe_transport_new_fds ("consumer", fds[1], fds[1]);
+  g_signal_connect (slow.transport, "recv", G_CALLBACK (on_slow_consumer_recv), &slow);
+  g_signal_connect (slow.transport, "control", G_CALLBACK (on_slow_consumer_control), &slow);
+  slow.timeout = g_timeout_add (10, on_slow_consumer_timeout, &slow);
+
+  command = g_strdup_printf ("head -c %" G_GINT64_FORMAT " /dev/zero", length);
+  options = json_object_new ();
+  array = json_array_new ();
+  json_array_add_string_element (array, "/bin/sh");
+  json_array_add_string_element (array, "-c");
+  json_array_add_string_element (array, command);
+  json_object_set_array_member (options, "spawn", array);
+  json_object_set_string_member (options, "payload", "stream");
+  json_object_set_string_member (options, "binary", "raw");
+  json_object_set_boolean_member (options, "flow-control", TRUE);
+
+  channel = g_object_new (COCKPIT_TYPE_PIPE_CHANNEL,
+                          "options", options,
+                          "id", "548",
+                          "transport", transport,
+                          NULL);
+  g_signal_connect (channel, "closed", G_CALLBACK (on_closed_get_problem), &problem);
+  json_object_unref (options);
+  g_free (command);
+
+  while (!slow.closed)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpstr (problem, ==, "");
+  g_assert_cmpint (slow.received, ==, length);
+
+  /* Never more than the window plus a ping interval and a frame in flight */
+  g_assert_cmpint (slow.max_outstanding, <=, 2 * 1024 * 1024 + 16 * 1024 + MAX_PACKET_SIZE);
+
+  g_source_remove (slow.timeout);
+  g_queue_foreach (&slow.pings, (GFunc)json_object_unref, NULL);
+  g_queue_clear (&slow.pings);
+
+  g_object_unref (channel);
+  g_object_unref (transport);
+  g_object_unref (slow.transport);
+  g_free (problem);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -878,6 +1017,8 @@ main (int argc,
   g_test_add_func ("/pipe-channel/spawn/pty", test_spawn_pty);
   g_test_add_func ("/pipe-channel/spawn/pty-resize", test_spawn_pty_resize);
 
+  g_test_add_func ("/pipe-channel/flow-control", test_flow_control);
+
   g_test_add_func ("/pipe-channel/fail/not-found", test_fail_not_found);
   g_test_add_func ("/pipe-channel/fail/access-denied", test_fail_access_denied);
 
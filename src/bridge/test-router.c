@@ -177,6 +177,94 @@ test_local_channel (TestCase *tc,
   g_object_unref (router);
 }
 
+static void
+test_reuse_channel (TestCase *tc,
+                    gconstpointer unused)
+{
+  CockpitRouter *router;
+  gchar *problem = NULL;
+  GBytes *sent;
+
+  static CockpitPayloadType payload_types[] = {
+    { "echo", mock_echo_channel_get_type },
+    { NULL },
+  };
+
+  router = cockpit_router_new (COCKPIT_TRANSPORT (tc->transport), payload_types, NULL);
+  g_signal_connect (tc->transport, "closed", G_CALLBACK (on_transport_closed), &problem);
+
+  emit_string (tc, NULL, "{\"command\": \"init\", \"version\": 1, \"host\": \"localhost\" }");
+  emit_string (tc, NULL, "{\"command\": \"open\", \"channel\": \"a\", \"payload\": \"echo\"}");
+  emit_string (tc, "a", "oh marmalade");
+
+  while ((sent = mock_transport_pop_channel (tc->transport, "a")) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  cockpit_assert_bytes_eq (sent, "oh marmalade", -1);
+
+  /* The open channel must not see the second open */
+  cockpit_expect_warning ("*caller tried to reuse a channel that's already in use*");
+  emit_string (tc, NULL, "{\"command\": \"open\", \"channel\": \"a\", \"payload\": \"echo\"}");
+
+  g_assert_cmpstr (problem, ==, "protocol-error");
+  g_free (problem);
+
+  g_object_unref (router);
+}
+
+static void
+test_statistics (TestCase *tc,
+                 gconstpointer unused)
+{
+  CockpitRouter *router;
+  JsonObject *control;
+  JsonObject *object;
+  JsonArray *transports;
+  GBytes *sent;
+
+  static CockpitPayloadType payload_types[] = {
+    { "echo", mock_echo_channel_get_type },
+    { NULL },
+  };
+
+  router = cockpit_router_new (COCKPIT_TRANSPORT (tc->transport), payload_types, NULL);
+
+  emit_string (tc, NULL, "{\"command\": \"init\", \"version\": 1, \"host\": \"localhost\" }");
+  emit_string (tc, NULL, "{\"command\": \"open\", \"channel\": \"a\", \"payload\": \"echo\"}");
+  emit_string (tc, "a", "oh marmalade");
+
+  while ((sent = mock_transport_pop_channel (tc->transport, "a")) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  cockpit_assert_bytes_eq (sent, "oh marmalade", -1);
+
+  emit_string (tc, NULL, "{\"command\": \"statistics\"}");
+  for (;;)
+    {
+      control = mock_transport_pop_control (tc->transport);
+      g_assert (control != NULL);
+      if (g_str_equal (json_object_get_string_member (control, "command"), "statistics"))
+        break;
+    }
+  g_assert_cmpstr (json_object_get_string_member (control, "command"), ==, "statistics");
+
+  object = json_object_get_object_member (json_object_get_object_member (control, "channels"), "a");
+  g_assert (object != NULL);
+  g_assert_cmpint (json_object_get_int_member (object, "rx-messages"), ==, 1);
+  g_assert_cmpint (json_object_get_int_member (object, "rx-bytes"), ==, 12);
+  g_assert_cmpint (json_object_get_int_member (object, "tx-messages"), ==, 1);
+  g_assert_cmpint (json_object_get_int_member (object, "tx-bytes"), ==, 12);
+
+  object = json_object_get_object_member (json_object_get_object_member (control, "payloads"), "echo");
+  g_assert (object != NULL);
+  g_assert_cmpint (json_object_get_int_member (object, "rx-bytes"), >=, 12);
+  g_assert_cmpint (json_object_get_int_member (object, "tx-bytes"), >=, 12);
+
+  transports = json_object_get_array_member (control, "transports");
+  g_assert (transports != NULL);
+  g_assert_cmpuint (json_array_get_length (transports), >=, 1);
+
+  g_object_unref (router);
+}
+
 static void
 test_external_bridge (TestCase *tc,
                       gconstpointer unused)
@@ -706,6 +794,10 @@ main (int argc,
 
   g_test_add ("/router/local-channel", TestCase, NULL,
               setup, test_local_channel, teardown);
+  g_test_add ("/router/reuse-channel", TestCase, NULL,
+              setup, test_reuse_channel, teardown);
+  g_test_add ("/router/statistics", TestCase, NULL,
+              setup, test_statistics, teardown);
   g_test_add ("/router/external-bridge", TestCase, NULL,
               setup, test_external_bridge, teardown);
   g_test_add ("/router/external-fail", TestCase, &fixture_fail,
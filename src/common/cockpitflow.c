@@ -0,0 +1,94 @@
+/*
+ * This file is part of Cockpit.
+ *
+ * Copyright (C) 2018 Red Hat, Inc.
+ *
+ * Cockpit is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Cockpit is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Cockpit; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "cockpitflow.h"
+
+/**
+ * CockpitFlow
+ *
+ * An object that produces or consumes data and takes part in flow
+ * control. A flow emits the CockpitFlow::pressure signal when it wants
+ * whoever is feeding it to stop, and again when it is able to accept
+ * more data.
+ *
+ * Use cockpit_flow_throttle() to have one flow stop producing data
+ * while another flow is under pressure.
+ */
+
+typedef CockpitFlowIface CockpitFlowInterface;
+G_DEFINE_INTERFACE (CockpitFlow, cockpit_flow, 0);
+
+static guint cockpit_flow_sig_pressure;
+
+static void
+cockpit_flow_default_init (CockpitFlowIface *iface)
+{
+  /**
+   * CockpitFlow::pressure:
+   *
+   * Emitted with TRUE when the flow wants data producers to stop
+   * sending it data, and with FALSE when they can start again.
+   */
+  cockpit_flow_sig_pressure = g_signal_new ("pressure", COCKPIT_TYPE_FLOW, G_SIGNAL_RUN_LAST,
+                                            G_STRUCT_OFFSET (CockpitFlowIface, pressure),
+                                            NULL, NULL, NULL, G_TYPE_NONE, 1, G_TYPE_BOOLEAN);
+}
+
+/**
+ * cockpit_flow_throttle:
+ * @flow: the flow that produces data
+ * @controlling: the flow that @flow feeds, or NULL
+ *
+ * Have @flow stop reading from its source while @controlling is under
+ * pressure. Only one controlling flow can be set at a time, and a NULL
+ * @controlling removes the throttling.
+ */
+void
+cockpit_flow_throttle (CockpitFlow *flow,
+                       CockpitFlow *controlling)
+{
+  CockpitFlowIface *iface;
+
+  g_return_if_fail (COCKPIT_IS_FLOW (flow));
+  g_return_if_fail (controlling == NULL || COCKPIT_IS_FLOW (controlling));
+
+  iface = COCKPIT_FLOW_GET_IFACE (flow);
+  g_return_if_fail (iface != NULL);
+
+  g_assert (iface->throttle);
+  (iface->throttle) (flow, controlling);
+}
+
+/**
+ * cockpit_flow_emit_pressure:
+ * @flow: the flow
+ * @pressure: whether under pressure or not
+ *
+ * Used by implementations to signal that they are, or are no longer,
+ * under pressure.
+ */
+void
+cockpit_flow_emit_pressure (CockpitFlow *flow,
+                            gboolean pressure)
+{
+  g_return_if_fail (COCKPIT_IS_FLOW (flow));
+  g_signal_emit (flow, cockpit_flow_sig_pressure, 0, pressure);
+}
@@ -20,6 +20,7 @@
 #include "config.h"
 
 #include "cockpitframe.h"
+#include "cockpitmemory.h"
 
 #include <assert.h>
 #include <errno.h>
@@ -28,7 +29,10 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/uio.h>
+
 #define MAX_FRAME_SIZE_BYTES 7
+#define READ_AHEAD_BYTES 4096
 
 /**
  * cockpit_frame_parse:
@@ -104,79 +108,101 @@ cockpit_fd_write_all (int fd,
   return written;
 }
 
+/**
+ * cockpit_frame_write:
+ * @fd: The file descriptor to write to
+ * @input: The frame payload
+ * @length: The length of @input
+ *
+ * Write a frame with its length prefix. The prefix and
+ * payload are written together with a single writev() call,
+ * unless the write is interrupted or partial.
+ *
+ * Returns: The length of the payload written, or -1 with errno set.
+ */
 ssize_t
 cockpit_frame_write (int fd,
                      unsigned char *input,
                      size_t length)
 {
-  char *prefix = NULL;
-  ssize_t ret = -1;
-  int errn = 0;
+  char prefix[16];
+  struct iovec iov[2];
+  struct iovec *at = iov;
+  int count = 2;
+  ssize_t res;
+  int len;
 
   assert (length > 0);
   assert (input != NULL);
 
-  if (asprintf (&prefix, "%u\n", (unsigned int)length) < 0)
-    {
-      errn = ENOMEM;
-      goto out;
-    }
+  len = snprintf (prefix, sizeof (prefix), "%u\n", (unsigned int)length);
+  assert (len > 0 && (size_t)len < sizeof (prefix));
 
-  ret = cockpit_fd_write_all (fd, (unsigned char *)prefix, strlen (prefix));
-  if (ret > 0)
-    ret = cockpit_fd_write_all (fd, input, length);
-  if (ret < 0)
-    errn = errno;
+  iov[0].iov_base = prefix;
+  iov[0].iov_len = len;
+  iov[1].iov_base = input;
+  iov[1].iov_len = length;
 
-out:
-  free (prefix);
-  if (ret < 0)
-    errno = errn;
-  return ret;
-}
+  while (count > 0)
+    {
+      res = writev (fd, at, count);
+      if (res < 0)
+        {
+          if (errno != EAGAIN && errno != EINTR)
+            return -1;
+          continue;
+        }
 
-static void *
-xrealloc (void *old,
-          size_t length)
-{
-  void *data = realloc (old, length);
-  if (!data && length > 0)
-    free (old);
-  return data;
+      /* Skip over what was written, and continue from there */
+      while (count > 0 && (size_t)res >= at->iov_len)
+        {
+          res -= at->iov_len;
+          at++;
+          count--;
+        }
+      if (count > 0)
+        {
+          at->iov_base = (unsigned char *)at->iov_base + res;
+          at->iov_len -= res;
+        }
+    }
+
+  return length;
 }
 
+/**
+ * cockpit_frame_read:
+ * @fd: The file descriptor to read from
+ * @output: Location to place the frame payload
+ *
+ * Read a single frame from @fd. Nothing beyond the end of the
+ * frame is read, so that @fd can be handed over to something
+ * else afterwards. The length prefix is read a byte at a time,
+ * and the payload in as few reads as possible.
+ *
+ * If you're reading more than one frame, and can deal with the
+ * leftover data afterwards, then use a #CockpitFrameReader.
+ *
+ * Returns: The length of @output, zero on end of file, or -1 with errno set.
+ */
 ssize_t
 cockpit_frame_read (int fd,
                     unsigned char **output)
 {
+  unsigned char prefix[MAX_FRAME_SIZE_BYTES + 2];
+  size_t prefixlen = 0;
   ssize_t size = 0;
-  size_t skip;
   ssize_t res;
   int errn = 0;
   ssize_t ret = -1;
 
   unsigned char *buf = NULL;
   size_t buflen = 0;
-  size_t allocated = 0;
 
-  while (size == 0 || buflen < size)
+  while (size == 0)
     {
-      /* Reallocate */
-      if (buflen + 1 > allocated)
-        {
-          allocated = size;
-          if (allocated < buflen + 128)
-            allocated = buflen + 128;
-          buf = xrealloc (buf, allocated);
-          if (!buf)
-            {
-              errn = ENOMEM;
-              goto out;
-            }
-        }
-
-      res = read (fd, buf + buflen, 1);
-      if (res < 0 && errno == ECONNRESET && buflen == 0)
+      res = read (fd, prefix + prefixlen, 1);
+      if (res < 0 && errno == ECONNRESET && prefixlen == 0)
         res = 0;
       if (res < 0)
         {
@@ -190,36 +216,51 @@ cockpit_frame_read (int fd,
       else if (res == 0)
         {
           /* No message parsed, but also no data received */
-          if (size == 0 && buflen == 0)
+          if (prefixlen == 0)
             ret = 0;
           else
             errn = EBADMSG;
           goto out;
         }
-      else if (res > 0)
+      else
         {
-          buflen += 1;
+          prefixlen += 1;
+          size = cockpit_frame_parse (prefix, prefixlen, NULL);
+          if (size < 0)
+            {
+              errn = EBADMSG;
+              goto out;
+            }
         }
+    }
 
-      /* Parse the length if necessary */
-      if (size == 0)
+  buf = malloc (size);
+  if (!buf)
+    {
+      errn = ENOMEM;
+      goto out;
+    }
+
+  while (buflen < size)
+    {
+      res = read (fd, buf + buflen, size - buflen);
+      if (res < 0)
         {
-          assert (buf != NULL);
-          size = cockpit_frame_parse (buf, buflen, &skip);
-          if (size > 0)
+          if (errno != EINTR && errno != EAGAIN)
             {
-              assert (buflen >= skip);
-              if (buflen > skip)
-                memmove (buf, buf + skip, buflen - skip);
-              buflen -= skip;
+              errn = errno;
+              goto out;
             }
         }
-
-      if (size < 0)
+      else if (res == 0)
         {
           errn = EBADMSG;
           goto out;
         }
+      else
+        {
+          buflen += res;
+        }
     }
 
   if (output)
@@ -235,3 +276,206 @@ out:
     errno = errn;
   return ret;
 }
+
+/**
+ * CockpitFrameReader:
+ *
+ * Reads frames from a file descriptor with a read-ahead buffer,
+ * so that many frames can be read with few system calls. Since
+ * the reader may read past the last frame, any leftover data must
+ * be taken with cockpit_frame_reader_steal() before the file
+ * descriptor is handed over to something else.
+ *
+ * The reader can be initialized with COCKPIT_FRAME_READER_INIT()
+ * or cockpit_frame_reader_init(), and must be released with
+ * cockpit_frame_reader_clear().
+ */
+
+void
+cockpit_frame_reader_init (CockpitFrameReader *reader,
+                           int fd)
+{
+  CockpitFrameReader init = COCKPIT_FRAME_READER_INIT (fd);
+
+  assert (reader != NULL);
+  *reader = init;
+}
+
+static int
+reader_reserve (CockpitFrameReader *reader,
+                size_t want)
+{
+  unsigned char *buffer;
+  size_t allocated;
+  size_t avail;
+
+  avail = reader->length - reader->offset;
+
+  /* Move remaining data to the front */
+  if (reader->offset > 0)
+    {
+      if (avail > 0)
+        memmove (reader->buffer, reader->buffer + reader->offset, avail);
+      cockpit_memory_clear (reader->buffer + avail, reader->length - avail);
+      reader->offset = 0;
+      reader->length = avail;
+    }
+
+  if (want + READ_AHEAD_BYTES <= reader->allocated)
+    return 0;
+
+  /* Not realloc(), so as to clear the old contents */
+  allocated = want + READ_AHEAD_BYTES;
+  buffer = malloc (allocated);
+  if (!buffer)
+    return -1;
+
+  if (reader->buffer)
+    {
+      memcpy (buffer, reader->buffer, reader->length);
+      cockpit_memory_clear (reader->buffer, reader->allocated);
+      free (reader->buffer);
+    }
+
+  reader->buffer = buffer;
+  reader->allocated = allocated;
+  return 0;
+}
+
+/**
+ * cockpit_frame_reader_read:
+ * @reader: The frame reader
+ * @output: Location to place the frame payload
+ *
+ * Read a single frame, reading ahead as much as is available
+ * from the file descriptor.
+ *
+ * Returns: The length of @output, zero on end of file, or -1 with errno set.
+ */
+ssize_t
+cockpit_frame_reader_read (CockpitFrameReader *reader,
+                           unsigned char **output)
+{
+  ssize_t size;
+  size_t skip = 0;
+  size_t avail;
+  size_t want;
+  ssize_t res;
+  unsigned char *buf;
+
+  assert (reader != NULL);
+
+  for (;;)
+    {
+      avail = reader->length - reader->offset;
+      size = cockpit_frame_parse (reader->buffer + reader->offset, avail, &skip);
+      if (size < 0)
+        {
+          errno = EBADMSG;
+          return -1;
+        }
+
+      /* A complete frame is buffered */
+      if (size > 0 && avail >= skip + size)
+        break;
+
+      want = size > 0 ? skip + size : avail + 1;
+      if (reader_reserve (reader, want) < 0)
+        {
+          errno = ENOMEM;
+          return -1;
+        }
+
+      res = read (reader->fd, reader->buffer + reader->length,
+                  reader->allocated - reader->length);
+      if (res < 0 && errno == ECONNRESET && avail == 0)
+        res = 0;
+      if (res < 0)
+        {
+          if (errno != EINTR && errno != EAGAIN)
+            return -1;
+        }
+      else if (res == 0)
+        {
+          if (avail == 0)
+            return 0;
+          errno = EBADMSG;
+          return -1;
+        }
+      else
+        {
+          reader->length += res;
+        }
+    }
+
+  buf = malloc (size);
+  if (!buf)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+
+  memcpy (buf, reader->buffer + reader->offset + skip, size);
+  cockpit_memory_clear (reader->buffer + reader->offset, skip + size);
+  reader->offset += skip + size;
+
+  if (reader->offset == reader->length)
+    reader->offset = reader->length = 0;
+
+  if (output)
+    *output = buf;
+  else
+    free (buf);
+  return size;
+}
+
+/**
+ * cockpit_frame_reader_steal:
+ * @reader: The frame reader
+ * @leftover: Location to place the unread data
+ *
+ * Take any data that was read ahead from the file descriptor
+ * but not yet returned as a frame. The caller must free
+ * @leftover when the return value is not zero.
+ *
+ * Returns: The length of @leftover, or zero if nothing left.
+ */
+size_t
+cockpit_frame_reader_steal (CockpitFrameReader *reader,
+                            unsigned char **leftover)
+{
+  size_t avail;
+
+  assert (reader != NULL);
+  assert (leftover != NULL);
+
+  avail = reader->length - reader->offset;
+  *leftover = NULL;
+
+  if (avail > 0)
+    {
+      *leftover = malloc (avail);
+      if (!*leftover)
+        return 0;
+      memcpy (*leftover, reader->buffer + reader->offset, avail);
+      cockpit_memory_clear (reader->buffer + reader->offset, avail);
+    }
+
+  reader->offset = reader->length = 0;
+  return avail;
+}
+
+void
+cockpit_frame_reader_clear (CockpitFrameReader *reader)
+{
+  assert (reader != NULL);
+
+  if (reader->buffer)
+    {
+      cockpit_memory_clear (reader->buffer, reader->allocated);
+      free (reader->buffer);
+    }
+
+  reader->buffer = NULL;
+  reader->offset = reader->length = reader->allocated = 0;
+}
@@ -22,6 +22,16 @@
 
 #include <sys/types.h>
 
+typedef struct {
+  int fd;
+  unsigned char *buffer;
+  size_t offset;
+  size_t length;
+  size_t allocated;
+} CockpitFrameReader;
+
+#define COCKPIT_FRAME_READER_INIT(fd) { (fd), NULL, 0, 0, 0 }
+
 ssize_t            cockpit_frame_parse       (unsigned char *input,
                                               size_t length,
                                               size_t *consumed);
@@ -33,6 +43,17 @@ ssize_t            cockpit_frame_write       (int fd,
                                               unsigned char *input,
                                               size_t length);
 
+void               cockpit_frame_reader_init  (CockpitFrameReader *reader,
+                                               int fd);
+
+ssize_t            cockpit_frame_reader_read  (CockpitFrameReader *reader,
+                                               unsigned char **output);
+
+size_t             cockpit_frame_reader_steal (CockpitFrameReader *reader,
+                                               unsigned char **leftover);
+
+void               cockpit_frame_reader_clear (CockpitFrameReader *reader);
+
 ssize_t            cockpit_fd_write_all      (int fd,
                                               unsigned char *input,
                                               size_t length);
@@ -685,55 +685,60 @@ static gchar *dump_object (const gchar   *name,
                            JsonObject    *object,
                            gsize         *length);
 
-static gchar *
-json_strescape (const gchar *str)
+static void
+append_escaped (GString *output,
+                const gchar *str)
 {
   const gchar *p;
-  const gchar *end;
-  GString *output;
-  gsize len;
-
-  len = strlen (str);
-  end = str + len;
-  output = g_string_sized_new (len);
+  const gchar *run;
 
-  for (p = str; p < end; p++)
+  for (p = run = str; *p; p++)
     {
-      if (*p == '\\' || *p == '"')
+      if (*p != '\\' && *p != '"' && !((*p > 0 && *p < 0x1f) || *p == 0x7f))
+        continue;
+
+      /* Copy everything that needs no escaping in one go */
+      g_string_append_len (output, run, p - run);
+      run = p + 1;
+
+      switch (*p)
         {
+        case '\\':
+        case '"':
           g_string_append_c (output, '\\');
           g_string_append_c (output, *p);
-        }
-      else if ((*p > 0 && *p < 0x1f) || *p == 0x7f)
-        {
-          switch (*p)
-            {
-            case '\b':
-              g_string_append (output, "\\b");
-              break;
-            case '\f':
-              g_string_append (output, "\\f");
-              break;
-            case '\n':
-              g_string_append (output, "\\n");
-              break;
-            case '\r':
-              g_string_append (output, "\\r");
-              break;
-            case '\t':
-              g_string_append (output, "\\t");
-              break;
-            default:
-              g_string_append_printf (output, "\\u00%02x", (guint)*p);
-              break;
-            }
-        }
-      else
-        {
-          g_string_append_c (output, *p);
+          break;
+        case '\b':
+          g_string_append (output, "\\b");
+          break;
+        case '\f':
+          g_string_append (output, "\\f");
+          break;
+        case '\n':
+          g_string_append (output, "\\n");
+          break;
+        case '\r':
+          g_string_append (output, "\\r");
+          break;
+        case '\t':
+          g_string_append (output, "\\t");
+          break;
+        default:
+          g_string_append_printf (output, "\\u00%02x", (guint)*p);
+          break;
         }
     }
 
+  g_string_append_len (output, run, p - run);
+}
+
+static gchar *
+json_strescape (const gchar *str)
+{
+  GString *output;
+
+  output = g_string_sized_new (strlen (str));
+  append_escaped (output, str);
   return g_string_free (output, FALSE);
 }
 
@@ -757,17 +762,7 @@ dump_value (const gchar   *name,
     }
   else if (type == G_TYPE_DOUBLE)
     {
-      gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
-      gdouble d = json_node_get_double (node);
-
-      if (fpclassify (d) == FP_NAN || fpclassify (d) == FP_INFINITE)
-        {
-          g_string_append (buffer, "null");
-        }
-      else
-        {
-          g_string_append (buffer, g_ascii_dtostr (buf, sizeof (buf), d));
-        }
+      cockpit_json_append_double (buffer, json_node_get_double (node));
     }
   else if (type == G_TYPE_BOOLEAN)
     {
@@ -775,14 +770,7 @@ dump_value (const gchar   *name,
     }
   else if (type == G_TYPE_STRING)
     {
-        gchar *tmp;
-
-        tmp = json_strescape (json_node_get_string (node));
-        g_string_append_c (buffer, '"');
-        g_string_append (buffer, tmp);
-        g_string_append_c (buffer, '"');
-
-        g_free (tmp);
+      cockpit_json_append_string (buffer, json_node_get_string (node));
     }
   else
     {
@@ -918,6 +906,44 @@ dump_object (const gchar   *name,
   return g_string_free (buffer, FALSE);
 }
 
+/**
+ * cockpit_json_append_string:
+ * @output: the buffer to write to
+ * @str: the string to encode
+ *
+ * Append a JSON encoded and quoted string to @output, escaped in the
+ * same way as cockpit_json_write() does. This is used by code that
+ * streams JSON without building a JsonNode tree first.
+ */
+void
+cockpit_json_append_string (GString *output,
+                            const gchar *str)
+{
+  g_string_append_c (output, '"');
+  append_escaped (output, str);
+  g_string_append_c (output, '"');
+}
+
+/**
+ * cockpit_json_append_double:
+ * @output: the buffer to write to
+ * @value: the number to encode
+ *
+ * Append a JSON encoded number to @output, in the same format as
+ * cockpit_json_write() uses. NaN and infinity become null.
+ */
+void
+cockpit_json_append_double (GString *output,
+                            gdouble value)
+{
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  if (fpclassify (value) == FP_NAN || fpclassify (value) == FP_INFINITE)
+    g_string_append (output, "null");
+  else
+    g_string_append (output, g_ascii_dtostr (buf, sizeof (buf), value));
+}
+
 /**
  * cockpit_json_write:
  * @node: the node to encode
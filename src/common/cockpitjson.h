@@ -50,6 +50,12 @@ gchar *        cockpit_json_write_object      (JsonObject *object,
 
 GBytes *       cockpit_json_write_bytes       (JsonObject *object);
 
+void           cockpit_json_append_string     (GString *output,
+                                               const gchar *str);
+
+void           cockpit_json_append_double     (GString *output,
+                                               gdouble value);
+
 gboolean       cockpit_json_equal             (JsonNode *previous,
                                                JsonNode *current);
 
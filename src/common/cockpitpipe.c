@@ -20,6 +20,8 @@
 #include "config.h"
 
 #include "cockpitpipe.h"
+
+#include "cockpitflow.h"
 #include "cockpitunixfd.h"
 
 #include <glib-unix.h>
@@ -30,6 +32,7 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <pty.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -40,6 +43,16 @@
 #include <sys/prctl.h>
 #endif
 
+/* The most buffers gathered into one writev() call */
+#ifdef IOV_MAX
+#define MAX_IOVECS IOV_MAX
+#else
+#define MAX_IOVECS 16
+#endif
+
+/* When coalescing, write right away once this much is queued */
+#define COALESCE_MAX_BYTES (64 * 1024)
+
 /**
  * CockpitPipe:
  *
@@ -81,11 +94,22 @@ struct _CockpitPipePrivate {
   GSource *out_source;
   GQueue *out_queue;
   gsize out_partial;
+  gsize out_queued;
+  guint64 out_writes;
+
+  /* Output is held back for up to this many microseconds */
+  gint64 out_coalesce;
+  GSource *out_delay;
 
   int in_fd;
   GSource *in_source;
   GByteArray *in_buffer;
 
+  /* Flow control: input is paused while throttled */
+  CockpitFlow *throttle;
+  gulong throttle_sig;
+  gboolean in_paused;
+
   int err_fd;
   GSource *err_source;
   GByteArray *err_buffer;
@@ -107,7 +131,13 @@ static void  set_problem_from_errno (CockpitPipe *self,
                                      const gchar *message,
                                      int errn);
 
-G_DEFINE_TYPE (CockpitPipe, cockpit_pipe, G_TYPE_OBJECT);
+static void  cockpit_pipe_flow_iface_init (CockpitFlowIface *iface);
+
+static void  start_input (CockpitPipe *self);
+
+G_DEFINE_TYPE_WITH_CODE (CockpitPipe, cockpit_pipe, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_FLOW, cockpit_pipe_flow_iface_init)
+);
 
 static void
 cockpit_pipe_init (CockpitPipe *self)
@@ -132,6 +162,15 @@ stop_output (CockpitPipe *self)
   self->priv->out_source = NULL;
 }
 
+static void
+stop_delay (CockpitPipe *self)
+{
+  g_assert (self->priv->out_delay != NULL);
+  g_source_destroy (self->priv->out_delay);
+  g_source_unref (self->priv->out_delay);
+  self->priv->out_delay = NULL;
+}
+
 static void
 stop_input (CockpitPipe *self)
 {
@@ -164,6 +203,7 @@ close_immediately (CockpitPipe *self,
     }
 
   self->priv->closed = TRUE;
+  self->priv->in_paused = FALSE;
 
   g_debug ("%s: closing pipe%s%s", self->priv->name,
            self->priv->problem ? ": " : "",
@@ -173,6 +213,8 @@ close_immediately (CockpitPipe *self,
     stop_input (self);
   if (self->priv->out_source)
     stop_output (self);
+  if (self->priv->out_delay)
+    stop_delay (self);
   if (self->priv->err_source)
     stop_error (self);
 
@@ -212,7 +254,9 @@ close_maybe (CockpitPipe *self)
 {
   if (!self->priv->closed)
     {
-      if (!self->priv->in_source && !self->priv->out_source && !self->priv->err_source)
+      if (!self->priv->in_source && !self->priv->in_paused &&
+          !self->priv->out_source && !self->priv->out_delay &&
+          !self->priv->err_source)
         {
           g_debug ("%s: input and output done", self->priv->name);
           close_immediately (self, NULL);
@@ -392,6 +436,7 @@ close_output (CockpitPipe *self)
               if (self->priv->in_fd == self->priv->out_fd)
                 {
                   self->priv->in_fd = -1;
+                  self->priv->in_paused = FALSE;
                   if (self->priv->in_source)
                     {
                       g_debug ("%s: and closing input because same fd", self->priv->name);
@@ -479,7 +524,7 @@ dispatch_output (gint fd,
                  gpointer user_data)
 {
   CockpitPipe *self = (CockpitPipe *)user_data;
-  struct iovec iov[4];
+  struct iovec iov[MAX_IOVECS];
   gsize partial;
   gssize ret;
   gint i, count;
@@ -512,7 +557,10 @@ dispatch_output (gint fd,
   if (count == 0)
     ret = 0;
   else
-    ret = writev (self->priv->out_fd, iov, count);
+    {
+      ret = writev (self->priv->out_fd, iov, count);
+      self->priv->out_writes++;
+    }
   if (ret < 0)
     {
       if (errno != EAGAIN && errno != EINTR)
@@ -539,6 +587,7 @@ dispatch_output (gint fd,
           g_debug ("%s: wrote %d bytes", self->priv->name, (int)iov[i].iov_len);
           g_bytes_unref (g_queue_pop_head (self->priv->out_queue));
           self->priv->out_partial = 0;
+          self->priv->out_queued -= iov[i].iov_len;
           ret -= iov[i].iov_len;
         }
       else
@@ -546,6 +595,7 @@ dispatch_output (gint fd,
           g_debug ("%s: partial write %d of %d bytes", self->priv->name,
                    (int)ret, (int)iov[i].iov_len);
           self->priv->out_partial += ret;
+          self->priv->out_queued -= ret;
           ret = 0;
         }
     }
@@ -576,6 +626,161 @@ start_output (CockpitPipe *self)
   g_source_attach (self->priv->out_source, self->priv->context);
 }
 
+/*
+ * A source that becomes ready at a deadline with microsecond
+ * precision, since g_source_set_ready_time() isn't available to us.
+ */
+typedef struct {
+  GSource source;
+  gint64 deadline;
+} DelaySource;
+
+static gboolean
+delay_prepare (GSource *source,
+               gint *timeout)
+{
+  gint64 remaining = ((DelaySource *)source)->deadline - g_source_get_time (source);
+
+  if (remaining <= 0)
+    {
+      *timeout = 0;
+      return TRUE;
+    }
+
+  *timeout = (remaining + 999) / 1000;
+  return FALSE;
+}
+
+static gboolean
+delay_check (GSource *source)
+{
+  return g_source_get_time (source) >= ((DelaySource *)source)->deadline;
+}
+
+static gboolean
+delay_dispatch (GSource *source,
+                GSourceFunc callback,
+                gpointer user_data)
+{
+  return (callback) (user_data);
+}
+
+static GSourceFuncs delay_source_funcs = {
+  delay_prepare,
+  delay_check,
+  delay_dispatch,
+  NULL,
+};
+
+static gboolean
+dispatch_delay (gpointer user_data)
+{
+  CockpitPipe *self = user_data;
+
+  stop_delay (self);
+  if (!self->priv->out_source && self->priv->out_fd >= 0)
+    start_output (self);
+
+  return TRUE;
+}
+
+static void
+start_delay (CockpitPipe *self)
+{
+  g_assert (self->priv->out_delay == NULL);
+  self->priv->out_delay = g_source_new (&delay_source_funcs, sizeof (DelaySource));
+  ((DelaySource *)self->priv->out_delay)->deadline = g_get_monotonic_time () + self->priv->out_coalesce;
+  g_source_set_name (self->priv->out_delay, "pipe-coalesce");
+  g_source_set_callback (self->priv->out_delay, dispatch_delay, self, NULL);
+  g_source_attach (self->priv->out_delay, self->priv->context);
+}
+
+static void
+start_input (CockpitPipe *self)
+{
+  g_assert (self->priv->in_source == NULL);
+  self->priv->in_source = cockpit_unix_fd_source_new (self->priv->in_fd, G_IO_IN);
+  g_source_set_name (self->priv->in_source, "pipe-input");
+  g_source_set_callback (self->priv->in_source, (GSourceFunc)dispatch_input, self, NULL);
+  g_source_attach (self->priv->in_source, self->priv->context);
+}
+
+static void
+on_throttle_pressure (GObject *object,
+                      gboolean throttle,
+                      gpointer user_data)
+{
+  CockpitPipe *self = COCKPIT_PIPE (user_data);
+
+  if (throttle)
+    {
+      if (self->priv->in_source)
+        {
+          g_debug ("%s: applying back pressure in pipe", self->priv->name);
+          stop_input (self);
+          self->priv->in_paused = TRUE;
+        }
+    }
+  else
+    {
+      if (self->priv->in_paused && !self->priv->closed)
+        {
+          g_debug ("%s: relieving back pressure in pipe", self->priv->name);
+          self->priv->in_paused = FALSE;
+          start_input (self);
+        }
+    }
+}
+
+static void
+on_throttle_weak (gpointer data,
+                  GObject *where_the_object_was)
+{
+  CockpitPipe *self = COCKPIT_PIPE (data);
+  self->priv->throttle = NULL;
+  self->priv->throttle_sig = 0;
+  on_throttle_pressure (NULL, FALSE, self);
+}
+
+static void
+disconnect_throttle (CockpitPipe *self)
+{
+  if (self->priv->throttle)
+    {
+      g_signal_handler_disconnect (self->priv->throttle, self->priv->throttle_sig);
+      g_object_weak_unref (G_OBJECT (self->priv->throttle), on_throttle_weak, self);
+      self->priv->throttle = NULL;
+      self->priv->throttle_sig = 0;
+    }
+}
+
+static void
+cockpit_pipe_throttle (CockpitFlow *flow,
+                       CockpitFlow *controlling)
+{
+  CockpitPipe *self = COCKPIT_PIPE (flow);
+
+  disconnect_throttle (self);
+
+  if (controlling)
+    {
+      self->priv->throttle = controlling;
+      self->priv->throttle_sig = g_signal_connect (controlling, "pressure",
+                                                   G_CALLBACK (on_throttle_pressure), self);
+      g_object_weak_ref (G_OBJECT (controlling), on_throttle_weak, self);
+    }
+  else
+    {
+      on_throttle_pressure (NULL, FALSE, self);
+    }
+}
+
+static void
+cockpit_pipe_flow_iface_init (CockpitFlowIface *iface)
+{
+  iface->throttle = cockpit_pipe_throttle;
+}
+
 static void
 cockpit_pipe_constructed (GObject *object)
 {
@@ -596,10 +801,7 @@ cockpit_pipe_constructed (GObject *object)
           g_clear_error (&error);
         }
 
-      self->priv->in_source = cockpit_unix_fd_source_new (self->priv->in_fd, G_IO_IN);
-      g_source_set_name (self->priv->in_source, "pipe-input");
-      g_source_set_callback (self->priv->in_source, (GSourceFunc)dispatch_input, self, NULL);
-      g_source_attach (self->priv->in_source, self->priv->context);
+      start_input (self);
     }
 
   if (self->priv->out_fd >= 0)
@@ -725,11 +927,16 @@ cockpit_pipe_dispose (GObject *object)
       kill (self->priv->pid, SIGTERM);
     }
 
+  /* Going away, so input isn't resumed */
+  disconnect_throttle (self);
+
   if (!self->priv->closed)
     close_immediately (self, "terminated");
 
   while (self->priv->out_queue->head)
     g_bytes_unref (g_queue_pop_head (self->priv->out_queue));
+  self->priv->out_partial = 0;
+  self->priv->out_queued = 0;
 
   G_OBJECT_CLASS (cockpit_pipe_parent_class)->dispose (object);
 }
@@ -742,6 +949,7 @@ cockpit_pipe_finalize (GObject *object)
   g_assert (self->priv->closed);
   g_assert (!self->priv->in_source);
   g_assert (!self->priv->out_source);
+  g_assert (!self->priv->out_delay);
 
   /* Release our reference on watch handler */
   if (self->priv->child)
@@ -932,10 +1140,24 @@ _cockpit_pipe_write (CockpitPipe *self,
     }
 
   g_queue_push_tail (self->priv->out_queue, g_bytes_ref (data));
+  self->priv->out_queued += g_bytes_get_size (data);
 
   if (!self->priv->out_source && self->priv->out_fd >= 0)
     {
-      start_output (self);
+      /* Hold back small writes so that several go out together */
+      if (self->priv->out_coalesce > 0 && !self->priv->closing &&
+          self->priv->out_queued < COALESCE_MAX_BYTES &&
+          self->priv->out_queue->length < MAX_IOVECS)
+        {
+          if (!self->priv->out_delay)
+            start_delay (self);
+        }
+      else
+        {
+          if (self->priv->out_delay)
+            stop_delay (self);
+          start_output (self);
+        }
     }
 
   /*
@@ -969,6 +1191,53 @@ cockpit_pipe_close (CockpitPipe *self,
       close_immediately (self, problem);
   else if (g_queue_is_empty (self->priv->out_queue))
     close_output (self);
+  else
+    cockpit_pipe_flush (self);
+}
+
+/**
+ * cockpit_pipe_set_coalesce:
+ * @self: a pipe
+ * @usec: microseconds to hold back output, or zero
+ *
+ * Gather the blocks passed to cockpit_pipe_write() for up to @usec
+ * microseconds, so that they go out in one write. Output is started
+ * early once a full write worth of data is queued, or when
+ * cockpit_pipe_flush() is called.
+ *
+ * The default is zero, where writing starts in the next main loop
+ * iteration.
+ */
+void
+cockpit_pipe_set_coalesce (CockpitPipe *self,
+                           gint64 usec)
+{
+  g_return_if_fail (COCKPIT_IS_PIPE (self));
+  g_return_if_fail (usec >= 0);
+
+  self->priv->out_coalesce = usec;
+  if (usec == 0)
+    cockpit_pipe_flush (self);
+}
+
+/**
+ * cockpit_pipe_flush:
+ * @self: a pipe
+ *
+ * Start writing any output that is being held back by
+ * cockpit_pipe_set_coalesce() right away.
+ */
+void
+cockpit_pipe_flush (CockpitPipe *self)
+{
+  g_return_if_fail (COCKPIT_IS_PIPE (self));
+
+  if (self->priv->out_delay)
+    {
+      stop_delay (self);
+      if (!self->priv->out_source && self->priv->out_fd >= 0)
+        start_output (self);
+    }
 }
 
 static gboolean
@@ -1363,6 +1632,45 @@ cockpit_pipe_exit_status (CockpitPipe *self)
   return self->priv->status;
 }
 
+/**
+ * cockpit_pipe_get_queued:
+ * @self: a pipe
+ * @blocks: (out) (optional): location to return number of queued blocks
+ * @bytes: (out) (optional): location to return number of queued bytes
+ *
+ * Get the depth of the output queue: the blocks passed to
+ * cockpit_pipe_write() and the bytes in them that have not
+ * yet been written.
+ */
+void
+cockpit_pipe_get_queued (CockpitPipe *self,
+                         guint *blocks,
+                         gsize *bytes)
+{
+  g_return_if_fail (COCKPIT_IS_PIPE (self));
+
+  if (blocks)
+    *blocks = self->priv->out_queue->length;
+  if (bytes)
+    *bytes = self->priv->out_queued;
+}
+
+/**
+ * cockpit_pipe_get_write_count:
+ * @self: a pipe
+ *
+ * Get the number of write system calls made so far. Each
+ * one gathers up to IOV_MAX queued blocks.
+ *
+ * Returns: the number of writes
+ */
+guint64
+cockpit_pipe_get_write_count (CockpitPipe *self)
+{
+  g_return_val_if_fail (COCKPIT_IS_PIPE (self), 0);
+  return self->priv->out_writes;
+}
+
 /**
  * cockpit_pipe_consume:
  * @buffer: a data buffer
@@ -93,6 +93,11 @@ void               _cockpit_pipe_write        (CockpitPipe *self,
 void               cockpit_pipe_close        (CockpitPipe *self,
                                               const gchar *problem);
 
+void               cockpit_pipe_set_coalesce (CockpitPipe *self,
+                                              gint64 usec);
+
+void               cockpit_pipe_flush        (CockpitPipe *self);
+
 gint               cockpit_pipe_exit_status  (CockpitPipe *self);
 
 const gchar *      cockpit_pipe_get_name     (CockpitPipe *self);
@@ -101,6 +106,12 @@ GByteArray *       cockpit_pipe_get_buffer   (CockpitPipe *self);
 
 GByteArray *       cockpit_pipe_get_stderr   (CockpitPipe *self);
 
+void               cockpit_pipe_get_queued   (CockpitPipe *self,
+                                              guint *blocks,
+                                              gsize *bytes);
+
+guint64            cockpit_pipe_get_write_count (CockpitPipe *self);
+
 gboolean           cockpit_pipe_get_pid      (CockpitPipe *self,
                                               GPid *pid);
 
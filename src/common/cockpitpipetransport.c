@@ -22,6 +22,7 @@
 #include "cockpitpipetransport.h"
 
 #include "cockpitframe.h"
+#include "cockpitjson.h"
 #include "cockpitpipe.h"
 
 #include <glib-unix.h>
@@ -35,6 +36,8 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <zlib.h>
+
 /**
  * CockpitPipeTransport:
  *
@@ -43,6 +46,37 @@
  * framing looks ... including the MSB length prefix.
  */
 
+/*
+ * Length and channel prefixes are formatted into a shared block
+ * of memory. Each prefix holds a reference to the block, and when
+ * all of them have been written the block is reused.
+ */
+#define PREFIX_ARENA_SIZE 4096
+
+/*
+ * When compression has been negotiated, messages are deflated as
+ * one stream across frames. Each compressed message starts with
+ * a nul byte, which is never valid in a channel id. Small messages
+ * aren't worth compressing and are sent as they are.
+ *
+ * The compression window is only shared between messages of the same
+ * channel. When another channel's message comes along, the window is
+ * reset with a full flush, so what one channel sends can't be guessed
+ * from the size of another's compressed messages. Runs of messages on
+ * one channel, the usual case on a slow link, still compress well.
+ */
+#define COMPRESS_MARKER '\0'
+#define COMPRESS_THRESHOLD 128
+
+/* The same limit as cockpit_frame_parse() places on a frame */
+#define MAX_INFLATED_SIZE 100000000
+
+typedef struct {
+  gint refs;
+  gsize offset;
+  gchar data[PREFIX_ARENA_SIZE];
+} PrefixArena;
+
 struct _CockpitPipeTransport {
   CockpitTransport parent_instance;
   gchar *name;
@@ -50,6 +84,15 @@ struct _CockpitPipeTransport {
   gboolean closed;
   gulong read_sig;
   gulong close_sig;
+  PrefixArena *arena;
+  gboolean compress;
+  z_stream *deflater;
+  gchar *deflate_channel;
+  z_stream *inflater;
+
+  /* Bytes read and written, after compression */
+  guint64 rx_wire;
+  guint64 tx_wire;
 };
 
 struct _CockpitPipeTransportClass {
@@ -193,6 +236,253 @@ cockpit_pipe_transport_set_property (GObject *object,
     }
 }
 
+static void
+prefix_arena_unref (gpointer data)
+{
+  PrefixArena *arena = data;
+  if (g_atomic_int_dec_and_test (&arena->refs))
+    g_free (arena);
+}
+
+static gchar *
+arena_alloc (CockpitPipeTransport *self,
+             gsize needed)
+{
+  PrefixArena *arena;
+
+  arena = self->arena;
+  if (arena && arena->offset + needed > PREFIX_ARENA_SIZE)
+    {
+      /* Only we hold the block, all its prefixes have been written */
+      if (g_atomic_int_get (&arena->refs) == 1)
+        {
+          arena->offset = 0;
+        }
+      else
+        {
+          prefix_arena_unref (arena);
+          arena = self->arena = NULL;
+        }
+    }
+
+  if (!arena)
+    {
+      arena = self->arena = g_new (PrefixArena, 1);
+      arena->refs = 1;
+      arena->offset = 0;
+    }
+
+  return arena->data + arena->offset;
+}
+
+static GBytes *
+arena_commit (CockpitPipeTransport *self,
+              gchar *prefix,
+              gint len)
+{
+  g_assert (prefix == self->arena->data + self->arena->offset);
+  self->arena->offset += len;
+
+  g_atomic_int_inc (&self->arena->refs);
+  return g_bytes_new_with_free_func (prefix, len, prefix_arena_unref, self->arena);
+}
+
+static GBytes *
+build_prefix (CockpitPipeTransport *self,
+              const gchar *channel_id,
+              gsize channel_len,
+              gsize payload_len)
+{
+  gsize needed;
+  gchar *prefix;
+  gint len;
+
+  /* Digits of the length, the channel and two newlines */
+  needed = 24 + channel_len;
+
+  /* Unusually long channel ids don't go in the arena */
+  if (needed > PREFIX_ARENA_SIZE / 4)
+    {
+      prefix = g_strdup_printf ("%" G_GSIZE_FORMAT "\n%s\n",
+                                channel_len + 1 + payload_len,
+                                channel_id ? channel_id : "");
+      return g_bytes_new_take (prefix, strlen (prefix));
+    }
+
+  prefix = arena_alloc (self, needed);
+  len = g_snprintf (prefix, needed, "%" G_GSIZE_FORMAT "\n%s\n",
+                    channel_len + 1 + payload_len,
+                    channel_id ? channel_id : "");
+  g_assert (len > 0 && (gsize)len < needed);
+  return arena_commit (self, prefix, len);
+}
+
+/* For a compressed message, which carries its channel inside */
+static GBytes *
+build_length_prefix (CockpitPipeTransport *self,
+                     gsize message_len)
+{
+  gsize needed = 24;
+  gchar *prefix;
+  gint len;
+
+  prefix = arena_alloc (self, needed);
+  len = g_snprintf (prefix, needed, "%" G_GSIZE_FORMAT "\n", message_len);
+  g_assert (len > 0 && (gsize)len < needed);
+  return arena_commit (self, prefix, len);
+}
+
+static gboolean
+deflate_chunk (z_stream *stream,
+               GByteArray *output,
+               gconstpointer data,
+               gsize length,
+               gint flush)
+{
+  gsize offset;
+  gint ret;
+
+  stream->next_in = (Bytef *)data;
+  stream->avail_in = length;
+
+  do
+    {
+      offset = output->len;
+      g_byte_array_set_size (output, offset + MAX (length, 256));
+      stream->next_out = output->data + offset;
+      stream->avail_out = output->len - offset;
+
+      ret = deflate (stream, flush);
+      g_byte_array_set_size (output, output->len - stream->avail_out);
+
+      if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+          g_warning ("couldn't compress message: %s", stream->msg ? stream->msg : "unknown error");
+          return FALSE;
+        }
+    }
+  while (stream->avail_out == 0);
+
+  return TRUE;
+}
+
+static GBytes *
+deflate_message (CockpitPipeTransport *self,
+                 const gchar *channel_id,
+                 gsize channel_len,
+                 GBytes *payload)
+{
+  GByteArray *output;
+  gconstpointer data;
+  gsize length;
+  guint8 marker = COMPRESS_MARKER;
+
+  if (!self->deflater)
+    {
+      self->deflater = g_new0 (z_stream, 1);
+      if (deflateInit (self->deflater, Z_DEFAULT_COMPRESSION) != Z_OK)
+        {
+          g_critical ("%s: couldn't initialize compression", self->name);
+          g_free (self->deflater);
+          self->deflater = NULL;
+          self->compress = FALSE;
+          return NULL;
+        }
+    }
+
+  data = g_bytes_get_data (payload, &length);
+  output = g_byte_array_sized_new (channel_len + length / 2 + 64);
+  g_byte_array_append (output, &marker, 1);
+
+  /* Forget the previous channel's data before compressing this one's */
+  if (!self->deflate_channel ||
+      strncmp (self->deflate_channel, channel_id, channel_len) != 0 ||
+      self->deflate_channel[channel_len] != '\0')
+    {
+      if (self->deflate_channel &&
+          !deflate_chunk (self->deflater, output, NULL, 0, Z_FULL_FLUSH))
+        {
+          self->compress = FALSE;
+          g_byte_array_unref (output);
+          return NULL;
+        }
+      g_free (self->deflate_channel);
+      self->deflate_channel = g_strndup (channel_id, channel_len);
+    }
+
+  /* Each message is flushed so the other side can decode it right away */
+  if (!deflate_chunk (self->deflater, output, channel_id, channel_len, Z_NO_FLUSH) ||
+      !deflate_chunk (self->deflater, output, "\n", 1, Z_NO_FLUSH) ||
+      !deflate_chunk (self->deflater, output, data, length, Z_SYNC_FLUSH))
+    {
+      /* The stream is now out of step with the other side */
+      self->compress = FALSE;
+      g_byte_array_unref (output);
+      return NULL;
+    }
+
+  return g_byte_array_free_to_bytes (output);
+}
+
+static GBytes *
+inflate_message (CockpitPipeTransport *self,
+                 GBytes *message)
+{
+  GByteArray *output;
+  const guint8 *data;
+  gsize length;
+  gsize offset;
+  gint ret;
+
+  if (!self->inflater)
+    {
+      self->inflater = g_new0 (z_stream, 1);
+      if (inflateInit (self->inflater) != Z_OK)
+        {
+          g_critical ("%s: couldn't initialize decompression", self->name);
+          g_free (self->inflater);
+          self->inflater = NULL;
+          return NULL;
+        }
+    }
+
+  data = g_bytes_get_data (message, &length);
+  g_assert (length > 0 && data[0] == COMPRESS_MARKER);
+
+  self->inflater->next_in = (Bytef *)data + 1;
+  self->inflater->avail_in = length - 1;
+
+  output = g_byte_array_sized_new (length * 4);
+  do
+    {
+      offset = output->len;
+      if (offset >= MAX_INFLATED_SIZE)
+        {
+          g_message ("%s: received compressed message that is too large", self->name);
+          g_byte_array_unref (output);
+          return NULL;
+        }
+
+      g_byte_array_set_size (output, offset + MAX (length * 4, 4096));
+      self->inflater->next_out = output->data + offset;
+      self->inflater->avail_out = output->len - offset;
+
+      ret = inflate (self->inflater, Z_SYNC_FLUSH);
+      g_byte_array_set_size (output, output->len - self->inflater->avail_out);
+
+      if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+          g_message ("%s: received invalid compressed message: %s", self->name,
+                     self->inflater->msg ? self->inflater->msg : "unknown error");
+          g_byte_array_unref (output);
+          return NULL;
+        }
+    }
+  while (self->inflater->avail_out == 0);
+
+  return g_byte_array_free_to_bytes (output);
+}
+
 static void
 cockpit_pipe_transport_finalize (GObject *object)
 {
@@ -204,6 +494,20 @@ cockpit_pipe_transport_finalize (GObject *object)
   g_free (self->name);
   g_clear_object (&self->pipe);
 
+  if (self->arena)
+    prefix_arena_unref (self->arena);
+  if (self->deflater)
+    {
+      deflateEnd (self->deflater);
+      g_free (self->deflater);
+    }
+  g_free (self->deflate_channel);
+  if (self->inflater)
+    {
+      inflateEnd (self->inflater);
+      g_free (self->inflater);
+    }
+
   G_OBJECT_CLASS (cockpit_pipe_transport_parent_class)->finalize (object);
 }
 
@@ -213,8 +517,8 @@ cockpit_pipe_transport_send (CockpitTransport *transport,
                              GBytes *payload)
 {
   CockpitPipeTransport *self = COCKPIT_PIPE_TRANSPORT (transport);
+  GBytes *compressed = NULL;
   GBytes *prefix;
-  gchar *prefix_str;
   gsize payload_len;
   gsize channel_len;
 
@@ -227,15 +531,35 @@ cockpit_pipe_transport_send (CockpitTransport *transport,
   channel_len = channel_id ? strlen (channel_id) : 0;
   payload_len = g_bytes_get_size (payload);
 
-  prefix_str = g_strdup_printf ("%" G_GSIZE_FORMAT "\n%s\n",
-                                channel_len + 1 + payload_len,
-                                channel_id ? channel_id : "");
-  prefix = g_bytes_new_take (prefix_str, strlen (prefix_str));
+  /*
+   * Control messages are never compressed. They carry credentials,
+   * and sharing a compression stream with data that an observer can
+   * influence would leak their contents through the message lengths.
+   */
+  if (self->compress && channel_id && channel_len + 1 + payload_len >= COMPRESS_THRESHOLD)
+    compressed = deflate_message (self, channel_id, channel_len, payload);
 
-  cockpit_pipe_write (self->pipe, prefix);
-  cockpit_pipe_write (self->pipe, payload);
+  if (compressed)
+    {
+      prefix = build_length_prefix (self, g_bytes_get_size (compressed));
+      cockpit_pipe_write (self->pipe, prefix);
+      cockpit_pipe_write (self->pipe, compressed);
+      self->tx_wire += g_bytes_get_size (prefix) + g_bytes_get_size (compressed);
+      g_bytes_unref (compressed);
+    }
+  else
+    {
+      prefix = build_prefix (self, channel_id, channel_len, payload_len);
+      cockpit_pipe_write (self->pipe, prefix);
+      cockpit_pipe_write (self->pipe, payload);
+      self->tx_wire += g_bytes_get_size (prefix) + payload_len;
+    }
   g_bytes_unref (prefix);
 
+  /* Control messages don't wait for other output to be gathered */
+  if (!channel_id)
+    cockpit_pipe_flush (self->pipe);
+
   g_debug ("%s: queued %" G_GSIZE_FORMAT " byte payload", self->name, payload_len);
 }
 
@@ -247,6 +571,25 @@ cockpit_pipe_transport_close (CockpitTransport *transport,
   cockpit_pipe_close (self->pipe, problem);
 }
 
+static void
+cockpit_pipe_transport_get_queued (CockpitTransport *transport,
+                                   guint *blocks,
+                                   gsize *bytes)
+{
+  CockpitPipeTransport *self = COCKPIT_PIPE_TRANSPORT (transport);
+  cockpit_pipe_get_queued (self->pipe, blocks, bytes);
+}
+
+static void
+cockpit_pipe_transport_get_wire (CockpitTransport *transport,
+                                 guint64 *rx_bytes,
+                                 guint64 *tx_bytes)
+{
+  CockpitPipeTransport *self = COCKPIT_PIPE_TRANSPORT (transport);
+  *rx_bytes = self->rx_wire;
+  *tx_bytes = self->tx_wire;
+}
+
 static void
 cockpit_pipe_transport_class_init (CockpitPipeTransportClass *klass)
 {
@@ -255,6 +598,8 @@ cockpit_pipe_transport_class_init (CockpitPipeTransportClass *klass)
 
   transport_class->send = cockpit_pipe_transport_send;
   transport_class->close = cockpit_pipe_transport_close;
+  transport_class->get_queued = cockpit_pipe_transport_get_queued;
+  transport_class->get_wire = cockpit_pipe_transport_get_wire;
 
   gobject_class->constructed = cockpit_pipe_transport_constructed;
   gobject_class->get_property = cockpit_pipe_transport_get_property;
@@ -318,12 +663,86 @@ cockpit_pipe_transport_get_pipe (CockpitPipeTransport *self)
   return self->pipe;
 }
 
+/**
+ * cockpit_pipe_transport_set_compression:
+ * @self: the transport
+ * @compress: whether to compress messages
+ *
+ * Compress messages sent from now on. Only do this once
+ * the other side has advertised the "compression" capability
+ * in its "init" message. Compressed messages are always
+ * understood when received.
+ */
+void
+cockpit_pipe_transport_set_compression (CockpitPipeTransport *self,
+                                        gboolean compress)
+{
+  g_return_if_fail (COCKPIT_IS_PIPE_TRANSPORT (self));
+  self->compress = compress;
+}
+
+gboolean
+cockpit_pipe_transport_get_compression (CockpitPipeTransport *self)
+{
+  g_return_val_if_fail (COCKPIT_IS_PIPE_TRANSPORT (self), FALSE);
+  return self->compress;
+}
+
+/**
+ * cockpit_pipe_transport_negotiate_compression:
+ * @transport: a transport
+ * @init: the "init" message received over @transport
+ *
+ * If @transport is a #CockpitPipeTransport and the other side
+ * asked for the "compression" capability in its "init" message
+ * then compress the messages sent from now on.
+ *
+ * Returns: whether compression was turned on
+ */
+gboolean
+cockpit_pipe_transport_negotiate_compression (CockpitTransport *transport,
+                                              JsonObject *init)
+{
+  gchar **capabilities = NULL;
+  gboolean compress = FALSE;
+  gint i;
+
+  g_return_val_if_fail (COCKPIT_IS_TRANSPORT (transport), FALSE);
+  g_return_val_if_fail (init != NULL, FALSE);
+
+  if (!COCKPIT_IS_PIPE_TRANSPORT (transport))
+    return FALSE;
+
+  if (!cockpit_json_get_strv (init, "capabilities", NULL, &capabilities))
+    {
+      g_message ("invalid \"capabilities\" field in init message");
+    }
+  else if (capabilities)
+    {
+      for (i = 0; !compress && capabilities[i] != NULL; i++)
+        compress = g_str_equal (capabilities[i], "compression");
+      g_free (capabilities);
+    }
+
+  if (compress)
+    {
+      g_debug ("%s: compressing messages", COCKPIT_PIPE_TRANSPORT (transport)->name);
+      cockpit_pipe_transport_set_compression (COCKPIT_PIPE_TRANSPORT (transport), TRUE);
+    }
+
+  return compress;
+}
+
 /**
  * cockpit_transport_read_from_pipe:
  *
  * Meant to be used in a "read" handler for a #CockpitPipe
  * Closed is pointer to a boolean value that may be updated
  * during the read and parse loop.
+ *
+ * All the complete frames in @input are consumed from the
+ * buffer in one go, and each message is a slice of that block.
+ * Only a partial frame at the end of @input is copied.
  */
 void
 cockpit_transport_read_from_pipe (CockpitTransport *self,
@@ -333,19 +752,34 @@ cockpit_transport_read_from_pipe (CockpitTransport *self,
                                   GByteArray *input,
                                   gboolean end_of_data)
 {
+  CockpitPipeTransport *pipe_transport = NULL;
+  GBytes *block = NULL;
+  gboolean invalid = FALSE;
+  GBytes *inflated;
   GBytes *message;
   GBytes *payload;
-  gchar *channel;
+  const gchar *channel;
+  gsize channel_len;
+  gchar *unknown;
+  guint8 *data;
   gssize size;
+  gsize offset;
+  gsize total;
+  gsize tail;
   gsize i;
 
   /* This may be updated during the loop. */
   g_assert (closed != NULL);
   g_object_ref (self);
 
-  while (!*closed)
+  if (COCKPIT_IS_PIPE_TRANSPORT (self))
+    pipe_transport = COCKPIT_PIPE_TRANSPORT (self);
+
+  /* Find out how many complete frames there are */
+  total = 0;
+  while (!*closed && total < input->len)
     {
-      size = cockpit_frame_parse (input->data, input->len, &i);
+      size = cockpit_frame_parse (input->data + total, input->len - total, &i);
 
       if (size == 0)
         {
@@ -355,29 +789,87 @@ cockpit_transport_read_from_pipe (CockpitTransport *self,
         }
       else if (size < 0)
         {
-          g_warning ("%s: incorrect protocol: received invalid length prefix", logname);
-          cockpit_pipe_close (pipe, "protocol-error");
+          /* Still dispatch the valid frames before this one */
+          invalid = TRUE;
           break;
         }
-      else if (input->len < i + size)
+      else if (input->len - total < i + size)
         {
           g_debug ("%s: want more data 2", logname);
           break;
         }
 
-      message = cockpit_pipe_consume (input, i, size, 0);
-      payload = cockpit_transport_parse_frame (message, &channel);
+      total += i + size;
+    }
+
+  tail = input->len - total;
+
+  /*
+   * Take ownership of the whole buffer without copying, and only copy
+   * the partial frame at the end (if any) back into input.
+   */
+  if (pipe_transport)
+    pipe_transport->rx_wire += total;
+
+  if (total > 0)
+    {
+      g_byte_array_ref (input);
+      data = g_byte_array_free (input, FALSE);
+      block = g_bytes_new_with_free_func (data, total, g_free, data);
+      if (tail > 0)
+        g_byte_array_append (input, data + total, tail);
+    }
+
+  offset = 0;
+  while (!*closed && offset < total)
+    {
+      size = cockpit_frame_parse ((guchar *)g_bytes_get_data (block, NULL) + offset,
+                                  total - offset, &i);
+      g_assert (size > 0);
+
+      message = g_bytes_new_from_bytes (block, offset + i, size);
+      offset += i + size;
+
+      if (pipe_transport && *((const gchar *)g_bytes_get_data (message, NULL)) == COMPRESS_MARKER)
+        {
+          inflated = inflate_message (pipe_transport, message);
+          g_bytes_unref (message);
+          if (!inflated)
+            {
+              cockpit_pipe_close (pipe, "protocol-error");
+              break;
+            }
+          message = inflated;
+        }
+
+      payload = cockpit_transport_parse_frame_intern (self, message, &channel, &channel_len);
       if (payload)
         {
+          /* Only channels that aren't open need a copy of their id */
+          unknown = NULL;
+          if (!channel && channel_len > 0)
+            channel = unknown = g_strndup (g_bytes_get_data (message, NULL), channel_len);
+
           g_debug ("%s: received a %d byte payload", logname, (int)size);
           cockpit_transport_emit_recv (self, channel, payload);
           g_bytes_unref (payload);
-          g_free (channel);
+          g_free (unknown);
         }
       g_bytes_unref (message);
     }
 
-  if (end_of_data)
+  if (block)
+    g_bytes_unref (block);
+
+  if (invalid)
+    {
+      if (!*closed)
+        {
+          g_warning ("%s: incorrect protocol: received invalid length prefix", logname);
+          cockpit_pipe_close (pipe, "protocol-error");
+        }
+    }
+  else if (end_of_data)
     {
       /* Received a partial message */
       if (input->len > 0)
@@ -46,6 +46,14 @@ CockpitTransport * cockpit_pipe_transport_new_fds    (const gchar *name,
 
 CockpitPipe *      cockpit_pipe_transport_get_pipe   (CockpitPipeTransport *self);
 
+void               cockpit_pipe_transport_set_compression (CockpitPipeTransport *self,
+                                                           gboolean compress);
+
+gboolean           cockpit_pipe_transport_get_compression (CockpitPipeTransport *self);
+
+gboolean           cockpit_pipe_transport_negotiate_compression (CockpitTransport *transport,
+                                                                 JsonObject *init);
+
 void               cockpit_transport_read_from_pipe  (CockpitTransport *self,
                                                       const gchar *logname,
                                                       CockpitPipe *pipe,
@@ -43,6 +43,40 @@ frozen_message_free (gpointer data)
   g_slice_free (FrozenMessage, frozen);
 }
 
+typedef struct {
+    CockpitTransportRecvFunc recv;
+    CockpitTransportControlFunc control;
+    gpointer user_data;
+} ChannelHandler;
+
+static void
+channel_handler_free (gpointer data)
+{
+  g_slice_free (ChannelHandler, data);
+}
+
+/*
+ * Channel ids of open channels are interned, so that the data path
+ * can refer to them without allocating a copy for each message, and
+ * tables of channels can be keyed by the interned pointer. The id
+ * itself follows the reference count in memory. Ids of channels that
+ * aren't open are never added, so that a peer sending junk channel
+ * ids can't fill the table.
+ *
+ * Like the rest of the transport code, this is only used from the
+ * main thread.
+ */
+typedef struct {
+    gint refs;
+    gsize length;
+    gchar id[1];
+} InternedChannel;
+
+static GHashTable *interned_channels;
+
+/* A set of all the live transports, for cockpit_transport_foreach_stats() */
+static GHashTable *all_transports;
+
 enum {
   RECV,
   CONTROL,
@@ -55,8 +89,20 @@ static guint signals[NUM_SIGNALS];
 G_DEFINE_ABSTRACT_TYPE (CockpitTransport, cockpit_transport, G_TYPE_OBJECT);
 
 struct _CockpitTransportPrivate {
+    /* Channel id -> ChannelHandler, dispatched before the signals */
+    GHashTable *channels;
+
     GHashTable *freeze;
     GQueue *frozen;
+
+    /* The channel of the last frame parsed, usually the same as the next */
+    InternedChannel *last;
+
+    /* Statistics */
+    guint64 rx_messages;
+    guint64 rx_bytes;
+    guint64 tx_messages;
+    guint64 tx_bytes;
 };
 
 static void
@@ -64,6 +110,9 @@ cockpit_transport_init (CockpitTransport *self)
 {
   self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, COCKPIT_TYPE_TRANSPORT,
                                             CockpitTransportPrivate);
+  if (!all_transports)
+    all_transports = g_hash_table_new (g_direct_hash, g_direct_equal);
+  g_hash_table_add (all_transports, self);
 }
 
 static void
@@ -137,10 +186,16 @@ cockpit_transport_finalize (GObject *object)
 {
   CockpitTransport *self = COCKPIT_TRANSPORT (object);
 
+  if (self->priv->channels)
+    g_hash_table_destroy (self->priv->channels);
   if (self->priv->freeze)
     g_hash_table_destroy (self->priv->freeze);
   if (self->priv->frozen)
     g_queue_free_full (self->priv->frozen, frozen_message_free);
+  if (self->priv->last)
+    cockpit_transport_release_channel (self->priv->last->id);
+
+  g_hash_table_remove (all_transports, self);
 
   G_OBJECT_CLASS (cockpit_transport_parent_class)->finalize (object);
 }
@@ -192,6 +247,9 @@ cockpit_transport_send (CockpitTransport *transport,
   klass = COCKPIT_TRANSPORT_GET_CLASS (transport);
   g_return_if_fail (klass && klass->send);
   klass->send (transport, channel, data);
+
+  transport->priv->tx_messages++;
+  transport->priv->tx_bytes += g_bytes_get_size (data);
 }
 
 void
@@ -207,24 +265,53 @@ cockpit_transport_close (CockpitTransport *transport,
   klass->close (transport, problem);
 }
 
-void
-cockpit_transport_emit_recv (CockpitTransport *transport,
-                             const gchar *channel,
-                             GBytes *data)
+static ChannelHandler *
+lookup_channel_handler (CockpitTransport *self,
+                        const gchar *channel)
 {
-  gboolean result = FALSE;
+  return cockpit_transport_lookup_channel (self->priv->channels, channel);
+}
 
-  g_return_if_fail (COCKPIT_IS_TRANSPORT (transport));
+static void
+dispatch_recv (CockpitTransport *transport,
+               const gchar *channel,
+               GBytes *data)
+{
+  CockpitTransportRecvFunc func;
+  ChannelHandler *handler;
+  gboolean result = FALSE;
 
   if (maybe_freeze_message (transport, channel, NULL, data))
     return;
 
+  handler = lookup_channel_handler (transport, channel);
+  if (handler && handler->recv)
+    {
+      /* The handler may remove itself while being called */
+      func = handler->recv;
+      if ((func) (transport, channel, data, handler->user_data))
+        return;
+    }
+
   g_signal_emit (transport, signals[RECV], 0, channel, data, &result);
 
   if (!result)
     g_debug ("no handler for received message in channel %s", channel);
 }
 
+void
+cockpit_transport_emit_recv (CockpitTransport *transport,
+                             const gchar *channel,
+                             GBytes *data)
+{
+  g_return_if_fail (COCKPIT_IS_TRANSPORT (transport));
+
+  transport->priv->rx_messages++;
+  transport->priv->rx_bytes += g_bytes_get_size (data);
+
+  dispatch_recv (transport, channel, data);
+}
+
 void
 cockpit_transport_emit_control (CockpitTransport *transport,
                                 const gchar *command,
@@ -232,6 +319,8 @@ cockpit_transport_emit_control (CockpitTransport *transport,
                                 JsonObject *options,
                                 GBytes *data)
 {
+  CockpitTransportControlFunc func;
+  ChannelHandler *handler;
   gboolean result = FALSE;
 
   g_return_if_fail (COCKPIT_IS_TRANSPORT (transport));
@@ -239,6 +328,14 @@ cockpit_transport_emit_control (CockpitTransport *transport,
   if (maybe_freeze_message (transport, channel, options, data))
     return;
 
+  handler = lookup_channel_handler (transport, channel);
+  if (handler && handler->control)
+    {
+      func = handler->control;
+      if ((func) (transport, command, channel, options, data, handler->user_data))
+        return;
+    }
+
   g_signal_emit (transport, signals[CONTROL], 0, command, channel, options, data, &result);
 
   if (!result)
@@ -253,6 +350,66 @@ cockpit_transport_emit_closed (CockpitTransport *transport,
   g_signal_emit (transport, signals[CLOSED], 0, problem);
 }
 
+/**
+ * cockpit_transport_add_channel:
+ * @self: a transport
+ * @channel: the channel id
+ * @recv: called for data messages on the channel, or NULL
+ * @control: called for control messages about the channel, or NULL
+ * @user_data: passed to the callbacks
+ *
+ * Register handlers for messages on a single channel. These are looked
+ * up by channel id and called before the CockpitTransport::recv and
+ * CockpitTransport::control signals are emitted, so that dispatch does
+ * not depend on the number of open channels.
+ *
+ * If a handler returns FALSE then the message is passed on to the
+ * signal handlers as usual.
+ *
+ * Only one set of handlers can be registered per channel. Use
+ * cockpit_transport_remove_channel() to remove them again.
+ */
+void
+cockpit_transport_add_channel (CockpitTransport *self,
+                               const gchar *channel,
+                               CockpitTransportRecvFunc recv,
+                               CockpitTransportControlFunc control,
+                               gpointer user_data)
+{
+  ChannelHandler *handler;
+
+  g_return_if_fail (COCKPIT_IS_TRANSPORT (self));
+  g_return_if_fail (channel != NULL);
+
+  if (!self->priv->channels)
+    {
+      self->priv->channels = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                                    (GDestroyNotify)cockpit_transport_release_channel,
+                                                    channel_handler_free);
+    }
+
+  handler = g_slice_new0 (ChannelHandler);
+  handler->recv = recv;
+  handler->control = control;
+  handler->user_data = user_data;
+
+  if (cockpit_transport_lookup_channel (self->priv->channels, channel))
+    g_warning ("%s: replacing handlers for channel", channel);
+  g_hash_table_replace (self->priv->channels,
+                        (gpointer)cockpit_transport_intern_channel (channel, -1), handler);
+}
+
+void
+cockpit_transport_remove_channel (CockpitTransport *self,
+                                  const gchar *channel)
+{
+  g_return_if_fail (COCKPIT_IS_TRANSPORT (self));
+  g_return_if_fail (channel != NULL);
+
+  if (self->priv->channels)
+    g_hash_table_remove (self->priv->channels, cockpit_transport_find_channel (channel));
+}
+
 void
 cockpit_transport_freeze (CockpitTransport *self,
                           const gchar *channel)
@@ -298,7 +455,8 @@ cockpit_transport_thaw (CockpitTransport *self,
             }
           else
             {
-              cockpit_transport_emit_recv (self, stolen, frozen->data);
+              /* Already counted when it was received */
+              dispatch_recv (self, stolen, frozen->data);
             }
           g_queue_delete_link (self->priv->frozen, flush);
           frozen_message_free (frozen);
@@ -308,15 +466,264 @@ cockpit_transport_thaw (CockpitTransport *self,
   g_free (stolen);
 }
 
+/**
+ * cockpit_transport_get_stats:
+ * @self: a transport
+ * @stats: filled in with the statistics
+ *
+ * Get the number of messages and bytes that have passed through
+ * the transport, how many received messages are held back by
+ * cockpit_transport_freeze(), and how much is waiting to be sent.
+ *
+ * The wire bytes include framing and are counted after compression.
+ * For transports that have no wire they are the same as the payload bytes.
+ */
+void
+cockpit_transport_get_stats (CockpitTransport *self,
+                             CockpitTransportStats *stats)
+{
+  CockpitTransportClass *klass;
+
+  g_return_if_fail (COCKPIT_IS_TRANSPORT (self));
+  g_return_if_fail (stats != NULL);
+
+  memset (stats, 0, sizeof (CockpitTransportStats));
+  stats->rx_messages = self->priv->rx_messages;
+  stats->rx_bytes = self->priv->rx_bytes;
+  stats->tx_messages = self->priv->tx_messages;
+  stats->tx_bytes = self->priv->tx_bytes;
+  if (self->priv->frozen)
+    stats->frozen = g_queue_get_length (self->priv->frozen);
+
+  klass = COCKPIT_TRANSPORT_GET_CLASS (self);
+  if (klass->get_queued)
+    (klass->get_queued) (self, &stats->queued_blocks, &stats->queued_bytes);
+  if (klass->get_wire)
+    {
+      (klass->get_wire) (self, &stats->rx_wire_bytes, &stats->tx_wire_bytes);
+    }
+  else
+    {
+      stats->rx_wire_bytes = stats->rx_bytes;
+      stats->tx_wire_bytes = stats->tx_bytes;
+    }
+}
+
+/**
+ * cockpit_transport_foreach_stats:
+ * @func: called for each transport
+ * @user_data: passed to @func
+ *
+ * Call @func with the statistics of each transport in this
+ * process. @func must not create or destroy transports.
+ */
+void
+cockpit_transport_foreach_stats (CockpitTransportStatsFunc func,
+                                 gpointer user_data)
+{
+  CockpitTransportStats stats;
+  CockpitTransport *transport;
+  GHashTableIter iter;
+
+  if (!all_transports)
+    return;
+
+  g_hash_table_iter_init (&iter, all_transports);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&transport, NULL))
+    {
+      cockpit_transport_get_stats (transport, &stats);
+      (func) (transport, &stats, user_data);
+    }
+}
+
+/**
+ * cockpit_transport_build_stats:
+ * @stats: transport statistics
+ *
+ * Describe the statistics as JSON, for a "statistics" reply.
+ *
+ * Returns: (transfer full): a new JSON object
+ */
+JsonObject *
+cockpit_transport_build_stats (const CockpitTransportStats *stats)
+{
+  JsonObject *object;
+
+  g_return_val_if_fail (stats != NULL, NULL);
+
+  object = json_object_new ();
+  json_object_set_int_member (object, "rx-messages", stats->rx_messages);
+  json_object_set_int_member (object, "rx-bytes", stats->rx_bytes);
+  json_object_set_int_member (object, "tx-messages", stats->tx_messages);
+  json_object_set_int_member (object, "tx-bytes", stats->tx_bytes);
+  json_object_set_int_member (object, "rx-wire-bytes", stats->rx_wire_bytes);
+  json_object_set_int_member (object, "tx-wire-bytes", stats->tx_wire_bytes);
+  json_object_set_int_member (object, "frozen", stats->frozen);
+  json_object_set_int_member (object, "queued-blocks", stats->queued_blocks);
+  json_object_set_int_member (object, "queued-bytes", stats->queued_bytes);
+  return object;
+}
+
+static InternedChannel *
+lookup_interned (const gchar *channel,
+                 gsize length)
+{
+  InternedChannel *entry;
+  gchar *allocated = NULL;
+  gchar buffer[64];
+  const gchar *key;
+
+  if (!interned_channels)
+    return NULL;
+
+  /* A null terminated copy of the id, but without allocating for the usual lengths */
+  if (length < sizeof (buffer))
+    {
+      memcpy (buffer, channel, length);
+      buffer[length] = '\0';
+      key = buffer;
+    }
+  else
+    {
+      key = allocated = g_strndup (channel, length);
+    }
+
+  entry = g_hash_table_lookup (interned_channels, key);
+  g_free (allocated);
+  return entry;
+}
+
+/**
+ * cockpit_transport_intern_channel:
+ * @channel: a channel id
+ * @length: length of @channel or -1 if null terminated
+ *
+ * Get the interned copy of a channel id. The same pointer is
+ * returned for equal ids for as long as any reference to it is
+ * held, so code on the data path can use it without making a
+ * copy for every message. Tables of channels should use the interned
+ * id as a key with g_direct_hash(), see cockpit_transport_lookup_channel().
+ *
+ * Only call this from the main thread.
+ *
+ * Returns: the interned channel id, release with
+ *          cockpit_transport_release_channel()
+ */
+const gchar *
+cockpit_transport_intern_channel (const gchar *channel,
+                                  gssize length)
+{
+  InternedChannel *entry;
+
+  g_return_val_if_fail (channel != NULL, NULL);
+
+  if (length < 0)
+    length = strlen (channel);
+
+  entry = lookup_interned (channel, length);
+  if (!entry)
+    {
+      if (!interned_channels)
+        interned_channels = g_hash_table_new (g_str_hash, g_str_equal);
+
+      entry = g_malloc (G_STRUCT_OFFSET (InternedChannel, id) + length + 1);
+      entry->refs = 0;
+      entry->length = length;
+      memcpy (entry->id, channel, length);
+      entry->id[length] = '\0';
+      g_hash_table_insert (interned_channels, entry->id, entry);
+    }
+
+  entry->refs++;
+  return entry->id;
+}
+
+/**
+ * cockpit_transport_release_channel:
+ * @channel: an interned channel id
+ *
+ * Release a channel id returned from cockpit_transport_intern_channel().
+ */
+void
+cockpit_transport_release_channel (const gchar *channel)
+{
+  InternedChannel *entry;
+
+  if (!channel)
+    return;
+
+  entry = (InternedChannel *)(channel - G_STRUCT_OFFSET (InternedChannel, id));
+
+  g_assert (entry->refs > 0);
+  if (--entry->refs == 0)
+    {
+      g_hash_table_remove (interned_channels, entry->id);
+      g_free (entry);
+    }
+}
+
+/**
+ * cockpit_transport_find_channel:
+ * @channel: a channel id
+ *
+ * Find the interned copy of @channel, if it is interned at all. No
+ * reference is taken. Use this to get the key for removing a channel
+ * from a table keyed by interned ids.
+ *
+ * Returns: the interned id or NULL
+ */
+const gchar *
+cockpit_transport_find_channel (const gchar *channel)
+{
+  InternedChannel *entry;
+
+  if (!channel || !interned_channels)
+    return NULL;
+
+  entry = g_hash_table_lookup (interned_channels, channel);
+  return entry ? entry->id : NULL;
+}
+
+/**
+ * cockpit_transport_lookup_channel:
+ * @table: a table keyed by interned channel ids with g_direct_hash()
+ * @channel: a channel id, interned or not
+ *
+ * Lookup a channel in @table. Ids parsed on the data path are already
+ * interned, and are found without hashing the string. Other ids are
+ * first looked up in the table of interned ids.
+ *
+ * Returns: the value in @table or NULL
+ */
+gpointer
+cockpit_transport_lookup_channel (GHashTable *table,
+                                  const gchar *channel)
+{
+  const gchar *interned;
+  gpointer value;
+
+  if (!channel || !table)
+    return NULL;
+
+  if (g_hash_table_lookup_extended (table, channel, NULL, &value))
+    return value;
+
+  interned = cockpit_transport_find_channel (channel);
+  if (!interned || interned == channel)
+    return NULL;
+
+  return g_hash_table_lookup (table, interned);
+}
+
 static GBytes *
-parse_frame (GBytes *message,
-             gboolean expect,
-             gchar **channel)
+parse_frame_prefix (GBytes *message,
+                    gboolean expect,
+                    const gchar **channel,
+                    gsize *channel_len)
 {
   const gchar *data;
   gsize length;
   const gchar *line;
-  gsize channel_len;
 
   g_return_val_if_fail (message != NULL, NULL);
 
@@ -329,21 +736,31 @@ parse_frame (GBytes *message,
       return NULL;
     }
 
-  channel_len = line - data;
-  if (memchr (data, '\0', channel_len) != NULL)
+  *channel_len = line - data;
+  if (memchr (data, '\0', *channel_len) != NULL)
     {
       if (expect)
         g_message ("received massage with invalid channel prefix");
       return NULL;
     }
 
-  if (channel_len)
-    *channel = g_strndup (data, channel_len);
-  else
-    *channel = NULL;
+  *channel = data;
+  return g_bytes_new_from_bytes (message, *channel_len + 1, length - (*channel_len + 1));
+}
+
+static GBytes *
+parse_frame (GBytes *message,
+             gboolean expect,
+             gchar **channel)
+{
+  const gchar *data;
+  gsize channel_len;
+  GBytes *payload;
 
-  channel_len++;
-  return g_bytes_new_from_bytes (message, channel_len, length - channel_len);
+  payload = parse_frame_prefix (message, expect, &data, &channel_len);
+  if (payload)
+    *channel = channel_len ? g_strndup (data, channel_len) : NULL;
+  return payload;
 }
 
 /**
@@ -366,6 +783,76 @@ cockpit_transport_parse_frame (GBytes *message,
   return parse_frame (message, TRUE, channel);
 }
 
+static const gchar *
+resolve_channel (CockpitTransport *self,
+                 const gchar *channel,
+                 gsize length)
+{
+  InternedChannel *last = self->priv->last;
+  InternedChannel *entry;
+
+  /* Frames for the same channel tend to come in runs, skip the hashing */
+  if (last && last->length == length && memcmp (last->id, channel, length) == 0)
+    {
+      if (last->refs > 1)
+        return last->id;
+
+      /* Only we still hold it, the channel has closed */
+      self->priv->last = NULL;
+      cockpit_transport_release_channel (last->id);
+      return NULL;
+    }
+
+  entry = lookup_interned (channel, length);
+  if (!entry)
+    return NULL;
+
+  /* Held so that the id stays valid while the frame is dispatched */
+  entry->refs++;
+  self->priv->last = entry;
+  if (last)
+    cockpit_transport_release_channel (last->id);
+
+  return entry->id;
+}
+
+/**
+ * cockpit_transport_parse_frame_intern:
+ * @self: the transport the frame is for
+ * @message: message to parse
+ * @channel: location to return the interned channel
+ * @channel_len: location to return the length of the channel id
+ *
+ * Parse a message into a channel and payload, like
+ * cockpit_transport_parse_frame(). But nothing is copied: when the
+ * channel is open, its interned id is returned, and otherwise NULL.
+ * The last id found is remembered by @self, so a run of frames for the
+ * same channel is resolved without hashing.
+ *
+ * @channel is not owned by the caller, and stays valid until the next
+ * frame is parsed for @self. It is NULL both for control messages,
+ * where @channel_len is zero, and for channels that aren't open. The
+ * id of the latter is at the start of @message.
+ *
+ * Returns: (transfer full): the payload or NULL.
+ */
+GBytes *
+cockpit_transport_parse_frame_intern (CockpitTransport *self,
+                                      GBytes *message,
+                                      const gchar **channel,
+                                      gsize *channel_len)
+{
+  const gchar *data;
+  GBytes *payload;
+
+  g_return_val_if_fail (COCKPIT_IS_TRANSPORT (self), NULL);
+
+  payload = parse_frame_prefix (message, TRUE, &data, channel_len);
+  if (payload)
+    *channel = *channel_len ? resolve_channel (self, data, *channel_len) : NULL;
+  return payload;
+}
+
 GBytes *
 cockpit_transport_maybe_frame (GBytes *message,
                                gchar **channel)
@@ -494,3 +981,30 @@ cockpit_transport_build_control (const gchar *name,
   json_object_unref (object);
   return message;
 }
+
+/**
+ * cockpit_transport_build_pong:
+ * @ping: the options of a "ping" control message
+ *
+ * Build the reply to a "ping", which carries all the same fields,
+ * such as "channel" and "sequence", but with a "pong" command.
+ *
+ * Returns: (transfer full): the "pong" control message options
+ */
+JsonObject *
+cockpit_transport_build_pong (JsonObject *ping)
+{
+  JsonObject *pong;
+  GList *l, *names;
+
+  g_return_val_if_fail (ping != NULL, NULL);
+
+  pong = json_object_new ();
+  names = json_object_get_members (ping);
+  for (l = names; l != NULL; l = g_list_next (l))
+    json_object_set_member (pong, l->data, json_object_dup_member (ping, l->data));
+  g_list_free (names);
+
+  json_object_set_string_member (pong, "command", "pong");
+  return pong;
+}
@@ -73,8 +73,51 @@ struct _CockpitTransportClass
 
   void        (* close)       (CockpitTransport *transport,
                                const gchar *problem);
+
+  /*
+   * Optional. Reports data queued but not yet sent.
+   */
+  void        (* get_queued)  (CockpitTransport *transport,
+                               guint *blocks,
+                               gsize *bytes);
+
+  /*
+   * Optional. Reports bytes actually read and written, including
+   * framing and after compression.
+   */
+  void        (* get_wire)    (CockpitTransport *transport,
+                               guint64 *rx_bytes,
+                               guint64 *tx_bytes);
 };
 
+typedef struct {
+  guint64 rx_messages;
+  guint64 rx_bytes;
+  guint64 tx_messages;
+  guint64 tx_bytes;
+  guint64 rx_wire_bytes;
+  guint64 tx_wire_bytes;
+  guint frozen;
+  guint queued_blocks;
+  gsize queued_bytes;
+} CockpitTransportStats;
+
+typedef gboolean (* CockpitTransportRecvFunc)    (CockpitTransport *transport,
+                                                  const gchar *channel,
+                                                  GBytes *data,
+                                                  gpointer user_data);
+
+typedef gboolean (* CockpitTransportControlFunc) (CockpitTransport *transport,
+                                                  const gchar *command,
+                                                  const gchar *channel,
+                                                  JsonObject *options,
+                                                  GBytes *data,
+                                                  gpointer user_data);
+
+typedef void     (* CockpitTransportStatsFunc)   (CockpitTransport *transport,
+                                                  const CockpitTransportStats *stats,
+                                                  gpointer user_data);
+
 GType       cockpit_transport_get_type       (void) G_GNUC_CONST;
 
 void        cockpit_transport_send           (CockpitTransport *transport,
@@ -97,18 +140,50 @@ void        cockpit_transport_emit_control   (CockpitTransport *transport,
 void        cockpit_transport_emit_closed    (CockpitTransport *transport,
                                               const gchar *problem);
 
+void        cockpit_transport_add_channel    (CockpitTransport *transport,
+                                              const gchar *channel,
+                                              CockpitTransportRecvFunc recv,
+                                              CockpitTransportControlFunc control,
+                                              gpointer user_data);
+
+void        cockpit_transport_remove_channel (CockpitTransport *transport,
+                                              const gchar *channel);
+
 void        cockpit_transport_freeze         (CockpitTransport *transport,
                                               const gchar *channel);
 
 void        cockpit_transport_thaw           (CockpitTransport *transport,
                                               const gchar *channel);
 
+void        cockpit_transport_get_stats      (CockpitTransport *transport,
+                                              CockpitTransportStats *stats);
+
+void        cockpit_transport_foreach_stats  (CockpitTransportStatsFunc func,
+                                              gpointer user_data);
+
+JsonObject *cockpit_transport_build_stats    (const CockpitTransportStats *stats);
+
 GBytes *    cockpit_transport_parse_frame    (GBytes *message,
                                               gchar **channel);
 
+GBytes *    cockpit_transport_parse_frame_intern (CockpitTransport *self,
+                                                  GBytes *message,
+                                                  const gchar **channel,
+                                                  gsize *channel_len);
+
 GBytes *    cockpit_transport_maybe_frame    (GBytes *message,
                                               gchar **channel);
 
+const gchar * cockpit_transport_intern_channel  (const gchar *channel,
+                                                 gssize length);
+
+void        cockpit_transport_release_channel (const gchar *channel);
+
+const gchar * cockpit_transport_find_channel    (const gchar *channel);
+
+gpointer    cockpit_transport_lookup_channel (GHashTable *table,
+                                              const gchar *channel);
+
 gboolean    cockpit_transport_parse_command  (GBytes *payload,
                                               const gchar **command,
                                               const gchar **channel,
@@ -120,6 +195,8 @@ JsonObject *cockpit_transport_build_json     (const gchar *name,
 GBytes *    cockpit_transport_build_control  (const gchar *name,
                                               ...) G_GNUC_NULL_TERMINATED;
 
+JsonObject *cockpit_transport_build_pong     (JsonObject *ping);
+
 G_END_DECLS
 
 #endif /* __COCKPIT_TRANSPORT_H__ */
@@ -21,56 +21,544 @@
 
 #include "cockpitunicode.h"
 
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WITH_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/*
+ * The validators below accept exactly what g_utf8_validate() accepts:
+ * shortest form UTF-8 up to U+10FFFF without surrogates, and no nul
+ * bytes. They return the offset of the first byte that does not start
+ * a valid character. If the input ends in the middle of an otherwise
+ * valid sequence, then @incomplete is set to the length of that tail.
+ */
+
+/* How much the scalar code looks at before going back to vectors */
+#define SCALAR_WINDOW 64
+
+typedef gsize (* ValidateFunc) (const guchar *data,
+                                gsize length,
+                                gsize *incomplete);
+
+/*
+ * Length of the character at @p, or zero if it is not valid. When the
+ * character would be valid but is cut short by @end, then @truncated
+ * is set to the number of bytes that are there.
+ */
+static inline guint
+char_length (const guchar *p,
+             const guchar *end,
+             gsize *truncated)
+{
+  guchar lo = 0x80;
+  guchar hi = 0xBF;
+  guint need;
+  guint i;
+
+  if (*p < 0x80)
+    return *p != 0;
+
+  if (*p >= 0xC2 && *p <= 0xDF)
+    {
+      need = 1;
+    }
+  else if (*p >= 0xE0 && *p <= 0xEF)
+    {
+      need = 2;
+      if (*p == 0xE0)
+        lo = 0xA0;              /* overlong */
+      else if (*p == 0xED)
+        hi = 0x9F;              /* surrogates */
+    }
+  else if (*p >= 0xF0 && *p <= 0xF4)
+    {
+      need = 3;
+      if (*p == 0xF0)
+        lo = 0x90;              /* overlong */
+      else if (*p == 0xF4)
+        hi = 0x8F;              /* above U+10FFFF */
+    }
+  else
+    {
+      return 0;
+    }
+
+  for (i = 1; i <= need; i++)
+    {
+      if (p + i == end)
+        {
+          *truncated = i;
+          return 0;
+        }
+      if (i == 1 ? (p[i] < lo || p[i] > hi) : (p[i] & 0xC0) != 0x80)
+        return 0;
+    }
+
+  return need + 1;
+}
+
+static gsize
+validate_scalar (const guchar *data,
+                 gsize length,
+                 gsize *incomplete)
+{
+  const guchar *p = data;
+  const guchar *end = data + length;
+  guint64 word;
+  guint n;
+
+  *incomplete = 0;
+
+  while (p < end)
+    {
+      /* Eight ASCII bytes at a time, as long as none of them is nul */
+      while (end - p >= 8)
+        {
+          memcpy (&word, p, 8);
+          if ((word & G_GUINT64_CONSTANT (0x8080808080808080)) ||
+              ((word - G_GUINT64_CONSTANT (0x0101010101010101)) & ~word &
+               G_GUINT64_CONSTANT (0x8080808080808080)))
+            break;
+          p += 8;
+        }
+
+      if (p == end)
+        break;
+
+      n = char_length (p, end, incomplete);
+      if (n == 0)
+        break;
+      p += n;
+    }
+
+  return p - data;
+}
+
+#ifdef WITH_X86_SIMD
+
+/*
+ * Back up from a block boundary to the start of the character that
+ * straddles it. Everything before the boundary has already been checked,
+ * so at most three continuation bytes are skipped.
+ */
+static inline gsize
+char_boundary (const guchar *data,
+               gsize offset)
+{
+  gsize i;
+
+  for (i = 0; i < 3 && offset > 0 && (data[offset - 1] & 0xC0) == 0x80; i++)
+    offset--;
+  if (offset > 0 && data[offset - 1] >= 0xC0)
+    offset--;
+  return offset;
+}
+
+static inline gsize
+finish_scalar (const guchar *data,
+               gsize offset,
+               gsize length,
+               gsize *incomplete)
+{
+  offset = char_boundary (data, offset);
+  return offset + validate_scalar (data + offset, length - offset, incomplete);
+}
+
+/*
+ * SSE2 has no byte shuffle, so only ASCII runs are vectorized here.
+ * Anything else is handed to the scalar code a window at a time.
+ */
+__attribute__((target ("sse2")))
+static inline gboolean
+sse2_is_ascii (const guchar *data)
+{
+  __m128i block = _mm_loadu_si128 ((const __m128i *)data);
+  return (_mm_movemask_epi8 (block) | _mm_movemask_epi8 (_mm_cmpeq_epi8 (block, _mm_setzero_si128 ()))) == 0;
+}
+
+__attribute__((target ("sse2")))
+static gsize
+validate_sse2 (const guchar *data,
+               gsize length,
+               gsize *incomplete)
+{
+  gsize offset = 0;
+  gsize window;
+  gsize valid;
+
+  for (;;)
+    {
+      while (length - offset >= 16 && sse2_is_ascii (data + offset))
+        offset += 16;
+
+      window = MIN (length - offset, SCALAR_WINDOW);
+      valid = offset + validate_scalar (data + offset, window, incomplete);
+      if (valid == length)
+        return valid;
+
+      /* Only cut short by the window, carry on from that character */
+      if (offset + window < length && (valid == offset + window || *incomplete))
+        {
+          *incomplete = 0;
+          offset = valid;
+          continue;
+        }
+
+      return valid;
+    }
+}
+
+/*
+ * Vectorized validation, see "Validating UTF-8 In Less Than One
+ * Instruction Per Byte" by John Keiser and Daniel Lemire. Each byte is
+ * classified together with the one before it via three table lookups,
+ * and the required continuation bytes of three and four byte sequences
+ * are checked separately. This only tells us whether a block is valid,
+ * the exact offset of a problem is found with the scalar code.
+ */
+
+#define TOO_SHORT       (1 << 0)
+#define TOO_LONG        (1 << 1)
+#define OVERLONG_3      (1 << 2)
+#define TOO_LARGE       (1 << 3)
+#define SURROGATE       (1 << 4)
+#define OVERLONG_2      (1 << 5)
+#define TOO_LARGE_1000  (1 << 6)
+#define OVERLONG_4      (1 << 6)
+#define TWO_CONTS       (1 << 7)
+#define CARRY           (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define TABLE16(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p) \
+  _mm256_setr_epi8 (a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p, \
+                    a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p)
+
+__attribute__((target ("avx2")))
+static inline __m256i
+avx2_check_block (__m256i input,
+                  __m256i prev_input)
+{
+  const __m256i nibble = _mm256_set1_epi8 (0x0F);
+  __m256i shifted, prev1, prev2, prev3;
+  __m256i byte_1_high, byte_1_low, byte_2_high;
+  __m256i special, must23;
+
+  /* The input shifted by one, two and three bytes, continuing from the previous block */
+  shifted = _mm256_permute2x128_si256 (prev_input, input, 0x21);
+  prev1 = _mm256_alignr_epi8 (input, shifted, 15);
+  prev2 = _mm256_alignr_epi8 (input, shifted, 14);
+  prev3 = _mm256_alignr_epi8 (input, shifted, 13);
+
+  byte_1_high = _mm256_shuffle_epi8 (TABLE16 (
+      /* 0_______ ASCII */
+      TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+      TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+      /* 10______ continuation */
+      TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+      /* 1100____ two byte lead */
+      TOO_SHORT | OVERLONG_2,
+      /* 1101____ two byte lead */
+      TOO_SHORT,
+      /* 1110____ three byte lead */
+      TOO_SHORT | OVERLONG_3 | SURROGATE,
+      /* 1111____ four byte lead */
+      TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4),
+    _mm256_and_si256 (_mm256_srli_epi16 (prev1, 4), nibble));
+
+  byte_1_low = _mm256_shuffle_epi8 (TABLE16 (
+      /* ____0000 */
+      CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+      /* ____0001 */
+      CARRY | OVERLONG_2,
+      /* ____001_ */
+      CARRY, CARRY,
+      /* ____0100 */
+      CARRY | TOO_LARGE,
+      /* ____0101 to ____1100 */
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      /* ____1101 */
+      CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+      /* ____111_ */
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000),
+    _mm256_and_si256 (prev1, nibble));
+
+  byte_2_high = _mm256_shuffle_epi8 (TABLE16 (
+      /* ________ 0_______ */
+      TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+      TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+      /* ________ 1000____ */
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+      /* ________ 1001____ */
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+      /* ________ 101_____ */
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+      /* ________ 11______ */
+      TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT),
+    _mm256_and_si256 (_mm256_srli_epi16 (input, 4), nibble));
+
+  special = _mm256_and_si256 (_mm256_and_si256 (byte_1_high, byte_1_low), byte_2_high);
+
+  /* The second and third byte after a three or four byte lead */
+  must23 = _mm256_or_si256 (_mm256_subs_epu8 (prev2, _mm256_set1_epi8 ((char)(0xE0 - 0x80))),
+                            _mm256_subs_epu8 (prev3, _mm256_set1_epi8 ((char)(0xF0 - 0x80))));
+  must23 = _mm256_and_si256 (must23, _mm256_set1_epi8 ((char)0x80));
+
+  return _mm256_xor_si256 (must23, special);
+}
+
+__attribute__((target ("avx2")))
+static gsize
+validate_avx2 (const guchar *data,
+               gsize length,
+               gsize *incomplete)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  __m256i prev_input = zero;
+  __m256i prev_incomplete = zero;
+  __m256i input, error;
+  gsize offset = 0;
+
+  while (length - offset >= 32)
+    {
+      input = _mm256_loadu_si256 ((const __m256i *)(data + offset));
+
+      if (_mm256_movemask_epi8 (input) == 0)
+        error = prev_incomplete;
+      else
+        error = avx2_check_block (input, prev_input);
+
+      error = _mm256_or_si256 (error, _mm256_cmpeq_epi8 (input, zero));
+      if (!_mm256_testz_si256 (error, error))
+        break;
+
+      /* Does the block end in the middle of a character? */
+      prev_incomplete = _mm256_subs_epu8 (input, _mm256_setr_epi8 (
+          -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+          -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+          (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1)));
+      prev_input = input;
+      offset += 32;
+    }
+
+  return finish_scalar (data, offset, length, incomplete);
+}
+
+#endif /* WITH_X86_SIMD */
+
+static ValidateFunc
+lookup_validate (const gchar *name)
+{
+  if (g_str_equal (name, "scalar"))
+    return validate_scalar;
+#ifdef WITH_X86_SIMD
+  __builtin_cpu_init ();
+  if (g_str_equal (name, "avx2") && __builtin_cpu_supports ("avx2"))
+    return validate_avx2;
+  if (g_str_equal (name, "sse2") && __builtin_cpu_supports ("sse2"))
+    return validate_sse2;
+#endif
+  return NULL;
+}
+
+static ValidateFunc validate_func;
+
+static ValidateFunc
+choose_validate (void)
+{
+  static const gchar *preferred[] = { "avx2", "sse2", "scalar" };
+  ValidateFunc func = NULL;
+  gint i;
+
+  for (i = 0; func == NULL && i < G_N_ELEMENTS (preferred); i++)
+    func = lookup_validate (preferred[i]);
+  return func;
+}
+
+static inline gsize
+validate_utf8 (const guchar *data,
+               gsize length,
+               gsize *incomplete)
+{
+  static gsize chosen = 0;
+
+  if (g_once_init_enter (&chosen))
+    {
+      if (!validate_func)
+        validate_func = choose_validate ();
+      g_once_init_leave (&chosen, 1);
+    }
+
+  return (validate_func) (data, length, incomplete);
+}
+
+/**
+ * cockpit_unicode_use_implementation:
+ * @name: "avx2", "sse2", "scalar" or NULL
+ *
+ * Used by tests and benchmarks to force a given implementation
+ * of the UTF-8 validation. NULL picks the best one for this CPU,
+ * which is also what happens by default. Not thread safe.
+ *
+ * Returns: FALSE if the implementation is not available
+ */
+gboolean
+cockpit_unicode_use_implementation (const gchar *name)
+{
+  ValidateFunc func;
+
+  if (name)
+    func = lookup_validate (name);
+  else
+    func = choose_validate ();
+
+  if (func)
+    validate_func = func;
+  return func != NULL;
+}
+
+/**
+ * cockpit_unicode_validate:
+ * @data: the data to validate
+ * @length: length of @data
+ * @incomplete: (out) (optional): location for length of incomplete tail
+ *
+ * Check how much of @data is valid UTF-8, in a single pass. Uses
+ * vector instructions where the CPU supports them. The rules are
+ * the same as g_utf8_validate(), including the rejection of nul bytes.
+ *
+ * If @data ends with the start of a character that is cut short,
+ * then @incomplete is set to the number of bytes in that tail, and
+ * the return value plus @incomplete is @length.
+ *
+ * Returns: the length of the valid prefix of @data
+ */
+gsize
+cockpit_unicode_validate (const gchar *data,
+                          gsize length,
+                          gsize *incomplete)
+{
+  gsize dummy;
+  return validate_utf8 ((const guchar *)data, length, incomplete ? incomplete : &dummy);
+}
+
+/**
+ * cockpit_unicode_repair:
+ * @data: the data to repair
+ * @length: length of @data
+ * @output: buffer of at least COCKPIT_UNICODE_REPAIR_SIZE (@length) bytes
+ *
+ * Copy @data into @output replacing every byte that does not belong to
+ * a valid UTF-8 character with U+FFFD. This replaces exactly the bytes
+ * that g_utf8_validate() would stop at.
+ *
+ * Returns: the number of bytes written to @output
+ */
+gsize
+cockpit_unicode_repair (const gchar *data,
+                        gsize length,
+                        gchar *output)
+{
+  const guchar *p = (const guchar *)data;
+  const guchar *end = p + length;
+  gchar *out = output;
+  gsize truncated;
+  gsize valid;
+  guint run;
+  guint n;
+
+  for (;;)
+    {
+      valid = validate_utf8 (p, end - p, &truncated);
+      memcpy (out, p, valid);
+      out += valid;
+      p += valid;
+
+      if (p == end)
+        break;
+
+      /*
+       * Invalid bytes tend to come in bunches, so repair byte by byte
+       * until there has been a run of valid text again.
+       */
+      run = 0;
+      while (p < end && run < SCALAR_WINDOW)
+        {
+          n = char_length (p, end, &truncated);
+          if (n == 0)
+            {
+              /* Replacement character */
+              *(out++) = '\xef';
+              *(out++) = '\xbf';
+              *(out++) = '\xbd';
+              p++;
+              run = 0;
+            }
+          else
+            {
+              run += n;
+              do
+                *(out++) = *(p++);
+              while (--n > 0);
+            }
+        }
+    }
+
+  return out - output;
+}
+
 gboolean
 cockpit_unicode_has_incomplete_ending (GBytes *input)
 {
   const gchar *data;
-  const gchar *end;
+  gsize incomplete;
   gsize length;
+  gsize valid;
 
   data = g_bytes_get_data (input, &length);
-  if (g_utf8_validate (data, length, &end))
-    return FALSE;
-
-  do
+  for (;;)
     {
-      length -= (end - data) + 1;
-      data = end + 1;
-    }
-  while (!g_utf8_validate (data, length, &end));
+      valid = cockpit_unicode_validate (data, length, &incomplete);
+      if (valid == length)
+        return FALSE;
 
-  return length == 0;
+      /* A cut short character, or an invalid byte right at the end */
+      if (incomplete || valid + 1 == length)
+        return TRUE;
+
+      length -= valid + 1;
+      data += valid + 1;
+    }
 }
 
 GBytes *
 cockpit_unicode_force_utf8 (GBytes *input)
 {
   const gchar *data;
-  const gchar *end;
+  gchar *output;
   gsize length;
-  GString *string;
+  gsize valid;
+  gsize size;
 
   data = g_bytes_get_data (input, &length);
-  if (g_utf8_validate (data, length, &end))
+  valid = cockpit_unicode_validate (data, length, NULL);
+  if (valid == length)
     return g_bytes_ref (input);
 
-  string = g_string_sized_new (length + 16);
-  do
-    {
-      /* Valid part of the string */
-      g_string_append_len (string, data, end - data);
-
-      /* Replacement character */
-      g_string_append (string, "\xef\xbf\xbd");
+  /* The valid prefix is copied as is, only the rest can grow */
+  output = g_malloc (valid + COCKPIT_UNICODE_REPAIR_SIZE (length - valid));
+  memcpy (output, data, valid);
+  size = valid + cockpit_unicode_repair (data + valid, length - valid, output + valid);
 
-      length -= (end - data) + 1;
-      data = end + 1;
-    }
-  while (!g_utf8_validate (data, length, &end));
-
-  if (length)
-    g_string_append_len (string, data, length);
-
-  return g_string_free_to_bytes (string);
+  return g_bytes_new_take (g_realloc (output, size), size);
 }
-
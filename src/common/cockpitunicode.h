@@ -24,6 +24,19 @@
 
 G_BEGIN_DECLS
 
+/* Worst case output size of cockpit_unicode_repair() */
+#define COCKPIT_UNICODE_REPAIR_SIZE(length) ((length) * 3)
+
+gsize         cockpit_unicode_validate      (const gchar *data,
+                                             gsize length,
+                                             gsize *incomplete);
+
+gsize         cockpit_unicode_repair        (const gchar *data,
+                                             gsize length,
+                                             gchar *output);
+
+gboolean      cockpit_unicode_use_implementation (const gchar *name);
+
 GBytes *      cockpit_unicode_force_utf8    (GBytes *input);
 
 gboolean      cockpit_unicode_has_incomplete_ending (GBytes *input);
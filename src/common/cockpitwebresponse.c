@@ -30,6 +30,7 @@
 
 #include "common/cockpitconf.h"
 #include "common/cockpiterror.h"
+#include "common/cockpitflow.h"
 #include "common/cockpitlocale.h"
 #include "common/cockpittemplate.h"
 
@@ -55,8 +56,14 @@ static const gchar default_failure_template[] =
  * cockpit_web_response_headers() send the headers
  * cockpit_web_response_queue() send a block of data.
  * cockpit_web_response_complete() finish.
+ *
+ * The response is a #CockpitFlow and signals pressure while more than
+ * RESPONSE_PRESSURE bytes are queued and not yet written to the client.
  */
 
+/* Pressure is applied above this many queued bytes, and relieved below half */
+#define RESPONSE_PRESSURE (1024 * 1024)
+
 struct _CockpitWebResponse {
   GObject parent;
   GIOStream *io;
@@ -73,8 +80,10 @@ struct _CockpitWebResponse {
   /* The output queue */
   GPollableOutputStream *out;
   GQueue *queue;
+  gsize queued;
   gsize partial_offset;
   GSource *source;
+  gboolean pressure;
 
   /* Status flags */
   guint count;
@@ -93,7 +102,11 @@ typedef struct {
 
 static guint signal__done;
 
-G_DEFINE_TYPE (CockpitWebResponse, cockpit_web_response, G_TYPE_OBJECT);
+static void  cockpit_web_response_flow_iface_init (CockpitFlowIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (CockpitWebResponse, cockpit_web_response, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (COCKPIT_TYPE_FLOW, cockpit_web_response_flow_iface_init)
+);
 
 static void
 cockpit_web_response_init (CockpitWebResponse *self)
@@ -183,6 +196,19 @@ cockpit_web_response_class_init (CockpitWebResponseClass *klass)
                                G_TYPE_NONE, 1, G_TYPE_BOOLEAN);
 }
 
+static void
+cockpit_web_response_throttle (CockpitFlow *flow,
+                               CockpitFlow *controlling)
+{
+  /* A response doesn't read from anywhere, so has nothing to throttle */
+}
+
+static void
+cockpit_web_response_flow_iface_init (CockpitFlowIface *iface)
+{
+  iface->throttle = cockpit_web_response_throttle;
+}
+
 /**
  * cockpit_web_response_new:
  * @io: the stream to send on
@@ -374,6 +400,25 @@ on_output_flushed (GObject *stream,
   g_object_unref (self);
 }
 
+static void
+update_pressure (CockpitWebResponse *self)
+{
+  gboolean pressure;
+
+  if (self->pressure)
+    pressure = self->queued >= RESPONSE_PRESSURE / 2;
+  else
+    pressure = self->queued >= RESPONSE_PRESSURE;
+
+  if (pressure != self->pressure)
+    {
+      g_debug ("%s: %s back pressure on response", self->logname,
+               pressure ? "applying" : "relieving");
+      self->pressure = pressure;
+      cockpit_flow_emit_pressure (COCKPIT_FLOW (self), pressure);
+    }
+}
+
 static gboolean
 on_response_output (GObject *pollable,
                     gpointer user_data)
@@ -426,7 +471,9 @@ on_response_output (GObject *pollable,
           g_debug ("%s: sent %d bytes", self->logname, (int)len);
           self->partial_offset = 0;
           g_queue_pop_head (self->queue);
+          self->queued -= g_bytes_get_size (block);
           g_bytes_unref (block);
+          update_pressure (self);
         }
       else
         {
@@ -458,6 +505,7 @@ queue_bytes (CockpitWebResponse *self,
              GBytes *block)
 {
   g_queue_push_tail (self->queue, g_bytes_ref (block));
+  self->queued += g_bytes_get_size (block);
 
   self->count++;
 
@@ -0,0 +1,397 @@
+/*
+ * Copyright (c) 2018 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * Author: Stef Walter <stefw@redhat.com>
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include "retest/retest.h"
+
+#include "cockpitframe.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+static int
+temp_file (void)
+{
+  char path[] = "/tmp/test-frame.XXXXXX";
+  int fd;
+
+  fd = mkstemp (path);
+  assert (fd >= 0);
+  assert (unlink (path) == 0);
+  return fd;
+}
+
+static void
+write_raw (int fd,
+           const char *data)
+{
+  assert_num_eq (cockpit_fd_write_all (fd, (unsigned char *)data, strlen (data)), strlen (data));
+}
+
+static void
+test_write (void)
+{
+  char buffer[64];
+  ssize_t len;
+  int fd;
+
+  fd = temp_file ();
+  assert_num_eq (cockpit_frame_write (fd, (unsigned char *)"one", 3), 3);
+  assert_num_eq (cockpit_frame_write (fd, (unsigned char *)"second", 6), 6);
+
+  assert_num_eq (lseek (fd, 0, SEEK_SET), 0);
+  len = read (fd, buffer, sizeof (buffer) - 1);
+  assert_num_eq (len, 13);
+  buffer[len] = '\0';
+  assert_str_eq (buffer, "3\none6\nsecond");
+
+  close (fd);
+}
+
+static void
+test_read (void)
+{
+  unsigned char *output;
+  char buffer[64];
+  ssize_t len;
+  int fds[2];
+
+  assert (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  write_raw (fds[1], "5\nhello3\nabcextra");
+
+  len = cockpit_frame_read (fds[0], &output);
+  assert_num_eq (len, 5);
+  assert (memcmp (output, "hello", 5) == 0);
+  free (output);
+
+  /* Nothing past the frame must have been read */
+  len = read (fds[0], buffer, sizeof (buffer) - 1);
+  assert_num_eq (len, 10);
+  buffer[len] = '\0';
+  assert_str_eq (buffer, "3\nabcextra");
+
+  close (fds[0]);
+  close (fds[1]);
+}
+
+static void
+test_read_eof (void)
+{
+  unsigned char *output = NULL;
+  int fds[2];
+
+  assert (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  close (fds[1]);
+
+  assert_num_eq (cockpit_frame_read (fds[0], &output), 0);
+  assert_ptr_eq (output, NULL);
+
+  close (fds[0]);
+}
+
+static void
+test_read_bad (void)
+{
+  const char *inputs[] = { "x\nblah", "0\n", "123456789\n", "5\nhel", "5", NULL };
+  CockpitFrameReader reader;
+  unsigned char *output;
+  int fds[2];
+  int i;
+
+  for (i = 0; inputs[i] != NULL; i++)
+    {
+      assert (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+      write_raw (fds[1], inputs[i]);
+      shutdown (fds[1], SHUT_WR);
+
+      errno = 0;
+      assert_num_eq (cockpit_frame_read (fds[0], &output), -1);
+      assert_num_eq (errno, EBADMSG);
+
+      close (fds[0]);
+      close (fds[1]);
+
+      assert (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+      write_raw (fds[1], inputs[i]);
+      shutdown (fds[1], SHUT_WR);
+
+      cockpit_frame_reader_init (&reader, fds[0]);
+      errno = 0;
+      assert_num_eq (cockpit_frame_reader_read (&reader, &output), -1);
+      assert_num_eq (errno, EBADMSG);
+      cockpit_frame_reader_clear (&reader);
+
+      close (fds[0]);
+      close (fds[1]);
+    }
+}
+
+static void
+test_reader (void)
+{
+  CockpitFrameReader reader;
+  unsigned char *output;
+  ssize_t len;
+  int fds[2];
+
+  assert (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  write_raw (fds[1], "5\nhello3\nabc1\nxextra");
+
+  cockpit_frame_reader_init (&reader, fds[0]);
+
+  len = cockpit_frame_reader_read (&reader, &output);
+  assert_num_eq (len, 5);
+  assert (memcmp (output, "hello", 5) == 0);
+  free (output);
+
+  len = cockpit_frame_reader_read (&reader, &output);
+  assert_num_eq (len, 3);
+  assert (memcmp (output, "abc", 3) == 0);
+  free (output);
+
+  len = cockpit_frame_reader_read (&reader, &output);
+  assert_num_eq (len, 1);
+  assert (memcmp (output, "x", 1) == 0);
+  free (output);
+
+  /* The reader read ahead, the rest is left over */
+  len = cockpit_frame_reader_steal (&reader, &output);
+  assert_num_eq (len, 5);
+  assert (memcmp (output, "extra", 5) == 0);
+  free (output);
+
+  assert_num_eq (cockpit_frame_reader_steal (&reader, &output), 0);
+  assert_ptr_eq (output, NULL);
+
+  cockpit_frame_reader_clear (&reader);
+  close (fds[0]);
+  close (fds[1]);
+}
+
+static void
+test_reader_large (void)
+{
+  CockpitFrameReader reader = COCKPIT_FRAME_READER_INIT (-1);
+  unsigned char *input;
+  unsigned char *output;
+  size_t length = 100 * 1000;
+  ssize_t len;
+  int fd;
+
+  input = malloc (length);
+  assert (input != NULL);
+  memset (input, 'x', length);
+
+  fd = temp_file ();
+  assert_num_eq (cockpit_frame_write (fd, (unsigned char *)"small", 5), 5);
+  assert_num_eq (cockpit_frame_write (fd, input, length), length);
+  assert_num_eq (lseek (fd, 0, SEEK_SET), 0);
+
+  reader.fd = fd;
+
+  len = cockpit_frame_reader_read (&reader, &output);
+  assert_num_eq (len, 5);
+  free (output);
+
+  len = cockpit_frame_reader_read (&reader, &output);
+  assert_num_eq (len, length);
+  assert (memcmp (output, input, length) == 0);
+  free (output);
+
+  assert_num_eq (cockpit_frame_reader_read (&reader, &output), 0);
+
+  cockpit_frame_reader_clear (&reader);
+  free (input);
+  close (fd);
+}
+
+static long long
+count_read_syscalls (void)
+{
+  long long syscr = -1;
+  char line[128];
+  FILE *file;
+
+  file = fopen ("/proc/self/io", "r");
+  if (!file)
+    return -1;
+  while (fgets (line, sizeof (line), file))
+    {
+      if (sscanf (line, "syscr: %lld", &syscr) == 1)
+        break;
+    }
+  fclose (file);
+  return syscr;
+}
+
+static double
+now_usec (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+static void
+test_reader_syscalls (void)
+{
+  static const char payload[] = "\n{\"command\":\"ping\"}";
+  CockpitFrameReader reader;
+  unsigned char *output;
+  long long before, buffered;
+  int frames = 100;
+  int fd;
+  int i;
+
+  fd = temp_file ();
+  for (i = 0; i < frames; i++)
+    assert (cockpit_frame_write (fd, (unsigned char *)payload, sizeof (payload) - 1) > 0);
+  assert_num_eq (lseek (fd, 0, SEEK_SET), 0);
+
+  before = count_read_syscalls ();
+  if (before < 0)
+    {
+      close (fd);
+      re_test_skip ("no /proc/self/io syscall accounting");
+      return;
+    }
+
+  cockpit_frame_reader_init (&reader, fd);
+  for (i = 0; i < frames; i++)
+    {
+      assert_num_eq (cockpit_frame_reader_read (&reader, &output), sizeof (payload) - 1);
+      free (output);
+    }
+  buffered = count_read_syscalls () - before;
+  cockpit_frame_reader_clear (&reader);
+  close (fd);
+
+  /* All the frames fit in one buffer, plus the read of /proc/self/io itself */
+  assert_num_cmp (buffered, <=, 4);
+}
+
+static void
+test_benchmark (void)
+{
+  static const char payload[] = "\n{\"command\":\"authorize\",\"cookie\":\"session1234\",\"response\":\"Basic c2NydWZmeTp6ZXJvZw==\"}";
+  CockpitFrameReader reader;
+  unsigned char *output;
+  long long before, plain, buffered;
+  double start, plain_time, buffered_time;
+  int frames = 100000;
+  int fd;
+  int i;
+
+  /* Time and count the read() calls made while reading frames from a file */
+  fd = temp_file ();
+  for (i = 0; i < frames; i++)
+    assert (cockpit_frame_write (fd, (unsigned char *)payload, sizeof (payload) - 1) > 0);
+
+  assert_num_eq (lseek (fd, 0, SEEK_SET), 0);
+  before = count_read_syscalls ();
+  start = now_usec ();
+  for (i = 0; i < frames; i++)
+    {
+      assert_num_eq (cockpit_frame_read (fd, &output), sizeof (payload) - 1);
+      free (output);
+    }
+  plain_time = now_usec () - start;
+  plain = count_read_syscalls () - before;
+
+  assert_num_eq (lseek (fd, 0, SEEK_SET), 0);
+  cockpit_frame_reader_init (&reader, fd);
+  before = count_read_syscalls ();
+  start = now_usec ();
+  for (i = 0; i < frames; i++)
+    {
+      assert_num_eq (cockpit_frame_reader_read (&reader, &output), sizeof (payload) - 1);
+      free (output);
+    }
+  buffered_time = now_usec () - start;
+  buffered = count_read_syscalls () - before;
+  cockpit_frame_reader_clear (&reader);
+
+  close (fd);
+
+  printf ("# cockpit_frame_read: %.2f usec per frame\n", plain_time / frames);
+  printf ("# cockpit_frame_reader_read: %.2f usec per frame\n", buffered_time / frames);
+
+  if (before >= 0)
+    {
+      printf ("# cockpit_frame_read: %.2f syscalls per frame\n", (double)plain / frames);
+      printf ("# cockpit_frame_reader_read: %.2f syscalls per frame\n", (double)buffered / frames);
+    }
+}
+
+/* Like GLib tests, benchmarks only run with "-m perf" */
+static int
+perf_mode (int argc,
+           char *argv[])
+{
+  int i;
+
+  for (i = 1; i < argc - 1; i++)
+    {
+      if (strcmp (argv[i], "-m") == 0 && strcmp (argv[i + 1], "perf") == 0)
+        return 1;
+    }
+  return 0;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+  re_test (test_write, "/frame/write");
+  re_test (test_read, "/frame/read");
+  re_test (test_read_eof, "/frame/read-eof");
+  re_test (test_read_bad, "/frame/read-bad");
+  re_test (test_reader, "/frame/reader");
+  re_test (test_reader_large, "/frame/reader-large");
+  re_test (test_reader_syscalls, "/frame/reader-syscalls");
+
+  if (perf_mode (argc, argv))
+    re_test (test_benchmark, "/frame/benchmark");
+
+  return re_test_run (argc, argv);
+}
@@ -521,6 +521,7 @@ test_string_encode (gconstpointer data)
 {
   const FixtureString *fixture = data;
   JsonNode *node;
+  GString *buffer;
   gsize length;
   gchar *output;
 
@@ -530,6 +531,12 @@ test_string_encode (gconstpointer data)
   g_assert_cmpuint (length, ==, strlen (fixture->expect));
   g_free (output);
   json_node_free (node);
+
+  /* Streaming writers must produce the same thing */
+  buffer = g_string_new ("prefix:");
+  cockpit_json_append_string (buffer, fixture->str);
+  g_assert_cmpstr (buffer->str + 7, ==, fixture->expect);
+  g_string_free (buffer, TRUE);
 }
 
 static const gchar *patch_data =
@@ -658,6 +665,7 @@ static void
 test_write_infinite_nan (void)
 {
   JsonArray *array;
+  GString *buffer;
   gchar *string;
   JsonNode *node;
 
@@ -674,6 +682,13 @@ test_write_infinite_nan (void)
 
   json_node_free (node);
   g_free (string);
+
+  buffer = g_string_new ("");
+  cockpit_json_append_double (buffer, 3.0);
+  cockpit_json_append_double (buffer, 1.0/0.0);
+  cockpit_json_append_double (buffer, sqrt (-1));
+  g_assert_cmpstr (buffer->str, ==, "3nullnull");
+  g_string_free (buffer, TRUE);
 }
 
 int
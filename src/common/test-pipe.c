@@ -219,6 +219,8 @@ test_echo_queue (TestCase *tc,
 {
   MockEchoPipe *echo_pipe = (MockEchoPipe *)tc->pipe;
   GBytes *sent;
+  guint blocks;
+  gsize bytes;
 
   sent = g_bytes_new_static ("one", 3);
   cockpit_pipe_write (tc->pipe, sent);
@@ -227,6 +229,10 @@ test_echo_queue (TestCase *tc,
   cockpit_pipe_write (tc->pipe, sent);
   g_bytes_unref (sent);
 
+  cockpit_pipe_get_queued (tc->pipe, &blocks, &bytes);
+  g_assert_cmpuint (blocks, ==, 2);
+  g_assert_cmpuint (bytes, ==, 6);
+
   /* Only closes after above are sent */
   cockpit_pipe_close (tc->pipe, NULL);
 
@@ -235,6 +241,68 @@ test_echo_queue (TestCase *tc,
 
   g_assert_cmpint (echo_pipe->received->len, ==, 6);
   g_assert (memcmp (echo_pipe->received->data, "onetwo", 6) == 0);
+
+  /* Both blocks are gathered into one write */
+  cockpit_pipe_get_queued (tc->pipe, &blocks, &bytes);
+  g_assert_cmpuint (blocks, ==, 0);
+  g_assert_cmpuint (bytes, ==, 0);
+  g_assert_cmpuint (cockpit_pipe_get_write_count (tc->pipe), ==, 1);
+}
+
+static void
+write_static (CockpitPipe *pipe,
+              const gchar *data)
+{
+  GBytes *bytes = g_bytes_new_static (data, strlen (data));
+  cockpit_pipe_write (pipe, bytes);
+  g_bytes_unref (bytes);
+}
+
+static void
+test_echo_coalesce (TestCase *tc,
+                    gconstpointer data)
+{
+  MockEchoPipe *echo_pipe = (MockEchoPipe *)tc->pipe;
+  guint blocks;
+  gint i;
+
+  cockpit_pipe_set_coalesce (tc->pipe, 60 * G_USEC_PER_SEC);
+
+  /* Blocks written over several main loop iterations are held back */
+  write_static (tc->pipe, "one");
+  for (i = 0; i < 10; i++)
+    g_main_context_iteration (NULL, FALSE);
+  write_static (tc->pipe, "two");
+  for (i = 0; i < 10; i++)
+    g_main_context_iteration (NULL, FALSE);
+
+  cockpit_pipe_get_queued (tc->pipe, &blocks, NULL);
+  g_assert_cmpuint (blocks, ==, 2);
+  g_assert_cmpuint (cockpit_pipe_get_write_count (tc->pipe), ==, 0);
+
+  /* And go out together once flushed */
+  cockpit_pipe_flush (tc->pipe);
+  while (echo_pipe->received->len < 6)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert (memcmp (echo_pipe->received->data, "onetwo", 6) == 0);
+  g_assert_cmpuint (cockpit_pipe_get_write_count (tc->pipe), ==, 1);
+
+  /* The budget runs out on its own */
+  cockpit_pipe_set_coalesce (tc->pipe, 1000);
+  write_static (tc->pipe, "three");
+  write_static (tc->pipe, "four");
+  while (echo_pipe->received->len < 15)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpuint (cockpit_pipe_get_write_count (tc->pipe), ==, 2);
+
+  /* Closing sends what is held back */
+  cockpit_pipe_set_coalesce (tc->pipe, 60 * G_USEC_PER_SEC);
+  write_static (tc->pipe, "five");
+  cockpit_pipe_close (tc->pipe, NULL);
+  while (!echo_pipe->closed)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpstr (echo_pipe->problem, ==, NULL);
+  g_assert_cmpint (echo_pipe->received->len, ==, 19);
 }
 
 static const TestFixture fixture_no_timeout = {
@@ -1189,6 +1257,8 @@ main (int argc,
               setup_simple, test_echo_and_close, teardown);
   g_test_add ("/pipe/echo-queue", TestCase, NULL,
               setup_simple, test_echo_queue, teardown);
+  g_test_add ("/pipe/echo-coalesce", TestCase, NULL,
+              setup_simple, test_echo_coalesce, teardown);
   g_test_add ("/pipe/echo-large", TestCase, &fixture_no_timeout,
               setup_simple, test_echo_large, teardown);
   g_test_add ("/pipe/close-problem", TestCase, NULL,
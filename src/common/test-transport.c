@@ -20,9 +20,11 @@
 #include "config.h"
 
 #include "cockpittransport.h"
+#include "cockpitframe.h"
 #include "cockpitpipe.h"
 #include "cockpitpipetransport.h"
 
+#include "common/cockpitjson.h"
 #include "common/cockpittest.h"
 
 #include "websocket/websocket.h"
@@ -473,6 +475,909 @@ test_incorrect_protocol (void)
   cockpit_assert_expected ();
 }
 
+static gboolean
+on_channel_recv_count (CockpitTransport *transport,
+                       const gchar *channel,
+                       GBytes *data,
+                       gpointer user_data)
+{
+  gint *count = user_data;
+  (*count)++;
+  return TRUE;
+}
+
+static gboolean
+on_channel_control_count (CockpitTransport *transport,
+                          const gchar *command,
+                          const gchar *channel,
+                          JsonObject *options,
+                          GBytes *data,
+                          gpointer user_data)
+{
+  gint *count = user_data;
+  (*count)++;
+  return TRUE;
+}
+
+static gboolean
+on_recv_count (CockpitTransport *transport,
+               const gchar *channel,
+               GBytes *data,
+               gpointer user_data)
+{
+  gint *count = user_data;
+  (*count)++;
+  return TRUE;
+}
+
+static void
+test_channel_dispatch (TestCase *tc,
+                       gconstpointer data)
+{
+  JsonObject *options;
+  GBytes *payload;
+  gint direct = 0;
+  gint controls = 0;
+  gint fallback = 0;
+
+  payload = g_bytes_new_static ("blah", 4);
+  options = cockpit_transport_build_json ("command", "ready", "channel", "a", NULL);
+
+  g_signal_connect (tc->transport, "recv", G_CALLBACK (on_recv_count), &fallback);
+  cockpit_transport_add_channel (tc->transport, "a", on_channel_recv_count,
+                                 on_channel_control_count, &direct);
+
+  cockpit_transport_emit_recv (tc->transport, "a", payload);
+  cockpit_transport_emit_recv (tc->transport, "a", payload);
+  cockpit_transport_emit_recv (tc->transport, "b", payload);
+  g_assert_cmpint (direct, ==, 2);
+  g_assert_cmpint (fallback, ==, 1);
+
+  cockpit_transport_add_channel (tc->transport, "c", NULL,
+                                 on_channel_control_count, &controls);
+  cockpit_transport_emit_control (tc->transport, "ready", "c", options, payload);
+  cockpit_transport_emit_recv (tc->transport, "c", payload);
+  g_assert_cmpint (controls, ==, 1);
+  g_assert_cmpint (fallback, ==, 2);
+
+  /* Frozen messages are dispatched to the handler on thaw */
+  cockpit_transport_freeze (tc->transport, "a");
+  cockpit_transport_emit_recv (tc->transport, "a", payload);
+  g_assert_cmpint (direct, ==, 2);
+  cockpit_transport_thaw (tc->transport, "a");
+  g_assert_cmpint (direct, ==, 3);
+
+  cockpit_transport_remove_channel (tc->transport, "a");
+  cockpit_transport_remove_channel (tc->transport, "c");
+  cockpit_transport_emit_recv (tc->transport, "a", payload);
+  g_assert_cmpint (direct, ==, 3);
+  g_assert_cmpint (fallback, ==, 3);
+
+  json_object_unref (options);
+  g_bytes_unref (payload);
+}
+
+static void
+test_channel_dispatch_perf (TestCase *tc,
+                            gconstpointer data)
+{
+  const gint sizes[] = { 10, 100, 1000, 10000 };
+  const gint messages = 100000;
+  GBytes *payload;
+  gchar channel[16];
+  gdouble elapsed;
+  gint count;
+  gint i, j;
+
+  payload = g_bytes_new_static ("blah", 4);
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    {
+      count = 0;
+      for (j = 0; j < sizes[i]; j++)
+        {
+          g_snprintf (channel, sizeof (channel), "%d", j);
+          cockpit_transport_add_channel (tc->transport, channel, on_channel_recv_count, NULL, &count);
+        }
+
+      g_test_timer_start ();
+      for (j = 0; j < messages; j++)
+        {
+          g_snprintf (channel, sizeof (channel), "%d", j % sizes[i]);
+          cockpit_transport_emit_recv (tc->transport, channel, payload);
+        }
+      elapsed = g_test_timer_elapsed ();
+
+      g_assert_cmpint (count, ==, messages);
+      g_test_message ("%d channels: %.1f ns per message", sizes[i], (elapsed * 1000000000) / messages);
+
+      for (j = 0; j < sizes[i]; j++)
+        {
+          g_snprintf (channel, sizeof (channel), "%d", j);
+          cockpit_transport_remove_channel (tc->transport, channel);
+        }
+    }
+
+  g_bytes_unref (payload);
+}
+
+static GByteArray *
+build_frames (gsize payload_size,
+              gsize total_size)
+{
+  GByteArray *input;
+  gchar *prefix;
+  guint8 *payload;
+
+  payload = g_malloc (payload_size);
+  memset (payload, 'x', payload_size);
+  prefix = g_strdup_printf ("%" G_GSIZE_FORMAT "\na\n", payload_size + 2);
+
+  input = g_byte_array_new ();
+  while (input->len < total_size)
+    {
+      g_byte_array_append (input, (guint8 *)prefix, strlen (prefix));
+      g_byte_array_append (input, payload, payload_size);
+    }
+
+  /* And a partial frame at the end, as with a real read */
+  g_byte_array_append (input, (guint8 *)prefix, strlen (prefix));
+
+  g_free (prefix);
+  g_free (payload);
+  return input;
+}
+
+static void
+read_frames_copying (CockpitTransport *transport,
+                     GByteArray *input)
+{
+  GBytes *message;
+  GBytes *payload;
+  gchar *channel;
+  gssize size;
+  gsize i;
+
+  /* How cockpit_transport_read_from_pipe() used to consume each frame */
+  for (;;)
+    {
+      size = cockpit_frame_parse (input->data, input->len, &i);
+      if (size <= 0 || input->len < i + size)
+        break;
+      message = cockpit_pipe_consume (input, i, size, 0);
+      payload = cockpit_transport_parse_frame (message, &channel);
+      cockpit_transport_emit_recv (transport, channel, payload);
+      g_bytes_unref (payload);
+      g_bytes_unref (message);
+      g_free (channel);
+    }
+}
+
+static void
+test_read_partial (TestCase *tc,
+                   gconstpointer data)
+{
+  GByteArray *input;
+  gboolean closed = FALSE;
+  gint count = 0;
+
+  cockpit_transport_add_channel (tc->transport, "a", on_channel_recv_count, NULL, &count);
+
+  /* Two 15 byte frames, and the 5 byte prefix of a third */
+  input = build_frames (10, 30);
+  g_assert_cmpuint (input->len, ==, 35);
+
+  cockpit_transport_read_from_pipe (tc->transport, "test", tc->pipe, &closed, input, FALSE);
+  g_assert (!closed);
+  g_assert_cmpint (count, ==, 2);
+  g_assert_cmpuint (input->len, ==, 5);
+  g_assert (memcmp (input->data, "12\na\n", 5) == 0);
+
+  g_byte_array_append (input, (const guint8 *)"xxxxxxxxxx", 10);
+  cockpit_transport_read_from_pipe (tc->transport, "test", tc->pipe, &closed, input, FALSE);
+  g_assert (!closed);
+  g_assert_cmpint (count, ==, 3);
+  g_assert_cmpuint (input->len, ==, 0);
+
+  g_byte_array_unref (input);
+  cockpit_transport_remove_channel (tc->transport, "a");
+}
+
+static void
+test_read_frames_perf (TestCase *tc,
+                       gconstpointer data)
+{
+  const gsize sizes[] = { 8, 100, 1000, 16 * 1024 };
+  const gsize total = 60 * 1024;
+  const gint rounds = 200;
+  GByteArray *input;
+  gboolean closed = FALSE;
+  gdouble copying, slicing;
+  gint count;
+  gint frames;
+  gint i, j;
+
+  cockpit_transport_add_channel (tc->transport, "a", on_channel_recv_count, NULL, &count);
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    {
+      count = 0;
+      copying = slicing = 0;
+      for (j = 0; j < rounds; j++)
+        {
+          input = build_frames (sizes[i], total);
+          g_test_timer_start ();
+          read_frames_copying (tc->transport, input);
+          copying += g_test_timer_elapsed ();
+          g_byte_array_unref (input);
+
+          input = build_frames (sizes[i], total);
+          g_test_timer_start ();
+          cockpit_transport_read_from_pipe (tc->transport, "test", tc->pipe, &closed, input, FALSE);
+          slicing += g_test_timer_elapsed ();
+          g_byte_array_unref (input);
+        }
+
+      g_assert (!closed);
+      g_assert (count % 2 == 0);
+      frames = count / 2;
+
+      g_test_message ("%" G_GSIZE_FORMAT " byte frames: copying %.1f MB/s, slicing %.1f MB/s",
+                      sizes[i], (frames * sizes[i]) / (copying * 1024 * 1024),
+                      (frames * sizes[i]) / (slicing * 1024 * 1024));
+    }
+
+  cockpit_transport_remove_channel (tc->transport, "a");
+}
+
+static void
+test_write_batch_perf (TestCase *tc,
+                       gconstpointer data)
+{
+  const gint messages = 10000;
+  GBytes *payload;
+  guint64 writes;
+  gdouble elapsed;
+  guint blocks;
+  gsize bytes;
+  gint count = 0;
+  gint i;
+
+  /* The pipe writes back to itself, like the bridge's stdout with many small messages */
+  payload = g_bytes_new_static ("{\"metric\":[1,2,3]}", 18);
+  cockpit_transport_add_channel (tc->transport, "a", on_channel_recv_count, NULL, &count);
+
+  writes = cockpit_pipe_get_write_count (tc->pipe);
+  g_test_timer_start ();
+
+  for (i = 0; i < messages; i++)
+    cockpit_transport_send (tc->transport, "a", payload);
+
+  cockpit_pipe_get_queued (tc->pipe, &blocks, &bytes);
+  g_assert_cmpuint (blocks, ==, messages * 2);
+  g_assert_cmpuint (bytes, >, messages * 18);
+
+  WAIT_UNTIL (count == messages);
+  elapsed = g_test_timer_elapsed ();
+  writes = cockpit_pipe_get_write_count (tc->pipe) - writes;
+
+  cockpit_pipe_get_queued (tc->pipe, &blocks, &bytes);
+  g_assert_cmpuint (blocks, ==, 0);
+  g_assert_cmpuint (bytes, ==, 0);
+
+  g_test_message ("%d messages: %" G_GUINT64_FORMAT " writes, %.1f ms",
+                  messages, writes, elapsed * 1000);
+
+  cockpit_transport_remove_channel (tc->transport, "a");
+  g_bytes_unref (payload);
+}
+
+static void
+test_coalesce (TestCase *tc,
+               gconstpointer data)
+{
+  GBytes *payload;
+  GBytes *control;
+  gint count = 0;
+  gint controls = 0;
+  gint i;
+
+  payload = g_bytes_new_static ("{\"metric\":[1,2,3]}", 18);
+  control = cockpit_transport_build_control ("command", "ping", NULL);
+  cockpit_transport_add_channel (tc->transport, "a", on_channel_recv_count, NULL, &count);
+  g_signal_connect (tc->transport, "control", G_CALLBACK (on_channel_control_count), &controls);
+
+  cockpit_pipe_set_coalesce (tc->pipe, 60 * G_USEC_PER_SEC);
+
+  /* Messages from several main loop iterations are held back */
+  for (i = 0; i < 3; i++)
+    {
+      cockpit_transport_send (tc->transport, "a", payload);
+      while (g_main_context_iteration (NULL, FALSE));
+    }
+  g_assert_cmpint (count, ==, 0);
+  g_assert_cmpuint (cockpit_pipe_get_write_count (tc->pipe), ==, 0);
+
+  /* A control message sends them all right away, in one write */
+  cockpit_transport_send (tc->transport, NULL, control);
+  WAIT_UNTIL (count == 3 && controls == 1);
+  g_assert_cmpuint (cockpit_pipe_get_write_count (tc->pipe), ==, 1);
+
+  g_signal_handlers_disconnect_by_func (tc->transport, on_channel_control_count, &controls);
+  cockpit_transport_remove_channel (tc->transport, "a");
+  g_bytes_unref (control);
+  g_bytes_unref (payload);
+}
+
+typedef struct {
+  CockpitTransport *transport;
+  GBytes *payload;
+  gchar *channel;
+} Ticker;
+
+static gboolean
+on_ticker_send (gpointer user_data)
+{
+  Ticker *ticker = user_data;
+  cockpit_transport_send (ticker->transport, ticker->channel, ticker->payload);
+  return TRUE;
+}
+
+static void
+test_coalesce_perf (TestCase *tc,
+                    gconstpointer data)
+{
+  const gint64 budgets[] = { 0, 1000, 5000, 20000 };
+  Ticker tickers[50];
+  guint sources[G_N_ELEMENTS (tickers)];
+  guint64 writes;
+  gint64 start;
+  gdouble seconds;
+  guint wakeups;
+  gint count;
+  guint i, j;
+
+  /*
+   * A busy dashboard: metrics, D-Bus notifications and process output
+   * arriving on many channels, each at its own pace.
+   */
+  for (i = 0; i < G_N_ELEMENTS (tickers); i++)
+    {
+      tickers[i].transport = tc->transport;
+      tickers[i].channel = g_strdup_printf ("%u", i);
+      tickers[i].payload = g_bytes_new_static ("[[1024,2048,4096],[0.5,0.25]]", 29);
+      cockpit_transport_add_channel (tc->transport, tickers[i].channel, on_channel_recv_count, NULL, &count);
+    }
+
+  for (j = 0; j < G_N_ELEMENTS (budgets); j++)
+    {
+      cockpit_pipe_set_coalesce (tc->pipe, budgets[j]);
+      for (i = 0; i < G_N_ELEMENTS (tickers); i++)
+        sources[i] = g_timeout_add (10 + (i * 7) % 90, on_ticker_send, tickers + i);
+
+      count = 0;
+      wakeups = 0;
+      writes = cockpit_pipe_get_write_count (tc->pipe);
+      start = g_get_monotonic_time ();
+      while (g_get_monotonic_time () - start < G_USEC_PER_SEC)
+        {
+          g_main_context_iteration (NULL, TRUE);
+          wakeups++;
+        }
+
+      for (i = 0; i < G_N_ELEMENTS (tickers); i++)
+        g_source_remove (sources[i]);
+      cockpit_pipe_flush (tc->pipe);
+      while (g_main_context_iteration (NULL, FALSE));
+
+      seconds = (g_get_monotonic_time () - start) / (gdouble)G_USEC_PER_SEC;
+      writes = cockpit_pipe_get_write_count (tc->pipe) - writes;
+      g_test_message ("%" G_GINT64_FORMAT " usec budget: %d messages, %.0f writes/s, %.0f wakeups/s",
+                      budgets[j], count, writes / seconds, wakeups / seconds);
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (tickers); i++)
+    {
+      cockpit_transport_remove_channel (tc->transport, tickers[i].channel);
+      g_bytes_unref (tickers[i].payload);
+      g_free (tickers[i].channel);
+    }
+}
+
+/*
+ * A sender and receiver with a relay in between, like cockpit-ssh,
+ * which keeps a copy of every byte that crosses it.
+ */
+typedef struct {
+  CockpitTransport *sender;
+  CockpitTransport *receiver;
+  CockpitPipe *relay;
+  GByteArray *wire;
+} TestRelay;
+
+static void
+on_relay_read (CockpitPipe *pipe,
+               GByteArray *input,
+               gboolean end_of_data,
+               gpointer user_data)
+{
+  GByteArray *wire = user_data;
+  GBytes *bytes;
+
+  if (input->len == 0)
+    return;
+
+  g_byte_array_append (wire, input->data, input->len);
+  bytes = cockpit_pipe_consume (input, 0, input->len, 0);
+  cockpit_pipe_write (pipe, bytes);
+  g_bytes_unref (bytes);
+}
+
+static void
+setup_relay (TestRelay *tr,
+             gconstpointer data)
+{
+  int one[2];
+  int two[2];
+
+  if (socketpair (PF_LOCAL, SOCK_STREAM, 0, one) < 0 ||
+      socketpair (PF_LOCAL, SOCK_STREAM, 0, two) < 0)
+    g_assert_not_reached ();
+
+  tr->wire = g_byte_array_new ();
+  tr->sender = cockpit_pipe_transport_new_fds ("sender", one[0], one[0]);
+  tr->relay = cockpit_pipe_new ("relay", one[1], two[0]);
+  tr->receiver = cockpit_pipe_transport_new_fds ("receiver", two[1], two[1]);
+  g_signal_connect (tr->relay, "read", G_CALLBACK (on_relay_read), tr->wire);
+}
+
+static void
+teardown_relay (TestRelay *tr,
+                gconstpointer data)
+{
+  cockpit_assert_expected ();
+
+  g_signal_handlers_disconnect_by_func (tr->relay, on_relay_read, tr->wire);
+  g_object_unref (tr->sender);
+  g_object_unref (tr->receiver);
+  g_object_unref (tr->relay);
+  g_byte_array_unref (tr->wire);
+}
+
+typedef struct {
+  GPtrArray *expected;
+  guint received;
+} Expected;
+
+static gboolean
+on_recv_expected (CockpitTransport *transport,
+                  const gchar *channel,
+                  GBytes *payload,
+                  gpointer user_data)
+{
+  Expected *ex = user_data;
+
+  g_assert_cmpstr (channel, ==, "4:1");
+  g_assert_cmpuint (ex->received, <, ex->expected->len);
+  g_assert (g_bytes_equal (payload, ex->expected->pdata[ex->received]));
+  ex->received++;
+  return TRUE;
+}
+
+/* D-Bus notifications, package manifests and small acknowledgements */
+static GPtrArray *
+build_typical_traffic (void)
+{
+  static const gchar *units[] = {
+    "sshd", "cockpit", "NetworkManager", "systemd-journald", "firewalld",
+    "chronyd", "crond", "dbus", "polkit", "rsyslog", "tuned", "udisks2",
+  };
+  static const gchar *states[] = { "active", "running", "inactive", "dead" };
+  GPtrArray *messages;
+  gchar *data;
+  gint i;
+
+  messages = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+
+  for (i = 0; i < 2000; i++)
+    {
+      if (i % 10 == 0)
+        {
+          data = g_strdup_printf ("{\"version\":0,\"menu\":{\"index\":{\"label\":\"Package %d\",\"order\":%d}},"
+                                  "\"content-security-policy\":\"default-src 'self'; connect-src 'self' ws: wss:\","
+                                  "\"requires\":{\"cockpit\":\"122\"},\"tools\":{\"index\":{\"label\":\"Tool %d\"}}}",
+                                  i, i, i);
+        }
+      else if (i % 5 == 0)
+        {
+          data = g_strdup_printf ("[%d]", i);
+        }
+      else
+        {
+          data = g_strdup_printf ("{\"notify\":{\"/org/freedesktop/systemd1/unit/%s_2eservice\":"
+                                  "{\"org.freedesktop.systemd1.Unit\":{\"ActiveState\":\"%s\",\"SubState\":\"%s\","
+                                  "\"Description\":\"The %s service\",\"LoadState\":\"loaded\","
+                                  "\"UnitFileState\":\"enabled\",\"ActiveEnterTimestamp\":%d}}}}",
+                                  units[i % G_N_ELEMENTS (units)], states[i % 2], states[(i % 2) + 1],
+                                  units[i % G_N_ELEMENTS (units)], 1500000000 + i);
+        }
+      g_ptr_array_add (messages, g_bytes_new_take (data, strlen (data)));
+    }
+
+  return messages;
+}
+
+static gsize
+send_typical_traffic (TestRelay *tr,
+                      gboolean compress)
+{
+  Expected ex = { NULL, 0 };
+  gulong sig;
+  guint i;
+
+  ex.expected = build_typical_traffic ();
+  sig = g_signal_connect (tr->receiver, "recv", G_CALLBACK (on_recv_expected), &ex);
+
+  g_byte_array_set_size (tr->wire, 0);
+  cockpit_pipe_transport_set_compression (COCKPIT_PIPE_TRANSPORT (tr->sender), compress);
+
+  for (i = 0; i < ex.expected->len; i++)
+    cockpit_transport_send (tr->sender, "4:1", ex.expected->pdata[i]);
+
+  WAIT_UNTIL (ex.received == ex.expected->len);
+
+  g_signal_handler_disconnect (tr->receiver, sig);
+  g_ptr_array_unref (ex.expected);
+  return tr->wire->len;
+}
+
+static void
+test_compression (TestRelay *tr,
+                  gconstpointer data)
+{
+  gsize plain;
+  gsize compressed;
+
+  plain = send_typical_traffic (tr, FALSE);
+  compressed = send_typical_traffic (tr, TRUE);
+
+  g_test_message ("%" G_GSIZE_FORMAT " bytes plain, %" G_GSIZE_FORMAT " bytes compressed",
+                  plain, compressed);
+  g_assert_cmpuint (compressed * 4, <, plain);
+
+  /* The stream carries on across later messages */
+  g_assert_cmpuint (send_typical_traffic (tr, TRUE), <, compressed);
+}
+
+static void
+test_compression_threshold (TestRelay *tr,
+                            gconstpointer data)
+{
+  Expected ex = { NULL, 0 };
+  GBytes *large;
+  gchar *string;
+
+  ex.expected = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  g_ptr_array_add (ex.expected, g_bytes_new_static ("[1,2,3]", 7));
+  string = g_strnfill (1000, 'x');
+  large = g_bytes_new_take (string, 1000);
+  g_ptr_array_add (ex.expected, large);
+
+  g_signal_connect (tr->receiver, "recv", G_CALLBACK (on_recv_expected), &ex);
+  cockpit_pipe_transport_set_compression (COCKPIT_PIPE_TRANSPORT (tr->sender), TRUE);
+  g_assert (cockpit_pipe_transport_get_compression (COCKPIT_PIPE_TRANSPORT (tr->sender)));
+
+  /* Small messages go as they are */
+  cockpit_transport_send (tr->sender, "4:1", ex.expected->pdata[0]);
+  WAIT_UNTIL (ex.received == 1);
+  g_assert_cmpuint (tr->wire->len, ==, 14);
+  g_assert (memcmp (tr->wire->data, "11\n4:1\n[1,2,3]", 14) == 0);
+
+  /* Larger ones are marked and compressed */
+  cockpit_transport_send (tr->sender, "4:1", large);
+  WAIT_UNTIL (ex.received == 2);
+  g_assert_cmpuint (tr->wire->len, <, 14 + 100);
+  g_assert (memchr (tr->wire->data + 14, '\n', 4) != NULL);
+  g_assert (((gchar *)memchr (tr->wire->data + 14, '\n', 4))[1] == '\0');
+
+  g_signal_handlers_disconnect_by_func (tr->receiver, on_recv_expected, &ex);
+  g_ptr_array_unref (ex.expected);
+}
+
+static void
+test_compression_control (TestRelay *tr,
+                          gconstpointer data)
+{
+  GString *control;
+  GBytes *payload;
+  gsize expected;
+
+  cockpit_pipe_transport_set_compression (COCKPIT_PIPE_TRANSPORT (tr->sender), TRUE);
+
+  /* Large enough to be compressed if it were a channel message */
+  control = g_string_new ("{\"command\":\"authorize\",\"cookie\":\"xxx\",\"response\":\"");
+  while (control->len < 1000)
+    g_string_append (control, "secret");
+  g_string_append (control, "\"}");
+  payload = g_bytes_new_take (control->str, control->len);
+  expected = control->len + 1;
+  g_string_free (control, FALSE);
+
+  cockpit_transport_send (tr->sender, NULL, payload);
+  WAIT_UNTIL (tr->wire->len >= expected);
+
+  /* Sent as is, and never marked as compressed */
+  g_assert (memmem (tr->wire->data, tr->wire->len,
+                    g_bytes_get_data (payload, NULL), g_bytes_get_size (payload)) != NULL);
+  g_assert (memchr (tr->wire->data, '\0', tr->wire->len) == NULL);
+
+  g_bytes_unref (payload);
+}
+
+static void
+test_compression_wire (TestRelay *tr,
+                       gconstpointer data)
+{
+  CockpitTransportStats sent;
+  CockpitTransportStats received;
+  gsize compressed;
+
+  compressed = send_typical_traffic (tr, TRUE);
+
+  cockpit_transport_get_stats (tr->sender, &sent);
+  cockpit_transport_get_stats (tr->receiver, &received);
+
+  /* The wire bytes show how much the compression saved */
+  g_assert_cmpuint (sent.tx_wire_bytes, ==, compressed);
+  g_assert_cmpuint (sent.tx_wire_bytes * 2, <, sent.tx_bytes);
+  g_assert_cmpuint (received.rx_wire_bytes, ==, compressed);
+  g_assert_cmpuint (received.rx_bytes, ==, sent.tx_bytes);
+}
+
+static gsize
+send_compressed (TestRelay *tr,
+                 const gchar *channel,
+                 GBytes *payload,
+                 gint *count)
+{
+  gsize before = tr->wire->len;
+  gint received = *count;
+
+  cockpit_transport_send (tr->sender, channel, payload);
+  WAIT_UNTIL (*count == received + 1);
+  return tr->wire->len - before;
+}
+
+static void
+test_compression_channels (TestRelay *tr,
+                           gconstpointer data)
+{
+  GBytes *secret;
+  GString *string;
+  GRand *rand;
+  gint count = 0;
+  gint i;
+
+  /* Hex digits compress, but not much against themselves */
+  rand = g_rand_new_with_seed (7);
+  string = g_string_new ("");
+  for (i = 0; i < 1000; i++)
+    g_string_append_c (string, "0123456789abcdef"[g_rand_int_range (rand, 0, 16)]);
+  g_rand_free (rand);
+  secret = g_bytes_new_take (string->str, string->len);
+  g_string_free (string, FALSE);
+
+  g_signal_connect (tr->receiver, "recv", G_CALLBACK (on_channel_recv_count), &count);
+  cockpit_pipe_transport_set_compression (COCKPIT_PIPE_TRANSPORT (tr->sender), TRUE);
+
+  g_assert_cmpuint (send_compressed (tr, "4:1", secret, &count), >, 400);
+
+  /* The same channel refers back to what it sent before */
+  g_assert_cmpuint (send_compressed (tr, "4:1", secret, &count), <, 100);
+
+  /* But another channel can't */
+  g_assert_cmpuint (send_compressed (tr, "4:2", secret, &count), >, 400);
+
+  g_signal_handlers_disconnect_by_func (tr->receiver, on_channel_recv_count, &count);
+  g_bytes_unref (secret);
+}
+
+static void
+test_compression_invalid (TestRelay *tr,
+                          gconstpointer data)
+{
+  gchar *problem = NULL;
+  GBytes *bytes;
+
+  cockpit_expect_message ("receiver: received invalid compressed message*");
+
+  g_signal_connect (tr->receiver, "closed", G_CALLBACK (on_closed_get_problem), &problem);
+
+  /* Not a zlib stream */
+  bytes = g_bytes_new_static ("6\n\0abcde", 8);
+  cockpit_pipe_write (tr->relay, bytes);
+  g_bytes_unref (bytes);
+
+  WAIT_UNTIL (problem != NULL);
+
+  g_assert_cmpstr (problem, ==, "protocol-error");
+  g_free (problem);
+}
+
+static void
+test_intern_channel (void)
+{
+  const gchar *one;
+  const gchar *two;
+
+  one = cockpit_transport_intern_channel ("55", -1);
+  g_assert_cmpstr (one, ==, "55");
+
+  two = cockpit_transport_intern_channel ("555", 2);
+  g_assert (one == two);
+  cockpit_transport_release_channel (two);
+
+  two = cockpit_transport_intern_channel ("555", -1);
+  g_assert (one != two);
+  g_assert_cmpstr (two, ==, "555");
+  cockpit_transport_release_channel (two);
+
+  cockpit_transport_release_channel (one);
+  g_assert (cockpit_transport_find_channel ("55") == NULL);
+}
+
+static void
+test_lookup_channel (void)
+{
+  GHashTable *table;
+  const gchar *interned;
+  gchar copy[] = "77";
+
+  table = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                 (GDestroyNotify)cockpit_transport_release_channel, NULL);
+
+  interned = cockpit_transport_intern_channel ("77", -1);
+  g_hash_table_insert (table, (gpointer)interned, "value");
+
+  /* Found both by interned pointer and by a copy of the string */
+  g_assert_cmpstr (cockpit_transport_lookup_channel (table, interned), ==, "value");
+  g_assert_cmpstr (cockpit_transport_lookup_channel (table, copy), ==, "value");
+  g_assert (cockpit_transport_find_channel (copy) == interned);
+
+  g_assert (cockpit_transport_lookup_channel (table, "78") == NULL);
+  g_assert (cockpit_transport_lookup_channel (table, NULL) == NULL);
+
+  g_assert (g_hash_table_remove (table, cockpit_transport_find_channel (copy)));
+  g_assert (cockpit_transport_find_channel (copy) == NULL);
+  g_assert (cockpit_transport_lookup_channel (table, copy) == NULL);
+
+  g_hash_table_destroy (table);
+}
+
+static void
+test_parse_frame_intern (TestCase *tc,
+                         gconstpointer data)
+{
+  const gchar *interned;
+  const gchar *channel;
+  gsize channel_len;
+  GBytes *message;
+  GBytes *payload;
+  gint count = 0;
+  gint i;
+
+  message = g_bytes_new_static ("546\ntest", 8);
+
+  /* An open channel's id is shared with every message */
+  cockpit_transport_add_channel (tc->transport, "546", on_channel_recv_count, NULL, &count);
+  interned = cockpit_transport_intern_channel ("546", -1);
+
+  for (i = 0; i < 3; i++)
+    {
+      payload = cockpit_transport_parse_frame_intern (tc->transport, message, &channel, &channel_len);
+      g_assert (payload != NULL);
+      g_assert (channel == interned);
+      g_assert_cmpuint (channel_len, ==, 3);
+      g_assert_cmpuint (g_bytes_get_size (payload), ==, 4);
+      g_assert (memcmp (g_bytes_get_data (payload, NULL), "test", 4) == 0);
+      cockpit_transport_emit_recv (tc->transport, channel, payload);
+      g_bytes_unref (payload);
+    }
+
+  g_assert_cmpint (count, ==, 3);
+  cockpit_transport_remove_channel (tc->transport, "546");
+  cockpit_transport_release_channel (interned);
+  g_bytes_unref (message);
+
+  /* Ids of channels that aren't open are never interned, nor copied */
+  message = g_bytes_new_static ("546\ntest", 8);
+  for (i = 0; i < 3; i++)
+    {
+      payload = cockpit_transport_parse_frame_intern (tc->transport, message, &channel, &channel_len);
+      g_assert (payload != NULL);
+      g_assert (channel == NULL);
+      g_assert_cmpuint (channel_len, ==, 3);
+      g_assert (cockpit_transport_find_channel ("546") == NULL);
+      g_bytes_unref (payload);
+    }
+
+  g_bytes_unref (message);
+
+  /* Another channel replaces the one that was last seen */
+  message = g_bytes_new_static ("547\ntest", 8);
+  interned = cockpit_transport_intern_channel ("547", -1);
+  payload = cockpit_transport_parse_frame_intern (tc->transport, message, &channel, &channel_len);
+  g_assert (channel == interned);
+  g_bytes_unref (payload);
+  g_bytes_unref (message);
+
+  message = g_bytes_new_static ("548\ntest", 8);
+  payload = cockpit_transport_parse_frame_intern (tc->transport, message, &channel, &channel_len);
+  g_assert (channel == NULL);
+  g_bytes_unref (payload);
+  g_bytes_unref (message);
+
+  /* Still held as the last one seen, until the next frame for it */
+  cockpit_transport_release_channel (interned);
+  g_assert (cockpit_transport_find_channel ("547") != NULL);
+  message = g_bytes_new_static ("547\ntest", 8);
+  payload = cockpit_transport_parse_frame_intern (tc->transport, message, &channel, &channel_len);
+  g_assert (channel == NULL);
+  g_assert (cockpit_transport_find_channel ("547") == NULL);
+  g_bytes_unref (payload);
+  g_bytes_unref (message);
+
+  /* Control messages have no channel */
+  message = g_bytes_new_static ("\n{}", 3);
+  payload = cockpit_transport_parse_frame_intern (tc->transport, message, &channel, &channel_len);
+  g_assert (payload != NULL);
+  g_assert (channel == NULL);
+  g_assert_cmpuint (channel_len, ==, 0);
+  g_bytes_unref (payload);
+  g_bytes_unref (message);
+}
+
+static void
+test_parse_frame_perf (TestCase *tc,
+                       gconstpointer data)
+{
+  const gint messages = 1000000;
+  const gchar *interned;
+  const gchar *channel;
+  gsize channel_len;
+  gchar *copied;
+  GBytes *message;
+  GBytes *payload;
+  gdouble elapsed;
+  gint i;
+
+  message = g_bytes_new_static ("1:546\n{\"metric\":[1,2,3]}", 24);
+  interned = cockpit_transport_intern_channel ("1:546", -1);
+
+  g_test_timer_start ();
+  for (i = 0; i < messages; i++)
+    {
+      payload = cockpit_transport_parse_frame (message, &copied);
+      g_free (copied);
+      g_bytes_unref (payload);
+    }
+  elapsed = g_test_timer_elapsed ();
+  g_test_message ("copied channel: %.1f ns per message", (elapsed * 1000000000) / messages);
+
+  g_test_timer_start ();
+  for (i = 0; i < messages; i++)
+    {
+      payload = cockpit_transport_parse_frame_intern (tc->transport, message, &channel, &channel_len);
+      g_assert (channel == interned);
+      g_bytes_unref (payload);
+    }
+  elapsed = g_test_timer_elapsed ();
+  g_test_message ("interned channel: %.1f ns per message", (elapsed * 1000000000) / messages);
+
+  cockpit_transport_release_channel (interned);
+  g_bytes_unref (message);
+}
+
 static void
 test_parse_frame (void)
 {
@@ -588,6 +1493,26 @@ test_parse_command_no_channel (void)
   json_object_unref (options);
 }
 
+static void
+test_build_pong (void)
+{
+  const gchar *input = "{ \"command\": \"ping\", \"channel\": \"a\", \"sequence\": 5 }";
+  JsonObject *ping;
+  JsonObject *pong;
+
+  ping = cockpit_json_parse_object (input, -1, NULL);
+  g_assert (ping != NULL);
+
+  pong = cockpit_transport_build_pong (ping);
+  cockpit_assert_json_eq (pong, "{ \"command\": \"pong\", \"channel\": \"a\", \"sequence\": 5 }");
+
+  /* The ping itself is left alone */
+  g_assert_cmpstr (json_object_get_string_member (ping, "command"), ==, "ping");
+
+  json_object_unref (ping);
+  json_object_unref (pong);
+}
+
 static void
 test_parse_command_nulls (void)
 {
@@ -656,6 +1581,7 @@ main (int argc,
   g_test_add_func ("/transport/parse-command/normal", test_parse_command);
   g_test_add_func ("/transport/parse-command/no-channel", test_parse_command_no_channel);
   g_test_add_func ("/transport/parse-command/nulls", test_parse_command_nulls);
+  g_test_add_func ("/transport/build-pong", test_build_pong);
 
   for (i = 0; i < G_N_ELEMENTS (bad_command_payloads); i++)
     {
@@ -697,6 +1623,42 @@ main (int argc,
               BUILDDIR "/mock-echo", setup_with_child,
               test_terminate_problem, teardown_transport);
 
+  g_test_add ("/transport/channel-dispatch", TestCase, NULL,
+              setup_no_child, test_channel_dispatch, teardown_transport);
+  g_test_add_func ("/transport/intern-channel", test_intern_channel);
+  g_test_add_func ("/transport/lookup-channel", test_lookup_channel);
+  g_test_add ("/transport/read-partial", TestCase, NULL,
+              setup_no_child, test_read_partial, teardown_transport);
+  g_test_add ("/transport/compression", TestRelay, NULL,
+              setup_relay, test_compression, teardown_relay);
+  g_test_add ("/transport/compression-threshold", TestRelay, NULL,
+              setup_relay, test_compression_threshold, teardown_relay);
+  g_test_add ("/transport/compression-control", TestRelay, NULL,
+              setup_relay, test_compression_control, teardown_relay);
+  g_test_add ("/transport/compression-wire", TestRelay, NULL,
+              setup_relay, test_compression_wire, teardown_relay);
+  g_test_add ("/transport/compression-channels", TestRelay, NULL,
+              setup_relay, test_compression_channels, teardown_relay);
+  g_test_add ("/transport/compression-invalid", TestRelay, NULL,
+              setup_relay, test_compression_invalid, teardown_relay);
+  g_test_add ("/transport/coalesce", TestCase, NULL,
+              setup_no_child, test_coalesce, teardown_transport);
+  g_test_add ("/transport/parse-frame-intern", TestCase, NULL,
+              setup_no_child, test_parse_frame_intern, teardown_transport);
+  if (g_test_perf ())
+    {
+      g_test_add ("/transport/channel-dispatch-perf", TestCase, NULL,
+                  setup_no_child, test_channel_dispatch_perf, teardown_transport);
+      g_test_add ("/transport/read-frames-perf", TestCase, NULL,
+                  setup_no_child, test_read_frames_perf, teardown_transport);
+      g_test_add ("/transport/write-batch-perf", TestCase, NULL,
+                  setup_no_child, test_write_batch_perf, teardown_transport);
+      g_test_add ("/transport/coalesce-perf", TestCase, NULL,
+                  setup_no_child, test_coalesce_perf, teardown_transport);
+      g_test_add ("/transport/parse-frame-perf", TestCase, NULL,
+                  setup_no_child, test_parse_frame_perf, teardown_transport);
+    }
+
   g_test_add_func ("/transport/read-error", test_read_error);
   g_test_add_func ("/transport/write-error", test_write_error);
   g_test_add_func ("/transport/read-combined", test_read_combined);
@@ -83,6 +83,179 @@ static const Fixture fixtures[] = {
   { "Marmalaade!""\xe2\x94\x80", NULL, FALSE },
 };
 
+/* What the code did before it was vectorized, using GLib */
+static GBytes *
+glib_force_utf8 (const gchar *data,
+                 gsize length)
+{
+  const gchar *end;
+  GString *string;
+
+  string = g_string_sized_new (length + 16);
+  while (!g_utf8_validate (data, length, &end))
+    {
+      g_string_append_len (string, data, end - data);
+      g_string_append (string, "\xef\xbf\xbd");
+      length -= (end - data) + 1;
+      data = end + 1;
+    }
+  g_string_append_len (string, data, length);
+  return g_string_free_to_bytes (string);
+}
+
+static void
+assert_matches_glib (const gchar *data,
+                     gsize length)
+{
+  const gchar *end;
+  gchar *output;
+  GBytes *expect;
+  gsize incomplete;
+  gsize valid;
+  gsize size;
+
+  g_utf8_validate (data, length, &end);
+  valid = cockpit_unicode_validate (data, length, &incomplete);
+  g_assert_cmpuint (valid, ==, end - data);
+  if (incomplete)
+    g_assert_cmpuint (valid + incomplete, ==, length);
+
+  output = g_malloc (COCKPIT_UNICODE_REPAIR_SIZE (length) + 1);
+  size = cockpit_unicode_repair (data, length, output);
+  expect = glib_force_utf8 (data, length);
+  cockpit_assert_bytes_eq (expect, output, size);
+  g_bytes_unref (expect);
+  g_free (output);
+}
+
+/* Pieces that exercise every class of valid and invalid sequence */
+static const gchar *pieces[] = {
+  "a", "\303\244", "\342\224\200", "\360\237\230\200",
+  "\355\240\200", "\340\200\200", "\364\220\200\200", "\300\200",
+  "\200", "\377", "\303", "\342\224", "\360\237\230",
+  "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ",
+  "\303\244\303\266\303\274\342\202\254\344\270\255\346\226\207",
+  "", /* a nul byte */
+};
+
+static void
+test_implementation (gconstpointer data)
+{
+  const gchar *name = data;
+  GByteArray *array;
+  const gchar *piece;
+  gsize length;
+  gint i, j, count;
+
+  if (!cockpit_unicode_use_implementation (name))
+    {
+      cockpit_test_skip ("not supported on this CPU");
+      return;
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (fixtures); i++)
+    assert_matches_glib (fixtures[i].input, strlen (fixtures[i].input));
+
+  array = g_byte_array_new ();
+  for (i = 0; i < 20000; i++)
+    {
+      g_byte_array_set_size (array, 0);
+      count = g_test_rand_int_range (0, 60);
+      for (j = 0; j < count; j++)
+        {
+          piece = pieces[g_test_rand_int_range (0, G_N_ELEMENTS (pieces))];
+          length = piece[0] ? strlen (piece) : 1;
+          g_byte_array_append (array, (const guint8 *)piece, length);
+        }
+
+      /* Cut off anywhere, which leaves incomplete characters */
+      if (g_test_rand_bit ())
+        g_byte_array_set_size (array, g_test_rand_int_range (0, array->len + 1));
+
+      assert_matches_glib ((const gchar *)array->data, array->len);
+    }
+
+  /* Random binary data */
+  for (i = 0; i < 2000; i++)
+    {
+      g_byte_array_set_size (array, g_test_rand_int_range (0, 300));
+      for (j = 0; j < array->len; j++)
+        array->data[j] = g_test_rand_int_range (0, 256);
+      assert_matches_glib ((const gchar *)array->data, array->len);
+    }
+
+  g_byte_array_unref (array);
+  cockpit_unicode_use_implementation (NULL);
+}
+
+static void
+test_benchmark (void)
+{
+  static const gchar *names[] = { "scalar", "sse2", "avx2" };
+  const gsize length = 4 * 1024 * 1024;
+  const gint rounds = 20;
+  const gchar *text = "Mot\303\266rhead \342\200\224 \346\227\245\346\234\254\350\252\236 "
+                      "\320\240\321\203\321\201\321\201\320\272\320\270\320\271 ascii text\n";
+  gchar *inputs[3];
+  const gchar *labels[] = { "ascii", "multilingual", "binary" };
+  gchar *output;
+  GBytes *forced;
+  gdouble elapsed;
+  gsize i;
+  gint j, k, r;
+
+  inputs[0] = g_malloc (length);
+  inputs[1] = g_malloc (length);
+  inputs[2] = g_malloc (length);
+  for (i = 0; i < length; i++)
+    {
+      inputs[0][i] = 'a' + i % 26;
+      inputs[1][i] = text[i % strlen (text)];
+      inputs[2][i] = g_test_rand_int_range (0, 256);
+    }
+
+  /* Don't end in the middle of a character */
+  for (i = length - 1; (guchar)inputs[1][i] >= 0x80; i--)
+    inputs[1][i] = ' ';
+
+  output = g_malloc (COCKPIT_UNICODE_REPAIR_SIZE (length));
+
+  for (j = 0; j < G_N_ELEMENTS (names); j++)
+    {
+      if (!cockpit_unicode_use_implementation (names[j]))
+        continue;
+
+      for (k = 0; k < G_N_ELEMENTS (labels); k++)
+        {
+          g_test_timer_start ();
+          for (r = 0; r < rounds; r++)
+            cockpit_unicode_repair (inputs[k], length, output);
+          elapsed = g_test_timer_elapsed ();
+          g_test_message ("%s %s repair: %.0f MB/s", names[j], labels[k],
+                          (length * rounds) / elapsed / (1024 * 1024));
+        }
+    }
+
+  /* And the way things were done with GLib */
+  for (k = 0; k < G_N_ELEMENTS (labels); k++)
+    {
+      g_test_timer_start ();
+      for (r = 0; r < rounds; r++)
+        {
+          forced = glib_force_utf8 (inputs[k], length);
+          g_bytes_unref (forced);
+        }
+      elapsed = g_test_timer_elapsed ();
+      g_test_message ("glib %s repair: %.0f MB/s", labels[k],
+                      (length * rounds) / elapsed / (1024 * 1024));
+    }
+
+  cockpit_unicode_use_implementation (NULL);
+  g_free (output);
+  for (k = 0; k < G_N_ELEMENTS (inputs); k++)
+    g_free (inputs[k]);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -108,5 +281,12 @@ main (int argc,
       g_free (name2);
     }
 
+  g_test_add_data_func ("/unicode/implementation/scalar", "scalar", test_implementation);
+  g_test_add_data_func ("/unicode/implementation/sse2", "sse2", test_implementation);
+  g_test_add_data_func ("/unicode/implementation/avx2", "avx2", test_implementation);
+
+  if (g_test_perf ())
+    g_test_add_func ("/unicode/benchmark", test_benchmark);
+
   return g_test_run ();
 }
@@ -76,6 +76,7 @@ typedef struct {
   GHashTable *auth_results;
   gchar *user_known_hosts;
   gint outfd;
+  CockpitFrameReader reader;
 
 } CockpitSshData;
 
@@ -185,7 +186,7 @@ byte_array_clear_and_free (gpointer data)
 }
 
 static JsonObject *
-read_control_message (int fd)
+read_control_message (CockpitFrameReader *reader)
 {
   JsonObject *options = NULL;
   GBytes *payload = NULL;
@@ -194,7 +195,7 @@ read_control_message (int fd)
   guchar *data = NULL;
   gssize length = 0;
 
-  length = cockpit_frame_read (fd, &data);
+  length = cockpit_frame_reader_read (reader, &data);
   if (length < 0)
     {
       g_message ("couldn't read control message: %s", g_strerror (errno));
@@ -254,8 +255,8 @@ send_authorize_challenge (const gchar *challenge,
 }
 
 static gchar *
-challenge_for_auth_data (const gchar *challenge,
-                         gint outfd,
+challenge_for_auth_data (CockpitSshData *data,
+                         const gchar *challenge,
                          gchar **ret_type)
 {
   const gchar *response = NULL;
@@ -264,8 +265,8 @@ challenge_for_auth_data (const gchar *challenge,
   gchar *type = NULL;
   JsonObject *reply;
 
-  send_authorize_challenge (challenge ? challenge : "*", outfd);
-  reply = read_control_message (STDIN_FILENO);
+  send_authorize_challenge (challenge ? challenge : "*", data->outfd);
+  reply = read_control_message (&data->reader);
   if (!reply)
     goto out;
 
@@ -303,7 +304,7 @@ challenge_for_knownhosts_data (CockpitSshData *data)
   gchar *ret = NULL;
   gchar *response = NULL;
 
-  response = challenge_for_auth_data ("x-host-key", data->outfd, NULL);
+  response = challenge_for_auth_data (data, "x-host-key", NULL);
   if (response)
     {
       value = cockpit_authorize_type (response, NULL);
@@ -361,7 +362,7 @@ prompt_with_authorize (CockpitSshData *data,
   if (!ret)
     return NULL;
 
-  reply = read_control_message (STDIN_FILENO);
+  reply = read_control_message (&data->reader);
   if (!reply)
     return NULL;
 
@@ -1000,8 +1001,7 @@ has_password (CockpitSshData *data)
   if (data->auth_type == NULL &&
       data->initial_auth_data == NULL)
     {
-      data->initial_auth_data = challenge_for_auth_data ("basic",
-                                                         data->outfd,
+      data->initial_auth_data = challenge_for_auth_data (data, "basic",
                                                          &data->auth_type);
     }
 
@@ -1419,6 +1419,7 @@ cockpit_ssh_data_free (CockpitSshData *data)
   g_free (data->user_known_hosts);
   g_free (data->auth_type);
   g_strfreev (data->env);
+  cockpit_frame_reader_clear (&data->reader);
   g_free (data);
 }
 
@@ -2083,6 +2084,8 @@ cockpit_ssh_relay_start (CockpitSshRelay *self,
                          gint outfd)
 {
   const gchar *problem;
+  guchar *leftover;
+  gsize leftover_len;
   int rc;
 
   static struct ssh_channel_callbacks_struct channel_cbs = {
@@ -2095,7 +2098,7 @@ cockpit_ssh_relay_start (CockpitSshRelay *self,
   };
 
   self->ssh_data->outfd = outfd;
-  self->ssh_data->initial_auth_data = challenge_for_auth_data ("*", outfd,
+  self->ssh_data->initial_auth_data = challenge_for_auth_data (self->ssh_data, "*",
                                                                &self->ssh_data->auth_type);
 
   problem = cockpit_ssh_connect (self->ssh_data, self->connection_string, &self->channel);
@@ -2124,6 +2127,16 @@ cockpit_ssh_relay_start (CockpitSshRelay *self,
                                       G_CALLBACK (on_pipe_close),
                                       self);
 
+  /* Anything read ahead during authentication belongs to the pipe */
+  leftover_len = cockpit_frame_reader_steal (&self->ssh_data->reader, &leftover);
+  if (leftover_len > 0)
+    {
+      g_byte_array_append (cockpit_pipe_get_buffer (self->pipe), leftover, leftover_len);
+      on_pipe_read (self->pipe, cockpit_pipe_get_buffer (self->pipe), FALSE, self);
+      cockpit_memory_clear (leftover, leftover_len);
+      free (leftover);
+    }
+
   for (rc = SSH_AGAIN; rc == SSH_AGAIN; )
     rc = ssh_channel_request_exec (self->channel, self->ssh_data->ssh_options->command);
 
@@ -2196,6 +2209,7 @@ cockpit_ssh_relay_constructed (GObject *object)
   self->ssh_data->auth_results = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
   self->ssh_data->ssh_options = cockpit_ssh_options_from_env (self->ssh_data->env);
   self->ssh_data->user_known_hosts = g_build_filename (g_get_home_dir (), ".ssh/known_hosts", NULL);
+  cockpit_frame_reader_init (&self->ssh_data->reader, 0);
 }
 
 static void
@@ -993,6 +993,7 @@ cockpit_session_create (CockpitAuth *self,
   const gchar *command;
   const gchar *section;
   const gchar *program_default;
+  gboolean remote;
 
   gchar **env = g_get_environ ();
 
@@ -1003,6 +1004,7 @@ cockpit_session_create (CockpitAuth *self,
   };
 
   host = application_parse_host (application);
+  remote = (host != NULL);
   action = type_option (type, "action", "localhost");
   if (g_strcmp0 (action, ACTION_NONE) == 0)
     {
@@ -1063,6 +1065,10 @@ cockpit_session_create (CockpitAuth *self,
 
   session->service = cockpit_web_service_new (creds, transport);
 
+  /* Another machine is reached over SSH, compress what crosses it */
+  if (remote)
+    cockpit_web_service_set_compression (session->service, TRUE);
+
   session->idling_sig = g_signal_connect (session->service, "idling",
                                           G_CALLBACK (on_web_service_idling), session);
   session->destroy_sig = g_signal_connect (session->service, "destroy",
@@ -21,6 +21,7 @@
 
 #include "cockpitchannelresponse.h"
 
+#include "common/cockpitflow.h"
 #include "common/cockpitwebinject.h"
 #include "common/cockpitwebserver.h"
 #include "common/cockpitwebresponse.h"
@@ -134,10 +135,15 @@ typedef struct {
   GHashTable *headers;
 
   CockpitTransport *transport;
-  gulong transport_recv;
-  gulong transport_control;
+  gboolean http_stream1_meta;
+  gboolean http_stream2;
   gulong transport_closed;
 
+  /* Flow control, a "ping" is held while the response is backed up */
+  gulong response_pressure;
+  gboolean pressure;
+  JsonObject *ping;
+
   /* Set when injecting data into response */
   CockpitChannelInject *inject;
 } CockpitChannelResponse;
@@ -168,9 +174,9 @@ cockpit_channel_response_close (CockpitChannelResponse *chesp,
   CockpitWebResponding state;
 
   /* Ensure no more signals arrive about our response */
-  g_signal_handler_disconnect (chesp->transport, chesp->transport_recv);
-  g_signal_handler_disconnect (chesp->transport, chesp->transport_control);
+  cockpit_transport_remove_channel (chesp->transport, chesp->channel);
   g_signal_handler_disconnect (chesp->transport, chesp->transport_closed);
+  g_signal_handler_disconnect (chesp->response, chesp->response_pressure);
 
   /* The web response should not yet be complete */
   state = cockpit_web_response_get_state (chesp->response);
@@ -230,10 +236,68 @@ cockpit_channel_response_close (CockpitChannelResponse *chesp,
   g_hash_table_unref (chesp->headers);
   cockpit_channel_inject_free (chesp->inject);
   json_object_unref (chesp->open);
+  if (chesp->ping)
+    json_object_unref (chesp->ping);
   g_free (chesp->channel);
   g_free (chesp);
 }
 
+static void
+send_pong (CockpitChannelResponse *chesp,
+           JsonObject *ping)
+{
+  JsonObject *pong;
+  GBytes *bytes;
+
+  pong = cockpit_transport_build_pong (ping);
+  bytes = cockpit_json_write_bytes (pong);
+  cockpit_transport_send (chesp->transport, NULL, bytes);
+  g_bytes_unref (bytes);
+  json_object_unref (pong);
+}
+
+static void
+on_response_pressure (CockpitFlow *flow,
+                      gboolean pressure,
+                      gpointer user_data)
+{
+  CockpitChannelResponse *chesp = user_data;
+  JsonObject *ping;
+
+  chesp->pressure = pressure;
+
+  /* Answer the latest ping now that the client has caught up */
+  if (!pressure && chesp->ping)
+    {
+      ping = chesp->ping;
+      chesp->ping = NULL;
+      send_pong (chesp, ping);
+      json_object_unref (ping);
+    }
+}
+
+static void
+process_ping (CockpitChannelResponse *chesp,
+              JsonObject *ping)
+{
+  /*
+   * We're the end of channels opened with "flow-control". Pongs are
+   * only sent as fast as the HTTP client reads the data, and a pong
+   * acknowledges everything up to its sequence, so only the latest
+   * ping needs to be held.
+   */
+  if (chesp->pressure)
+    {
+      if (chesp->ping)
+        json_object_unref (chesp->ping);
+      chesp->ping = json_object_ref (ping);
+    }
+  else
+    {
+      send_pong (chesp, ping);
+    }
+}
+
 static gboolean
 on_transport_recv (CockpitTransport *transport,
                    const gchar *channel,
@@ -314,8 +378,7 @@ on_httpstream_recv (CockpitTransport *transport,
   g_return_val_if_fail (cockpit_web_response_get_state (chesp->response) == COCKPIT_WEB_RESPONSE_READY, FALSE);
 
   /* First response payload message is meta data, then switch to actual data */
-  g_signal_handler_disconnect (chesp->transport, chesp->transport_recv);
-  chesp->transport_recv = g_signal_connect (chesp->transport, "recv", G_CALLBACK (on_transport_recv), chesp);
+  chesp->http_stream1_meta = FALSE;
 
   object = cockpit_json_parse_bytes (payload, &error);
   if (error)
@@ -368,6 +431,10 @@ on_transport_control (CockpitTransport *transport,
         }
       cockpit_channel_response_close (chesp, problem);
     }
+  else if (g_str_equal (command, "ping"))
+    {
+      process_ping (chesp, options);
+    }
   else
     {
       /* Ignore other control messages */
@@ -408,6 +475,36 @@ on_httpstream_control (CockpitTransport *transport,
 }
 
 
+static gboolean
+on_channel_recv (CockpitTransport *transport,
+                 const gchar *channel,
+                 GBytes *payload,
+                 gpointer user_data)
+{
+  CockpitChannelResponse *chesp = user_data;
+
+  if (chesp->http_stream1_meta)
+    return on_httpstream_recv (transport, channel, payload, chesp);
+  else
+    return on_transport_recv (transport, channel, payload, chesp);
+}
+
+static gboolean
+on_channel_control (CockpitTransport *transport,
+                    const gchar *command,
+                    const gchar *channel,
+                    JsonObject *options,
+                    GBytes *message,
+                    gpointer user_data)
+{
+  CockpitChannelResponse *chesp = user_data;
+
+  if (chesp->http_stream2)
+    return on_httpstream_control (transport, command, channel, options, message, chesp);
+  else
+    return on_transport_control (transport, command, channel, options, message, chesp);
+}
+
 static void
 on_transport_closed (CockpitTransport *transport,
                      const gchar *problem,
@@ -445,18 +542,16 @@ cockpit_channel_response_create (CockpitWebService *service,
   json_object_set_string_member (open, "channel", chesp->channel);
 
   /* Special handling for http-stream1, splice in headers, handle injection */
-  if (g_strcmp0 (payload, "http-stream1") == 0)
-    chesp->transport_recv = g_signal_connect (transport, "recv", G_CALLBACK (on_httpstream_recv), chesp);
-  else
-    chesp->transport_recv = g_signal_connect (transport, "recv", G_CALLBACK (on_transport_recv), chesp);
+  chesp->http_stream1_meta = (g_strcmp0 (payload, "http-stream1") == 0);
 
   /* Special handling for http-stream2, splice in headers, handle injection */
-  if (g_strcmp0 (payload, "http-stream2") == 0)
-    chesp->transport_control = g_signal_connect (transport, "control", G_CALLBACK (on_httpstream_control), chesp);
-  else
-    chesp->transport_control = g_signal_connect (transport, "control", G_CALLBACK (on_transport_control), chesp);
+  chesp->http_stream2 = (g_strcmp0 (payload, "http-stream2") == 0);
+
+  /* Messages for our channel come straight here, rather than through the signals */
+  cockpit_transport_add_channel (transport, chesp->channel, on_channel_recv, on_channel_control, chesp);
 
   chesp->transport_closed = g_signal_connect (transport, "closed", G_CALLBACK (on_transport_closed), chesp);
+  chesp->response_pressure = g_signal_connect (response, "pressure", G_CALLBACK (on_response_pressure), chesp);
 
   bytes = cockpit_json_write_bytes (chesp->open);
   cockpit_transport_send (transport, NULL, bytes);
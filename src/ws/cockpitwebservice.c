@@ -36,6 +36,7 @@
 #include "common/cockpitjson.h"
 #include "common/cockpitlog.h"
 #include "common/cockpitmemory.h"
+#include "common/cockpitpipetransport.h"
 #include "common/cockpitsystem.h"
 #include "common/cockpitwebresponse.h"
 #include "common/cockpitwebserver.h"
@@ -63,12 +64,34 @@ typedef struct {
   gboolean init_received;
 } CockpitSocket;
 
+typedef struct {
+  const gchar *id;
+  CockpitSocket *socket;
+  WebSocketDataType data_type;
+  GBytes *prefix;
+
+  /* Received from and sent to the web socket */
+  guint64 rx_messages;
+  guint64 rx_bytes;
+  guint64 tx_messages;
+  guint64 tx_bytes;
+} CockpitSocketChannel;
+
 typedef struct {
   GHashTable *by_channel;
   GHashTable *by_connection;
   guint next_socket_id;
 } CockpitSockets;
 
+static void
+cockpit_socket_channel_free (gpointer data)
+{
+  CockpitSocketChannel *chan = data;
+  cockpit_transport_release_channel (chan->id);
+  g_bytes_unref (chan->prefix);
+  g_slice_free (CockpitSocketChannel, chan);
+}
+
 static void
 cockpit_socket_free (gpointer data)
 {
@@ -84,7 +107,8 @@ cockpit_sockets_init (CockpitSockets *sockets)
 {
   sockets->next_socket_id = 1;
 
-  sockets->by_channel = g_hash_table_new (g_str_hash, g_str_equal);
+  /* Keyed by interned channel ids */
+  sockets->by_channel = g_hash_table_new (g_direct_hash, g_direct_equal);
 
   /* This owns the socket */
   sockets->by_connection = g_hash_table_new_full (g_direct_hash, g_direct_equal,
@@ -98,11 +122,19 @@ cockpit_socket_lookup_by_connection (CockpitSockets *sockets,
   return g_hash_table_lookup (sockets->by_connection, connection);
 }
 
+inline static CockpitSocketChannel *
+cockpit_socket_lookup_channel (CockpitSockets *sockets,
+                               const gchar *channel)
+{
+  return cockpit_transport_lookup_channel (sockets->by_channel, channel);
+}
+
 inline static CockpitSocket *
 cockpit_socket_lookup_by_channel (CockpitSockets *sockets,
                                   const gchar *channel)
 {
-  return g_hash_table_lookup (sockets->by_channel, channel);
+  CockpitSocketChannel *chan = cockpit_transport_lookup_channel (sockets->by_channel, channel);
+  return chan ? chan->socket : NULL;
 }
 
 static void
@@ -110,9 +142,11 @@ cockpit_socket_remove_channel (CockpitSockets *sockets,
                                CockpitSocket *socket,
                                const gchar *channel)
 {
+  const gchar *interned = cockpit_transport_find_channel (channel);
+
   g_debug ("%s remove channel %s for socket", socket->id, channel);
-  g_hash_table_remove (sockets->by_channel, channel);
-  g_hash_table_remove (socket->channels, channel);
+  g_hash_table_remove (sockets->by_channel, interned);
+  g_hash_table_remove (socket->channels, interned);
 }
 
 static void
@@ -121,11 +155,19 @@ cockpit_socket_add_channel (CockpitSockets *sockets,
                             const gchar *channel,
                             WebSocketDataType data_type)
 {
-  gchar *chan;
+  CockpitSocketChannel *chan;
+  gchar *prefix;
+
+  /* The interned id and the frame prefix are reused for every message */
+  chan = g_slice_new0 (CockpitSocketChannel);
+  chan->id = cockpit_transport_intern_channel (channel, -1);
+  chan->socket = socket;
+  chan->data_type = data_type;
+  prefix = g_strdup_printf ("%s\n", channel);
+  chan->prefix = g_bytes_new_take (prefix, strlen (prefix));
 
-  chan = g_strdup (channel);
-  g_hash_table_insert (sockets->by_channel, chan, socket);
-  g_hash_table_replace (socket->channels, chan, GINT_TO_POINTER (data_type));
+  g_hash_table_insert (sockets->by_channel, (gpointer)chan->id, chan);
+  g_hash_table_replace (socket->channels, (gpointer)chan->id, chan);
 
   g_debug ("%s added channel %s to socket", socket->id, channel);
 }
@@ -139,7 +181,7 @@ cockpit_socket_track (CockpitSockets *sockets,
   socket = g_new0 (CockpitSocket, 1);
   socket->id = g_strdup_printf ("%u:", sockets->next_socket_id++);
   socket->connection = g_object_ref (connection);
-  socket->channels = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  socket->channels = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, cockpit_socket_channel_free);
 
   g_debug ("%s new socket", socket->id);
 
@@ -211,11 +253,22 @@ struct _CockpitWebService {
 
   CockpitTransport *transport;
   gboolean init_received;
+  gboolean compress;
   gulong control_sig;
   gulong recv_sig;
   gulong closed_sig;
   gboolean sent_done;
 
+  /*
+   * Connections waiting for the "statistics" reply from the bridge.
+   * Only one request is with the bridge at a time. Connections that
+   * ask in the meantime wait for the next one, and asking again
+   * while waiting doesn't add another request.
+   */
+  GHashTable *statistics;
+  GHashTable *statistics_next;
+  GBytes *statistics_request;
+
   GHashTable *checksum_by_host;
   GHashTable *host_by_checksum;
 };
@@ -276,6 +329,11 @@ cockpit_web_service_finalize (GObject *object)
 
   cockpit_sockets_cleanup (&self->sockets);
 
+  g_hash_table_destroy (self->statistics);
+  g_hash_table_destroy (self->statistics_next);
+  if (self->statistics_request)
+    g_bytes_unref (self->statistics_request);
+
   if (self->transport)
     g_object_unref (self->transport);
 
@@ -597,6 +655,7 @@ process_transport_init (CockpitWebService *self,
                         CockpitTransport *transport,
                         JsonObject *options)
 {
+  JsonArray *capabilities;
   JsonObject *object;
   GBytes *payload;
   gint64 version;
@@ -619,10 +678,22 @@ process_transport_init (CockpitWebService *self,
       object = cockpit_transport_build_json ("command", "init", NULL);
       json_object_set_int_member (object, "version", 1);
       json_object_set_string_member (object, "host", "localhost");
+
+      /* Ask a bridge on the other end of a slow link to compress */
+      if (self->compress)
+        {
+          capabilities = json_array_new ();
+          json_array_add_string_element (capabilities, "compression");
+          json_object_set_array_member (object, "capabilities", capabilities);
+        }
+
       payload = cockpit_json_write_bytes (object);
       json_object_unref (object);
       cockpit_transport_send (transport, NULL, payload);
       g_bytes_unref (payload);
+
+      if (self->compress)
+        cockpit_pipe_transport_negotiate_compression (transport, options);
     }
   else
     {
@@ -634,6 +705,141 @@ process_transport_init (CockpitWebService *self,
   return NULL;
 }
 
+static JsonObject *
+build_socket_stats (CockpitSocket *socket)
+{
+  CockpitSocketChannel *chan;
+  GHashTableIter iter;
+  JsonObject *channels;
+  JsonObject *object;
+  JsonObject *stats;
+
+  channels = json_object_new ();
+  g_hash_table_iter_init (&iter, socket->channels);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&chan))
+    {
+      stats = json_object_new ();
+      json_object_set_int_member (stats, "rx-messages", chan->rx_messages);
+      json_object_set_int_member (stats, "rx-bytes", chan->rx_bytes);
+      json_object_set_int_member (stats, "tx-messages", chan->tx_messages);
+      json_object_set_int_member (stats, "tx-bytes", chan->tx_bytes);
+      json_object_set_object_member (channels, chan->id, stats);
+    }
+
+  object = json_object_new ();
+  json_object_set_string_member (object, "id", socket->id);
+  json_object_set_int_member (object, "buffered",
+                              web_socket_connection_get_buffered_amount (socket->connection));
+  json_object_set_object_member (object, "channels", channels);
+  return object;
+}
+
+/*
+ * The bridge answers with its own counters, and we add ours for the
+ * connection to the bridge and each of the web sockets.
+ */
+static void
+send_statistics (CockpitWebService *self,
+                 WebSocketConnection *connection,
+                 JsonObject *options)
+{
+  CockpitTransportStats stats;
+  CockpitSocket *other;
+  GHashTableIter iter;
+  JsonObject *object;
+  JsonArray *sockets;
+  GList *members, *l;
+  GBytes *reply;
+
+  if (web_socket_connection_get_ready_state (connection) != WEB_SOCKET_STATE_OPEN)
+    return;
+
+  object = json_object_new ();
+  if (options)
+    {
+      members = json_object_get_members (options);
+      for (l = members; l != NULL; l = g_list_next (l))
+        json_object_set_member (object, l->data, json_object_dup_member (options, l->data));
+      g_list_free (members);
+    }
+  json_object_set_string_member (object, "command", "statistics");
+
+  cockpit_transport_get_stats (self->transport, &stats);
+  json_object_set_object_member (object, "transport", cockpit_transport_build_stats (&stats));
+
+  sockets = json_array_new ();
+  g_hash_table_iter_init (&iter, self->sockets.by_connection);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&other))
+    json_array_add_object_element (sockets, build_socket_stats (other));
+  json_object_set_array_member (object, "sockets", sockets);
+
+  reply = cockpit_json_write_bytes (object);
+  json_object_unref (object);
+  web_socket_connection_send (connection, WEB_SOCKET_DATA_TEXT, self->control_prefix, reply);
+  g_bytes_unref (reply);
+}
+
+static gboolean
+process_statistics (CockpitWebService *self,
+                    CockpitSocket *socket,
+                    GBytes *payload)
+{
+  /* Without a bridge we can only answer for ourselves */
+  if (self->sent_done)
+    {
+      send_statistics (self, socket->connection, NULL);
+    }
+  else if (g_hash_table_size (self->statistics) == 0)
+    {
+      g_hash_table_add (self->statistics, g_object_ref (socket->connection));
+      cockpit_transport_send (self->transport, NULL, payload);
+    }
+  else
+    {
+      /* Sent once the bridge answers the request it already has */
+      if (!g_hash_table_contains (self->statistics_next, socket->connection))
+        g_hash_table_add (self->statistics_next, g_object_ref (socket->connection));
+      if (self->statistics_request)
+        g_bytes_unref (self->statistics_request);
+      self->statistics_request = g_bytes_ref (payload);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+process_transport_statistics (CockpitWebService *self,
+                              JsonObject *options)
+{
+  WebSocketConnection *connection;
+  GHashTableIter iter;
+  GHashTable *answered;
+
+  if (g_hash_table_size (self->statistics) == 0)
+    {
+      g_message ("bridge sent a 'statistics' reply that was not asked for");
+      return FALSE;
+    }
+
+  g_hash_table_iter_init (&iter, self->statistics);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&connection, NULL))
+    send_statistics (self, connection, options);
+  g_hash_table_remove_all (self->statistics);
+
+  if (g_hash_table_size (self->statistics_next) > 0)
+    {
+      answered = self->statistics;
+      self->statistics = self->statistics_next;
+      self->statistics_next = answered;
+
+      cockpit_transport_send (self->transport, NULL, self->statistics_request);
+      g_bytes_unref (self->statistics_request);
+      self->statistics_request = NULL;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 on_transport_control (CockpitTransport *transport,
                       const gchar *command,
@@ -668,6 +874,10 @@ on_transport_control (CockpitTransport *transport,
         {
           valid = TRUE;
         }
+      else if (g_strcmp0 (command, "statistics") == 0)
+        {
+          valid = process_transport_statistics (self, options);
+        }
       else
         {
           g_debug ("received a %s unknown control command", command);
@@ -716,23 +926,18 @@ on_transport_recv (CockpitTransport *transport,
                    gpointer user_data)
 {
   CockpitWebService *self = user_data;
-  WebSocketDataType data_type;
-  CockpitSocket *socket;
-  gchar *string;
-  GBytes *prefix;
+  CockpitSocketChannel *chan;
 
   if (!channel)
     return FALSE;
 
   /* Forward the message to the right socket */
-  socket = cockpit_socket_lookup_by_channel (&self->sockets, channel);
-  if (socket && web_socket_connection_get_ready_state (socket->connection) == WEB_SOCKET_STATE_OPEN)
-    {
-      string = g_strdup_printf ("%s\n", channel);
-      prefix = g_bytes_new_take (string, strlen (string));
-      data_type = GPOINTER_TO_INT (g_hash_table_lookup (socket->channels, channel));
-      web_socket_connection_send (socket->connection, data_type, prefix, payload);
-      g_bytes_unref (prefix);
+  chan = cockpit_socket_lookup_channel (&self->sockets, channel);
+  if (chan && web_socket_connection_get_ready_state (chan->socket->connection) == WEB_SOCKET_STATE_OPEN)
+    {
+      web_socket_connection_send (chan->socket->connection, chan->data_type, chan->prefix, payload);
+      chan->tx_messages++;
+      chan->tx_bytes += g_bytes_get_size (payload);
       return TRUE;
     }
 
@@ -1035,6 +1240,10 @@ dispatch_inbound_command (CockpitWebService *self,
     {
       valid = process_kill (self, socket, options, payload);
     }
+  else if (g_strcmp0 (command, "statistics") == 0)
+    {
+      valid = process_statistics (self, socket, payload);
+    }
   else if (channel)
     {
       /* Relay anything with a channel by default */
@@ -1055,17 +1264,34 @@ on_web_socket_message (WebSocketConnection *connection,
                        GBytes *message,
                        CockpitWebService *self)
 {
+  CockpitSocketChannel *chan;
   CockpitSocket *socket;
   GBytes *payload;
-  gchar *channel;
+  const gchar *channel;
+  gsize channel_len;
+  gchar *unknown = NULL;
 
   socket = cockpit_socket_lookup_by_connection (&self->sockets, connection);
   g_return_if_fail (socket != NULL);
 
-  payload = cockpit_transport_parse_frame (message, &channel);
+  payload = cockpit_transport_parse_frame_intern (self->transport, message, &channel, &channel_len);
   if (!payload)
     return;
 
+  /* Only channels that aren't open need a copy of their id */
+  if (!channel && channel_len > 0)
+    channel = unknown = g_strndup (g_bytes_get_data (message, NULL), channel_len);
+
+  if (channel)
+    {
+      chan = cockpit_socket_lookup_channel (&self->sockets, channel);
+      if (chan)
+        {
+          chan->rx_messages++;
+          chan->rx_bytes += g_bytes_get_size (payload);
+        }
+    }
+
   /* A control channel command */
   if (!channel)
     {
@@ -1079,7 +1305,7 @@ on_web_socket_message (WebSocketConnection *connection,
         cockpit_transport_send (self->transport, channel, payload);
     }
 
-  g_free (channel);
+  g_free (unknown);
   g_bytes_unref (payload);
 }
 
@@ -1218,6 +1444,8 @@ cockpit_web_service_init (CockpitWebService *self)
 {
   self->control_prefix = g_bytes_new_static ("\n", 1);
   cockpit_sockets_init (&self->sockets);
+  self->statistics = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, NULL);
+  self->statistics_next = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, NULL);
   self->ping_timeout = g_timeout_add_seconds (cockpit_ws_ping_interval, on_ping_time, self);
   self->host_by_checksum = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
   self->checksum_by_host = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
@@ -1409,6 +1637,24 @@ cockpit_web_service_get_transport (CockpitWebService *self)
   return self->transport;
 }
 
+/**
+ * cockpit_web_service_set_compression:
+ * @self: the web service
+ * @compress: whether to compress
+ *
+ * Set this when the session transport crosses a slow link
+ * such as SSH to another host. Must be called before the
+ * "init" message has been received from the bridge.
+ */
+void
+cockpit_web_service_set_compression (CockpitWebService *self,
+                                     gboolean compress)
+{
+  g_return_if_fail (COCKPIT_IS_WEB_SERVICE (self));
+  g_return_if_fail (!self->init_received);
+  self->compress = compress;
+}
+
 static void
 on_transport_init (CockpitWebService *service,
                    gpointer user_data)
@@ -63,6 +63,9 @@ gchar *                 cockpit_web_service_unique_channel   (CockpitWebService
 
 CockpitTransport *      cockpit_web_service_get_transport    (CockpitWebService *self);
 
+void                    cockpit_web_service_set_compression  (CockpitWebService *self,
+                                                              gboolean compress);
+
 gboolean                cockpit_web_service_parse_binary     (JsonObject *open,
                                                               WebSocketDataType *type);
 
@@ -876,6 +876,40 @@ test_resource_head (TestResourceCase *tc,
   g_object_unref (response);
 }
 
+static void
+test_external_flow_control (TestResourceCase *tc,
+                            gconstpointer data)
+{
+  CockpitWebResponse *response;
+  GError *error = NULL;
+  JsonObject *open;
+  GBytes *bytes;
+  const gchar *url = "/cockpit/channel/blah";
+
+  /* More than the 2MB the bridge sends without a pong */
+  open = cockpit_json_parse_object ("{ \"payload\": \"stream\","
+                                    "  \"spawn\": [ \"head\", \"-c\", \"3000000\", \"/dev/zero\" ],"
+                                    "  \"binary\": \"raw\", \"flow-control\": true }", -1, &error);
+  g_assert_no_error (error);
+
+  response = cockpit_web_response_new (tc->io, url, url, NULL, NULL);
+  cockpit_channel_response_open (tc->service, tc->headers, response, open);
+
+  while (cockpit_web_response_get_state (response) != COCKPIT_WEB_RESPONSE_SENT)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_output_stream_close (G_OUTPUT_STREAM (tc->output), NULL, &error);
+  g_assert_no_error (error);
+
+  bytes = g_memory_output_stream_steal_as_bytes (tc->output);
+  g_assert (g_str_has_prefix (g_bytes_get_data (bytes, NULL), "HTTP/1.1 200 OK\r\n"));
+  g_assert_cmpuint (g_bytes_get_size (bytes), >, 3000000);
+  g_bytes_unref (bytes);
+
+  g_object_unref (response);
+  json_object_unref (open);
+}
+
 static gboolean
 on_hack_raise_sigchld (gpointer user_data)
 {
@@ -939,5 +973,8 @@ main (int argc,
   g_test_add ("/web-channel/resource/head", TestResourceCase, NULL,
               setup_resource, test_resource_head, teardown_resource);
 
+  g_test_add ("/web-channel/external/flow-control", TestResourceCase, NULL,
+              setup_resource, test_external_flow_control, teardown_resource);
+
   return g_test_run ();
 }
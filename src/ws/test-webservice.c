@@ -1190,6 +1190,137 @@ test_logout (TestCase *test,
   close_client_and_stop_web_service (test, ws, service);
 }
 
+static void
+test_statistics (TestCase *test,
+                 gconstpointer data)
+{
+  WebSocketConnection *ws;
+  JsonObject *received = NULL;
+  CockpitWebService *service;
+  GBytes *message = NULL;
+  JsonObject *object;
+  JsonArray *sockets;
+
+  start_web_service_and_create_client (test, data, &ws, &service);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (ws) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert (web_socket_connection_get_ready_state (ws) == WEB_SOCKET_STATE_OPEN);
+
+  send_control_message (ws, "init", NULL, BUILD_INTS, "version", 1, NULL);
+
+  g_signal_connect (ws, "message", G_CALLBACK (on_message_get_control), &received);
+
+  /* The mock bridge echoes the request back, as if it was its reply */
+  data = "\n{ \"command\": \"statistics\", \"payloads\": { } }";
+  message = g_bytes_new_static (data, strlen (data));
+  web_socket_connection_send (ws, WEB_SOCKET_DATA_TEXT, NULL, message);
+  g_bytes_unref (message);
+
+  for (;;)
+    {
+      while (received == NULL)
+        g_main_context_iteration (NULL, TRUE);
+      if (g_strcmp0 (json_object_get_string_member (received, "command"), "statistics") == 0)
+        break;
+      json_object_unref (received);
+      received = NULL;
+    }
+
+  /* The bridge reply, with our own counters added */
+  g_assert (cockpit_json_get_object (received, "payloads", NULL, &object));
+  g_assert (object != NULL);
+  g_assert (cockpit_json_get_object (received, "transport", NULL, &object));
+  g_assert (object != NULL);
+  g_assert (json_object_has_member (object, "tx-wire-bytes"));
+  g_assert (cockpit_json_get_array (received, "sockets", NULL, &sockets));
+  g_assert (sockets != NULL);
+  g_assert_cmpuint (json_array_get_length (sockets), ==, 1);
+  json_object_unref (received);
+
+  g_signal_handlers_disconnect_by_func (ws, on_message_get_control, &received);
+  close_client_and_stop_web_service (test, ws, service);
+}
+
+static void
+send_statistics_request (WebSocketConnection *ws,
+                         const gchar *tag)
+{
+  GBytes *message;
+  gchar *data;
+
+  data = g_strdup_printf ("\n{ \"command\": \"statistics\", \"tag\": \"%s\" }", tag);
+  message = g_bytes_new_take (data, strlen (data));
+  web_socket_connection_send (ws, WEB_SOCKET_DATA_TEXT, NULL, message);
+  g_bytes_unref (message);
+}
+
+static void
+on_message_queue_statistics (WebSocketConnection *ws,
+                             WebSocketDataType type,
+                             GBytes *message,
+                             gpointer user_data)
+{
+  GQueue *replies = user_data;
+  JsonObject *object;
+  GError *error = NULL;
+
+  if (!g_str_has_prefix (g_bytes_get_data (message, NULL), "\n"))
+    return;
+
+  object = cockpit_json_parse_bytes (message, &error);
+  g_assert_no_error (error);
+  if (g_strcmp0 (json_object_get_string_member (object, "command"), "statistics") == 0)
+    g_queue_push_tail (replies, object);
+  else
+    json_object_unref (object);
+}
+
+static void
+assert_statistics_reply (GQueue *replies,
+                         const gchar *tag)
+{
+  JsonObject *reply;
+
+  while (g_queue_is_empty (replies))
+    g_main_context_iteration (NULL, TRUE);
+
+  reply = g_queue_pop_head (replies);
+  g_assert_cmpstr (json_object_get_string_member (reply, "tag"), ==, tag);
+  json_object_unref (reply);
+}
+
+static void
+test_statistics_coalesce (TestCase *test,
+                          gconstpointer data)
+{
+  WebSocketConnection *ws;
+  CockpitWebService *service;
+  GQueue replies = G_QUEUE_INIT;
+
+  start_web_service_and_create_client (test, data, &ws, &service);
+  WAIT_UNTIL (web_socket_connection_get_ready_state (ws) != WEB_SOCKET_STATE_CONNECTING);
+  g_assert (web_socket_connection_get_ready_state (ws) == WEB_SOCKET_STATE_OPEN);
+
+  send_control_message (ws, "init", NULL, BUILD_INTS, "version", 1, NULL);
+
+  g_signal_connect (ws, "message", G_CALLBACK (on_message_queue_statistics), &replies);
+
+  /* Only one request goes to the bridge, the others wait for one more */
+  send_statistics_request (ws, "one");
+  send_statistics_request (ws, "two");
+  send_statistics_request (ws, "three");
+
+  assert_statistics_reply (&replies, "one");
+  assert_statistics_reply (&replies, "three");
+
+  /* And nothing else was queued up */
+  send_statistics_request (ws, "four");
+  assert_statistics_reply (&replies, "four");
+  g_assert (g_queue_is_empty (&replies));
+
+  g_signal_handlers_disconnect_by_func (ws, on_message_queue_statistics, &replies);
+  close_client_and_stop_web_service (test, ws, service);
+}
+
 static void
 test_hint_credential (TestCase *test,
                       gconstpointer data)
@@ -1515,6 +1646,10 @@ main (int argc,
               setup_for_socket, test_dispose, teardown_for_socket);
   g_test_add ("/web-service/logout", TestCase, NULL,
               setup_for_socket, test_logout, teardown_for_socket);
+  g_test_add ("/web-service/statistics", TestCase, NULL,
+              setup_for_socket, test_statistics, teardown_for_socket);
+  g_test_add ("/web-service/statistics-coalesce", TestCase, NULL,
+              setup_for_socket, test_statistics_coalesce, teardown_for_socket);
 
   g_test_add ("/web-service/authorize/hint", TestCase, NULL,
               setup_for_socket, test_hint_credential, teardown_for_socket);